@@ -29,6 +29,8 @@
 #include "sysemu/cpus.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 #include "accel-system.h"
 
 int accel_init_machine(AccelState *accel, MachineState *ms)
@@ -26,6 +26,8 @@
 #include "qemu/osdep.h"
 #include "qemu/accel.h"
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 
 #include "cpu.h"
 #include "hw/core/accel-cpu.h"
@@ -0,0 +1,135 @@
+/*
+ * COSIM: run-ahead checkpoint and rollback
+ *
+ * QEMU runs ahead of the RTL and buffers the RVFI records. On a mismatch
+ * (or an RTL-injected interrupt/bus fault) the testbench rolls QEMU back
+ * to the last checkpoint and replays up to the exact instruction.
+ *
+ * The architectural state is copied by the target, guest RAM is covered
+ * by an undo log: the checkpoint clears the DIRTY_MEMORY_MIGRATION bits,
+ * so the first write to any RAM page goes through notdirty_write() which
+ * saves the page before it is modified.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "hw/core/cpu.h"
+#include "hw/core/tcg-cpu-ops.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "exec/cosim-checkpoint.h"
+
+bool cosim_undo_active;
+
+typedef struct CosimCheckpoint {
+    void *arch;
+    bool halted;
+    /* page ram_addr -> page contents at the checkpoint */
+    GHashTable *undo;
+} CosimCheckpoint;
+
+static CosimCheckpoint ckpt;
+
+void cosim_undo_log_page(ram_addr_t ram_addr)
+{
+    uint64_t page = ram_addr & TARGET_PAGE_MASK;
+    uint64_t *key;
+    void *copy;
+
+    if (g_hash_table_contains(ckpt.undo, &page)) {
+        return;
+    }
+
+    key = g_new(uint64_t, 1);
+    *key = page;
+    copy = g_malloc(TARGET_PAGE_SIZE);
+    WITH_RCU_READ_LOCK_GUARD() {
+        memcpy(copy, qemu_map_ram_ptr(NULL, page), TARGET_PAGE_SIZE);
+    }
+    g_hash_table_insert(ckpt.undo, key, copy);
+}
+
+/*
+ * Makes every page of the block clean for the migration client:
+ * notdirty_write() is called again on the first write.
+ */
+static int cosim_undo_arm_block(RAMBlock *rb, void *opaque)
+{
+    cpu_physical_memory_test_and_clear_dirty(qemu_ram_get_offset(rb),
+                                             qemu_ram_get_used_length(rb),
+                                             DIRTY_MEMORY_MIGRATION);
+    return 0;
+}
+
+void cosim_checkpoint_drop(void)
+{
+    cosim_undo_active = false;
+    g_free(ckpt.arch);
+    ckpt.arch = NULL;
+    if (ckpt.undo) {
+        g_hash_table_destroy(ckpt.undo);
+        ckpt.undo = NULL;
+    }
+}
+
+bool cosim_checkpoint_take(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+
+    g_assert(qemu_mutex_iothread_locked());
+
+    if (!cc->tcg_ops->cosim_save_state || !cc->tcg_ops->cosim_load_state) {
+        return false;
+    }
+
+    cosim_checkpoint_drop();
+
+    ckpt.arch = cc->tcg_ops->cosim_save_state(cpu);
+    ckpt.halted = cpu->halted;
+    ckpt.undo = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                      g_free, g_free);
+    cosim_undo_active = true;
+    qemu_ram_foreach_block(cosim_undo_arm_block, NULL);
+    return true;
+}
+
+bool cosim_checkpoint_restore(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    GHashTableIter iter;
+    gpointer key, copy;
+
+    g_assert(qemu_mutex_iothread_locked());
+
+    if (ckpt.arch == NULL) {
+        return false;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        g_hash_table_iter_init(&iter, ckpt.undo);
+        while (g_hash_table_iter_next(&iter, &key, &copy)) {
+            ram_addr_t page = *(uint64_t *)key;
+
+            memcpy(qemu_map_ram_ptr(NULL, page), copy, TARGET_PAGE_SIZE);
+            /* the restored page may hold code translated since then */
+            tb_invalidate_phys_range(page, page + TARGET_PAGE_SIZE - 1);
+        }
+    }
+
+    /*
+     * The log is kept: the pages are back to the checkpoint contents,
+     * re-arm the tracking so that the checkpoint can be reused.
+     */
+    qemu_ram_foreach_block(cosim_undo_arm_block, NULL);
+
+    cc->tcg_ops->cosim_load_state(cpu, ckpt.arch);
+    cpu->halted = ckpt.halted;
+    cpu->exception_index = -1;
+    cpu->cflags_next_tb = -1;
+    tlb_flush(cpu);
+    return true;
+}
@@ -24,6 +24,8 @@
 #include "internal-common.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 
 bool tcg_allowed;
 
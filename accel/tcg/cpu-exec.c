@@ -21,7 +21,10 @@
 #include "qemu/qemu-print.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 #include "qemu-main.h"
+#include "qemu/cosim-ring.h"
 
 #include "qapi/error.h"
 #include "qapi/type-helpers.h"
@@ -160,6 +163,81 @@ static vaddr get_current_pc (CPUState *cpu)
     return pc;
 }
 
+/////////////// COSIM ////////////////
+static inline bool cosim_rvfi_active(CPUState *cpu)
+{
+    COSIM_hart_t *hart = (COSIM_hart_t *)cpu->cosim_data;
+
+    return hart != NULL && (hart->rvfi_buf != NULL || hart->ring_active);
+}
+
+/*
+ * RVFI batch/ring: let the target prepare the retirement record of
+ * the next instruction (the fields are captured by CF_COSIM_RVFI code).
+ * With the ring nothing is executed until the consumer frees a slot,
+ * EXCP_COSIM gives the CPU thread a chance to wait for it.
+ */
+static inline void cosim_insn_start(CPUState *cpu)
+{
+    if (unlikely(cosim_rvfi_active(cpu))) {
+        COSIM_hart_t *hart = (COSIM_hart_t *)cpu->cosim_data;
+        CPUClass *cc = CPU_GET_CLASS(cpu);
+
+        if (hart->ring_active && cosim_ring_full(hart->ring)) {
+            cpu->exception_index = EXCP_COSIM;
+            cpu_loop_exit(cpu);
+        }
+        if (cc->tcg_ops->cosim_insn_start) {
+            cc->tcg_ops->cosim_insn_start(cpu);
+        }
+    }
+}
+
+static void cosim_fill_record(CPUState *cpu, st_rvfi_t *rec, int trap_cause)
+{
+    COSIM_hart_t *hart = (COSIM_hart_t *)cpu->cosim_data;
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+
+    memset(rec, 0, sizeof(*rec));
+    if (cc->tcg_ops->cosim_retire) {
+        cc->tcg_ops->cosim_retire(cpu, rec);
+    }
+    rec->order = hart->rvfi_order++;
+    if (trap_cause >= 0) {
+        rec->trap = 1;
+        rec->cause = trap_cause;
+        rec->rd1_addr = 0;
+        rec->rd1_wdata = 0;
+    }
+}
+
+/*
+ * RVFI batch/ring: appends the record of one instruction executed in
+ * COSIM mode. TRAP_CAUSE is the exception number for trapped instruction,
+ * -1 otherwise. The step budget itself is counted down by CF_COSIM_COUNT TBs.
+ * Returns true when the buffer (ring) is full and EXCP_COSIM has to be raised.
+ */
+static bool cosim_retire_insn(CPUState *cpu, int trap_cause)
+{
+    COSIM_hart_t *hart = (COSIM_hart_t *)cpu->cosim_data;
+
+    hart->state_pc = get_current_pc (cpu);
+
+    if (hart->ring_active) {
+        /* cosim_insn_start() made sure there is a free slot */
+        cosim_fill_record(cpu, cosim_ring_slot(hart->ring), trap_cause);
+        cosim_ring_publish(hart->ring);
+        return cosim_ring_full(hart->ring);
+    }
+
+    if (hart->rvfi_n < hart->rvfi_max) {
+        cosim_fill_record(cpu, &hart->rvfi_buf[hart->rvfi_n++], trap_cause);
+    }
+
+    return hart->rvfi_n >= hart->rvfi_max;
+}
+/////////////// COSIM ////////////////
+
 uint32_t curr_cflags(CPUState *cpu)
 {
     uint32_t cflags = cpu->tcg_cflags;
@@ -251,58 +329,167 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, vaddr pc,
     return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
 }
 
+static bool tb_lookup_phys_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    return (tb_cflags(tb) & CF_PCREL || tb->pc == desc->pc) &&
+           tb_page_addr0(tb) == desc->page_addr0 &&
+           tb_page_addr1(tb) == -1 &&
+           tb->cs_base == desc->cs_base &&
+           tb->flags == desc->flags &&
+           tb_cflags(tb) == desc->cflags;
+}
+
+/*
+ * As tb_htable_lookup(), with the physical address known and only for
+ * the TBs within one page: the guest page tables are not walked, so that
+ * the translator can use it.
+ */
+TranslationBlock *tb_htable_lookup_phys(vaddr pc, tb_page_addr_t phys_pc,
+                                        uint64_t cs_base, uint32_t flags,
+                                        uint32_t cflags)
+{
+    struct tb_desc desc;
+    uint32_t h;
+
+    desc.env = NULL;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.cflags = cflags;
+    desc.pc = pc;
+    desc.page_addr0 = phys_pc;
+    h = tb_hash_func(phys_pc, (cflags & CF_PCREL ? 0 : pc),
+                     flags, cs_base, cflags);
+    return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_phys_cmp);
+}
+
+/*
+ * Returns the TB of ENTRY if it matches, NULL otherwise.
+ * For CF_PCREL the pc is the one of the entry, else the one in the TB.
+ */
+static inline TranslationBlock *tb_jmp_cache_get(CPUJumpCacheEntry *entry,
+                                                 vaddr pc, uint64_t cs_base,
+                                                 uint32_t flags,
+                                                 uint32_t cflags)
+{
+    /* Use acquire to ensure current load of pc from the entry or *tb. */
+    TranslationBlock *tb = qatomic_load_acquire(&entry->tb);
+
+    if (likely(tb &&
+               (cflags & CF_PCREL ? entry->pc : tb->pc) == pc &&
+               tb->cs_base == cs_base &&
+               tb->flags == flags &&
+               tb_cflags(tb) == cflags)) {
+        return tb;
+    }
+    return NULL;
+}
+
+static inline void tb_jmp_cache_set(CPUJumpCacheEntry *entry,
+                                    TranslationBlock *tb, vaddr pc)
+{
+    entry->pc = pc;
+    /* Ensure pc is written first. */
+    qatomic_store_release(&entry->tb, tb);
+}
+
+/*
+ * Makes TB the first level entry of PC. The TB it replaces becomes
+ * the most recently used way of its second level set.
+ *
+ * Other threads only clear entries (of invalidated TBs, which carry
+ * CF_INVALID and thus never match), so moving entries around is safe.
+ */
+static void tb_jmp_cache_fill(CPUJumpCache *jc, vaddr pc,
+                              TranslationBlock *tb)
+{
+    CPUJumpCacheEntry *entry = &jc->array[tb_jmp_cache_hash_func(pc)];
+    TranslationBlock *victim = qatomic_read(&entry->tb);
+
+    if (victim && victim != tb) {
+        CPUJumpCacheEntry *set = jc->l2[tb_jmp_l2_hash_func(entry->pc)];
+        int i;
+
+        for (i = TB_JMP_L2_WAYS - 1; i > 0; i--) {
+            tb_jmp_cache_set(&set[i], qatomic_read(&set[i - 1].tb),
+                             set[i - 1].pc);
+        }
+        tb_jmp_cache_set(&set[0], victim, entry->pc);
+    }
+    tb_jmp_cache_set(entry, tb, pc);
+}
+
 /* Might cause an exception, so have a longjmp destination ready */
 static inline TranslationBlock *tb_lookup(CPUState *cpu, vaddr pc,
                                           uint64_t cs_base, uint32_t flags,
                                           uint32_t cflags)
 {
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    CPUJumpCacheEntry *set;
     TranslationBlock *tb;
-    CPUJumpCache *jc;
-    uint32_t hash;
+    int i;
 
     /* we should never be trying to look up an INVALID tb */
     tcg_debug_assert(!(cflags & CF_INVALID));
 
-    hash = tb_jmp_cache_hash_func(pc);
-    jc = cpu->tb_jmp_cache;
-
-    if (cflags & CF_PCREL) {
-        /* Use acquire to ensure current load of pc from jc. */
-        tb = qatomic_load_acquire(&jc->array[hash].tb);
+    jc->stats.lookups++;
+    tb = tb_jmp_cache_get(&jc->array[tb_jmp_cache_hash_func(pc)],
+                          pc, cs_base, flags, cflags);
+    if (likely(tb)) {
+        return tb;
+    }
 
-        if (likely(tb &&
-                   jc->array[hash].pc == pc &&
-                   tb->cs_base == cs_base &&
-                   tb->flags == flags &&
-                   tb_cflags(tb) == cflags)) {
+    set = jc->l2[tb_jmp_l2_hash_func(pc)];
+    for (i = 0; i < TB_JMP_L2_WAYS; i++) {
+        tb = tb_jmp_cache_get(&set[i], pc, cs_base, flags, cflags);
+        if (tb) {
+            jc->stats.l2_hits++;
+            /* Drop the way, the first level entry may take its place */
+            for (; i < TB_JMP_L2_WAYS - 1; i++) {
+                tb_jmp_cache_set(&set[i], qatomic_read(&set[i + 1].tb),
+                                 set[i + 1].pc);
+            }
+            qatomic_set(&set[i].tb, NULL);
+            tb_jmp_cache_fill(jc, pc, tb);
             return tb;
         }
-        tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
-        if (tb == NULL) {
-            return NULL;
-        }
-        jc->array[hash].pc = pc;
-        /* Ensure pc is written first. */
-        qatomic_store_release(&jc->array[hash].tb, tb);
-    } else {
-        /* Use rcu_read to ensure current load of pc from *tb. */
-        tb = qatomic_rcu_read(&jc->array[hash].tb);
-
-        if (likely(tb &&
-                   tb->pc == pc &&
-                   tb->cs_base == cs_base &&
-                   tb->flags == flags &&
-                   tb_cflags(tb) == cflags)) {
+    }
+
+    jc->stats.htable_lookups++;
+    tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
+    if (tb) {
+        tb_jmp_cache_fill(jc, pc, tb);
+    }
+    return tb;
+}
+
+/*
+ * tb_lookup() for the target of a return: the top of the return address
+ * stack predicts it, and keeps its TB while the same call site pushes it.
+ */
+static TranslationBlock *tb_lookup_ret(CPUState *cpu, vaddr pc,
+                                       uint64_t cs_base, uint32_t flags,
+                                       uint32_t cflags)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    CPUJumpCacheEntry *entry = &jc->ras[jc->ras_top];
+    TranslationBlock *tb;
+
+    jc->ras_top = (jc->ras_top - 1) & (TB_RAS_SIZE - 1);
+    if (entry->pc == pc) {
+        tb = tb_jmp_cache_get(entry, pc, cs_base, flags, cflags);
+        if (likely(tb)) {
+            jc->stats.ras_hits++;
             return tb;
         }
-        tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
-        if (tb == NULL) {
-            return NULL;
-        }
-        /* Use the pc value already stored in tb->pc. */
-        qatomic_set(&jc->array[hash].tb, tb);
     }
-
+    jc->stats.ras_misses++;
+    tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
+    if (tb && entry->pc == pc) {
+        tb_jmp_cache_set(entry, tb, pc);
+    }
     return tb;
 }
 
@@ -418,7 +605,7 @@ static inline bool check_for_breakpoints(CPUState *cpu, vaddr pc,
  * If found, return the code pointer.  If not found, return
  * the tcg epilogue so that we return into cpu_tb_exec.
  */
-const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+static inline const void *lookup_tb_ptr(CPUArchState *env, bool ret)
 {
     CPUState *cpu = env_cpu(env);
     TranslationBlock *tb;
@@ -433,12 +620,16 @@ const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
         cpu_loop_exit(cpu);
     }
 
-LOGIM("--HELPER--> tb_lookup() pc = 0x%lx, cosim_mode = %d", pc, cpu->cosim_mode);
+    trace_cosim_lookup_tb_ptr(cpu->cpu_index, pc, cpu->cosim_mode);
 
-    tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
-
-    if (cpu->cosim_mode) {
-        tb = NULL;
+    /*
+     * COSIM: TBs stay chained - the step budget is counted by
+     * CF_COSIM_COUNT TBs, RVFI batch TBs are built with CF_NO_GOTO_PTR.
+     */
+    if (ret) {
+        tb = tb_lookup_ret(cpu, pc, cs_base, flags, cflags);
+    } else {
+        tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
     }
 
     if (tb == NULL) {
@@ -452,6 +643,38 @@ LOGIM("--HELPER--> tb_lookup() pc = 0x%lx, cosim_mode = %d", pc, cpu->cosim_mode
     return tb->tc.ptr;
 }
 
+const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    return lookup_tb_ptr(env, false);
+}
+
+/* helper_lookup_tb_ptr() for a return, see tb_lookup_ret() */
+const void *HELPER(lookup_tb_ptr_ret)(CPUArchState *env)
+{
+    return lookup_tb_ptr(env, true);
+}
+
+/**
+ * helper_tb_ras_push: push a return address
+ * @env: current cpu state
+ * @pc: the address a later return is predicted to go to
+ *
+ * Called by the calls of the guest. The entry keeps its TB if the
+ * previous call at the same depth pushed the same address.
+ */
+void HELPER(tb_ras_push)(CPUArchState *env, uint64_t pc)
+{
+    CPUJumpCache *jc = env_cpu(env)->tb_jmp_cache;
+    unsigned top = (jc->ras_top + 1) & (TB_RAS_SIZE - 1);
+    CPUJumpCacheEntry *entry = &jc->ras[top];
+
+    if (entry->pc != pc) {
+        qatomic_set(&entry->tb, NULL);
+        entry->pc = pc;
+    }
+    jc->ras_top = top;
+}
+
 extern int cosim_mode;
 
 /* Execute a TB, and fix up the CPU state afterwards if necessary */
@@ -471,26 +694,18 @@ cpu_tb_exec(CPUState *cpu, TranslationBlock *itb, int *tb_exit)
     uintptr_t ret;
     TranslationBlock *last_tb;
     const void *tb_ptr = itb->tc.ptr;
-    vaddr pc;
 
-LOGIM("-- tb = %p, cpu->cosim_singlestep = %d --", itb, cpu->cosim_singlestep);
+    trace_cosim_tb_exec(cpu->cpu_index, itb, cpu->cosim_singlestep);
 
     if (qemu_loglevel_mask(CPU_LOG_TB_CPU | CPU_LOG_EXEC)) {
         log_cpu_exec(log_pc(cpu, itb), cpu, itb);
     }
-    
-LOGIM("--> qemu_thread_jit_execute()");
-    qemu_thread_jit_execute();
-LOGIM("<-- qemu_thread_jit_execute()");
 
-LOGIM("====> tcg_qemu_tb_exec() JUMP to GENCODE");
+    qemu_thread_jit_execute();
     ret = tcg_qemu_tb_exec(env, tb_ptr);
-    pc = get_current_pc (cpu);
-LOGIM("<==== tcg_qemu_tb_exec(), PC = 0x%lx", pc);
 
     cpu->neg.can_do_io = true;
     qemu_plugin_disable_mem_helpers(cpu);
-LOGIM("<-- qemu_plugin_disable_mem_helpers()");
 
     /*
      * TODO: Delay swapping back to the read-write region of the TB
@@ -501,12 +716,13 @@ LOGIM("<-- qemu_plugin_disable_mem_helpers()");
      * double the host TLB pressure.
      */
     last_tb = tcg_splitwx_to_rw((void *)(ret & ~TB_EXIT_MASK));
-LOGIM("<-- tcg_splitwx_to_rw()");
 
     *tb_exit = ret & TB_EXIT_MASK;
 
     trace_exec_tb_exit(last_tb, *tb_exit);
-LOGIM("<-- trace_exec_tb_exit() tb_exit = %d ", *tb_exit);
+    if (trace_event_get_state_backends(TRACE_COSIM_TB_EXEC_EXIT)) {
+        trace_cosim_tb_exec_exit(cpu->cpu_index, get_current_pc(cpu), *tb_exit);
+    }
 
     if (*tb_exit > TB_EXIT_IDX1) {
         /* We didn't start executing this TB (eg because the instruction
@@ -544,13 +760,13 @@ LOGIM("<-- trace_exec_tb_exit() tb_exit = %d ", *tb_exit);
 
     /////////////// COSIM ////////////////   
 
-    COSIM_data_t* pgd = NULL;
-
-    if ((pgd = (COSIM_data_t*)cpu->cosim_data) != NULL) {
-        if (unlikely(cpu->cosim_singlestep) && cpu->exception_index == -1) {
-            pgd = (COSIM_data_t*)cpu->cosim_data;
-            pgd->state_pc = get_current_pc (cpu);
-
+    /*
+     * RVFI batch TBs hold one instruction and are never chained,
+     * so every executed instruction comes back here.
+     */
+    if (unlikely(cpu->cosim_singlestep) && cosim_rvfi_active(cpu) &&
+        cpu->exception_index == -1 && *tb_exit <= TB_EXIT_IDX1) {
+        if (cosim_retire_insn(cpu, -1)) {
             cpu->exception_index = EXCP_COSIM;
             cpu_loop_exit(cpu);
         }
@@ -558,8 +774,6 @@ LOGIM("<-- trace_exec_tb_exit() tb_exit = %d ", *tb_exit);
 
     /////////////// COSIM ////////////////   
 
-LOGIM("----  RETURN -----");
-
     return last_tb;
 }
 
@@ -785,20 +999,12 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
     if (cpu->exception_index >= EXCP_INTERRUPT) {
         /* exit request from the cpu execution loop */
         *ret = cpu->exception_index;
-   
-        ////////////////// COSIM //////////////////
-        if (*ret == EXCP_COSIM) {
-LOGIM ("==== hit EXCP_COSIM and return TRUE");
-            // For now there is nothing to do  for COSIM mode
-        }
-        ////////////////// COSIM //////////////////
+        trace_cosim_handle_exception(cpu->cpu_index, *ret);
 
         if (*ret == EXCP_DEBUG) {
             cpu_handle_debug_exception(cpu);
         }
 
-LOGIM("excp index = %d, <== -1 RET true", cpu->exception_index); 
-
         cpu->exception_index = -1;
         return true;
     } else {
@@ -823,11 +1029,26 @@ LOGIM("--> qemu_mutex_lock_iothread()");
             qemu_mutex_lock_iothread();
 LOGIM("<-- qemu_mutex_lock_iothread()");
           
+            ////////////////// COSIM //////////////////
+            int excp = cpu->exception_index;
+
             // SL: Looks like LOCK is needed to call DO_INTERRUPT() 
             cc->tcg_ops->do_interrupt(cpu);
             qemu_mutex_unlock_iothread();
             cpu->exception_index = -1;
 
+            /*
+             * With RVFI batch the trapped instruction is reported
+             * as retired with trap = 1.
+             */
+            if (unlikely(cpu->cosim_singlestep) && cosim_rvfi_active(cpu)) {
+                if (cosim_retire_insn(cpu, excp)) {
+                    *ret = EXCP_COSIM;
+                    return true;
+                }
+            }
+            ////////////////// COSIM //////////////////
+
             if (unlikely(cpu->singlestep_enabled)) {
                 /*
                  * After processing the exception, ensure an EXCP_DEBUG is
@@ -985,6 +1206,19 @@ LOGIM("RETURN(5) true");
         qemu_mutex_unlock_iothread();
     }
 
+    ////////////////// COSIM //////////////////
+    /* The step budget is used up - back to COSIM */
+    if (unlikely(cpu->cosim_singlestep)
+        && (cpu->tcg_cflags & CF_COSIM_COUNT)
+        && cpu_cosim_budget_left(cpu) == 0) {
+        if (cpu->exception_index == -1) {
+            ((COSIM_hart_t *)cpu->cosim_data)->state_pc = get_current_pc (cpu);
+            cpu->exception_index = EXCP_COSIM;
+        }
+        return true;
+    }
+    ////////////////// COSIM //////////////////
+
     /* Finally, check if we need to exit to the main loop.  */
     if (unlikely(qatomic_read(&cpu->exit_request))
         || (icount_enabled()
@@ -1010,24 +1244,20 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
     int32_t insns_left;
 
     trace_exec_tb(tb, pc);
-
-LOGIM("--> cpu_tb_exec() tb = %p, pc = 0x%lx", tb, pc);
     tb = cpu_tb_exec(cpu, tb, tb_exit);
-LOGIM("<-- cpu_tb_exec() tb_exit = %d", *tb_exit);
-
     if (*tb_exit != TB_EXIT_REQUESTED) {
         *last_tb = tb;
-
-LOGIM("RETURN (1)");
-
         return;
     }
 
     *last_tb = NULL;
 
-LOGIM("--> qatomic_read() ");
+    /* A hot first-tier TB: the main loop retranslates it */
+    if (unlikely(qatomic_read(&tb->tier_count) < 0)) {
+        return;
+    }
+
     insns_left = qatomic_read(&cpu->neg.icount_decr.u32);
-LOGIM("<-- qatomic_read() ");
 
     if (insns_left < 0) {
         /* Something asked us to stop executing chained TBs; just
@@ -1037,19 +1267,30 @@ LOGIM("<-- qatomic_read() ");
          * cpu_handle_interrupt.  cpu_handle_interrupt will also
          * clear cpu->icount_decr.u16.high.
          */
+        return;
+    }
 
-LOGIM("RETURN (2)");
+    ////////////////// COSIM //////////////////
+    /*
+     * COSIM step budget expired (or the TB is longer than what is left):
+     * refill the decrementer and, as icount does, make the next TB
+     * exactly as long as the rest of the budget.
+     */
+    if (cpu->tcg_cflags & CF_COSIM_COUNT) {
+        cpu_cosim_set_budget(cpu, cpu_cosim_budget_left(cpu));
+        insns_left = cpu->neg.icount_decr.u16.low;
+        if (insns_left > 0 && insns_left < tb->icount) {
+            cpu->cflags_next_tb = (tb->cflags & ~CF_COUNT_MASK) | insns_left;
+        }
         return;
     }
+    ////////////////// COSIM //////////////////
 
     /* Instruction counter expired.  */
     assert(icount_enabled());
 #ifndef CONFIG_USER_ONLY
     /* Ensure global icount has gone forward */
-
-LOGIM("--> icount_update() ");
     icount_update(cpu);
-LOGIM("<-- icount_update() ");
 
     /* Refill decrementer and continue execution.  */
     insns_left = MIN(0xffff, cpu->icount_budget);
@@ -1067,9 +1308,6 @@ LOGIM("<-- icount_update() ");
         cpu->cflags_next_tb = (tb->cflags & ~CF_COUNT_MASK) | insns_left;
     }
 #endif
-
-LOGIM("RETURN (3)");
-
 }
 
 /* main execution loop */
@@ -1084,8 +1322,6 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
         TranslationBlock *last_tb = NULL;
         int tb_exit = 0;
 
-LOGIM("<--cpu_handle_exception() ret = %d", ret);
-
         while (!cpu_handle_interrupt(cpu, &last_tb)) {
             TranslationBlock *tb;
             vaddr pc;
@@ -1093,8 +1329,7 @@ LOGIM("<--cpu_handle_exception() ret = %d", ret);
             uint32_t flags, cflags;
 
             cpu_get_tb_cpu_state(cpu_env(cpu), &pc, &cs_base, &flags);
-LOGIM("<--cpu_get_tb_state() pc = 0x%lx", pc);
-LOGIM("==========  PC = 0x%lx =============", pc);
+            cosim_insn_start(cpu);
 
             /*
              * When requested, use an exact setting for cflags for the next
@@ -1114,35 +1349,32 @@ LOGIM("==========  PC = 0x%lx =============", pc);
                 break;
             }
 
-LOGIM("<-- tb_lookup() PC = 0x%lx", pc);
+            /*
+             * COSIM RVFI batch: one instruction per TB, no chaining,
+             * so that cpu_tb_exec() sees every retired instruction.
+             */
+            if (unlikely(cpu->cosim_singlestep) && cosim_rvfi_active(cpu)) {
+                cflags = (cflags & ~CF_COUNT_MASK)
+                         | CF_NO_GOTO_TB | CF_NO_GOTO_PTR | 1;
+            }
+
             tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
-LOGIM("<-- tb_lookup() tb = %p", tb);
 
             if (tb == NULL) {
-                CPUJumpCache *jc;
-                uint32_t h;
-
-LOGIM("--> tb_gen_code() PC = 0x%lx", pc);
                 mmap_lock();
                 tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
                 mmap_unlock();
 
-LOGIM("<-- tb_gen_code() tb = %p", tb);
-
                 /*
                  * We add the TB in the virtual pc hash table
                  * for the fast lookup
                  */
-                h = tb_jmp_cache_hash_func(pc);
-                jc = cpu->tb_jmp_cache;
-                if (cflags & CF_PCREL) {
-                    jc->array[h].pc = pc;
-                    /* Ensure pc is written first. */
-                    qatomic_store_release(&jc->array[h].tb, tb);
-                } else {
-                    /* Use the pc value already stored in tb->pc. */
-                    qatomic_set(&jc->array[h].tb, tb);
-                }
+                tb_jmp_cache_fill(cpu->tb_jmp_cache, pc, tb);
+            } else if (unlikely(qatomic_read(&tb->tier_count) < 0)) {
+                mmap_lock();
+                tb = tb_retranslate(cpu, tb, pc, cs_base, flags, cflags);
+                mmap_unlock();
+                tb_jmp_cache_fill(cpu->tb_jmp_cache, pc, tb);
             }
 
 #ifndef CONFIG_USER_ONLY
@@ -1161,9 +1393,7 @@ LOGIM("<-- tb_gen_code() tb = %p", tb);
                 tb_add_jump(last_tb, tb_exit, tb);
             }
 
-LOGIM("--> cpu_loop_exec_tb () pc = 0x%lx, tb = %p", pc, tb);
             cpu_loop_exec_tb(cpu, tb, pc, &last_tb, &tb_exit);
-LOGIM("<-- cpu_loop_exec_tb () last_tb = %p", last_tb);
 
             /* Try to align the host and virtual clocks
                if the guest is in advance */
@@ -1171,7 +1401,6 @@ LOGIM("<-- cpu_loop_exec_tb () last_tb = %p", last_tb);
         }
     }
 
-LOGIM("RETURN ret = %d",  ret);
     return ret;
 }
 
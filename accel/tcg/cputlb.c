@@ -21,6 +21,8 @@
 #include "qemu/main-loop.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 
 #include "hw/core/tcg-cpu-ops.h"
 #include "exec/exec-all.h"
@@ -29,6 +31,7 @@
 #include "exec/cputlb.h"
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "exec/cosim-checkpoint.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
 #include "exec/log.h"
@@ -107,7 +110,7 @@ static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
 static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
 {
     CPUJumpCache *jc = cpu->tb_jmp_cache;
-    int i, i0;
+    int i, i0, w;
 
     if (unlikely(!jc)) {
         return;
@@ -117,6 +120,19 @@ static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
     for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
         qatomic_set(&jc->array[i0 + i].tb, NULL);
     }
+
+    i0 = tb_jmp_l2_hash_page(page_addr);
+    for (i = 0; i < TB_JMP_L2_PAGE_SIZE; i++) {
+        for (w = 0; w < TB_JMP_L2_WAYS; w++) {
+            qatomic_set(&jc->l2[i0 + i][w].tb, NULL);
+        }
+    }
+
+    for (i = 0; i < TB_RAS_SIZE; i++) {
+        if ((jc->ras[i].pc & TARGET_PAGE_MASK) == page_addr) {
+            qatomic_set(&jc->ras[i].tb, NULL);
+        }
+    }
 }
 
 /**
@@ -1419,6 +1435,9 @@ static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
 
     trace_memory_notdirty_write_access(mem_vaddr, ram_addr, size);
 
+    /* COSIM: first write to the page since the checkpoint */
+    cosim_undo_log(ram_addr);
+
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         tb_invalidate_phys_range_fast(ram_addr, size, retaddr);
     }
@@ -72,6 +72,12 @@ G_NORETURN void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu, vaddr pc,
                               uint64_t cs_base, uint32_t flags,
                               int cflags);
+TranslationBlock *tb_retranslate(CPUState *cpu, TranslationBlock *tb,
+                                 vaddr pc, uint64_t cs_base,
+                                 uint32_t flags, int cflags);
+TranslationBlock *tb_htable_lookup_phys(vaddr pc, tb_page_addr_t phys_pc,
+                                        uint64_t cs_base, uint32_t flags,
+                                        uint32_t cflags);
 void page_init(void);
 void tb_htable_init(void);
 void tb_reset_jump(TranslationBlock *tb, int n);
@@ -94,6 +100,8 @@ static inline vaddr log_pc(CPUState *cpu, const TranslationBlock *tb)
 }
 
 extern bool one_insn_per_tb;
+/* Executions of a first-tier TB before it is retranslated, 0 to disable */
+extern uint32_t tb_tier_threshold;
 
 /**
  * tcg_req_mo:
@@ -41,6 +41,13 @@
  * optimization to avoid generating redundant operations. For instance, for the
  * second and all subsequent callbacks of an event, we do not need to reload the
  * CPU's index into a TCG temp, since the first callback did it already.
+ *
+ * Inline ops come in too many shapes for templates; they are generated
+ * in place with the regular tcg_gen_* calls (see gen_after_begin()), their
+ * regions only mark the insertion point. Conditional and sampled callbacks
+ * copy the template call like the others, within a generated branch. For
+ * memory callbacks, the branch lands in the middle of the instruction:
+ * see mem_cb_preserve_temps().
  */
 #include "qemu/osdep.h"
 #include "cpu.h"
@@ -114,21 +121,11 @@ static void gen_empty_udata_cb(void)
 }
 
 /*
- * For now we only support addi_i64.
- * When we support more ops, we can generate one empty inline cb for each.
+ * Inline ops are generated in place by append_inline_cb(), there is
+ * no template to copy: the region only marks the insertion point.
  */
 static void gen_empty_inline_cb(void)
 {
-    TCGv_i64 val = tcg_temp_ebb_new_i64();
-    TCGv_ptr ptr = tcg_temp_ebb_new_ptr();
-
-    tcg_gen_movi_ptr(ptr, 0);
-    tcg_gen_ld_i64(val, ptr, 0);
-    /* pass an immediate != 0 so that it doesn't get optimized away */
-    tcg_gen_addi_i64(val, val, 0xdeadface);
-    tcg_gen_st_i64(val, ptr, 0);
-    tcg_temp_free_ptr(ptr);
-    tcg_temp_free_i64(val);
 }
 
 static void gen_empty_mem_cb(TCGv_i64 addr, uint32_t info)
@@ -278,19 +275,6 @@ static TCGOp *copy_const_ptr(TCGOp **begin_op, TCGOp *op, void *ptr)
     return op;
 }
 
-static TCGOp *copy_ld_i64(TCGOp **begin_op, TCGOp *op)
-{
-    if (TCG_TARGET_REG_BITS == 32) {
-        /* 2x ld_i32 */
-        op = copy_op(begin_op, op, INDEX_op_ld_i32);
-        op = copy_op(begin_op, op, INDEX_op_ld_i32);
-    } else {
-        /* ld_i64 */
-        op = copy_op(begin_op, op, INDEX_op_ld_i64);
-    }
-    return op;
-}
-
 static TCGOp *copy_st_i64(TCGOp **begin_op, TCGOp *op)
 {
     if (TCG_TARGET_REG_BITS == 32) {
@@ -304,21 +288,6 @@ static TCGOp *copy_st_i64(TCGOp **begin_op, TCGOp *op)
     return op;
 }
 
-static TCGOp *copy_add_i64(TCGOp **begin_op, TCGOp *op, uint64_t v)
-{
-    if (TCG_TARGET_REG_BITS == 32) {
-        /* all 32-bit backends must implement add2_i32 */
-        g_assert(TCG_TARGET_HAS_add2_i32);
-        op = copy_op(begin_op, op, INDEX_op_add2_i32);
-        op->args[4] = tcgv_i32_arg(tcg_constant_i32(v));
-        op->args[5] = tcgv_i32_arg(tcg_constant_i32(v >> 32));
-    } else {
-        op = copy_op(begin_op, op, INDEX_op_add_i64);
-        op->args[2] = tcgv_i64_arg(tcg_constant_i64(v));
-    }
-    return op;
-}
-
 static TCGOp *copy_st_ptr(TCGOp **begin_op, TCGOp *op)
 {
     if (UINTPTR_MAX == UINT32_MAX) {
@@ -331,8 +300,45 @@ static TCGOp *copy_st_ptr(TCGOp **begin_op, TCGOp *op)
     return op;
 }
 
+/*
+ * Callbacks registered with QEMU_PLUGIN_CB_R_REGS/RW_REGS access the CPU
+ * registers (qemu_plugin_read_register()). Their calls get a copy of the
+ * template's helper info without TCG_CALL_NO_READ_GLOBALS: the TCG globals
+ * are synced to CPUArchState before the call (and reloaded after it
+ * for RW_REGS). The template's info is laid out by the time it is copied.
+ */
+static TCGHelperInfo *regs_call_info(TCGHelperInfo *tmpl,
+                                     enum qemu_plugin_cb_flags regs)
+{
+    static TCGHelperInfo udata_info[2], mem_info[2];
+    static gsize udata_once[2], mem_once[2];
+    int i = regs == QEMU_PLUGIN_CB_RW_REGS;
+    TCGHelperInfo *info;
+    gsize *once;
+
+    if (tmpl == &helper_info_plugin_vcpu_udata_cb) {
+        info = &udata_info[i];
+        once = &udata_once[i];
+    } else {
+        tcg_debug_assert(tmpl == &helper_info_plugin_vcpu_mem_cb);
+        info = &mem_info[i];
+        once = &mem_once[i];
+    }
+
+    if (g_once_init_enter(once)) {
+        *info = *tmpl;
+        info->flags &= ~(TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_WRITE_GLOBALS);
+        if (regs == QEMU_PLUGIN_CB_R_REGS) {
+            info->flags |= TCG_CALL_NO_WRITE_GLOBALS;
+        }
+        g_once_init_leave(once, 1);
+    }
+    return info;
+}
+
 static TCGOp *copy_call(TCGOp **begin_op, TCGOp *op, void *empty_func,
-                        void *func, int *cb_idx)
+                        void *func, enum qemu_plugin_cb_flags regs,
+                        int *cb_idx)
 {
     TCGOp *old_op;
     int func_idx;
@@ -351,10 +357,137 @@ static TCGOp *copy_call(TCGOp **begin_op, TCGOp *op, void *empty_func,
     func_idx = TCGOP_CALLO(op) + TCGOP_CALLI(op);
     *cb_idx = func_idx;
     op->args[func_idx] = (uintptr_t)func;
+    if (regs != QEMU_PLUGIN_CB_NO_REGS) {
+        op->args[func_idx + 1] =
+            (uintptr_t)regs_call_info((TCGHelperInfo *)op->args[func_idx + 1],
+                                      regs);
+    }
+
+    return op;
+}
+
+/*
+ * Ops that have no template (inline ops, callback conditions) are
+ * generated with the regular tcg_gen_* calls between gen_after_begin()
+ * and gen_after_end(): they land right after @op, like copied ops.
+ */
+static void gen_after_begin(TCGOp *op)
+{
+    tcg_debug_assert(tcg_ctx->emit_before_op == NULL);
+    tcg_ctx->emit_before_op = QTAILQ_NEXT(op, link);
+}
+
+static TCGOp *gen_last_op(void)
+{
+    TCGOp *next = tcg_ctx->emit_before_op;
+
+    return next ? QTAILQ_PREV(next, link) : tcg_last_op();
+}
+
+/* returns the last op generated */
+static TCGOp *gen_after_end(void)
+{
+    TCGOp *op = gen_last_op();
 
+    tcg_ctx->emit_before_op = NULL;
     return op;
 }
 
+static void gen_load_cpu_index(TCGv_i32 cpu_index)
+{
+    tcg_gen_ld_i32(cpu_index, tcg_env,
+                   -offsetof(ArchCPU, env) + offsetof(CPUState, cpu_index));
+}
+
+/*
+ * Address of the element of the running vCPU: scoreboards move when
+ * they grow, so their data pointer is loaded at run-time.
+ */
+static TCGv_ptr gen_plugin_u64_ptr(qemu_plugin_u64 entry)
+{
+    TCGv_ptr ptr = tcg_temp_ebb_new_ptr();
+    TCGv_ptr offset = tcg_temp_ebb_new_ptr();
+    TCGv_i32 cpu_index = tcg_temp_ebb_new_i32();
+
+    gen_load_cpu_index(cpu_index);
+    tcg_gen_muli_i32(cpu_index, cpu_index, entry.score->element_size);
+    tcg_gen_ext_i32_ptr(offset, cpu_index);
+    tcg_gen_ld_ptr(ptr, tcg_constant_ptr(&entry.score->data), 0);
+    tcg_gen_add_ptr(ptr, ptr, offset);
+
+    tcg_temp_free_i32(cpu_index);
+    tcg_temp_free_ptr(offset);
+    return ptr;
+}
+
+static TCGCond plugin_cond_to_tcgcond(enum qemu_plugin_cond cond)
+{
+    switch (cond) {
+    case QEMU_PLUGIN_COND_EQ:
+        return TCG_COND_EQ;
+    case QEMU_PLUGIN_COND_NE:
+        return TCG_COND_NE;
+    case QEMU_PLUGIN_COND_LT:
+        return TCG_COND_LTU;
+    case QEMU_PLUGIN_COND_LE:
+        return TCG_COND_LEU;
+    case QEMU_PLUGIN_COND_GT:
+        return TCG_COND_GTU;
+    case QEMU_PLUGIN_COND_GE:
+        return TCG_COND_GEU;
+    default:
+        /* NEVER and ALWAYS are resolved at registration */
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Opens the branch around a conditional callback: if the condition
+ * does not hold, the ops generated until gen_cond_end() are skipped.
+ * A sampled callback bumps its counter first and fires (resetting
+ * the counter) when it reaches the period:
+ *
+ *   val = *entry + 1; val = val >= period ? 0 : val; *entry = val;
+ *   if (val != 0) goto skip;
+ */
+static TCGOp *gen_cond_begin(const struct qemu_plugin_dyn_cb *cb, TCGOp *op,
+                             TCGLabel **skip)
+{
+    TCGv_ptr ptr;
+    TCGv_i64 val;
+    intptr_t offset = cb->cond.entry.offset;
+
+    gen_after_begin(op);
+
+    *skip = gen_new_label();
+    ptr = gen_plugin_u64_ptr(cb->cond.entry);
+    val = tcg_temp_ebb_new_i64();
+    tcg_gen_ld_i64(val, ptr, offset);
+    if (cb->cond.sample) {
+        tcg_gen_addi_i64(val, val, 1);
+        tcg_gen_movcond_i64(TCG_COND_GEU, val, val,
+                            tcg_constant_i64(cb->cond.imm),
+                            tcg_constant_i64(0), val);
+        tcg_gen_st_i64(val, ptr, offset);
+        tcg_gen_brcondi_i64(TCG_COND_NE, val, 0, *skip);
+    } else {
+        tcg_gen_brcondi_i64(
+            tcg_invert_cond(plugin_cond_to_tcgcond(cb->cond.cond)),
+            val, cb->cond.imm, *skip);
+    }
+    tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(ptr);
+
+    return gen_after_end();
+}
+
+static TCGOp *gen_cond_end(TCGOp *op, TCGLabel *skip)
+{
+    gen_after_begin(op);
+    gen_set_label(skip);
+    return gen_after_end();
+}
+
 /*
  * When we append/replace ops here we are sensitive to changing patterns of
  * TCGOps generated by the tcg_gen_FOO calls when we generated the
@@ -364,6 +497,14 @@ static TCGOp *copy_call(TCGOp **begin_op, TCGOp *op, void *empty_func,
 static TCGOp *append_udata_cb(const struct qemu_plugin_dyn_cb *cb,
                               TCGOp *begin_op, TCGOp *op, int *cb_idx)
 {
+    TCGLabel *skip = NULL;
+
+    if (cb->type == PLUGIN_CB_COND) {
+        op = gen_cond_begin(cb, op, &skip);
+        /* cpu_index is loaded within the branch */
+        *cb_idx = -1;
+    }
+
     /* const_ptr */
     op = copy_const_ptr(&begin_op, op, cb->userp);
 
@@ -377,8 +518,13 @@ static TCGOp *append_udata_cb(const struct qemu_plugin_dyn_cb *cb,
 
     /* call */
     op = copy_call(&begin_op, op, HELPER(plugin_vcpu_udata_cb),
-                   cb->f.vcpu_udata, cb_idx);
+                   cb->f.vcpu_udata, cb->regs, cb_idx);
 
+    if (skip) {
+        op = gen_cond_end(op, skip);
+        /* and does not survive the label */
+        *cb_idx = -1;
+    }
     return op;
 }
 
@@ -386,28 +532,52 @@ static TCGOp *append_inline_cb(const struct qemu_plugin_dyn_cb *cb,
                                TCGOp *begin_op, TCGOp *op,
                                int *unused)
 {
-    /* const_ptr */
-    op = copy_const_ptr(&begin_op, op, cb->userp);
+    TCGv_ptr ptr;
+    TCGv_i64 val;
+    intptr_t offset = 0;
 
-    /* ld_i64 */
-    op = copy_ld_i64(&begin_op, op);
+    gen_after_begin(op);
 
-    /* add_i64 */
-    op = copy_add_i64(&begin_op, op, cb->inline_insn.imm);
+    if (cb->inline_insn.entry.score) {
+        ptr = gen_plugin_u64_ptr(cb->inline_insn.entry);
+        offset = cb->inline_insn.entry.offset;
+    } else {
+        ptr = tcg_temp_ebb_new_ptr();
+        tcg_gen_movi_ptr(ptr, (intptr_t)cb->userp);
+    }
 
-    /* st_i64 */
-    op = copy_st_i64(&begin_op, op);
+    switch (cb->inline_insn.op) {
+    case QEMU_PLUGIN_INLINE_ADD_U64:
+        val = tcg_temp_ebb_new_i64();
+        tcg_gen_ld_i64(val, ptr, offset);
+        tcg_gen_addi_i64(val, val, cb->inline_insn.imm);
+        tcg_gen_st_i64(val, ptr, offset);
+        tcg_temp_free_i64(val);
+        break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        tcg_gen_st_i64(tcg_constant_i64(cb->inline_insn.imm), ptr, offset);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    tcg_temp_free_ptr(ptr);
 
-    return op;
+    return gen_after_end();
 }
 
 static TCGOp *append_mem_cb(const struct qemu_plugin_dyn_cb *cb,
                             TCGOp *begin_op, TCGOp *op, int *cb_idx)
 {
     enum plugin_gen_cb type = begin_op->args[1];
+    TCGLabel *skip = NULL;
 
     tcg_debug_assert(type == PLUGIN_GEN_CB_MEM);
 
+    if (cb->type == PLUGIN_CB_COND) {
+        op = gen_cond_begin(cb, op, &skip);
+        *cb_idx = -1;
+    }
+
     /* const_i32 == mov_i32 ("info", so it remains as is) */
     op = copy_op(&begin_op, op, INDEX_op_mov_i32);
 
@@ -425,9 +595,13 @@ static TCGOp *append_mem_cb(const struct qemu_plugin_dyn_cb *cb,
     if (type == PLUGIN_GEN_CB_MEM) {
         /* call */
         op = copy_call(&begin_op, op, HELPER(plugin_vcpu_mem_cb),
-                       cb->f.vcpu_udata, cb_idx);
+                       cb->f.vcpu_udata, cb->regs, cb_idx);
     }
 
+    if (skip) {
+        op = gen_cond_end(op, skip);
+        *cb_idx = -1;
+    }
     return op;
 }
 
@@ -489,9 +663,50 @@ inject_inline_cb(const GArray *cbs, TCGOp *begin_op, op_ok_fn ok)
     inject_cb_type(cbs, begin_op, append_inline_cb, ok);
 }
 
+/*
+ * The branch of a conditional memory callback is inserted after the
+ * access, in the middle of the instruction, and the EBB temps the rest
+ * of it uses (e.g. the value loaded by an atomic op, or the vaddr of the
+ * next callbacks) would not survive its label.  Make them TB temps: they
+ * are synced to memory at the branch and reloaded after the label.
+ */
+static void mem_cb_preserve_temps(const GArray *cbs, TCGOp *begin_op)
+{
+    TCGOp *op;
+    int i;
+
+    for (i = 0; i < cbs->len; i++) {
+        if (g_array_index(cbs, struct qemu_plugin_dyn_cb, i).type ==
+            PLUGIN_CB_COND) {
+            break;
+        }
+    }
+    if (i == cbs->len) {
+        return;
+    }
+
+    for (op = begin_op; op && op->opc != INDEX_op_insn_start;
+         op = QTAILQ_NEXT(op, link)) {
+        const TCGOpDef *def = &tcg_op_defs[op->opc];
+        int nb_args;
+
+        if (op->opc == INDEX_op_call) {
+            nb_args = TCGOP_CALLO(op) + TCGOP_CALLI(op);
+        } else {
+            nb_args = def->nb_oargs + def->nb_iargs;
+        }
+        for (i = 0; i < nb_args; i++) {
+            tcg_temp_ebb_to_tb(arg_temp(op->args[i]));
+        }
+    }
+}
+
 static void
 inject_mem_cb(const GArray *cbs, TCGOp *begin_op)
 {
+    if (cbs && cbs->len) {
+        mem_cb_preserve_temps(cbs, begin_op);
+    }
     inject_cb_type(cbs, begin_op, append_mem_cb, op_rw);
 }
 
@@ -0,0 +1,645 @@
+/*
+ * Persistent translation cache
+ *
+ * With -accel tcg,tb-cache=FILE the code buffer is saved to FILE at exit
+ * and mapped back at the next start, so that repeated boots of the same
+ * images do not translate the same code again. A saved TB lies dormant
+ * until tb_gen_code() is about to translate the same guest code: same
+ * physical address, pc, flags and cflags, and the same guest bytes. It
+ * is then linked in as if it had just been translated.
+ *
+ * The host code is not relocatable, it reaches the helpers and the
+ * epilogue at absolute or pc-relative addresses. The cache is therefore
+ * only used if the QEMU binary, the code buffer and the prologue are at
+ * the same addresses as in the run that saved it, i.e. with address
+ * space randomization disabled (setarch -R). It is ignored as well when
+ * it was saved by another build, on another host CPU, or for another
+ * machine or CPU configuration.
+ *
+ * The file, in host byte order:
+ *
+ *   TBCacheHeader
+ *   n_regions x uint64_t   bytes used at the start of each region
+ *   n_tbs x TBCacheRecord  each followed by the guest bytes of the TB,
+ *                          padded to 8 bytes
+ *   at hdr.data, page aligned, the used bytes of each region
+ *
+ * The file is replaced (not rewritten) at exit: the loaded one stays
+ * mapped privately.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cacheflush.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/rcu.h"
+#include "qom/object.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "sysemu/sysemu.h"
+#include "exec/exec-all.h"
+#include "exec/memory.h"
+#include "tcg/tcg.h"
+#include "host/cpuinfo.h"
+#include "tb-hash.h"
+#include "tb-cache.h"
+#include "internal-common.h"
+#include "internal-target.h"
+#ifdef CONFIG_LINUX
+#include <link.h>
+#endif
+
+#define TB_CACHE_MAGIC      "QTBCACHE"
+#define TB_CACHE_VERSION    1
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_regions;
+    /* SHA-256 of the build and the host, see tb_cache_build_digest() */
+    uint8_t build[32];
+    /* SHA-256 of the machine configuration, see tb_cache_config_digest() */
+    uint8_t config[32];
+    uint64_t buffer;        /* address of the code buffer */
+    uint64_t stride;        /* distance of the regions */
+    uint64_t n_tbs;
+    uint64_t data;          /* file offset of the region bytes */
+} TBCacheHeader;
+
+typedef struct TBCacheRecord {
+    uint64_t tb;            /* offset of the TranslationBlock in the buffer */
+    uint64_t phys_pc;
+    uint64_t pc;            /* 0 for CF_PCREL */
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t size;          /* of the guest bytes that follow */
+    uint32_t reserved;
+} TBCacheRecord;
+
+/* A dormant TB */
+typedef struct TBCacheEntry {
+    TBCacheRecord rec;
+    TranslationBlock *tb;
+    uint8_t bytes[];
+} TBCacheEntry;
+
+static struct {
+    char *path;
+    int fd;
+    TBCacheHeader hdr;
+    /* the machine is up and matches the configuration, so save at exit */
+    bool config_done;
+    QemuMutex lock;
+    /* TBCacheRecord (the key fields) -> TBCacheEntry */
+    GHashTable *index;
+    size_t loaded;
+    size_t revived;
+    Notifier machine_done;
+    Notifier exit;
+} tb_cache = { .fd = -1 };
+
+static guint tb_cache_key_hash(gconstpointer p)
+{
+    const TBCacheRecord *r = p;
+
+    return tb_hash_func(r->phys_pc, r->pc, r->flags, r->cs_base, r->cflags);
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheRecord *x = a, *y = b;
+
+    return x->phys_pc == y->phys_pc && x->pc == y->pc &&
+           x->cs_base == y->cs_base && x->flags == y->flags &&
+           x->cflags == y->cflags;
+}
+
+#ifdef CONFIG_LINUX
+/* Hashes the ELF notes (the build ID) of the object QEMU is linked into */
+static int tb_cache_hash_notes(struct dl_phdr_info *info, size_t size,
+                               void *opaque)
+{
+    uintptr_t self = (uintptr_t)tb_cache_hash_notes;
+    GChecksum *cs = opaque;
+    bool found = false;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+
+        if (ph->p_type == PT_LOAD &&
+            self >= start && self - start < ph->p_memsz) {
+            found = true;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+        if (ph->p_type == PT_NOTE) {
+            g_checksum_update(cs, (const guchar *)(info->dlpi_addr +
+                                                   ph->p_vaddr),
+                              ph->p_memsz);
+        }
+    }
+    return 1;
+}
+#endif
+
+static void tb_cache_digest_u64(GChecksum *cs, uint64_t val)
+{
+    g_checksum_update(cs, (const guchar *)&val, sizeof(val));
+}
+
+static void tb_cache_digest_done(GChecksum *cs, uint8_t *digest)
+{
+    gsize len = 32;
+
+    g_checksum_get_digest(cs, digest, &len);
+    g_checksum_free(cs);
+}
+
+/*
+ * The build and where it is loaded: the code calls into the binary.
+ * The host CPU features select the instructions the backend emits.
+ */
+static void tb_cache_build_digest(uint8_t *digest)
+{
+    GChecksum *cs = g_checksum_new(G_CHECKSUM_SHA256);
+
+    g_checksum_update(cs, (const guchar *)QEMU_VERSION TARGET_NAME, -1);
+    tb_cache_digest_u64(cs, sizeof(TranslationBlock));
+    tb_cache_digest_u64(cs, (uintptr_t)tb_gen_code);
+    tb_cache_digest_u64(cs, qemu_real_host_page_size());
+#ifdef CONFIG_LINUX
+    dl_iterate_phdr(tb_cache_hash_notes, cs);
+#endif
+#ifdef CPUINFO_ALWAYS
+    tb_cache_digest_u64(cs, cpuinfo);
+#endif
+    tb_cache_digest_done(cs, digest);
+}
+
+/*
+ * The machine and the configuration of its first CPU, which the
+ * translation depends on beyond the TB flags (e.g. the extensions).
+ */
+static void tb_cache_config_digest(uint8_t *digest)
+{
+    GChecksum *cs = g_checksum_new(G_CHECKSUM_SHA256);
+    ObjectPropertyIterator iter;
+    ObjectProperty *prop;
+
+    g_checksum_update(cs, (const guchar *)
+                      object_get_typename(OBJECT(current_machine)), -1);
+    tb_cache_digest_u64(cs, current_machine->ram_size);
+    tb_cache_digest_u64(cs, current_machine->smp.max_cpus);
+
+    g_checksum_update(cs, (const guchar *)
+                      object_get_typename(OBJECT(first_cpu)), -1);
+    object_property_iter_init(&iter, OBJECT(first_cpu));
+    while ((prop = object_property_iter_next(&iter))) {
+        g_autofree char *val = NULL;
+
+        if (!prop->get || strstart(prop->type, "link<", NULL) ||
+            strstart(prop->type, "child<", NULL)) {
+            continue;
+        }
+        val = object_property_print(OBJECT(first_cpu), prop->name, true,
+                                    NULL);
+        if (val) {
+            g_checksum_update(cs, (const guchar *)prop->name, -1);
+            g_checksum_update(cs, (const guchar *)val, -1);
+        }
+    }
+    tb_cache_digest_done(cs, digest);
+}
+
+static void tb_cache_drop_index(void)
+{
+    GHashTable *index = tb_cache.index;
+
+    if (index) {
+        qatomic_set(&tb_cache.index, NULL);
+        g_hash_table_destroy(index);
+    }
+}
+
+static bool tb_cache_plugins_active(void)
+{
+#ifdef CONFIG_PLUGIN
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+static void tb_cache_machine_done(Notifier *notifier, void *data)
+{
+    uint8_t config[32];
+
+    tb_cache_config_digest(config);
+    if (tb_cache.index && memcmp(config, tb_cache.hdr.config, 32)) {
+        warn_report("tb-cache %s: saved for another configuration, ignored",
+                    tb_cache.path);
+        tb_cache_drop_index();
+        /* Nothing was translated yet, give the regions back */
+        tcg_region_reset_all();
+    }
+    memcpy(tb_cache.hdr.config, config, 32);
+    tb_cache.config_done = true;
+}
+
+typedef struct TBCacheSave {
+    GByteArray *recs;
+    uint64_t n_tbs;
+    void *buffer;
+} TBCacheSave;
+
+static void tb_cache_save_record(TBCacheSave *save, const TBCacheRecord *rec,
+                                 const void *bytes)
+{
+    static const uint8_t pad[8];
+
+    g_byte_array_append(save->recs, (const guint8 *)rec, sizeof(*rec));
+    g_byte_array_append(save->recs, bytes, rec->size);
+    g_byte_array_append(save->recs, pad, -rec->size & 7);
+    save->n_tbs++;
+}
+
+static gboolean tb_cache_save_tb(gpointer key, gpointer value, gpointer data)
+{
+    TBCacheSave *save = data;
+    TranslationBlock *tb = value;
+    uint32_t cflags = tb_cflags(tb);
+    TBCacheRecord rec = {
+        .tb = (void *)tb - save->buffer,
+        .phys_pc = tb_page_addr0(tb),
+        .pc = cflags & CF_PCREL ? 0 : tb->pc,
+        .cs_base = tb->cs_base,
+        .flags = tb->flags,
+        .cflags = cflags,
+        .size = tb->size,
+    };
+
+    /* Only the valid TBs within one page of RAM */
+    if ((cflags & CF_INVALID) || tb_page_addr0(tb) == -1 ||
+        tb_page_addr1(tb) != -1 || !tb->size) {
+        return false;
+    }
+    WITH_RCU_READ_LOCK_GUARD() {
+        tb_cache_save_record(save, &rec,
+                             qemu_map_ram_ptr(NULL, tb_page_addr0(tb)));
+    }
+    return false;
+}
+
+static bool tb_cache_write(int fd, const TBCacheHeader *hdr,
+                           const uint64_t *used, const GByteArray *recs)
+{
+    size_t page_size = qemu_real_host_page_size();
+    off_t off = hdr->data;
+    size_t i;
+
+    if (qemu_write_full(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+        qemu_write_full(fd, used, hdr->n_regions * sizeof(*used)) !=
+        hdr->n_regions * sizeof(*used) ||
+        qemu_write_full(fd, recs->data, recs->len) != recs->len) {
+        return false;
+    }
+    for (i = 0; i < hdr->n_regions; i++) {
+        if (pwrite(fd, tcg_region_base(i), used[i], off) != used[i]) {
+            return false;
+        }
+        off += ROUND_UP(used[i], page_size);
+    }
+    return true;
+}
+
+/* The vCPUs are stopped by now */
+static void tb_cache_save(Notifier *notifier, void *data)
+{
+    size_t n = tcg_region_count();
+    size_t page_size = qemu_real_host_page_size();
+    g_autofree uint64_t *used = g_new(uint64_t, n);
+    g_autofree char *tmp = g_strdup_printf("%s.XXXXXX", tb_cache.path);
+    TBCacheHeader hdr = {};
+    TBCacheSave save = {
+        .recs = g_byte_array_new(),
+        .buffer = tcg_region_base(0),
+    };
+    size_t i;
+    int fd;
+
+    if (!tb_cache.config_done) {
+        return;
+    }
+    if (tb_cache_plugins_active()) {
+        warn_report("tb-cache %s: not saved, the code is instrumented "
+                    "by plugins", tb_cache.path);
+        return;
+    }
+
+    /* The live TBs first, they win over dormant ones for the same code */
+    tcg_tb_foreach(tb_cache_save_tb, &save);
+    if (tb_cache.index) {
+        GHashTableIter iter;
+        TBCacheEntry *e;
+
+        g_hash_table_iter_init(&iter, tb_cache.index);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+            tb_cache_save_record(&save, &e->rec, e->bytes);
+        }
+    }
+
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.n_regions = n;
+    tb_cache_build_digest(hdr.build);
+    memcpy(hdr.config, tb_cache.hdr.config, sizeof(hdr.config));
+    hdr.buffer = (uintptr_t)tcg_region_base(0);
+    hdr.stride = n > 1 ? tcg_region_base(1) - tcg_region_base(0) : 0;
+    hdr.n_tbs = save.n_tbs;
+    hdr.data = ROUND_UP(sizeof(hdr) + n * sizeof(*used) + save.recs->len,
+                        page_size);
+    for (i = 0; i < n; i++) {
+        used[i] = tcg_region_used(i);
+    }
+
+    fd = g_mkstemp(tmp);
+    if (fd < 0) {
+        warn_report("tb-cache %s: %s", tmp, strerror(errno));
+    } else if (!tb_cache_write(fd, &hdr, used, save.recs) ||
+               close(fd) || rename(tmp, tb_cache.path)) {
+        warn_report("tb-cache %s: %s", tb_cache.path, strerror(errno));
+        unlink(tmp);
+    }
+    g_byte_array_free(save.recs, true);
+}
+
+void tb_cache_open(const char *path)
+{
+    TBCacheHeader *hdr = &tb_cache.hdr;
+    uint8_t build[32];
+    int fd;
+
+    tb_cache.path = g_strdup(path);
+    qemu_mutex_init(&tb_cache.lock);
+    tb_cache.machine_done.notify = tb_cache_machine_done;
+    qemu_add_machine_init_done_notifier(&tb_cache.machine_done);
+    tb_cache.exit.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        /* the first run creates it */
+        if (errno != ENOENT) {
+            warn_report("tb-cache %s: %s", path, strerror(errno));
+        }
+        return;
+    }
+    tb_cache_build_digest(build);
+    if (read(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+        memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != TB_CACHE_VERSION) {
+        warn_report("tb-cache %s: not a TB cache file, ignored", path);
+        close(fd);
+        return;
+    }
+    if (memcmp(hdr->build, build, sizeof(build))) {
+        warn_report("tb-cache %s: saved by another build or at another "
+                    "address, ignored", path);
+        close(fd);
+        return;
+    }
+    tcg_region_request_address((void *)(uintptr_t)hdr->buffer);
+    tb_cache.fd = fd;
+}
+
+/* Reads the records into the index */
+static bool tb_cache_load_index(int fd)
+{
+    const TBCacheHeader *hdr = &tb_cache.hdr;
+    size_t space = tcg_region_count() > 1 ?
+                   hdr->stride * tcg_region_count() :
+                   tcg_region_space(0);
+    uint64_t i;
+
+    tb_cache.index = g_hash_table_new_full(tb_cache_key_hash,
+                                           tb_cache_key_equal, NULL, g_free);
+    for (i = 0; i < hdr->n_tbs; i++) {
+        TBCacheRecord rec;
+        TBCacheEntry *e;
+
+        if (read(fd, &rec, sizeof(rec)) != sizeof(rec) ||
+            rec.size > TARGET_PAGE_SIZE || rec.tb >= space) {
+            return false;
+        }
+        e = g_malloc(sizeof(*e) + ROUND_UP(rec.size, 8));
+        e->rec = rec;
+        e->tb = tcg_region_base(0) + rec.tb;
+        if (read(fd, e->bytes, ROUND_UP(rec.size, 8)) !=
+            ROUND_UP(rec.size, 8)) {
+            g_free(e);
+            return false;
+        }
+        if (g_hash_table_contains(tb_cache.index, &e->rec)) {
+            g_free(e);
+            continue;
+        }
+        g_hash_table_add(tb_cache.index, e);
+    }
+    tb_cache.loaded = g_hash_table_size(tb_cache.index);
+    return true;
+}
+
+/* Maps the saved bytes of region I over it */
+static bool tb_cache_map_region(int fd, size_t i, size_t used, off_t off)
+{
+    size_t len = ROUND_UP(used, qemu_real_host_page_size());
+    void *base = tcg_region_base(i);
+
+    if (mmap(base, len, PROT_READ | PROT_WRITE | PROT_EXEC,
+             MAP_PRIVATE | MAP_FIXED, fd, off) == MAP_FAILED) {
+        /* e.g. a noexec file system: copy */
+        if (pread(fd, base, used, off) != used) {
+            return false;
+        }
+    }
+    flush_idcache_range((uintptr_t)base, (uintptr_t)base, used);
+    return true;
+}
+
+void tb_cache_load(void)
+{
+    const TBCacheHeader *hdr = &tb_cache.hdr;
+    size_t n = tcg_region_count();
+    size_t page_size = qemu_real_host_page_size();
+    size_t prologue = tcg_region_used(0);
+    g_autofree uint64_t *used = NULL;
+    g_autofree uint8_t *saved_prologue = NULL;
+    const char *why = NULL;
+    int fd = tb_cache.fd;
+    off_t off;
+    size_t i;
+
+    if (fd < 0) {
+        return;
+    }
+    tb_cache.fd = -1;
+
+    if (tcg_splitwx_diff) {
+        why = "split-wx is on";
+    } else if (hdr->buffer != (uintptr_t)tcg_region_base(0)) {
+        why = "the code buffer is at another address";
+    } else if (hdr->n_regions != n ||
+               (n > 1 && hdr->stride != tcg_region_base(1) -
+                                        tcg_region_base(0))) {
+        why = "the code buffer is split differently";
+    }
+    if (why) {
+        warn_report("tb-cache %s: %s, ignored", tb_cache.path, why);
+        close(fd);
+        return;
+    }
+
+    used = g_new(uint64_t, n);
+    if (read(fd, used, n * sizeof(*used)) != n * sizeof(*used)) {
+        goto bad;
+    }
+    for (i = 0; i < n; i++) {
+        if (used[i] > tcg_region_space(i) || (i == 0 && used[i] < prologue)) {
+            goto bad;
+        }
+    }
+    if (!tb_cache_load_index(fd)) {
+        goto bad;
+    }
+
+    /* The code jumps to the epilogue, it must be the same */
+    saved_prologue = g_malloc(prologue);
+    if (pread(fd, saved_prologue, prologue, hdr->data) != prologue) {
+        goto bad;
+    }
+    if (memcmp(saved_prologue, tcg_region_base(0), prologue)) {
+        warn_report("tb-cache %s: the prologue differs, ignored",
+                    tb_cache.path);
+        goto out;
+    }
+
+    off = hdr->data;
+    for (i = 0; i < n; i++) {
+        if (used[i] && !tb_cache_map_region(fd, i, used[i], off)) {
+            /* the prologue may be gone */
+            error_report("tb-cache %s: %s", tb_cache.path, strerror(errno));
+            exit(1);
+        }
+        tcg_region_reserve(i, used[i]);
+        off += ROUND_UP(used[i], page_size);
+    }
+    close(fd);
+    return;
+
+bad:
+    warn_report("tb-cache %s: truncated or corrupted, ignored", tb_cache.path);
+out:
+    tb_cache_drop_index();
+    tb_cache.loaded = 0;
+    close(fd);
+}
+
+TranslationBlock *tb_cache_lookup(CPUState *cpu, tb_page_addr_t phys_pc,
+                                  vaddr pc, uint64_t cs_base, uint32_t flags,
+                                  uint32_t cflags, void *host_pc)
+{
+    TBCacheRecord key = {
+        .phys_pc = phys_pc,
+        .pc = cflags & CF_PCREL ? 0 : pc,
+        .cs_base = cs_base,
+        .flags = flags,
+        .cflags = cflags,
+    };
+    TranslationBlock *tb, *existing_tb;
+    TBCacheEntry *e;
+
+    if (likely(!qatomic_read(&tb_cache.index)) || !host_pc) {
+        return NULL;
+    }
+#ifdef CONFIG_PLUGIN
+    /* The saved code is not instrumented */
+    if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+        return NULL;
+    }
+#endif
+
+    qemu_mutex_lock(&tb_cache.lock);
+    e = g_hash_table_lookup(tb_cache.index, &key);
+    if (e && (phys_pc & ~TARGET_PAGE_MASK) + e->rec.size <= TARGET_PAGE_SIZE &&
+        !memcmp(host_pc, e->bytes, e->rec.size)) {
+        g_hash_table_steal(tb_cache.index, &key);
+    } else {
+        e = NULL;
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+    if (!e) {
+        return NULL;
+    }
+    tb = e->tb;
+    g_free(e);
+
+    /* Everything that pointed to other TBs is stale */
+    tb->cflags = cflags;
+    tb_set_page_addr0(tb, phys_pc);
+    tb_set_page_addr1(tb, -1);
+    qemu_spin_init(&tb->jmp_lock);
+    tb->jmp_list_head = (uintptr_t)NULL;
+    tb->jmp_list_next[0] = (uintptr_t)NULL;
+    tb->jmp_list_next[1] = (uintptr_t)NULL;
+    tb->jmp_dest[0] = (uintptr_t)NULL;
+    tb->jmp_dest[1] = (uintptr_t)NULL;
+    if (tb->jmp_reset_offset[0] != TB_JMP_OFFSET_INVALID) {
+        tb_reset_jump(tb, 0);
+    }
+    if (tb->jmp_reset_offset[1] != TB_JMP_OFFSET_INVALID) {
+        tb_reset_jump(tb, 1);
+    }
+
+    /* As in tb_gen_code() */
+    tb_lock_page0(phys_pc);
+    tcg_tb_insert(tb);
+    existing_tb = tb_link_page(tb);
+    assert_no_pages_locked();
+    if (unlikely(existing_tb != tb)) {
+        tcg_tb_remove(tb);
+        return existing_tb;
+    }
+    qatomic_inc(&tb_cache.revived);
+    return tb;
+}
+
+void tb_cache_flush(void)
+{
+    tb_cache_drop_index();
+}
+
+void tb_cache_dump_info(GString *buf)
+{
+    if (!tb_cache.path) {
+        return;
+    }
+    g_string_append_printf(buf, "TB cache revived    %zu/%zu\n",
+                           qatomic_read(&tb_cache.revived), tb_cache.loaded);
+}
@@ -0,0 +1,48 @@
+/*
+ * Persistent translation cache, see tb-cache.c
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_CACHE_H
+#define ACCEL_TCG_TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+#ifdef CONFIG_USER_ONLY
+static inline TranslationBlock *tb_cache_lookup(CPUState *cpu,
+                                                tb_page_addr_t phys_pc,
+                                                vaddr pc, uint64_t cs_base,
+                                                uint32_t flags,
+                                                uint32_t cflags,
+                                                void *host_pc)
+{
+    return NULL;
+}
+
+static inline void tb_cache_flush(void)
+{
+}
+#else
+/* Reads the header of PATH, before tcg_init() */
+void tb_cache_open(const char *path);
+
+/* Maps the saved code into the code buffer, after tcg_prologue_init() */
+void tb_cache_load(void);
+
+/*
+ * Returns the saved TB of the guest code at PHYS_PC (at HOST_PC in host
+ * memory), linked in like a translated one, or NULL.
+ * Called from tb_gen_code().
+ */
+TranslationBlock *tb_cache_lookup(CPUState *cpu, tb_page_addr_t phys_pc,
+                                  vaddr pc, uint64_t cs_base, uint32_t flags,
+                                  uint32_t cflags, void *host_pc);
+
+/* Forgets the saved TBs, their code is gone. Call from a safe-work context */
+void tb_cache_flush(void);
+
+void tb_cache_dump_info(GString *buf);
+#endif
+
+#endif /* ACCEL_TCG_TB_CACHE_H */
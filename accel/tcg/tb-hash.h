@@ -50,6 +50,29 @@ static inline unsigned int tb_jmp_cache_hash_func(vaddr pc)
            | (tmp & TB_JMP_ADDR_MASK));
 }
 
+/* The same for the sets of the second level */
+#define TB_JMP_L2_PAGE_BITS (TB_JMP_L2_BITS / 2)
+#define TB_JMP_L2_PAGE_SIZE (1 << TB_JMP_L2_PAGE_BITS)
+#define TB_JMP_L2_ADDR_MASK (TB_JMP_L2_PAGE_SIZE - 1)
+#define TB_JMP_L2_PAGE_MASK (TB_JMP_L2_SETS - TB_JMP_L2_PAGE_SIZE)
+
+static inline unsigned int tb_jmp_l2_hash_page(vaddr pc)
+{
+    vaddr tmp;
+    tmp = pc ^ (pc >> (TARGET_PAGE_BITS - TB_JMP_L2_PAGE_BITS));
+    return (tmp >> (TARGET_PAGE_BITS - TB_JMP_L2_PAGE_BITS))
+           & TB_JMP_L2_PAGE_MASK;
+}
+
+static inline unsigned int tb_jmp_l2_hash_func(vaddr pc)
+{
+    vaddr tmp;
+    tmp = pc ^ (pc >> (TARGET_PAGE_BITS - TB_JMP_L2_PAGE_BITS));
+    return (((tmp >> (TARGET_PAGE_BITS - TB_JMP_L2_PAGE_BITS))
+             & TB_JMP_L2_PAGE_MASK)
+           | (tmp & TB_JMP_L2_ADDR_MASK));
+}
+
 #else
 
 /* In user-mode we can get better hashing because we do not have a TLB */
@@ -58,6 +81,11 @@ static inline unsigned int tb_jmp_cache_hash_func(vaddr pc)
     return (pc ^ (pc >> TB_JMP_CACHE_BITS)) & (TB_JMP_CACHE_SIZE - 1);
 }
 
+static inline unsigned int tb_jmp_l2_hash_func(vaddr pc)
+{
+    return (pc ^ (pc >> TB_JMP_L2_BITS)) & (TB_JMP_L2_SETS - 1);
+}
+
 #endif /* CONFIG_SOFTMMU */
 
 static inline
@@ -12,17 +12,43 @@
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/*
+ * The second level is a set associative cache of the TBs evicted from
+ * the first one, most recently used way first.
+ */
+#define TB_JMP_L2_BITS 10
+#define TB_JMP_L2_SETS (1 << TB_JMP_L2_BITS)
+#define TB_JMP_L2_WAYS 4
+
+/* Return address stack, a ring of the return targets of the last calls */
+#define TB_RAS_SIZE 16
+
 /*
  * Accessed in parallel; all accesses to 'tb' must be atomic.
  * For CF_PCREL, accesses to 'pc' must be protected by a
  * load_acquire/store_release to 'tb'.
  */
+typedef struct CPUJumpCacheEntry {
+    TranslationBlock *tb;
+    vaddr pc;
+} CPUJumpCacheEntry;
+
+/* Only updated by the vCPU thread, read racily by "info jit" */
+typedef struct CPUJumpCacheStats {
+    uint64_t lookups;
+    uint64_t l2_hits;
+    uint64_t ras_hits;
+    uint64_t ras_misses;
+    uint64_t htable_lookups;
+} CPUJumpCacheStats;
+
 struct CPUJumpCache {
     struct rcu_head rcu;
-    struct {
-        TranslationBlock *tb;
-        vaddr pc;
-    } array[TB_JMP_CACHE_SIZE];
+    CPUJumpCacheEntry array[TB_JMP_CACHE_SIZE];
+    CPUJumpCacheEntry l2[TB_JMP_L2_SETS][TB_JMP_L2_WAYS];
+    CPUJumpCacheEntry ras[TB_RAS_SIZE];
+    unsigned ras_top;
+    CPUJumpCacheStats stats;
 };
 
 #endif /* ACCEL_TCG_TB_JMP_CACHE_H */
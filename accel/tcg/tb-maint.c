@@ -28,6 +28,7 @@
 #include "sysemu/tcg.h"
 #include "tcg/tcg.h"
 #include "tb-hash.h"
+#include "tb-cache.h"
 #include "tb-context.h"
 #include "internal-common.h"
 #include "internal-target.h"
@@ -773,6 +774,7 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     tb_remove_all();
 
+    tb_cache_flush();
     tcg_region_reset_all();
     /* XXX: flush processor icache at this point if cache flush is expensive */
     qatomic_inc(&tb_ctx.tb_flush_count);
@@ -885,13 +887,25 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
         }
     } else {
         uint32_t h = tb_jmp_cache_hash_func(tb->pc);
+        uint32_t h2 = tb_jmp_l2_hash_func(tb->pc);
 
         CPU_FOREACH(cpu) {
             CPUJumpCache *jc = cpu->tb_jmp_cache;
+            int i;
 
             if (qatomic_read(&jc->array[h].tb) == tb) {
                 qatomic_set(&jc->array[h].tb, NULL);
             }
+            for (i = 0; i < TB_JMP_L2_WAYS; i++) {
+                if (qatomic_read(&jc->l2[h2][i].tb) == tb) {
+                    qatomic_set(&jc->l2[h2][i].tb, NULL);
+                }
+            }
+            for (i = 0; i < TB_RAS_SIZE; i++) {
+                if (qatomic_read(&jc->ras[i].tb) == tb) {
+                    qatomic_set(&jc->ras[i].tb, NULL);
+                }
+            }
         }
     }
 }
@@ -901,7 +915,7 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
  * In !user-mode, if @rm_from_page_list is set, call with the TB's pages'
  * locks held.
  */
-static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
+static bool do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
 {
     uint32_t h;
     tb_page_addr_t phys_pc;
@@ -919,7 +933,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     h = tb_hash_func(phys_pc, (orig_cflags & CF_PCREL ? 0 : tb->pc),
                      tb->flags, tb->cs_base, orig_cflags);
     if (!qht_remove(&tb_ctx.htable, tb, h)) {
-        return;
+        return false;
     }
 
     /* remove the TB from the page list */
@@ -939,6 +953,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
 
     qatomic_set(&tb_ctx.tb_phys_invalidate_count,
                 tb_ctx.tb_phys_invalidate_count + 1);
+    return true;
 }
 
 static void tb_phys_invalidate__locked(TranslationBlock *tb)
@@ -950,17 +965,21 @@ static void tb_phys_invalidate__locked(TranslationBlock *tb)
 
 /*
  * Invalidate one TB.
+ * Return false if another thread had already invalidated it.
  * Called with mmap_lock held in user-mode.
  */
-void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+bool tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
+    bool ret;
+
     if (page_addr == -1 && tb_page_addr0(tb) != -1) {
         tb_lock_pages(tb);
-        do_tb_phys_invalidate(tb, true);
+        ret = do_tb_phys_invalidate(tb, true);
         tb_unlock_pages(tb);
     } else {
-        do_tb_phys_invalidate(tb, false);
+        ret = do_tb_phys_invalidate(tb, false);
     }
+    return ret;
 }
 
 /*
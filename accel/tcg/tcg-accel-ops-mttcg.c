@@ -30,9 +30,13 @@
 #include "qemu/main-loop.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 
 #include "qemu/notify.h"
 #include "qemu/guest-random.h"
+#include "qemu/error-report.h"
+#include "qemu-main.h"
 #include "exec/exec-all.h"
 #include "hw/boards.h"
 #include "tcg/startup.h"
@@ -59,6 +63,8 @@ static void mttcg_force_rcu(Notifier *notify, void *data)
     async_run_on_cpu(cpu, do_nothing, RUN_ON_CPU_NULL);
 }
 
+extern int cosim_mode;
+
 /*
  * In the multi-threaded case each vCPU has its own thread. The TLS
  * variable current_cpu can be used deep in the code to find the
@@ -111,6 +117,10 @@ LOGIM("<-- tcg_cpus_exec () r = %d", r);
             case EXCP_DEBUG:
                 cpu_handle_guest_debug(cpu);
                 break;
+            case EXCP_COSIM:
+                /* the step of this hart is over (or its RVFI ring is full) */
+                cpu_handle_cosim_lockstep(cpu);
+                break;
              case EXCP_HALTED:
                 /*
                  * Usually cpu->halted is set, but may have already been
@@ -157,6 +167,21 @@ void mttcg_start_vcpu_thread(CPUState *cpu)
     g_assert(tcg_enabled());
     tcg_cpu_init_cflags(cpu, current_machine->smp.max_cpus > 1);
 
+    ////////////   COSIM ////////////////
+    /*
+     * Each hart is stepped on its own vCPU thread (LOCKSTEP only -
+     * DIRECT mode runs the vCPU loop on the COSIM thread).
+     */
+    if (cosim_mode == COSIM_MODE_DIRECT) {
+        error_report("COSIM: DIRECT mode requires -accel tcg,thread=single");
+        exit(1);
+    }
+    if (cosim_mode) {
+        cpu->tcg_cflags |= CF_COSIM_COUNT | CF_COSIM_RVFI;
+    }
+    cosim_hart_attach(cpu);
+    ///////////////////////////////////
+
     cpu->thread = g_new0(QemuThread, 1);
     cpu->halt_cond = g_malloc0(sizeof(QemuCond));
     qemu_cond_init(cpu->halt_cond);
@@ -32,9 +32,14 @@
 #include "qemu/notify.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 #include "qemu-main.h"
+#include "qemu/cosim-ring.h"
+#include "qemu/error-report.h"
 
 #include "qemu/guest-random.h"
+#include "sysemu/runstate.h"
 #include "exec/exec-all.h"
 #include "tcg/startup.h"
 #include "tcg-accel-ops.h"
@@ -374,20 +379,132 @@ LOGIM ("------ OUT OF LOOP -- RETURN ------");
 }
 
 ///////////  COSIM  ////////////
-static void cosim_thread_go (void)
+/*
+ * DIRECT mode: there is no CPU thread, the vCPU loop below is run
+ * on COSIM thread from QEMU_step_hart(). It is the rr_cpu_thread_fn()
+ * loop cut down to the single hart being stepped.
+ *
+ * As with the RR thread there is one TCG context, so all harts are
+ * stepped from one COSIM thread - the first one which steps.
+ */
+static Notifier rr_cosim_force_rcu;
+
+static bool rr_cosim_register_thread(CPUState *cpu)
 {
-    if (cosim_mode) {
-        printf ("%s() ----> LOCK () lock = %p \n", __FUNCTION__, COSIM_glue_data->cosim_mutex);
-        pthread_mutex_lock (COSIM_glue_data->cosim_mutex);  
-        printf ("%s() <---- LOCK () lock = %p \n", __FUNCTION__, COSIM_glue_data->cosim_mutex);
+    static bool thread_registered;
+
+    if (!thread_registered) {
+        rcu_register_thread();
+        rr_cosim_force_rcu.notify = rr_force_rcu;
+        rcu_add_force_rcu_notifier(&rr_cosim_force_rcu);
+        tcg_register_thread();
+        qemu_thread_get_self(cpu->thread);
+        thread_registered = true;
+    } else if (!qemu_thread_is_self(cpu->thread)) {
+        error_report("COSIM: DIRECT mode harts must be stepped "
+                     "from one thread");
+        return false;
+    }
+
+    if (cpu->thread_id != qemu_get_thread_id()) {
+        cpu->thread_id = qemu_get_thread_id();
+        cpu->neg.can_do_io = true;
+        qemu_guest_random_seed_thread_part2(cpu->random_seed);
+    }
+    return true;
+}
+
+/*
+ * Executes up to N instructions of HART on the caller's thread and returns
+ * the number of instructions executed. Less than N is returned when
+ * the VM is stopped/paused, QEMU is gone or a debug exception is hit,
+ * or (with more than one hart) the hart is halted in WFI.
+ */
+static uint64_t rr_cosim_direct_step(COSIM_hart_t *hart, uint64_t n)
+{
+    CPUState *cpu = (CPUState *)hart->vcpu;
+    uint64_t retired = 0;
+
+    qemu_mutex_lock_iothread();
+
+    if (COSIM_glue_data->qemu_done || !rr_cosim_register_thread(cpu)) {
+        qemu_mutex_unlock_iothread();
+        return 0;
+    }
+
+    /*
+     * Same as qemu_fd_sync_dispatch() does in LOCKSTEP mode but
+     * without the kick - nobody is sleeping on halt_cond.
+     */
+    if (!runstate_is_running()) {
+        runstate_set(RUN_STATE_RUNNING);
+    }
+    cpu->cosim_singlestep = 1;
+    cpu->stop = false;
+    cpu->stopped = false;
+    current_cpu = cpu;
+
+    /* the budget is counted down by the translated code */
+    cpu_cosim_set_budget(cpu, n);
+
+    while (cpu_cosim_budget_left(cpu) != 0) {
+        int r;
 
-        printf ("%s() ---->  BCAST () cond = %p \n", __FUNCTION__, COSIM_glue_data->cosim_cond);
-        pthread_cond_broadcast (COSIM_glue_data->cosim_cond);
+        /* process stop requests and queued work */
+        qemu_wait_io_event_common(cpu);
+        if (!cpu_can_run(cpu)) {
+            break;
+        }
+
+        cpu_cosim_set_budget(cpu, cpu_cosim_budget_left(cpu));
 
-        printf ("%s() ----> UNLOCK () lock = %p \n", __FUNCTION__, COSIM_glue_data->cosim_mutex);
-        pthread_mutex_unlock (COSIM_glue_data->cosim_mutex);  
-        printf ("%s() <---- UNLOCK () lock = %p \n", __FUNCTION__, COSIM_glue_data->cosim_mutex);
-     }
+        qemu_mutex_unlock_iothread();
+        r = tcg_cpus_exec(cpu);
+        qemu_mutex_lock_iothread();
+
+        if (r == EXCP_COSIM) {
+            if (hart->ring_active && cpu_cosim_budget_left(cpu) != 0) {
+                /* RVFI ring is full - wait for the consumer */
+                qemu_mutex_unlock_iothread();
+                cosim_ring_wait_space(hart->ring, COSIM_RING_WAIT_NS);
+                qemu_mutex_lock_iothread();
+                continue;
+            }
+            break;
+        } else if (r == EXCP_DEBUG) {
+            cpu_handle_guest_debug(cpu);
+            break;
+        } else if (r == EXCP_ATOMIC) {
+            cpu_cosim_set_budget(cpu, cpu_cosim_budget_left(cpu));
+            qemu_mutex_unlock_iothread();
+            cpu_exec_step_atomic(cpu);
+            qemu_mutex_lock_iothread();
+        } else if (r == EXCP_HALTED) {
+            /*
+             * WFI: the wake-up IPI may only come from a hart stepped
+             * by this very thread, give the control back to COSIM.
+             */
+            if (COSIM_glue_data->nharts > 1) {
+                break;
+            }
+            /* sleep on halt_cond until an interrupt arrives */
+            qemu_wait_io_event(cpu);
+        }
+    }
+
+    retired = n - cpu_cosim_budget_left(cpu);
+    cpu_cosim_set_budget(cpu, 0);
+
+    /*
+     * As in LOCKSTEP mode the CPU is "stopped" between steps so that
+     * pause_all_vcpus() from the main loop does not wait for COSIM.
+     * A stop request which raced with the last instruction is acked here.
+     */
+    qemu_wait_io_event_common(cpu);
+    cpu->stopped = true;
+
+    qemu_mutex_unlock_iothread();
+    return retired;
 }
 ///////////  COSIM  ////////////
 
@@ -400,19 +517,39 @@ void rr_start_vcpu_thread(CPUState *cpu)
     g_assert(tcg_enabled());
     tcg_cpu_init_cflags(cpu, false);
 
-    ////////////   COSIM ////////////////
     /*
-     * Linking CPu with cosim-specific data.
-     * Yet ... it s not clear how to deal with NCPU > 1 - TB figured out
+     * COSIM: translated code counts the step budget down, so TBs
+     * stay cached and chained (no one-insn-per-tb/nochain needed).
+     * The target captures the RVFI record in translated code as well.
      */
-    cpu->cosim_mode = cosim_mode;
-    cpu->cosim_data = (void*)COSIM_glue_data;
     if (cosim_mode) {
-        COSIM_glue_data->vcpu = cpu;
+        cpu->tcg_cflags |= CF_COSIM_COUNT | CF_COSIM_RVFI;
     }
+    if (cosim_mode == COSIM_MODE_DIRECT) {
+        COSIM_glue_data->step = rr_cosim_direct_step;
+    }
+
+    ////////////   COSIM ////////////////
+    /*
+     * Linking CPU with its cosim hart context.
+     */
+    cosim_hart_attach(cpu);
     ///////////////////////////////////
 
-    if (!single_tcg_cpu_thread) {
+    if (!single_tcg_cpu_thread && cosim_mode == COSIM_MODE_DIRECT) {
+        cpu->thread = g_new0(QemuThread, 1);
+        cpu->halt_cond = g_new0(QemuCond, 1);
+        qemu_cond_init(cpu->halt_cond);
+
+        /*
+         * No CPU thread - COSIM thread becomes the vCPU thread
+         * on the first QEMU_step().
+         */
+        cpu->created = true;
+
+        single_tcg_halt_cond = cpu->halt_cond;
+        single_tcg_cpu_thread = cpu->thread;
+    } else if (!single_tcg_cpu_thread) {
         cpu->thread = g_new0(QemuThread, 1);
         cpu->halt_cond = g_new0(QemuCond, 1);
         qemu_cond_init(cpu->halt_cond);
@@ -423,9 +560,6 @@ void rr_start_vcpu_thread(CPUState *cpu)
                            rr_cpu_thread_fn,
                            cpu, QEMU_THREAD_JOINABLE);
 
-
-        cosim_thread_go ();
-
         single_tcg_halt_cond = cpu->halt_cond;
         single_tcg_cpu_thread = cpu->thread;
     } else {
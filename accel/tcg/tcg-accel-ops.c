@@ -34,6 +34,8 @@
 #include "qemu/timer.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 
 #include "exec/exec-all.h"
 #include "exec/hwaddr.h"
@@ -35,6 +35,8 @@
 #include "qemu/atomic.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 
 #include "qapi/qapi-builtin-visit.h"
 #include "qemu/units.h"
@@ -42,6 +44,9 @@
 #include "hw/boards.h"
 #endif
 #include "internal-target.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "tb-cache.h"
+#endif
 
 struct TCGState {
     AccelState parent_obj;
@@ -50,6 +55,8 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t tier_threshold;
+    char *tb_cache;
 };
 typedef struct TCGState TCGState;
 
@@ -120,6 +127,11 @@ LOGIM("mttcg_enabled <== %d", s->mttcg_enabled);
 
     page_init();
     tb_htable_init();
+#if defined(CONFIG_SOFTMMU)
+    if (s->tb_cache) {
+        tb_cache_open(s->tb_cache);
+    }
+#endif
     tcg_init(s->tb_size * MiB, s->splitwx_enabled, max_cpus);
 
 #if defined(CONFIG_SOFTMMU)
@@ -128,6 +140,9 @@ LOGIM("mttcg_enabled <== %d", s->mttcg_enabled);
      * initialize the prologue now.
      */
     tcg_prologue_init();
+    if (s->tb_cache) {
+        tb_cache_load();
+    }
 #endif
 
     return 0;
@@ -189,6 +204,35 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static void tcg_get_tier_threshold(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->tier_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_tier_threshold(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value >= TB_TIER_FULL) {
+        error_setg(errp, "tier-threshold must be below %d", TB_TIER_FULL);
+        return;
+    }
+
+    s->tier_threshold = value;
+    qatomic_set(&tb_tier_threshold, value);
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -201,6 +245,23 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+#endif
+
 static bool tcg_get_one_insn_per_tb(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -250,11 +311,25 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+    object_class_property_add(oc, "tier-threshold", "int",
+        tcg_get_tier_threshold, tcg_set_tier_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "tier-threshold",
+        "Executions of a quickly translated block before it is optimised"
+        " (0: always optimise)");
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
         "Map jit pages into separate RW and RX regions");
 
+#if !defined(CONFIG_USER_ONLY)
+    object_class_property_add_str(oc, "tb-cache",
+                                  tcg_get_tb_cache, tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File keeping the translated code from one run to the next");
+#endif
+
     object_class_property_add_bool(oc, "one-insn-per-tb",
                                    tcg_get_one_insn_per_tb,
                                    tcg_set_one_insn_per_tb);
@@ -60,6 +60,7 @@
 #include "hw/core/tcg-cpu-ops.h"
 #include "tb-jmp-cache.h"
 #include "tb-hash.h"
+#include "tb-cache.h"
 #include "tb-context.h"
 #include "internal-common.h"
 #include "internal-target.h"
@@ -68,6 +69,8 @@
 
 TBContext tb_ctx;
 
+uint32_t tb_tier_threshold;
+
 /*
  * Encode VAL as a signed leb128 sequence at P.
  * Return P incremented past the encoded value.
@@ -216,6 +219,9 @@ void cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
          * shift if to the number of actually executed instructions.
          */
         cpu->neg.icount_decr.u16.low += insns_left;
+    } else if (tb_cflags(tb) & CF_COSIM_COUNT) {
+        /* Same for COSIM step budget */
+        cpu->neg.icount_decr.u16.low += insns_left;
     }
 
     cpu->cc->tcg_ops->restore_state_to_opc(cpu, tb, data);
@@ -285,9 +291,10 @@ static int setjmp_gen_code(CPUArchState *env, TranslationBlock *tb,
 }
 
 /* Called with mmap_lock held for user mode emulation.  */
-TranslationBlock *tb_gen_code(CPUState *cpu,
-                              vaddr pc, uint64_t cs_base,
-                              uint32_t flags, int cflags)
+static TranslationBlock *do_tb_gen_code(CPUState *cpu,
+                                        vaddr pc, uint64_t cs_base,
+                                        uint32_t flags, int cflags,
+                                        const TranslationBlock *hot_tb)
 {
     CPUArchState *env = cpu_env(cpu);
     TranslationBlock *tb, *existing_tb;
@@ -305,6 +312,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (phys_pc == -1) {
         /* Generate a one-shot TB with 1 insn in it */
         cflags = (cflags & ~CF_COUNT_MASK) | CF_LAST_IO | 1;
+    } else {
+        /* Translated by an earlier run? */
+        tb = tb_cache_lookup(cpu, phys_pc, pc, cs_base, flags, cflags,
+                             host_pc);
+        if (tb) {
+            return tb;
+        }
     }
 
     max_insns = cflags & CF_COUNT_MASK;
@@ -339,6 +353,19 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         tb_lock_page0(phys_pc);
     }
 
+    /*
+     * Only full-length TBs are tiered: the exact-length ones serve icount,
+     * single-stepping and atomic steps, which must not exit early.
+     * A retranslation of a HOT_TB is fully optimised and uses its profile.
+     */
+    tb->tier_count = TB_TIER_FULL;
+    tb->tier_taken = 0;
+    if (!hot_tb && qatomic_read(&tb_tier_threshold) &&
+        !(cflags & (CF_NOIRQ | CF_COUNT_MASK))) {
+        tb->tier_count = qatomic_read(&tb_tier_threshold);
+    }
+    tcg_ctx->gen_hot_tb = hot_tb;
+
     tcg_ctx->gen_tb = tb;
     tcg_ctx->addr_type = TARGET_LONG_BITS == 32 ? TCG_TYPE_I32 : TCG_TYPE_I64;
 #ifdef CONFIG_SOFTMMU
@@ -564,6 +591,39 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     return tb;
 }
 
+/* Called with mmap_lock held for user mode emulation.  */
+TranslationBlock *tb_gen_code(CPUState *cpu,
+                              vaddr pc, uint64_t cs_base,
+                              uint32_t flags, int cflags)
+{
+    return do_tb_gen_code(cpu, pc, cs_base, flags, cflags, NULL);
+}
+
+/*
+ * Replace the hot first-tier @tb, found for @pc, with a fully optimised
+ * translation, which continues past the branches the profiles show
+ * rarely taken.  Incoming jumps are unlinked with the old TB and chain to
+ * the new one as they are taken again.
+ * Called with mmap_lock held for user mode emulation.
+ */
+TranslationBlock *tb_retranslate(CPUState *cpu, TranslationBlock *tb,
+                                 vaddr pc, uint64_t cs_base,
+                                 uint32_t flags, int cflags)
+{
+    /*
+     * The vCPU whose invalidation removes @tb from the hash table owns the
+     * retranslation; for the others the old TB exits again at once and the
+     * next lookup finds the new one.  tier_count is decremented by the
+     * generated code without atomics and cannot serve as the claim.
+     */
+    if (qatomic_read(&tb->tier_count) >= 0 || !tb_phys_invalidate(tb, -1)) {
+        return tb;
+    }
+
+    qatomic_inc(&tb_ctx.tb_retranslate_count);
+    return do_tb_gen_code(cpu, pc, cs_base, flags, cflags, tb);
+}
+
 /* user-mode: call with mmap_lock held */
 void tb_check_watchpoint(CPUState *cpu, uintptr_t retaddr)
 {
@@ -719,6 +779,42 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
     return false;
 }
 
+static void dump_jmp_cache_info(GString *buf)
+{
+    CPUJumpCacheStats st = {};
+    uint64_t l1_hits;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+        if (jc) {
+            st.lookups += jc->stats.lookups;
+            st.l2_hits += jc->stats.l2_hits;
+            st.ras_hits += jc->stats.ras_hits;
+            st.ras_misses += jc->stats.ras_misses;
+            st.htable_lookups += jc->stats.htable_lookups;
+        }
+    }
+    /* tb_lookup() does not see the hits of the return address stack */
+    l1_hits = st.lookups - st.l2_hits - st.htable_lookups;
+
+    g_string_append_printf(buf, "TB lookups          %" PRIu64 "\n",
+                           st.lookups + st.ras_hits);
+    g_string_append_printf(buf, "  jump cache hits   %" PRIu64 " (%" PRIu64
+                           "%%)\n", l1_hits,
+                           st.lookups ? l1_hits * 100 / st.lookups : 0);
+    g_string_append_printf(buf, "  victim cache hits %" PRIu64 " (%" PRIu64
+                           "%%)\n", st.l2_hits,
+                           st.lookups ? st.l2_hits * 100 / st.lookups : 0);
+    g_string_append_printf(buf, "  hash table        %" PRIu64 " (%" PRIu64
+                           "%%)\n", st.htable_lookups,
+                           st.lookups ? st.htable_lookups * 100 / st.lookups
+                           : 0);
+    g_string_append_printf(buf, "return stack hits   %" PRIu64 "/%" PRIu64
+                           "\n", st.ras_hits, st.ras_hits + st.ras_misses);
+}
+
 void dump_exec_info(GString *buf)
 {
     struct tb_tree_stats tst = {};
@@ -764,11 +860,15 @@ void dump_exec_info(GString *buf)
                            qatomic_read(&tb_ctx.tb_flush_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+    g_string_append_printf(buf, "TB retranslations   %u\n",
+                           qatomic_read(&tb_ctx.tb_retranslate_count));
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
     g_string_append_printf(buf, "TLB partial flushes %zu\n", flush_part);
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
+    dump_jmp_cache_info(buf);
+    tb_cache_dump_info(buf);
     tcg_dump_info(buf);
 }
 
@@ -799,6 +899,14 @@ void tcg_flush_jmp_cache(CPUState *cpu)
     for (int i = 0; i < TB_JMP_CACHE_SIZE; i++) {
         qatomic_set(&jc->array[i].tb, NULL);
     }
+    for (int i = 0; i < TB_JMP_L2_SETS; i++) {
+        for (int w = 0; w < TB_JMP_L2_WAYS; w++) {
+            qatomic_set(&jc->l2[i][w].tb, NULL);
+        }
+    }
+    for (int i = 0; i < TB_RAS_SIZE; i++) {
+        qatomic_set(&jc->ras[i].tb, NULL);
+    }
 }
 
 /* This is a wrapper for common code that can not use CONFIG_SOFTMMU */
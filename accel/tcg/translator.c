@@ -9,6 +9,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#define LOGIM_CATEGORY tcg
+#include "qemu/logim.h"
 #include "qemu/error-report.h"
 #include "exec/exec-all.h"
 #include "exec/translator.h"
@@ -49,14 +51,14 @@ static TCGOp *gen_tb_start(DisasContextBase *db, uint32_t cflags)
 
 LOGIM("cflags = 0x%x, (cflags & CF_LAST_IO) = 0x%x", cflags, cflags & CF_LAST_IO);
 
-    if ((cflags & CF_USE_ICOUNT) || !(cflags & CF_NOIRQ)) {
+    if ((cflags & (CF_USE_ICOUNT | CF_COSIM_COUNT)) || !(cflags & CF_NOIRQ)) {
         count = tcg_temp_new_i32();
         tcg_gen_ld_i32(count, tcg_env,
                        offsetof(ArchCPU, parent_obj.neg.icount_decr.u32)
                        - offsetof(ArchCPU, env));
     }
 
-    if (cflags & CF_USE_ICOUNT) {
+    if (cflags & (CF_USE_ICOUNT | CF_COSIM_COUNT)) {
         /*
          * We emit a sub with a dummy immediate argument. Keep the insn index
          * of the sub so that we later (when we know the actual insn count)
@@ -80,7 +82,24 @@ LOGIM("cflags = 0x%x, (cflags & CF_LAST_IO) = 0x%x", cflags, cflags & CF_LAST_IO
         tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
     }
 
-    if (cflags & CF_USE_ICOUNT) {
+    /*
+     * A first-tier TB counts its executions and leaves through the same
+     * exit once hot, before the icount decrement is committed, so that
+     * the main loop can replace it.  The count is not atomic: vCPUs
+     * running the TB concurrently may lose a decrement, which only delays
+     * the retranslation, see tb_retranslate().
+     */
+    if (db->tb->tier_count != TB_TIER_FULL) {
+        TCGv_ptr tb_ptr = tcg_constant_ptr(db->tb);
+        TCGv_i32 hot = tcg_temp_new_i32();
+
+        tcg_gen_ld_i32(hot, tb_ptr, offsetof(TranslationBlock, tier_count));
+        tcg_gen_subi_i32(hot, hot, 1);
+        tcg_gen_st_i32(hot, tb_ptr, offsetof(TranslationBlock, tier_count));
+        tcg_gen_brcondi_i32(TCG_COND_LT, hot, 0, tcg_ctx->exitreq_label);
+    }
+
+    if (cflags & (CF_USE_ICOUNT | CF_COSIM_COUNT)) {
         tcg_gen_st16_i32(count, tcg_env,
                          offsetof(ArchCPU, parent_obj.neg.icount_decr.u16.low)
                          - offsetof(ArchCPU, env));
@@ -110,7 +129,7 @@ LOGIM("--> set_can_do_io()  db->max_insns = %d", db->max_insns);
 static void gen_tb_end(const TranslationBlock *tb, uint32_t cflags,
                        TCGOp *icount_start_insn, int num_insns)
 {
-    if (cflags & CF_USE_ICOUNT) {
+    if (cflags & (CF_USE_ICOUNT | CF_COSIM_COUNT)) {
         /*
          * Update the num_insn immediate parameter now that we know
          * the actual insn count.
@@ -125,6 +144,95 @@ static void gen_tb_end(const TranslationBlock *tb, uint32_t cflags,
     }
 }
 
+/*
+ * Return the first-tier TB of the guest basic block that ends with the
+ * branch being translated, and in @runs how many times it ran.
+ */
+static const TranslationBlock *trace_profile(DisasContextBase *db,
+                                             int64_t *runs)
+{
+    const TranslationBlock *tb = db->tb;
+    const TranslationBlock *prof;
+    int32_t count;
+
+    if (db->trace_start == db->pc_first) {
+        /* tb_retranslate() invalidated it once its count went below zero */
+        *runs = (int64_t)qatomic_read(&tb_tier_threshold) + 1;
+        return tcg_ctx->gen_hot_tb;
+    }
+
+    prof = tb_htable_lookup_phys(db->trace_start,
+                                 tb_page_addr0(tb) +
+                                 (db->trace_start - db->pc_first),
+                                 tb->cs_base, tb->flags, tb_cflags(tb));
+    count = prof ? qatomic_read(&prof->tier_count) : TB_TIER_FULL;
+    *runs = count == TB_TIER_FULL ? 0 :
+            (int64_t)qatomic_read(&tb_tier_threshold) - count;
+    return prof;
+}
+
+bool translator_trace_branch(DisasContextBase *db, vaddr next)
+{
+    const TranslationBlock *prof;
+    int64_t runs;
+
+    if (!db->trace_exits || db->plugin_enabled || !is_same_page(db, next)) {
+        return false;
+    }
+
+    /* Continue if the branch was taken at most once in eight runs */
+    prof = trace_profile(db, &runs);
+    if (!prof || runs <= 0 || db->trace_start + prof->size != next ||
+        (int64_t)qatomic_read(&prof->tier_taken) * 8 > runs) {
+        return false;
+    }
+    db->trace_start = next;
+    db->trace_exits--;
+    return true;
+}
+
+bool translator_trace_loop(DisasContextBase *db, vaddr next, vaddr dest)
+{
+    const TranslationBlock *prof;
+    int64_t runs;
+
+    if (!db->trace_head || db->plugin_enabled || dest != db->pc_first) {
+        return false;
+    }
+
+    /* Loop if the branch was taken in at least half of the runs */
+    prof = trace_profile(db, &runs);
+    return prof && runs > 0 && db->trace_start + prof->size == next &&
+           (int64_t)qatomic_read(&prof->tier_taken) * 2 >= runs;
+}
+
+void translator_goto_trace_head(DisasContextBase *db)
+{
+    TCGv_i32 count = tcg_temp_new_i32();
+
+    /* The state the instructions of the TB were translated for */
+    set_can_do_io(db, db->max_insns == 1);
+
+    /* The exit request check of gen_tb_start(), the label is past it */
+    tcg_gen_ld_i32(count, tcg_env,
+                   offsetof(ArchCPU, parent_obj.neg.icount_decr.u32)
+                   - offsetof(ArchCPU, env));
+    tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
+    tcg_gen_br(db->trace_head);
+}
+
+void translator_branch_taken(DisasContextBase *db)
+{
+    if (db->tb->tier_count != TB_TIER_FULL) {
+        TCGv_ptr tb_ptr = tcg_constant_ptr(db->tb);
+        TCGv_i32 taken = tcg_temp_new_i32();
+
+        tcg_gen_ld_i32(taken, tb_ptr, offsetof(TranslationBlock, tier_taken));
+        tcg_gen_addi_i32(taken, taken, 1);
+        tcg_gen_st_i32(taken, tb_ptr, offsetof(TranslationBlock, tier_taken));
+    }
+}
+
 bool translator_use_goto_tb(DisasContextBase *db, vaddr dest)
 {
     /* Suppress goto_tb if requested. */
@@ -158,6 +266,22 @@ LOGIM("max_insns = %d, cflags = 0x%x", *max_insns, cflags);
     db->host_addr[0] = host_pc;
     db->host_addr[1] = NULL;
 
+    /*
+     * Retranslations of hot TBs may continue past conditional branches.
+     * Not when each instruction is accounted for as the TB starts.
+     */
+    db->trace_start = pc;
+    db->trace_exits = 0;
+    db->trace_head = NULL;
+    if (tb->tier_count == TB_TIER_FULL && tcg_ctx->gen_hot_tb &&
+        !(cflags & (CF_USE_ICOUNT | CF_COSIM_COUNT | CF_COUNT_MASK))) {
+        db->trace_exits = TRANSLATOR_TRACE_MAX_EXITS;
+        /* Loops keep checking for exit requests */
+        if (!(cflags & CF_NOIRQ)) {
+            db->trace_head = gen_new_label();
+        }
+    }
+
     ops->init_disas_context(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -165,6 +289,9 @@ LOGIM("gen_tb_start() cflags = 0x%x", cflags);
 
     /* Start translating.  */
     icount_start_insn = gen_tb_start(db, cflags);
+    if (db->trace_head) {
+        gen_set_label(db->trace_head);
+    }
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -20,8 +20,23 @@
  *  7) QEMU thread upon instruction execution  wakes up COSIM thread 
  *  8) COSIM thread invokes QEMU_step() again....
  *
+ * ****** 10/17/2026 ******
+ *  -direct: QEMU runs the CPU loop on COSIM thread - QEMU_step(N) executes
+ *   N instructions inline, no CPU thread/event loop/condvar ping-pong.
+ *  -step N: the number of instructions passed to each QEMU_step(N) call.
+ *  -batch N: QEMU_step_batch() is used instead of QEMU_step() - up to N
+ *   RVFI retirement records are returned by each call.
+ *  -ring N: QEMU_ring_open(N)/QEMU_ring_run() - QEMU runs up to N instructions
+ *   ahead and streams RVFI records via the shared-memory ring; runs of
+ *   <-step> instructions.
+ *  -ckpt: with -batch, checkpoint before each batch, roll back to its middle
+ *   and check that the replayed records match (QEMU_checkpoint/QEMU_rollback).
+ *  -harts N: N harts (-smp N), each stepped by QEMU_step_hart(). LOCKSTEP mode
+ *   uses MTTCG and one COSIM thread per hart; DIRECT mode steps the harts
+ *   round robin on COSIM thread.
+ *
  *   COSIM command line:
- *    cosim  [-qlog] <QEMU.so path>  <QEMU plugin full path>  <RV executable>\n");
+ *    cosim  [-qlog] [-direct] [-step N] [-batch N] [-ring N] [-ckpt] [-harts N] <QEMU.so path>  <QEMU plugin full path>  <RV executable>\n");
  *
  */
 
@@ -37,13 +52,22 @@
 #include <time.h>
 #include <errno.h>
 
+#include "cosim-rvfi.h"
+#include "cosim-ring.h"
+
 ////////////////////////////////////////////////////////////////////
 
 typedef int   (*qemu_ep_t)         (int, char**); 
 typedef int   (*qemu_2_ep_t)       (void); 
 typedef void  (*qemu_cosim_API_t)  (void*);
 typedef void  (*qemu_cosim_sync_t) (pthread_mutex_t *pm, pthread_cond_t *pc);
-typedef void* (*qemu_cosim_step_t)  (void);
+typedef uint64_t (*qemu_cosim_step_t)  (uint64_t);
+typedef int   (*qemu_cosim_batch_t) (st_rvfi_t *, size_t, size_t *);
+typedef void* (*qemu_cosim_ring_open_t) (uint32_t, int *, size_t *);
+typedef int   (*qemu_cosim_ring_run_t)  (uint64_t);
+typedef int   (*qemu_cosim_ckpt_t)      (uint64_t *);
+typedef int   (*qemu_cosim_rollback_t)  (uint64_t);
+typedef uint64_t (*qemu_cosim_step_hart_t) (int, uint64_t);
 
 static void*  qemu_get_ep  (void * hso, char * ep);
 static void*  load_qemu  (char * path);
@@ -55,6 +79,12 @@ typedef struct qemu_args_
     int        argc;   
     qemu_ep_t  qemu_ep; 
     qemu_cosim_step_t qemu_step_ep;
+    qemu_cosim_batch_t qemu_batch_ep;
+    qemu_cosim_ring_open_t qemu_ring_open_ep;
+    qemu_cosim_ring_run_t  qemu_ring_run_ep;
+    qemu_cosim_ckpt_t      qemu_ckpt_ep;
+    qemu_cosim_rollback_t  qemu_rollback_ep;
+    qemu_cosim_step_hart_t qemu_step_hart_ep;
 
 } qemu_args_t;
 
@@ -84,6 +114,12 @@ static void* COSIM_init_sync(void*);
 static void* COSIM_init_step(void*);
 
 static bool qemu_log = false;
+static bool qemu_direct = false;
+static uint64_t qemu_step_n = 1;
+static size_t   qemu_batch_n = 0;
+static uint32_t qemu_ring_n = 0;
+static bool     qemu_ckpt = false;
+static int      qemu_harts = 1;
 
 ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////
@@ -98,15 +134,44 @@ main (int argc, char** argv)
         printf ("%s(): ARGV[%d] = %s\n", __FUNCTION__, i, argv[i]);
     }
 
-    if ((argc < 4) || (argc > 5)) {
-        printf ("Usage: cosim  [-qlog] <QEMU.so path>  <QEMU plugin full path>  <RV executable>\n");
-        return 0;
+    /*
+     * Options go first, <idx_arg> points at QEMU.so path
+     */
+    int idx_arg = 1;
+    while (idx_arg < argc && argv[idx_arg][0] == '-') {
+        if (strcmp("-qlog", argv[idx_arg]) == 0) {
+            qemu_log = true;    
+            printf ("Running COSIM with the new QEMU log \n");
+        } else if (strcmp("-direct", argv[idx_arg]) == 0) {
+            qemu_direct = true;
+            printf ("Running COSIM in DIRECT mode \n");
+        } else if (strcmp("-step", argv[idx_arg]) == 0 && idx_arg + 1 < argc) {
+            qemu_step_n = strtoull(argv[++idx_arg], NULL, 0);
+            if (qemu_step_n == 0) {
+                qemu_step_n = 1;
+            }
+        } else if (strcmp("-batch", argv[idx_arg]) == 0 && idx_arg + 1 < argc) {
+            qemu_batch_n = strtoull(argv[++idx_arg], NULL, 0);
+        } else if (strcmp("-ring", argv[idx_arg]) == 0 && idx_arg + 1 < argc) {
+            qemu_ring_n = strtoul(argv[++idx_arg], NULL, 0);
+        } else if (strcmp("-ckpt", argv[idx_arg]) == 0) {
+            qemu_ckpt = true;
+        } else if (strcmp("-harts", argv[idx_arg]) == 0 && idx_arg + 1 < argc) {
+            qemu_harts = atoi(argv[++idx_arg]);
+            if (qemu_harts < 1 || qemu_harts > MAX_CPU) {
+                printf ("-harts: 1 .. %d harts are supported\n", MAX_CPU);
+                return 0;
+            }
+        } else {
+            break;
+        }
+        idx_arg++;
     }
 
-    if (strcmp("-qlog", argv[1]) == 0) {
-        qemu_log = true;    
-        printf ("Running COSIM with the new QEMU log \n");
-    }  
+    if (argc - idx_arg != 3) {
+        printf ("Usage: cosim  [-qlog] [-direct] [-step N] [-batch N] [-ring N] [-ckpt] [-harts N] <QEMU.so path>  <QEMU plugin full path>  <RV executable>\n");
+        return 0;
+    }
 
     char **soargv = (char**)malloc(sizeof(char*) * 64);
     int    soargc = 0;
@@ -117,15 +182,34 @@ main (int argc, char** argv)
 
     soargv[soargc++] = strdup("-accel");
 
-    soargv[soargc++] = strdup("tcg,one-insn-per-tb=on,thread=single");
+    /*
+     * No one-insn-per-tb/nochain: QEMU counts the step budget in
+     * the translated code, TBs stay cached and chained.
+     * Several harts in LOCKSTEP mode run on their own CPU threads (MTTCG),
+     * DIRECT mode needs the single threaded TCG.
+     */
+    if (qemu_harts > 1 && !qemu_direct) {
+        soargv[soargc++] = strdup("tcg,thread=multi");
+    } else {
+        soargv[soargc++] = strdup("tcg,thread=single");
+    }
 
-    soargv[soargc++] = strdup("-d");
+    if (qemu_harts > 1) {
+        char smp[16];
 
-    soargv[soargc++] = qemu_log ? strdup("nochain,prefix:cosim") : strdup("nochain");
+        snprintf (smp, sizeof(smp), "%d", qemu_harts);
+        soargv[soargc++] = strdup("-smp");
+        soargv[soargc++] = strdup(smp);
+    }
+
+    if (qemu_log) {
+        soargv[soargc++] = strdup("-d");
+        soargv[soargc++] = strdup("prefix:cosim");
+    }
 
     soargv[soargc++] = strdup("-plugin");
 
-    int idx_pgn = qemu_log ? 3 : 2;
+    int idx_pgn = idx_arg + 1;
     soargv[soargc++] = strdup(argv[idx_pgn]);   // SL:  btw plugin is not needed :-)
 
     soargv[soargc++] = strdup("-machine");   
@@ -136,7 +220,7 @@ main (int argc, char** argv)
 
     soargv[soargc++] = strdup(argv[idx_pgn + 1]);   
 
-    soargv[soargc++] = strdup("-cosim");
+    soargv[soargc++] = qemu_direct ? strdup("-cosim-direct") : strdup("-cosim");
 
     //
     // argv [1 or 2]  = QEMU.so full name
@@ -151,7 +235,7 @@ main (int argc, char** argv)
     /*
      * Load QEMU.so shared library
      */
-    void *h = load_qemu (qemu_log ? argv[2] : argv[1]);
+    void *h = load_qemu (argv[idx_arg]);
     void *h_ep = NULL;
     void *h_sync = NULL; 
     void *h_step = NULL; 
@@ -199,6 +283,46 @@ main (int argc, char** argv)
     qemu_cosim_step_t step_func = (qemu_cosim_step_t)h_step;
     pqemu_arg->qemu_step_ep = step_func;
 
+    pqemu_arg->qemu_batch_ep = NULL;
+    if (qemu_batch_n != 0) {
+        pqemu_arg->qemu_batch_ep = (qemu_cosim_batch_t)qemu_get_ep (h, "QEMU_step_batch");
+        if (pqemu_arg->qemu_batch_ep == NULL) {
+            fprintf (stderr, "Unable to access <QEMU_step_batch>\n");
+            return 0;
+        }
+    }
+
+    pqemu_arg->qemu_ckpt_ep = NULL;
+    pqemu_arg->qemu_rollback_ep = NULL;
+    if (qemu_ckpt && qemu_batch_n != 0) {
+        pqemu_arg->qemu_ckpt_ep     = (qemu_cosim_ckpt_t)qemu_get_ep (h, "QEMU_checkpoint");
+        pqemu_arg->qemu_rollback_ep = (qemu_cosim_rollback_t)qemu_get_ep (h, "QEMU_rollback");
+        if (pqemu_arg->qemu_ckpt_ep == NULL || pqemu_arg->qemu_rollback_ep == NULL) {
+            fprintf (stderr, "Unable to access <QEMU_checkpoint/QEMU_rollback>\n");
+            return 0;
+        }
+    }
+
+    pqemu_arg->qemu_step_hart_ep = NULL;
+    if (qemu_harts > 1) {
+        pqemu_arg->qemu_step_hart_ep = (qemu_cosim_step_hart_t)qemu_get_ep (h, "QEMU_step_hart");
+        if (pqemu_arg->qemu_step_hart_ep == NULL) {
+            fprintf (stderr, "Unable to access <QEMU_step_hart>\n");
+            return 0;
+        }
+    }
+
+    pqemu_arg->qemu_ring_open_ep = NULL;
+    pqemu_arg->qemu_ring_run_ep = NULL;
+    if (qemu_ring_n != 0) {
+        pqemu_arg->qemu_ring_open_ep = (qemu_cosim_ring_open_t)qemu_get_ep (h, "QEMU_ring_open");
+        pqemu_arg->qemu_ring_run_ep  = (qemu_cosim_ring_run_t)qemu_get_ep (h, "QEMU_ring_run");
+        if (pqemu_arg->qemu_ring_open_ep == NULL || pqemu_arg->qemu_ring_run_ep == NULL) {
+            fprintf (stderr, "Unable to access <QEMU_ring_open/QEMU_ring_run>\n");
+            return 0;
+        }
+    }
+
     //////////////////////////////////////////////////////
 
     COSIM_run_sims (pqemu_arg);
@@ -297,6 +421,114 @@ load_qemu  (char * path)
 
 typedef int (*qemu_report_cosim_insn) (void* opaque_state, uint64_t pc_insn, uint64_t pc_next); 
 
+////////////////////////////////////////////////////////////////////
+/*
+ * RVFI ring consumer: drains the records published so far.
+ * Blocks (futex) while the ring is empty and the run is not done,
+ * returns when it is done and empty.
+ */
+static uint64_t ring_drain (cosim_ring_t *ring)
+{
+    uint64_t n = 0;
+    st_rvfi_t *rec;
+
+    while ((rec = cosim_ring_wait (ring)) != NULL) {
+        if (qemu_log) {
+            printf ("%s(): COSIM <-- order = %llu PC = 0x%llx insn = 0x%llx\n", __FUNCTION__,
+                    (unsigned long long)rec->order, (unsigned long long)rec->pc_rdata,
+                    (unsigned long long)rec->insn);
+        }
+        cosim_ring_consume (ring);
+        n++;
+    }
+    return n;
+}
+
+static volatile int ring_consumer_on = 0;
+static uint64_t     ring_consumed = 0;
+
+/*
+ * DIRECT mode: QEMU_ring_run() produces on COSIM thread,
+ * the records are consumed here.
+ */
+static void *ring_consumer_ep (void *arg)
+{
+    cosim_ring_t *ring = (cosim_ring_t *)arg;
+
+    while (ring_consumer_on) {
+        uint64_t n = ring_drain (ring);
+
+        ring_consumed += n;
+        if (n == 0) {
+            usleep (100);   // between runs
+        }
+    }
+    ring_consumed += ring_drain (ring);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+/*
+ * LOCKSTEP mode with several harts: each hart is stepped by its own
+ * COSIM thread, the harts run in parallel on their MTTCG CPU threads.
+ */
+typedef struct hart_args_
+{
+    qemu_args_t* qemu_args;
+    int          hart_id;
+    uint64_t     nn;
+} hart_args_t;
+
+static void *hart_thread_ep (void *arg)
+{
+    hart_args_t *ha = (hart_args_t *)arg;
+
+    while (qemu_running == 1) {
+        uint64_t n = ha->qemu_args->qemu_step_hart_ep (ha->hart_id, qemu_step_n);
+
+        if (n == 0 && qemu_running == 1) {
+            usleep (100);   // WFI - waits for an interrupt from another hart
+        }
+        ha->nn += n;
+    }
+    return NULL;
+}
+
+static uint64_t COSIM_run_harts (qemu_args_t* qemu_args)
+{
+    hart_args_t ha[MAX_CPU];
+    pthread_t   thr[MAX_CPU];
+    uint64_t    nn = 0;
+    int h;
+
+    for (h = 0; h < qemu_harts; h++) {
+        ha[h].qemu_args = qemu_args;
+        ha[h].hart_id   = h;
+        ha[h].nn        = 0;
+    }
+
+    if (qemu_direct) {
+        while (qemu_running == 1) {
+            for (h = 0; h < qemu_harts; h++) {
+                ha[h].nn += qemu_args->qemu_step_hart_ep (h, qemu_step_n);
+            }
+        }
+    } else {
+        for (h = 0; h < qemu_harts; h++) {
+            pthread_create (&thr[h], NULL, hart_thread_ep, &ha[h]);
+        }
+        for (h = 0; h < qemu_harts; h++) {
+            pthread_join (thr[h], NULL);
+        }
+    }
+
+    for (h = 0; h < qemu_harts; h++) {
+        printf ("Hart %d - %llu instructions executed\n", h, (unsigned long long)ha[h].nn);
+        nn += ha[h].nn;
+    }
+    return nn;
+}
+
 static void *qemu_thread_ep(void *arg);
 static pthread_t thr_qemu;
 
@@ -352,15 +584,108 @@ static void COSIM_run_sims (qemu_args_t* qemu_args)
     pthread_mutex_unlock(&mutex_qemu_cosim_sync);
     printf ("%s():COSIM-QEMU <-- UNLOCK ()  - 2\n", __FUNCTION__);
 
-    int nn = 0;
-    while (qemu_running == 1) {
+    uint64_t nn = 0;
+    uint64_t n_mismatch = 0;
+    st_rvfi_t *rvfi = NULL;
+    st_rvfi_t *replay = NULL;
+
+    if (qemu_args->qemu_batch_ep != NULL) {
+        rvfi = (st_rvfi_t *)calloc (qemu_batch_n, sizeof(st_rvfi_t));
+        replay = (st_rvfi_t *)calloc (qemu_batch_n, sizeof(st_rvfi_t));
+    }
+
+    while (qemu_running == 1 && rvfi != NULL) {
+        size_t n_retired = 0;
+        uint64_t base = 0;
+
+        if (qemu_args->qemu_ckpt_ep != NULL && qemu_args->qemu_ckpt_ep (&base) != 0) {
+            fprintf (stderr, "%s(): QEMU_checkpoint() failed\n", __FUNCTION__);
+            break;
+        }
+        if (qemu_args->qemu_batch_ep (rvfi, qemu_batch_n, &n_retired) != 0) {
+            break;
+        }
+
+        /*
+         * Pretend the RTL diverged in the middle of the batch:
+         * roll back there and compare the replayed tail.
+         */
+        if (qemu_args->qemu_rollback_ep != NULL && n_retired > 1) {
+            size_t half = n_retired / 2;
+            size_t n_replay = 0;
+
+            if (qemu_args->qemu_rollback_ep (base + half) != 0 ||
+                qemu_args->qemu_batch_ep (replay, n_retired - half, &n_replay) != 0) {
+                fprintf (stderr, "%s(): rollback to order %llu failed\n", __FUNCTION__,
+                         (unsigned long long)(base + half));
+                break;
+            }
+            for (size_t k = 0; k < n_replay; k++) {
+                if (memcmp (&replay[k], &rvfi[half + k], sizeof(st_rvfi_t)) != 0) {
+                    n_mismatch++;
+                }
+            }
+        }
+        if (qemu_log && n_retired != 0) {
+            st_rvfi_t *last = &rvfi[n_retired - 1];
+            printf ("%s(): COSIM <-- batch of %zu, last PC = 0x%llx insn = 0x%llx\n", __FUNCTION__,
+                    n_retired, (unsigned long long)last->pc_rdata, (unsigned long long)last->insn);
+        }
+        nn += n_retired;
+    }
+    free (rvfi);
+    free (replay);
+    if (qemu_ckpt) {
+        printf ("Rollback check - %llu replayed records mismatch\n", (unsigned long long)n_mismatch);
+    }
+
+    cosim_ring_t *ring = NULL;
+
+    if (qemu_args->qemu_ring_open_ep != NULL) {
+        int    ring_fd = -1;
+        size_t ring_size = 0;
+
+        ring = (cosim_ring_t *)qemu_args->qemu_ring_open_ep (qemu_ring_n, &ring_fd, &ring_size);
+        if (ring == NULL) {
+            fprintf (stderr, "Unable to open RVFI ring of %u records\n", qemu_ring_n);
+        } else {
+            printf ("%s(): RVFI ring fd = %d, size = %zu, records = %u\n", __FUNCTION__,
+                    ring_fd, ring_size, ring->nrec);
+        }
+    }
+
+    if (ring != NULL && qemu_direct) {
+        pthread_t thr_ring;
+
+        ring_consumer_on = 1;
+        pthread_create (&thr_ring, NULL, ring_consumer_ep, ring);
+        while (qemu_running == 1 && qemu_args->qemu_ring_run_ep (qemu_step_n) == 0) {
+        }
+        ring_consumer_on = 0;
+        pthread_join (thr_ring, NULL);
+        nn += ring_consumed;
+    }
+
+    while (ring != NULL && !qemu_direct && qemu_running == 1) {
+        if (qemu_args->qemu_ring_run_ep (qemu_step_n) != 0) {
+            break;
+        }
+        nn += ring_drain (ring);
+    }
+
+    if (qemu_args->qemu_step_hart_ep != NULL && qemu_args->qemu_batch_ep == NULL && ring == NULL) {
+        nn += COSIM_run_harts (qemu_args);
+    }
+
+    while (qemu_running == 1 && qemu_args->qemu_batch_ep == NULL && ring == NULL) {
 
-        printf ("%s(): COSIM --> call QEMU.step() \n", __FUNCTION__);
+        if (!qemu_direct) {
+            printf ("%s(): COSIM --> call QEMU.step() \n", __FUNCTION__);
+        }
         // QEMU <stepi> function - entry point
-        qemu_args->qemu_step_ep ();
-        nn++;
+        nn += qemu_args->qemu_step_ep (qemu_step_n);
     }
-    printf ("The test is completed - %d instructions executed\n", nn); 
+    printf ("The test is completed - %llu instructions executed\n", (unsigned long long)nn); 
     sleep(2);
     pthread_join (thr_qemu, NULL);
     return;
@@ -0,0 +1,311 @@
+/*
+ * Decoder of the traces written by the bintrace plugin
+ *
+ * Prints one line per executed instruction, in the style of execlog:
+ *
+ *   vcpu, 0xpc, 0xinsn[, load|store, 0xaddr]...
+ *
+ * The instructions of a vCPU are in order, the vCPUs are interleaved
+ * one buffer at a time. -s only counts the instructions and accesses.
+ *
+ * Usage: bintrace-decode [-s] TRACE
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "bintrace.h"
+
+typedef struct {
+    uint64_t pc;
+    uint64_t n_insns;
+    uint8_t *sizes;
+    /* the bytes of all insns, back to back */
+    uint8_t *bytes;
+} TBDef;
+
+typedef struct {
+    uint64_t idx;
+    uint64_t addr;
+    uint8_t tag;
+} MemRec;
+
+typedef struct {
+    TBDef *tb;
+    uint64_t prev_id;
+    uint64_t prev_addr;
+    GArray *mem;
+    uint64_t insns;
+    uint64_t accesses;
+} VCPUState;
+
+static bool summary;
+static GHashTable *tbs;
+static GPtrArray *vcpus;
+
+static VCPUState *get_vcpu(uint32_t index)
+{
+    if (index >= vcpus->len) {
+        g_ptr_array_set_size(vcpus, index + 1);
+    }
+    if (!g_ptr_array_index(vcpus, index)) {
+        VCPUState *vs = g_new0(VCPUState, 1);
+
+        vs->mem = g_array_new(false, false, sizeof(MemRec));
+        g_ptr_array_index(vcpus, index) = vs;
+    }
+    return g_ptr_array_index(vcpus, index);
+}
+
+/* Prints the first N instructions of the current TB of VS. */
+static void finish_tb(VCPUState *vs, uint32_t index, uint64_t n)
+{
+    TBDef *tb = vs->tb;
+    const uint8_t *bytes;
+    uint64_t pc, i;
+    guint m = 0;
+
+    if (!tb) {
+        return;
+    }
+    vs->tb = NULL;
+    vs->insns += MIN(n, tb->n_insns);
+    vs->accesses += vs->mem->len;
+    if (summary) {
+        g_array_set_size(vs->mem, 0);
+        return;
+    }
+
+    pc = tb->pc;
+    bytes = tb->bytes;
+    for (i = 0; i < n && i < tb->n_insns; i++) {
+        uint64_t insn = 0;
+        int j;
+
+        for (j = tb->sizes[i] - 1; j >= 0; j--) {
+            insn = (insn << 8) | bytes[j];
+        }
+        printf("%u, 0x%" PRIx64 ", 0x%0*" PRIx64, index, pc,
+               tb->sizes[i] * 2, insn);
+        for (; m < vs->mem->len; m++) {
+            MemRec *rec = &g_array_index(vs->mem, MemRec, m);
+
+            if (rec->idx != i) {
+                break;
+            }
+            printf(", %s, 0x%08" PRIx64,
+                   rec->tag & BINTRACE_MEM_STORE ? "store" : "load", rec->addr);
+        }
+        printf("\n");
+        pc += tb->sizes[i];
+        bytes += tb->sizes[i];
+    }
+    g_array_set_size(vs->mem, 0);
+}
+
+static bool decode_tbs(const uint8_t *p, const uint8_t *end)
+{
+    uint64_t prev_pc = 0;
+
+    while (p < end) {
+        TBDef *tb = g_new0(TBDef, 1);
+        uint64_t *id = g_new(uint64_t, 1);
+        uint64_t i, len = 0;
+
+        if (*p++ != BINTRACE_REC_TBDEF ||
+            !(p = bintrace_get_varint(p, end, id)) ||
+            !(p = bintrace_get_delta(p, end, prev_pc, &tb->pc)) ||
+            !(p = bintrace_get_varint(p, end, &tb->n_insns)) ||
+            tb->n_insns > end - p) {
+            g_free(tb);
+            g_free(id);
+            return false;
+        }
+        tb->sizes = g_malloc(tb->n_insns);
+        for (i = 0; i < tb->n_insns; i++) {
+            if (p >= end || *p > end - p - 1) {
+                return false;
+            }
+            tb->sizes[i] = *p++;
+            tb->bytes = g_realloc(tb->bytes, len + tb->sizes[i]);
+            memcpy(tb->bytes + len, p, tb->sizes[i]);
+            len += tb->sizes[i];
+            p += tb->sizes[i];
+        }
+        prev_pc = tb->pc;
+        g_hash_table_replace(tbs, id, tb);
+    }
+    return true;
+}
+
+static bool decode_exec(uint32_t index, const uint8_t *p, const uint8_t *end)
+{
+    VCPUState *vs = get_vcpu(index);
+
+    vs->prev_id = 0;
+    vs->prev_addr = 0;
+    while (p < end) {
+        uint8_t tag = *p++;
+        uint64_t val;
+        MemRec rec;
+
+        switch (tag) {
+        case BINTRACE_REC_TB:
+            if (!(p = bintrace_get_delta(p, end, vs->prev_id, &val))) {
+                return false;
+            }
+            finish_tb(vs, index, UINT64_MAX);
+            vs->tb = g_hash_table_lookup(tbs, &val);
+            if (!vs->tb) {
+                fprintf(stderr, "vcpu %u: undefined TB %" PRIu64 "\n",
+                        index, val);
+                return false;
+            }
+            vs->prev_id = val;
+            break;
+        case BINTRACE_REC_TRUNC:
+            if (!(p = bintrace_get_varint(p, end, &val))) {
+                return false;
+            }
+            finish_tb(vs, index, val);
+            break;
+        default:
+            if ((tag & ~(BINTRACE_MEM_STORE | BINTRACE_MEM_SIZE_MASK)) !=
+                BINTRACE_REC_MEM ||
+                !(p = bintrace_get_varint(p, end, &rec.idx)) ||
+                !(p = bintrace_get_delta(p, end, vs->prev_addr, &rec.addr))) {
+                return false;
+            }
+            rec.tag = tag;
+            vs->prev_addr = rec.addr;
+            g_array_append_val(vs->mem, rec);
+            break;
+        }
+    }
+    return true;
+}
+
+static int decode(FILE *fp)
+{
+    BinTraceHeader hdr;
+    BinTraceChunk chunk;
+    g_autofree uint8_t *data = NULL;
+    size_t data_size = 0;
+#ifdef CONFIG_ZSTD
+    g_autofree uint8_t *raw = NULL;
+    size_t raw_size = 0;
+#endif
+    uint32_t flags;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, BINTRACE_MAGIC, sizeof(BINTRACE_MAGIC)) ||
+        GUINT32_FROM_LE(hdr.version) != BINTRACE_VERSION) {
+        fprintf(stderr, "not a bintrace v%d file\n", BINTRACE_VERSION);
+        return -1;
+    }
+    flags = GUINT32_FROM_LE(hdr.flags);
+#ifndef CONFIG_ZSTD
+    if (flags & BINTRACE_F_ZSTD) {
+        fprintf(stderr, "compressed trace, built without zstd\n");
+        return -1;
+    }
+#endif
+
+    while (fread(&chunk, sizeof(chunk), 1, fp) == 1) {
+        uint32_t stream = GUINT32_FROM_LE(chunk.stream);
+        uint32_t size = GUINT32_FROM_LE(chunk.size);
+        uint32_t len = GUINT32_FROM_LE(chunk.raw_size);
+        const uint8_t *recs;
+        bool ok;
+
+        if (size > data_size) {
+            data_size = size;
+            data = g_realloc(data, data_size);
+        }
+        if (fread(data, 1, size, fp) != size) {
+            fprintf(stderr, "truncated trace\n");
+            return -1;
+        }
+        recs = data;
+#ifdef CONFIG_ZSTD
+        if (flags & BINTRACE_F_ZSTD) {
+            if (len > raw_size) {
+                raw_size = len;
+                raw = g_realloc(raw, raw_size);
+            }
+            if (ZSTD_decompress(raw, len, data, size) != len) {
+                fprintf(stderr, "corrupted chunk\n");
+                return -1;
+            }
+            recs = raw;
+        }
+#endif
+        if (!(flags & BINTRACE_F_ZSTD) && len != size) {
+            fprintf(stderr, "corrupted chunk\n");
+            return -1;
+        }
+
+        if (stream == BINTRACE_STREAM_TBS) {
+            ok = decode_tbs(recs, recs + len);
+        } else {
+            ok = decode_exec(stream, recs, recs + len);
+        }
+        if (!ok) {
+            fprintf(stderr, "bad record in a chunk of stream %u\n", stream);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *fp;
+    guint i;
+    int ret;
+
+    if (argc == 3 && !strcmp(argv[1], "-s")) {
+        summary = true;
+    } else if (argc != 2) {
+        fprintf(stderr, "usage: %s [-s] TRACE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    fp = fopen(argv[argc - 1], "rb");
+    if (!fp) {
+        perror(argv[argc - 1]);
+        return EXIT_FAILURE;
+    }
+
+    tbs = g_hash_table_new(g_int64_hash, g_int64_equal);
+    vcpus = g_ptr_array_new();
+    ret = decode(fp);
+    fclose(fp);
+
+    /* the last TBs ran to the end, a partial one ends with a TRUNC */
+    for (i = 0; i < vcpus->len; i++) {
+        VCPUState *vs = g_ptr_array_index(vcpus, i);
+
+        if (vs) {
+            finish_tb(vs, i, UINT64_MAX);
+        }
+    }
+    if (summary) {
+        for (i = 0; i < vcpus->len; i++) {
+            VCPUState *vs = g_ptr_array_index(vcpus, i);
+
+            if (vs) {
+                printf("vcpu %u: %" PRIu64 " insns, %" PRIu64 " accesses\n",
+                       i, vs->insns, vs->accesses);
+            }
+        }
+    }
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
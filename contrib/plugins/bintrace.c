@@ -0,0 +1,433 @@
+/*
+ * Binary execution trace
+ *
+ * Streams the executed TBs (and optionally the memory accesses) of every
+ * vCPU in the compact format of bintrace.h, see contrib/plugins/bintrace-decode
+ * to turn it into text. Unlike execlog nothing is formatted at run time:
+ *
+ *  - the instructions of a TB are written once, when it is translated,
+ *    its executions only record its id
+ *  - the number of instructions executed in a TB is tracked by an inline
+ *    store, so the only call per TB is the one recording it
+ *  - each vCPU fills its own buffer without locking, full buffers are
+ *    compressed and written out by a background thread
+ *
+ * Arguments:
+ *  outfile=PATH   the trace file (default: bintrace.bin)
+ *  mem=on|off     record the memory accesses (default: off)
+ *  compress=N     zstd level, 0 to write the records as they are
+ *                 (default: 1 if built with zstd, otherwise 0)
+ *  bufsize=N      the buffer size in KiB (default: 1024)
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include <qemu-plugin.h>
+#include "bintrace.h"
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+/* room for the longest exec stream record */
+#define MAX_EXEC_REC    (1 + 2 * BINTRACE_VARINT_MAX)
+
+/* buffers in flight per vCPU before the vCPUs wait for the writer */
+#define BUFS_PER_VCPU   4
+
+typedef struct {
+    uint32_t stream;
+    uint32_t len;
+    uint8_t data[];
+} TraceBuf;
+
+/* what the TB exec callback needs to know about its TB */
+typedef struct {
+    uint64_t id;
+    uint64_t n_insns;
+} TBInfo;
+
+typedef struct {
+    TraceBuf *buf;
+    /* instructions of the current TB started so far, stored inline */
+    uint64_t insns;
+    /* instructions of the current TB, 0 before the first one */
+    uint64_t tb_n_insns;
+    /* the delta bases of the current buffer */
+    uint64_t prev_id;
+    uint64_t prev_addr;
+} VCPUTrace;
+
+static char *file_name;
+static bool trace_mem;
+static int compress_level;
+static size_t buf_size = 1024 * 1024;
+
+static FILE *fp;
+static GThread *writer;
+static GAsyncQueue *full_bufs;
+static GAsyncQueue *free_bufs;
+static gint n_bufs;
+static gint max_bufs = BUFS_PER_VCPU;
+/* the writer is told to stop by this buffer */
+static TraceBuf stop_buf;
+
+static struct qemu_plugin_scoreboard *vcpus;
+static int max_vcpu_index = -1;
+
+/* TB definitions, vCPUs translate in parallel */
+static GMutex tbs_lock;
+static TraceBuf *tbs;
+static uint64_t tbs_prev_pc;
+static uint64_t next_tb_id;
+static GPtrArray *tb_infos;
+
+static TraceBuf *get_buf(uint32_t stream)
+{
+    TraceBuf *buf = g_async_queue_try_pop(free_bufs);
+
+    if (!buf) {
+        if (g_atomic_int_add(&n_bufs, 1) < g_atomic_int_get(&max_bufs)) {
+            buf = g_malloc(sizeof(TraceBuf) + buf_size);
+        } else {
+            g_atomic_int_add(&n_bufs, -1);
+            buf = g_async_queue_pop(free_bufs);
+        }
+    }
+    buf->stream = stream;
+    buf->len = 0;
+    return buf;
+}
+
+/* Must be called with tbs_lock held. */
+static void queue_tbs_locked(void)
+{
+    if (tbs->len) {
+        g_async_queue_push(full_bufs, tbs);
+        tbs = get_buf(BINTRACE_STREAM_TBS);
+        tbs_prev_pc = 0;
+    }
+}
+
+/*
+ * The definitions of the TBs a buffer executes are queued first,
+ * this keeps them ahead of their uses in the file.
+ */
+static void queue_buf(TraceBuf *buf)
+{
+    g_mutex_lock(&tbs_lock);
+    queue_tbs_locked();
+    if (buf->len) {
+        g_async_queue_push(full_bufs, buf);
+    } else {
+        g_async_queue_push(free_bufs, buf);
+    }
+    g_mutex_unlock(&tbs_lock);
+}
+
+static void vcpu_flush(VCPUTrace *vt, unsigned int cpu_index)
+{
+    queue_buf(vt->buf);
+    vt->buf = get_buf(cpu_index);
+    vt->prev_id = 0;
+    vt->prev_addr = 0;
+}
+
+static void write_buf(TraceBuf *buf, void *zbuf, size_t zbuf_size)
+{
+    BinTraceChunk hdr = {
+        .stream = GUINT32_TO_LE(buf->stream),
+        .raw_size = GUINT32_TO_LE(buf->len),
+    };
+    const void *data = buf->data;
+    size_t size = buf->len;
+
+#ifdef CONFIG_ZSTD
+    if (compress_level) {
+        size = ZSTD_compress(zbuf, zbuf_size, buf->data, buf->len,
+                             compress_level);
+        g_assert(!ZSTD_isError(size));
+        data = zbuf;
+    }
+#endif
+    hdr.size = GUINT32_TO_LE(size);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(data, 1, size, fp) != size) {
+        g_error("bintrace: unable to write %s", file_name);
+    }
+}
+
+static gpointer writer_thread(gpointer opaque)
+{
+    size_t zbuf_size = 0;
+    g_autofree void *zbuf = NULL;
+    TraceBuf *buf;
+
+#ifdef CONFIG_ZSTD
+    if (compress_level) {
+        zbuf_size = ZSTD_compressBound(buf_size);
+        zbuf = g_malloc(zbuf_size);
+    }
+#endif
+    while ((buf = g_async_queue_pop(full_bufs)) != &stop_buf) {
+        write_buf(buf, zbuf, zbuf_size);
+        g_async_queue_push(free_bufs, buf);
+    }
+    return NULL;
+}
+
+static void vcpu_tb_exec(unsigned int cpu_index, void *udata)
+{
+    VCPUTrace *vt = qemu_plugin_scoreboard_find(vcpus, cpu_index);
+    TBInfo *tb = udata;
+    uint8_t *p;
+
+    if (vt->buf->len + MAX_EXEC_REC * 2 > buf_size) {
+        vcpu_flush(vt, cpu_index);
+    }
+    p = vt->buf->data + vt->buf->len;
+
+    if (vt->insns != vt->tb_n_insns) {
+        *p++ = BINTRACE_REC_TRUNC;
+        p = bintrace_put_varint(p, vt->insns);
+    }
+    *p++ = BINTRACE_REC_TB;
+    p = bintrace_put_delta(p, tb->id, vt->prev_id);
+
+    vt->prev_id = tb->id;
+    vt->tb_n_insns = tb->n_insns;
+    vt->buf->len = p - vt->buf->data;
+}
+
+static void vcpu_mem(unsigned int cpu_index, qemu_plugin_meminfo_t info,
+                     uint64_t vaddr, void *udata)
+{
+    VCPUTrace *vt = qemu_plugin_scoreboard_find(vcpus, cpu_index);
+    uint8_t *p;
+
+    if (vt->buf->len + MAX_EXEC_REC > buf_size) {
+        vcpu_flush(vt, cpu_index);
+    }
+    p = vt->buf->data + vt->buf->len;
+
+    *p++ = BINTRACE_REC_MEM |
+           (qemu_plugin_mem_is_store(info) ? BINTRACE_MEM_STORE : 0) |
+           (qemu_plugin_mem_size_shift(info) & BINTRACE_MEM_SIZE_MASK);
+    p = bintrace_put_varint(p, GPOINTER_TO_UINT(udata));
+    p = bintrace_put_delta(p, vaddr, vt->prev_addr);
+
+    vt->prev_addr = vaddr;
+    vt->buf->len = p - vt->buf->data;
+}
+
+static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
+{
+    uint64_t pc = qemu_plugin_tb_vaddr(tb);
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    qemu_plugin_u64 insns = qemu_plugin_scoreboard_u64_in_struct(vcpus,
+                                                                 VCPUTrace,
+                                                                 insns);
+    size_t def_size = 1 + 3 * BINTRACE_VARINT_MAX;
+    TBInfo *info = g_new(TBInfo, 1);
+    uint8_t *p;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        def_size += 1 + qemu_plugin_insn_size(qemu_plugin_tb_get_insn(tb, i));
+    }
+    g_assert(def_size <= buf_size);
+
+    g_mutex_lock(&tbs_lock);
+    info->id = next_tb_id++;
+    info->n_insns = n;
+    g_ptr_array_add(tb_infos, info);
+
+    if (tbs->len + def_size > buf_size) {
+        queue_tbs_locked();
+    }
+    p = tbs->data + tbs->len;
+    *p++ = BINTRACE_REC_TBDEF;
+    p = bintrace_put_varint(p, info->id);
+    p = bintrace_put_delta(p, pc, tbs_prev_pc);
+    p = bintrace_put_varint(p, n);
+    for (i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        size_t size = qemu_plugin_insn_size(insn);
+
+        *p++ = size;
+        memcpy(p, qemu_plugin_insn_data(insn), size);
+        p += size;
+    }
+    tbs_prev_pc = pc;
+    tbs->len = p - tbs->data;
+    g_mutex_unlock(&tbs_lock);
+
+    qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec,
+                                         QEMU_PLUGIN_CB_NO_REGS, info);
+    for (i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_STORE_U64, insns, i + 1);
+        if (trace_mem) {
+            qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem,
+                                             QEMU_PLUGIN_CB_NO_REGS,
+                                             QEMU_PLUGIN_MEM_RW,
+                                             GUINT_TO_POINTER(i));
+        }
+    }
+}
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int cpu_index)
+{
+    VCPUTrace *vt = qemu_plugin_scoreboard_find(vcpus, cpu_index);
+    int old;
+
+    g_atomic_int_add(&max_bufs, BUFS_PER_VCPU);
+    if (!vt->buf) {
+        vt->buf = get_buf(cpu_index);
+    }
+    do {
+        old = g_atomic_int_get(&max_vcpu_index);
+    } while (old < (int) cpu_index &&
+             !g_atomic_int_compare_and_exchange(&max_vcpu_index, old,
+                                                cpu_index));
+}
+
+/* records how far the last TB got */
+static void vcpu_finish(VCPUTrace *vt)
+{
+    uint8_t *p;
+
+    if (vt->insns != vt->tb_n_insns) {
+        p = vt->buf->data + vt->buf->len;
+        *p++ = BINTRACE_REC_TRUNC;
+        p = bintrace_put_varint(p, vt->insns);
+        vt->buf->len = p - vt->buf->data;
+        vt->tb_n_insns = vt->insns;
+    }
+}
+
+static void vcpu_exit(qemu_plugin_id_t id, unsigned int cpu_index)
+{
+    VCPUTrace *vt = qemu_plugin_scoreboard_find(vcpus, cpu_index);
+
+    if (vt->buf) {
+        vcpu_finish(vt);
+        vcpu_flush(vt, cpu_index);
+    }
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void *p)
+{
+    int i;
+
+    for (i = 0; i <= g_atomic_int_get(&max_vcpu_index); i++) {
+        VCPUTrace *vt = qemu_plugin_scoreboard_find(vcpus, i);
+
+        if (vt->buf) {
+            vcpu_finish(vt);
+            queue_buf(vt->buf);
+            vt->buf = NULL;
+        }
+    }
+
+    g_mutex_lock(&tbs_lock);
+    queue_tbs_locked();
+    g_mutex_unlock(&tbs_lock);
+
+    g_async_queue_push(full_bufs, &stop_buf);
+    g_thread_join(writer);
+    fclose(fp);
+
+    qemu_plugin_scoreboard_free(vcpus);
+    g_ptr_array_free(tb_infos, true);
+}
+
+static int plugin_init(void)
+{
+    BinTraceHeader hdr = {
+        .magic = BINTRACE_MAGIC,
+        .version = GUINT32_TO_LE(BINTRACE_VERSION),
+        .flags = GUINT32_TO_LE((compress_level ? BINTRACE_F_ZSTD : 0) |
+                               (trace_mem ? BINTRACE_F_MEM : 0)),
+    };
+
+    fp = fopen(file_name, "wb");
+    if (!fp || fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        fprintf(stderr, "bintrace: unable to create %s\n", file_name);
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, buf_size);
+
+    full_bufs = g_async_queue_new();
+    free_bufs = g_async_queue_new();
+    tb_infos = g_ptr_array_new_with_free_func(g_free);
+    tbs = get_buf(BINTRACE_STREAM_TBS);
+    vcpus = qemu_plugin_scoreboard_new(sizeof(VCPUTrace));
+    writer = g_thread_new("bintrace", writer_thread, NULL);
+    return 0;
+}
+
+QEMU_PLUGIN_EXPORT
+int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
+                        int argc, char **argv)
+{
+    int i;
+
+#ifdef CONFIG_ZSTD
+    compress_level = 1;
+#endif
+
+    for (i = 0; i < argc; i++) {
+        char *opt = argv[i];
+        g_auto(GStrv) tokens = g_strsplit(opt, "=", 2);
+
+        if (g_strcmp0(tokens[0], "outfile") == 0) {
+            g_free(file_name);
+            file_name = g_strdup(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "mem") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &trace_mem)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
+        } else if (g_strcmp0(tokens[0], "compress") == 0) {
+            compress_level = g_ascii_strtoll(tokens[1], NULL, 10);
+#ifndef CONFIG_ZSTD
+            if (compress_level) {
+                fprintf(stderr, "bintrace: built without zstd: %s\n", opt);
+                return -1;
+            }
+#endif
+        } else if (g_strcmp0(tokens[0], "bufsize") == 0) {
+            buf_size = g_ascii_strtoull(tokens[1], NULL, 10) * 1024;
+            if (buf_size < 64 * 1024 || buf_size > UINT32_MAX) {
+                fprintf(stderr, "bintrace: bufsize out of range: %s\n", opt);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "option parsing failed: %s\n", opt);
+            return -1;
+        }
+    }
+    if (!file_name) {
+        file_name = g_strdup("bintrace.bin");
+    }
+
+    if (plugin_init() < 0) {
+        return -1;
+    }
+
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    qemu_plugin_register_vcpu_exit_cb(id, vcpu_exit);
+    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Binary execution trace format, shared by the bintrace plugin and
+ * the bintrace-decode tool.
+ *
+ * A trace is a BinTraceHeader followed by chunks. Every chunk is a
+ * BinTraceChunk header and <size> bytes of records, zstd-compressed
+ * to <size> bytes if BINTRACE_F_ZSTD is set (<raw_size> uncompressed).
+ * All header fields are little-endian.
+ *
+ * A chunk carries either the execution stream of one vCPU or the
+ * definitions of newly translated TBs (BINTRACE_STREAM_TBS). A TB is
+ * always defined in an earlier chunk than the first one executing it.
+ *
+ * Records start with a tag byte, numbers are LEB128 varints, deltas are
+ * zigzag-encoded. The delta bases (previous TB id, PC, address) are
+ * zero at the start of each chunk, so chunks decode independently.
+ *
+ *  TBDEF  id, pc delta, n_insns, then n_insns times: size byte, insn bytes
+ *  TB     id delta                     - a TB starts executing
+ *  TRUNC  n                            - only n insns of the previous TB
+ *                                        were executed (it faulted)
+ *  MEM    insn index, address delta    - a memory access of the current
+ *                                        TB, the tag has the store bit
+ *                                        and log2 of the access size
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#ifndef BINTRACE_H
+#define BINTRACE_H
+
+#include <stdint.h>
+
+#define BINTRACE_MAGIC      "QBTRACE"
+#define BINTRACE_VERSION    1
+
+#define BINTRACE_F_ZSTD     (1u << 0)
+#define BINTRACE_F_MEM      (1u << 1)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+} BinTraceHeader;
+
+#define BINTRACE_STREAM_TBS 0xffffffffu
+
+typedef struct {
+    uint32_t stream;
+    uint32_t raw_size;
+    uint32_t size;
+    uint32_t reserved;
+} BinTraceChunk;
+
+enum {
+    BINTRACE_REC_TBDEF = 0x01,
+    BINTRACE_REC_TB    = 0x02,
+    BINTRACE_REC_TRUNC = 0x03,
+    /* 0x10 | BINTRACE_MEM_STORE | log2(size) */
+    BINTRACE_REC_MEM   = 0x10,
+};
+
+#define BINTRACE_MEM_STORE      0x08
+#define BINTRACE_MEM_SIZE_MASK  0x07
+
+/* longest varint of a uint64_t */
+#define BINTRACE_VARINT_MAX 10
+
+static inline uint8_t *bintrace_put_varint(uint8_t *p, uint64_t val)
+{
+    while (val >= 0x80) {
+        *p++ = val | 0x80;
+        val >>= 7;
+    }
+    *p++ = val;
+    return p;
+}
+
+static inline uint8_t *bintrace_put_delta(uint8_t *p, uint64_t val,
+                                          uint64_t prev)
+{
+    int64_t delta = val - prev;
+
+    return bintrace_put_varint(p, ((uint64_t)delta << 1) ^ (delta >> 63));
+}
+
+/* Returns NULL if the varint does not end before END. */
+static inline const uint8_t *bintrace_get_varint(const uint8_t *p,
+                                                 const uint8_t *end,
+                                                 uint64_t *val)
+{
+    uint64_t v = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *val = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline const uint8_t *bintrace_get_delta(const uint8_t *p,
+                                                const uint8_t *end,
+                                                uint64_t prev, uint64_t *val)
+{
+    uint64_t zz;
+
+    p = bintrace_get_varint(p, end, &zz);
+    if (p) {
+        *val = prev + ((zz >> 1) ^ -(zz & 1));
+    }
+    return p;
+}
+
+#endif /* BINTRACE_H */
@@ -25,6 +25,18 @@ static GRand *rng;
 static int limit;
 static bool sys;
 
+/*
+ * With sample=N only 1 in N instruction fetches and 1 in N data accesses
+ * of each vCPU reach the model; the counting is done in the generated code.
+ */
+static uint64_t sample_period = 1;
+static struct qemu_plugin_scoreboard *sample_counters;
+
+typedef struct {
+    uint64_t insns;
+    uint64_t mem;
+} SampleCounters;
+
 enum EvictionPolicy {
     LRU,
     FIFO,
@@ -496,6 +508,20 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
         }
         g_mutex_unlock(&hashtable_lock);
 
+        if (sample_counters) {
+            qemu_plugin_register_vcpu_mem_sampled_cb(
+                insn, vcpu_mem_access, QEMU_PLUGIN_CB_NO_REGS, rw,
+                qemu_plugin_scoreboard_u64_in_struct(sample_counters,
+                                                     SampleCounters, mem),
+                sample_period, data);
+            qemu_plugin_register_vcpu_insn_exec_sampled_cb(
+                insn, vcpu_insn_exec, QEMU_PLUGIN_CB_NO_REGS,
+                qemu_plugin_scoreboard_u64_in_struct(sample_counters,
+                                                     SampleCounters, insns),
+                sample_period, data);
+            continue;
+        }
+
         qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem_access,
                                          QEMU_PLUGIN_CB_NO_REGS,
                                          rw, data);
@@ -611,9 +637,15 @@ static void log_stats(void)
     int i;
     Cache *icache, *dcache, *l2_cache;
 
-    g_autoptr(GString) rep = g_string_new("core #, data accesses, data misses,"
-                                          " dmiss rate, insn accesses,"
-                                          " insn misses, imiss rate");
+    g_autoptr(GString) rep = g_string_new("");
+
+    if (sample_period > 1) {
+        g_string_append_printf(rep, "sampled 1 in %" PRIu64 " accesses\n",
+                               sample_period);
+    }
+    g_string_append(rep, "core #, data accesses, data misses,"
+                         " dmiss rate, insn accesses,"
+                         " insn misses, imiss rate");
 
     if (use_l2) {
         g_string_append(rep, ", l2 accesses, l2 misses, l2 miss rate");
@@ -717,6 +749,10 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
     }
 
     g_hash_table_destroy(miss_ht);
+
+    if (sample_counters) {
+        qemu_plugin_scoreboard_free(sample_counters);
+    }
 }
 
 static void policy_init(void)
@@ -789,6 +825,12 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
             limit = STRTOLL(tokens[1]);
         } else if (g_strcmp0(tokens[0], "cores") == 0) {
             cores = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "sample") == 0) {
+            sample_period = STRTOLL(tokens[1]);
+            if (sample_period < 1) {
+                fprintf(stderr, "invalid sampling period: %s\n", opt);
+                return -1;
+            }
         } else if (g_strcmp0(tokens[0], "l2cachesize") == 0) {
             use_l2 = true;
             l2_cachesize = STRTOLL(tokens[1]);
@@ -850,6 +892,10 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
     l1_icache_locks = g_new0(GMutex, cores);
     l2_ucache_locks = use_l2 ? g_new0(GMutex, cores) : NULL;
 
+    if (sample_period > 1) {
+        sample_counters = qemu_plugin_scoreboard_new(sizeof(SampleCounters));
+    }
+
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
 
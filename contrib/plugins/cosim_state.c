@@ -15,15 +15,9 @@
 #include <dlfcn.h>
 
 #include <qemu-plugin.h>
-#include "qemu-plugin-cpu.h"
 
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
-static st_rvfi_t *cosim = NULL;
-static bool plugin_init = true;
-
-static CPUArchState prev_cpu_state;
-
 #if 0
 /**
  * Add memory read or write information to current instruction log
@@ -58,56 +52,100 @@ static void vcpu_mem(unsigned int cpu_index, qemu_plugin_meminfo_t info,
 }
 #endif
 
-static void vcpu_insn_after_exec(unsigned int cpu_index, void *udata)
+/**
+ * Log the RVFI record of/*
+ * Per-vCPU register snapshot: the handles of the registers to capture
+ * (the core registers - x0..x31 for RISC-V) and their values before
+ * and after the last instruction.
+ */
+typedef struct {
+    GArray *regs;
+    GPtrArray *handles;
+    GByteArray *prev;
+    GByteArray *cur;
+} CPURegs;
+
+static CPURegs *cpus;
+static int max_cpus;
+
+/* The feature of the core registers */
+static const char *core_feature = "org.gnu.gdb.riscv.cpu";
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int cpu_index)
 {
-    CPUState *state = (CPUState *)qemu_plugin_get_cpu(cpu_index);
-    CPUArchState *cpu;
-    cosim_args_t *regs;
-    
-    if (state == NULL) {
-        qemu_plugin_outs("CPU State does not exist\n");
+    CPURegs *c;
+    GArray *regs;
+    guint i;
+
+    if (cpu_index >= max_cpus) {
         return;
     }
-    cpu = (CPUArchState *)(state + 1);
-    regs = &cpu->cosim_args;
-    
-    fprintf(stderr,"**** After insn npc=%lx insn=%0x\n", cpu->pc, cpu->cosim_args.insn);
-    fprintf(stderr,"     Regs: %08x\n", cpu->cosim_args.insn_p_regs);
-
-    if (regs->insn_regs.rs1 != 0) fprintf(stderr,"           rs1=%2d val=%016lx\n",
-        regs->insn_regs.rs1, prev_cpu_state.gpr[regs->insn_regs.rs1]);
-
-    if (regs->insn_regs.rs2 != 0) fprintf(stderr,"           rs2=%2d val=%016lx\n",
-        regs->insn_regs.rs2, prev_cpu_state.gpr[regs->insn_regs.rs2]);
-        
-    if (regs->insn_regs.rs3 != 0) fprintf(stderr,"           rs3=%2d val=%016lx\n",
-        regs->insn_regs.rs3, prev_cpu_state.gpr[regs->insn_regs.rs3]);
+    c = &cpus[cpu_index];
+    regs = qemu_plugin_get_registers();
+    c->regs = g_array_new(false, false, sizeof(qemu_plugin_reg_descriptor));
+    c->handles = g_ptr_array_new();
+    for (i = 0; i < regs->len; i++) {
+        qemu_plugin_reg_descriptor *rd =
+            &g_array_index(regs, qemu_plugin_reg_descriptor, i);
+
+        /* the PC lags behind within a TB, the insn vaddr is used instead */
+        if (rd->feature && !strcmp(rd->feature, core_feature) &&
+            strcmp(rd->name, "pc") != 0) {
+            g_array_append_val(c->regs, *rd);
+            g_ptr_array_add(c->handles, rd->handle);
+        }
+    }
+    g_array_free(regs, true);
 
-    if (regs->insn_regs.rd != 0)  fprintf(stderr,"           rd =%2d val=%016lx\n",
-        regs->insn_regs.rd, cpu->gpr[regs->insn_regs.rd]);
-         
+    c->prev = g_byte_array_new();
+    c->cur = g_byte_array_new();
+    qemu_plugin_read_registers((struct qemu_plugin_register **)c->handles->pdata,
+                               c->handles->len, c->prev);
 }
 
 /**
- * Log instruction execution
+ * Log the registers written by the executed instruction: all core
+ * registers are read with one call and compared with the previous snapshot.
  */
-static void vcpu_insn_exec(unsigned int cpu_index, void *udata)
+static void vcpu_insn_after_exec(unsigned int cpu_index, void *udata)
 {
+    CPURegs *c = &cpus[cpu_index];
+    GByteArray *tmp;
+    guint i, off = 0;
 
-    CPUState *state = (CPUState *)qemu_plugin_get_cpu(cpu_index);
-    CPUArchState *cpu; // Same as CPURISCVState
-    
-    if (state == NULL) {
-        qemu_plugin_outs("CPU State does not exist\n");
+    if (cpu_index >= max_cpus || c->handles == NULL) {
         return;
     }
-    cpu = (CPUArchState *)(state + 1);
-    fprintf(stderr,"+++++ BEFORE INSN pc=%08lx\n",cpu->pc);
-    prev_cpu_state = *cpu;
+    g_byte_array_set_size(c->cur, 0);
+    if (qemu_plugin_read_registers((struct qemu_plugin_register **)c->handles->pdata,
+                                   c->handles->len, c->cur) < 0) {
+        qemu_plugin_outs("Unable to read the registers\n");
+        return;
+    }
+
+    fprintf(stderr, "**** After insn pc=%"PRIx64"\n", (uint64_t)(uintptr_t)udata);
+
+    for (i = 0; i < c->regs->len; i++) {
+        qemu_plugin_reg_descriptor *rd =
+            &g_array_index(c->regs, qemu_plugin_reg_descriptor, i);
+        uint64_t val = 0;
+
+        if (off + rd->size > c->cur->len) {
+            break;
+        }
+        if (memcmp(c->cur->data + off, c->prev->data + off, rd->size) != 0) {
+            memcpy(&val, c->cur->data + off, MIN(rd->size, sizeof(val)));
+            fprintf(stderr, "           %-4s = %016"PRIx64"\n", rd->name, val);
+        }
+        off += rd->size;
+    }
+
+    tmp = c->prev;
+    c->prev = c->cur;
+    c->cur = tmp;
 }
 
-/**
- * On translation block new translation
+ew translation
  *
  * QEMU convert code by translation block (TB). By hooking here we can then hook
  * a callback on each instruction and memory access.
@@ -116,46 +154,31 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
 {
     struct qemu_plugin_insn *insn;
 
-    if (plugin_init) {
-        CPUState *state = (CPUState *)qemu_plugin_get_cpu(0);
-        CPUArchState *cpu;
-
-        plugin_init = false;
-        if (state == NULL) {
-            fprintf(stderr, "CPU State does not exist\n");
-        } else {
-            cpu = (CPUArchState *)(state + 1);
-            cpu->cosim_state = cosim;
-        }
-    }
-
     size_t n = qemu_plugin_tb_n_insns(tb);
+    size_t i;
 
-    if ( n == 1) {
-        insn = qemu_plugin_tb_get_insn(tb, 0);
+    /* COSIM TBs are no longer one-insn-per-tb - instrument every insn */
+    for (i = 0; i < n; i++) {
+        insn = qemu_plugin_tb_get_insn(tb, i);
 
 //            /* Register callback on memory read or write */
 //            qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem,
 //                                             QEMU_PLUGIN_CB_NO_REGS,
 //                                             QEMU_PLUGIN_MEM_RW, NULL);
 
-            /* Register callback on instruction */
-            qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_insn_exec,
-                                                   QEMU_PLUGIN_CB_NO_REGS, NULL);
-
             /* Register callback after instruction execution */
             qemu_plugin_register_vcpu_insn_after_exec_cb(insn, vcpu_insn_after_exec,
-                                                   QEMU_PLUGIN_CB_NO_REGS, NULL);
+                                                   QEMU_PLUGIN_CB_R_REGS,
+                                                   (void *)(uintptr_t)qemu_plugin_insn_vaddr(insn));
     }
     
 }
 
 /**
- * On plugin exit, free memory
+ * On plugin exit
  */
 static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
-    g_free(cosim);
 }
 
 
@@ -174,14 +197,12 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
     fprintf(stderr, "********* COSIM\n");
     fprintf(stderr, "**** Architetcure: %s\n", info->target_name);
     fprintf(stderr, "**** CPU num: %d\n", info->system.smp_vcpus);
-    
-    cosim = g_malloc0(sizeof(st_rvfi_t));
-    if (cosim == NULL) {
-        fprintf(stderr, "g_malloc0: cannot allocate memory\n");
-        return -1;
-    }
 
-    /* Register translation block and exit callbacks */
+    max_cpus = info->system_emulation ? info->system.max_vcpus : 1;
+    cpus = g_new0(CPURegs, max_cpus);
+
+    /* Register vCPU init, translation block and exit callbacks */
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
 
@@ -36,6 +36,7 @@ enum sort_type {
 };
 
 static int sort_by = SORT_RW;
+static int max_vcpu_index;
 
 typedef struct {
     uint64_t page_address;
@@ -45,7 +46,15 @@ typedef struct {
     uint64_t writes;
 } PageCounters;
 
-static GMutex lock;
+/*
+ * Every vCPU counts into its own table (an element of the scoreboard),
+ * the tables are merged at exit, so the callback takes no lock.
+ */
+typedef struct {
+    GHashTable *pages;
+} VCPUPages;
+
+static struct qemu_plugin_scoreboard *vcpu_pages;
 static GHashTable *pages;
 
 static gint cmp_access_count(gconstpointer a, gconstpointer b)
@@ -73,12 +82,49 @@ static gint cmp_access_count(gconstpointer a, gconstpointer b)
 }
 
 
+static void merge_vcpu_pages(GHashTable *vcpu_table, unsigned int cpu_index)
+{
+    GHashTableIter iter;
+    PageCounters *vcount, *count;
+
+    g_hash_table_iter_init(&iter, vcpu_table);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &vcount)) {
+        count = g_hash_table_lookup(pages,
+                                    GUINT_TO_POINTER(vcount->page_address));
+        if (!count) {
+            count = g_new0(PageCounters, 1);
+            count->page_address = vcount->page_address;
+            g_hash_table_insert(pages, GUINT_TO_POINTER(count->page_address),
+                                (gpointer) count);
+        }
+        if (vcount->reads) {
+            count->reads += vcount->reads;
+            count->cpu_read |= (1 << cpu_index);
+        }
+        if (vcount->writes) {
+            count->writes += vcount->writes;
+            count->cpu_write |= (1 << cpu_index);
+        }
+    }
+}
+
 static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
     g_autoptr(GString) report = g_string_new("Addr, RCPUs, Reads, WCPUs, Writes\n");
     int i;
     GList *counts;
 
+    for (i = 0; i <= g_atomic_int_get(&max_vcpu_index); i++) {
+        VCPUPages *vp = qemu_plugin_scoreboard_find(vcpu_pages, i);
+
+        if (vp->pages) {
+            merge_vcpu_pages(vp->pages, i);
+            g_hash_table_destroy(vp->pages);
+            vp->pages = NULL;
+        }
+    }
+    qemu_plugin_scoreboard_free(vcpu_pages);
+
     counts = g_hash_table_get_values(pages);
     if (counts && g_list_next(counts)) {
         GList *it;
@@ -104,12 +150,29 @@ static void plugin_init(void)
 {
     page_mask = (page_size - 1);
     pages = g_hash_table_new(NULL, g_direct_equal);
+    vcpu_pages = qemu_plugin_scoreboard_new(sizeof(VCPUPages));
+}
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int cpu_index)
+{
+    VCPUPages *vp = qemu_plugin_scoreboard_find(vcpu_pages, cpu_index);
+    int old;
+
+    if (!vp->pages) {
+        vp->pages = g_hash_table_new_full(NULL, g_direct_equal, NULL, g_free);
+    }
+    do {
+        old = g_atomic_int_get(&max_vcpu_index);
+    } while (old < (int) cpu_index &&
+             !g_atomic_int_compare_and_exchange(&max_vcpu_index, old,
+                                                cpu_index));
 }
 
 static void vcpu_haddr(unsigned int cpu_index, qemu_plugin_meminfo_t meminfo,
                        uint64_t vaddr, void *udata)
 {
     struct qemu_plugin_hwaddr *hwaddr = qemu_plugin_get_hwaddr(meminfo, vaddr);
+    VCPUPages *vp = qemu_plugin_scoreboard_find(vcpu_pages, cpu_index);
     uint64_t page;
     PageCounters *count;
 
@@ -129,23 +192,20 @@ static void vcpu_haddr(unsigned int cpu_index, qemu_plugin_meminfo_t meminfo,
     }
     page &= ~page_mask;
 
-    g_mutex_lock(&lock);
-    count = (PageCounters *) g_hash_table_lookup(pages, GUINT_TO_POINTER(page));
+    count = (PageCounters *) g_hash_table_lookup(vp->pages,
+                                                 GUINT_TO_POINTER(page));
 
     if (!count) {
         count = g_new0(PageCounters, 1);
         count->page_address = page;
-        g_hash_table_insert(pages, GUINT_TO_POINTER(page), (gpointer) count);
+        g_hash_table_insert(vp->pages, GUINT_TO_POINTER(page),
+                            (gpointer) count);
     }
     if (qemu_plugin_mem_is_store(meminfo)) {
         count->writes++;
-        count->cpu_write |= (1 << cpu_index);
     } else {
         count->reads++;
-        count->cpu_read |= (1 << cpu_index);
     }
-
-    g_mutex_unlock(&lock);
 }
 
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
@@ -197,6 +257,7 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
 
     plugin_init();
 
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
     return 0;
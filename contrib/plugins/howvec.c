@@ -34,6 +34,7 @@ static int limit = 50;
 static bool do_inline;
 static bool verbose;
 
+/* protects the hash table, the counts are per-vCPU scoreboards */
 static GMutex lock;
 static GHashTable *insns;
 
@@ -43,16 +44,22 @@ typedef struct {
     uint32_t mask;
     uint32_t pattern;
     CountType what;
-    uint64_t count;
+    struct qemu_plugin_scoreboard *count;
 } InsnClassExecCount;
 
 typedef struct {
     char *insn;
     uint32_t opcode;
-    uint64_t count;
+    struct qemu_plugin_scoreboard *count;
+    uint64_t total;
     InsnClassExecCount *class;
 } InsnExecCount;
 
+static uint64_t count_sum(struct qemu_plugin_scoreboard *count)
+{
+    return qemu_plugin_u64_sum(qemu_plugin_scoreboard_u64(count));
+}
+
 /*
  * Matchers for classes of instructions, order is important.
  *
@@ -159,12 +166,13 @@ static gint cmp_exec_count(gconstpointer a, gconstpointer b)
 {
     InsnExecCount *ea = (InsnExecCount *) a;
     InsnExecCount *eb = (InsnExecCount *) b;
-    return ea->count > eb->count ? -1 : 1;
+    return ea->total > eb->total ? -1 : 1;
 }
 
 static void free_record(gpointer data)
 {
     InsnExecCount *rec = (InsnExecCount *) data;
+    qemu_plugin_scoreboard_free(rec->count);
     g_free(rec->insn);
     g_free(rec);
 }
@@ -173,18 +181,21 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
     g_autoptr(GString) report = g_string_new("Instruction Classes:\n");
     int i;
-    GList *counts;
+    GList *counts, *it;
     InsnClassExecCount *class = NULL;
 
     for (i = 0; i < class_table_sz; i++) {
+        uint64_t total;
+
         class = &class_table[i];
         switch (class->what) {
         case COUNT_CLASS:
-            if (class->count || verbose) {
+            total = count_sum(class->count);
+            if (total || verbose) {
                 g_string_append_printf(report,
                                        "Class: %-24s\t(%" PRId64 " hits)\n",
                                        class->class,
-                                       class->count);
+                                       total);
             }
             break;
         case COUNT_INDIVIDUAL:
@@ -201,6 +212,10 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
     }
 
     counts = g_hash_table_get_values(insns);
+    for (it = counts; it; it = it->next) {
+        InsnExecCount *rec = (InsnExecCount *) it->data;
+        rec->total = count_sum(rec->count);
+    }
     if (counts && g_list_next(counts)) {
         g_string_append_printf(report, "Individual Instructions:\n");
         counts = g_list_sort(counts, cmp_exec_count);
@@ -212,7 +227,7 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
                                    "Instr: %-24s\t(%" PRId64 " hits)"
                                    "\t(op=0x%08x/%s)\n",
                                    rec->insn,
-                                   rec->count,
+                                   rec->total,
                                    rec->opcode,
                                    rec->class ?
                                    rec->class->class : "un-categorised");
@@ -221,25 +236,34 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
     }
 
     g_hash_table_destroy(insns);
+    for (i = 0; i < class_table_sz; i++) {
+        qemu_plugin_scoreboard_free(class_table[i].count);
+    }
 
     qemu_plugin_outs(report->str);
 }
 
 static void plugin_init(void)
 {
+    int i;
+
     insns = g_hash_table_new_full(NULL, g_direct_equal, NULL, &free_record);
+    for (i = 0; i < class_table_sz; i++) {
+        class_table[i].count = qemu_plugin_scoreboard_new(sizeof(uint64_t));
+    }
 }
 
 static void vcpu_insn_exec_before(unsigned int cpu_index, void *udata)
 {
-    uint64_t *count = (uint64_t *) udata;
-    (*count)++;
+    struct qemu_plugin_scoreboard *count = udata;
+    qemu_plugin_u64_add(qemu_plugin_scoreboard_u64(count), cpu_index, 1);
 }
 
-static uint64_t *find_counter(struct qemu_plugin_insn *insn)
+static struct qemu_plugin_scoreboard *find_counter(
+    struct qemu_plugin_insn *insn)
 {
     int i;
-    uint64_t *cnt = NULL;
+    struct qemu_plugin_scoreboard *cnt = NULL;
     uint32_t opcode;
     InsnClassExecCount *class = NULL;
 
@@ -265,7 +289,7 @@ static uint64_t *find_counter(struct qemu_plugin_insn *insn)
     case COUNT_NONE:
         return NULL;
     case COUNT_CLASS:
-        return &class->count;
+        return class->count;
     case COUNT_INDIVIDUAL:
     {
         InsnExecCount *icount;
@@ -279,13 +303,14 @@ static uint64_t *find_counter(struct qemu_plugin_insn *insn)
             icount->opcode = opcode;
             icount->insn = qemu_plugin_insn_disas(insn);
             icount->class = class;
+            icount->count = qemu_plugin_scoreboard_new(sizeof(uint64_t));
 
             g_hash_table_insert(insns, GUINT_TO_POINTER(opcode),
                                 (gpointer) icount);
         }
         g_mutex_unlock(&lock);
 
-        return &icount->count;
+        return icount->count;
     }
     default:
         g_assert_not_reached();
@@ -300,14 +325,15 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
     size_t i;
 
     for (i = 0; i < n; i++) {
-        uint64_t *cnt;
+        struct qemu_plugin_scoreboard *cnt;
         struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
         cnt = find_counter(insn);
 
         if (cnt) {
             if (do_inline) {
-                qemu_plugin_register_vcpu_insn_exec_inline(
-                    insn, QEMU_PLUGIN_INLINE_ADD_U64, cnt, 1);
+                qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+                    insn, QEMU_PLUGIN_INLINE_ADD_U64,
+                    qemu_plugin_scoreboard_u64(cnt), 1);
             } else {
                 qemu_plugin_register_vcpu_insn_exec_cb(
                     insn, vcpu_insn_exec_before, QEMU_PLUGIN_CB_NO_REGS, cnt);
@@ -0,0 +1,711 @@
+/*
+ * RISC-V ISA coverage
+ *
+ * Every instruction is decoded once, when it is translated, and binned by
+ * mnemonic and privilege mode; CSR instructions also by CSR number and the
+ * integer register operands by register. The bins are per-vCPU scoreboard
+ * counters bumped by inline ops, so coverage costs no callback.
+ *
+ * The privilege mode is read at translation time: it is part of the TB
+ * flags, so a TB only ever runs in the mode it was translated for.
+ *
+ * Arguments:
+ *  regs=on|off     count the register operands (default: on)
+ *  mapfile=PATH    export the counters in PATH (layout below), updated
+ *                  every <interval> ms in system mode and at exit
+ *  interval=MS     (default: 1000)
+ *  verbose=on|off  also list the instructions that were not covered
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <qemu-plugin.h>
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* x-register operand fields */
+#define RD      (1 << 0)    /* rd   [11:7] */
+#define RS1     (1 << 1)    /* rs1  [19:15] */
+#define RS2     (1 << 2)    /* rs2  [24:20] */
+#define CRD     (1 << 3)    /* rd   [11:7] of a compressed insn */
+#define CRS1    (1 << 4)    /* rs1  [11:7] */
+#define CRS2    (1 << 5)    /* rs2  [6:2] */
+#define CRDP    (1 << 6)    /* rd'  [4:2] */
+#define CRS1P   (1 << 7)    /* rs1' [9:7] */
+#define CRS2P   (1 << 8)    /* rs2' [4:2] */
+#define CRDP1   (1 << 9)    /* rd'  [9:7] */
+
+typedef struct {
+    const char *name;
+    const char *class;
+    uint32_t mask;
+    uint32_t match;
+    uint16_t ops;
+    uint8_t size;
+} RVInsn;
+
+#define I32(n, c, mask, match, ops) { n, c, mask, match, ops, 4 }
+#define C16(n, c, mask, match, ops) { n, c, mask, match, ops, 2 }
+
+/*
+ * The first match wins, so the special cases come before the generic
+ * encodings (c.nop before c.addi, ...). The vector extension is only
+ * binned by its major encoding groups.
+ */
+static const RVInsn rv_insns[] = {
+    /* RV64I */
+    I32("lui",        "alu",     0x0000007f, 0x00000037, RD),
+    I32("auipc",      "alu",     0x0000007f, 0x00000017, RD),
+    I32("jal",        "jump",    0x0000007f, 0x0000006f, RD),
+    I32("jalr",       "jump",    0x0000707f, 0x00000067, RD | RS1),
+    I32("beq",        "branch",  0x0000707f, 0x00000063, RS1 | RS2),
+    I32("bne",        "branch",  0x0000707f, 0x00001063, RS1 | RS2),
+    I32("blt",        "branch",  0x0000707f, 0x00004063, RS1 | RS2),
+    I32("bge",        "branch",  0x0000707f, 0x00005063, RS1 | RS2),
+    I32("bltu",       "branch",  0x0000707f, 0x00006063, RS1 | RS2),
+    I32("bgeu",       "branch",  0x0000707f, 0x00007063, RS1 | RS2),
+    I32("lb",         "load",    0x0000707f, 0x00000003, RD | RS1),
+    I32("lh",         "load",    0x0000707f, 0x00001003, RD | RS1),
+    I32("lw",         "load",    0x0000707f, 0x00002003, RD | RS1),
+    I32("ld",         "load",    0x0000707f, 0x00003003, RD | RS1),
+    I32("lbu",        "load",    0x0000707f, 0x00004003, RD | RS1),
+    I32("lhu",        "load",    0x0000707f, 0x00005003, RD | RS1),
+    I32("lwu",        "load",    0x0000707f, 0x00006003, RD | RS1),
+    I32("sb",         "store",   0x0000707f, 0x00000023, RS1 | RS2),
+    I32("sh",         "store",   0x0000707f, 0x00001023, RS1 | RS2),
+    I32("sw",         "store",   0x0000707f, 0x00002023, RS1 | RS2),
+    I32("sd",         "store",   0x0000707f, 0x00003023, RS1 | RS2),
+    I32("addi",       "alu",     0x0000707f, 0x00000013, RD | RS1),
+    I32("slti",       "alu",     0x0000707f, 0x00002013, RD | RS1),
+    I32("sltiu",      "alu",     0x0000707f, 0x00003013, RD | RS1),
+    I32("xori",       "alu",     0x0000707f, 0x00004013, RD | RS1),
+    I32("ori",        "alu",     0x0000707f, 0x00006013, RD | RS1),
+    I32("andi",       "alu",     0x0000707f, 0x00007013, RD | RS1),
+    I32("slli",       "alu",     0xfc00707f, 0x00001013, RD | RS1),
+    I32("srli",       "alu",     0xfc00707f, 0x00005013, RD | RS1),
+    I32("srai",       "alu",     0xfc00707f, 0x40005013, RD | RS1),
+    I32("add",        "alu",     0xfe00707f, 0x00000033, RD | RS1 | RS2),
+    I32("sub",        "alu",     0xfe00707f, 0x40000033, RD | RS1 | RS2),
+    I32("sll",        "alu",     0xfe00707f, 0x00001033, RD | RS1 | RS2),
+    I32("slt",        "alu",     0xfe00707f, 0x00002033, RD | RS1 | RS2),
+    I32("sltu",       "alu",     0xfe00707f, 0x00003033, RD | RS1 | RS2),
+    I32("xor",        "alu",     0xfe00707f, 0x00004033, RD | RS1 | RS2),
+    I32("srl",        "alu",     0xfe00707f, 0x00005033, RD | RS1 | RS2),
+    I32("sra",        "alu",     0xfe00707f, 0x40005033, RD | RS1 | RS2),
+    I32("or",         "alu",     0xfe00707f, 0x00006033, RD | RS1 | RS2),
+    I32("and",        "alu",     0xfe00707f, 0x00007033, RD | RS1 | RS2),
+    I32("addiw",      "alu",     0x0000707f, 0x0000001b, RD | RS1),
+    I32("slliw",      "alu",     0xfe00707f, 0x0000101b, RD | RS1),
+    I32("srliw",      "alu",     0xfe00707f, 0x0000501b, RD | RS1),
+    I32("sraiw",      "alu",     0xfe00707f, 0x4000501b, RD | RS1),
+    I32("addw",       "alu",     0xfe00707f, 0x0000003b, RD | RS1 | RS2),
+    I32("subw",       "alu",     0xfe00707f, 0x4000003b, RD | RS1 | RS2),
+    I32("sllw",       "alu",     0xfe00707f, 0x0000103b, RD | RS1 | RS2),
+    I32("srlw",       "alu",     0xfe00707f, 0x0000503b, RD | RS1 | RS2),
+    I32("sraw",       "alu",     0xfe00707f, 0x4000503b, RD | RS1 | RS2),
+    I32("fence",      "fence",   0x0000707f, 0x0000000f, 0),
+    I32("fence.i",    "fence",   0x0000707f, 0x0000100f, 0),
+    /* system */
+    I32("ecall",      "system",  0xffffffff, 0x00000073, 0),
+    I32("ebreak",     "system",  0xffffffff, 0x00100073, 0),
+    I32("sret",       "system",  0xffffffff, 0x10200073, 0),
+    I32("mret",       "system",  0xffffffff, 0x30200073, 0),
+    I32("wfi",        "system",  0xffffffff, 0x10500073, 0),
+    I32("sfence.vma", "fence",   0xfe007fff, 0x12000073, RS1 | RS2),
+    I32("hfence.vvma", "fence",  0xfe007fff, 0x22000073, RS1 | RS2),
+    I32("hfence.gvma", "fence",  0xfe007fff, 0x62000073, RS1 | RS2),
+    /* Zicsr, the immediate forms have no rs1 */
+    I32("csrrw",      "csr",     0x0000707f, 0x00001073, RD | RS1),
+    I32("csrrs",      "csr",     0x0000707f, 0x00002073, RD | RS1),
+    I32("csrrc",      "csr",     0x0000707f, 0x00003073, RD | RS1),
+    I32("csrrwi",     "csr",     0x0000707f, 0x00005073, RD),
+    I32("csrrsi",     "csr",     0x0000707f, 0x00006073, RD),
+    I32("csrrci",     "csr",     0x0000707f, 0x00007073, RD),
+    /* M */
+    I32("mul",        "mul",     0xfe00707f, 0x02000033, RD | RS1 | RS2),
+    I32("mulh",       "mul",     0xfe00707f, 0x02001033, RD | RS1 | RS2),
+    I32("mulhsu",     "mul",     0xfe00707f, 0x02002033, RD | RS1 | RS2),
+    I32("mulhu",      "mul",     0xfe00707f, 0x02003033, RD | RS1 | RS2),
+    I32("div",        "div",     0xfe00707f, 0x02004033, RD | RS1 | RS2),
+    I32("divu",       "div",     0xfe00707f, 0x02005033, RD | RS1 | RS2),
+    I32("rem",        "div",     0xfe00707f, 0x02006033, RD | RS1 | RS2),
+    I32("remu",       "div",     0xfe00707f, 0x02007033, RD | RS1 | RS2),
+    I32("mulw",       "mul",     0xfe00707f, 0x0200003b, RD | RS1 | RS2),
+    I32("divw",       "div",     0xfe00707f, 0x0200403b, RD | RS1 | RS2),
+    I32("divuw",      "div",     0xfe00707f, 0x0200503b, RD | RS1 | RS2),
+    I32("remw",       "div",     0xfe00707f, 0x0200603b, RD | RS1 | RS2),
+    I32("remuw",      "div",     0xfe00707f, 0x0200703b, RD | RS1 | RS2),
+    /* A, aq/rl ignored */
+    I32("lr.w",       "amo",     0xf9f0707f, 0x1000202f, RD | RS1),
+    I32("sc.w",       "amo",     0xf800707f, 0x1800202f, RD | RS1 | RS2),
+    I32("amoswap.w",  "amo",     0xf800707f, 0x0800202f, RD | RS1 | RS2),
+    I32("amoadd.w",   "amo",     0xf800707f, 0x0000202f, RD | RS1 | RS2),
+    I32("amoxor.w",   "amo",     0xf800707f, 0x2000202f, RD | RS1 | RS2),
+    I32("amoand.w",   "amo",     0xf800707f, 0x6000202f, RD | RS1 | RS2),
+    I32("amoor.w",    "amo",     0xf800707f, 0x4000202f, RD | RS1 | RS2),
+    I32("amomin.w",   "amo",     0xf800707f, 0x8000202f, RD | RS1 | RS2),
+    I32("amomax.w",   "amo",     0xf800707f, 0xa000202f, RD | RS1 | RS2),
+    I32("amominu.w",  "amo",     0xf800707f, 0xc000202f, RD | RS1 | RS2),
+    I32("amomaxu.w",  "amo",     0xf800707f, 0xe000202f, RD | RS1 | RS2),
+    I32("lr.d",       "amo",     0xf9f0707f, 0x1000302f, RD | RS1),
+    I32("sc.d",       "amo",     0xf800707f, 0x1800302f, RD | RS1 | RS2),
+    I32("amoswap.d",  "amo",     0xf800707f, 0x0800302f, RD | RS1 | RS2),
+    I32("amoadd.d",   "amo",     0xf800707f, 0x0000302f, RD | RS1 | RS2),
+    I32("amoxor.d",   "amo",     0xf800707f, 0x2000302f, RD | RS1 | RS2),
+    I32("amoand.d",   "amo",     0xf800707f, 0x6000302f, RD | RS1 | RS2),
+    I32("amoor.d",    "amo",     0xf800707f, 0x4000302f, RD | RS1 | RS2),
+    I32("amomin.d",   "amo",     0xf800707f, 0x8000302f, RD | RS1 | RS2),
+    I32("amomax.d",   "amo",     0xf800707f, 0xa000302f, RD | RS1 | RS2),
+    I32("amominu.d",  "amo",     0xf800707f, 0xc000302f, RD | RS1 | RS2),
+    I32("amomaxu.d",  "amo",     0xf800707f, 0xe000302f, RD | RS1 | RS2),
+    /* F and D, only the x-register operands are binned */
+    I32("flw",        "fp-ldst", 0x0000707f, 0x00002007, RS1),
+    I32("fld",        "fp-ldst", 0x0000707f, 0x00003007, RS1),
+    I32("fsw",        "fp-ldst", 0x0000707f, 0x00002027, RS1),
+    I32("fsd",        "fp-ldst", 0x0000707f, 0x00003027, RS1),
+    I32("fmadd.s",    "fp-fma",  0x0600007f, 0x00000043, 0),
+    I32("fmsub.s",    "fp-fma",  0x0600007f, 0x00000047, 0),
+    I32("fnmsub.s",   "fp-fma",  0x0600007f, 0x0000004b, 0),
+    I32("fnmadd.s",   "fp-fma",  0x0600007f, 0x0000004f, 0),
+    I32("fmadd.d",    "fp-fma",  0x0600007f, 0x02000043, 0),
+    I32("fmsub.d",    "fp-fma",  0x0600007f, 0x02000047, 0),
+    I32("fnmsub.d",   "fp-fma",  0x0600007f, 0x0200004b, 0),
+    I32("fnmadd.d",   "fp-fma",  0x0600007f, 0x0200004f, 0),
+    I32("fadd.s",     "fp",      0xfe00007f, 0x00000053, 0),
+    I32("fsub.s",     "fp",      0xfe00007f, 0x08000053, 0),
+    I32("fmul.s",     "fp",      0xfe00007f, 0x10000053, 0),
+    I32("fdiv.s",     "fp-div",  0xfe00007f, 0x18000053, 0),
+    I32("fsqrt.s",    "fp-div",  0xfff0007f, 0x58000053, 0),
+    I32("fsgnj.s",    "fp",      0xfe00707f, 0x20000053, 0),
+    I32("fsgnjn.s",   "fp",      0xfe00707f, 0x20001053, 0),
+    I32("fsgnjx.s",   "fp",      0xfe00707f, 0x20002053, 0),
+    I32("fmin.s",     "fp",      0xfe00707f, 0x28000053, 0),
+    I32("fmax.s",     "fp",      0xfe00707f, 0x28001053, 0),
+    I32("fcvt.w.s",   "fp-cvt",  0xfff0007f, 0xc0000053, RD),
+    I32("fcvt.wu.s",  "fp-cvt",  0xfff0007f, 0xc0100053, RD),
+    I32("fcvt.l.s",   "fp-cvt",  0xfff0007f, 0xc0200053, RD),
+    I32("fcvt.lu.s",  "fp-cvt",  0xfff0007f, 0xc0300053, RD),
+    I32("fmv.x.w",    "fp-cvt",  0xfff0707f, 0xe0000053, RD),
+    I32("fclass.s",   "fp",      0xfff0707f, 0xe0001053, RD),
+    I32("feq.s",      "fp-cmp",  0xfe00707f, 0xa0002053, RD),
+    I32("flt.s",      "fp-cmp",  0xfe00707f, 0xa0001053, RD),
+    I32("fle.s",      "fp-cmp",  0xfe00707f, 0xa0000053, RD),
+    I32("fcvt.s.w",   "fp-cvt",  0xfff0007f, 0xd0000053, RS1),
+    I32("fcvt.s.wu",  "fp-cvt",  0xfff0007f, 0xd0100053, RS1),
+    I32("fcvt.s.l",   "fp-cvt",  0xfff0007f, 0xd0200053, RS1),
+    I32("fcvt.s.lu",  "fp-cvt",  0xfff0007f, 0xd0300053, RS1),
+    I32("fmv.w.x",    "fp-cvt",  0xfff0707f, 0xf0000053, RS1),
+    I32("fadd.d",     "fp",      0xfe00007f, 0x02000053, 0),
+    I32("fsub.d",     "fp",      0xfe00007f, 0x0a000053, 0),
+    I32("fmul.d",     "fp",      0xfe00007f, 0x12000053, 0),
+    I32("fdiv.d",     "fp-div",  0xfe00007f, 0x1a000053, 0),
+    I32("fsqrt.d",    "fp-div",  0xfff0007f, 0x5a000053, 0),
+    I32("fsgnj.d",    "fp",      0xfe00707f, 0x22000053, 0),
+    I32("fsgnjn.d",   "fp",      0xfe00707f, 0x22001053, 0),
+    I32("fsgnjx.d",   "fp",      0xfe00707f, 0x22002053, 0),
+    I32("fmin.d",     "fp",      0xfe00707f, 0x2a000053, 0),
+    I32("fmax.d",     "fp",      0xfe00707f, 0x2a001053, 0),
+    I32("fcvt.s.d",   "fp-cvt",  0xfff0007f, 0x40100053, 0),
+    I32("fcvt.d.s",   "fp-cvt",  0xfff0007f, 0x42000053, 0),
+    I32("feq.d",      "fp-cmp",  0xfe00707f, 0xa2002053, RD),
+    I32("flt.d",      "fp-cmp",  0xfe00707f, 0xa2001053, RD),
+    I32("fle.d",      "fp-cmp",  0xfe00707f, 0xa2000053, RD),
+    I32("fclass.d",   "fp",      0xfff0707f, 0xe2001053, RD),
+    I32("fcvt.w.d",   "fp-cvt",  0xfff0007f, 0xc2000053, RD),
+    I32("fcvt.wu.d",  "fp-cvt",  0xfff0007f, 0xc2100053, RD),
+    I32("fcvt.l.d",   "fp-cvt",  0xfff0007f, 0xc2200053, RD),
+    I32("fcvt.lu.d",  "fp-cvt",  0xfff0007f, 0xc2300053, RD),
+    I32("fcvt.d.w",   "fp-cvt",  0xfff0007f, 0xd2000053, RS1),
+    I32("fcvt.d.wu",  "fp-cvt",  0xfff0007f, 0xd2100053, RS1),
+    I32("fcvt.d.l",   "fp-cvt",  0xfff0007f, 0xd2200053, RS1),
+    I32("fcvt.d.lu",  "fp-cvt",  0xfff0007f, 0xd2300053, RS1),
+    I32("fmv.x.d",    "fp-cvt",  0xfff0707f, 0xe2000053, RD),
+    I32("fmv.d.x",    "fp-cvt",  0xfff0707f, 0xf2000053, RS1),
+    /* V, by encoding group */
+    I32("vl.e8",      "vector",  0x0000707f, 0x00000007, RS1),
+    I32("vl.e16",     "vector",  0x0000707f, 0x00005007, RS1),
+    I32("vl.e32",     "vector",  0x0000707f, 0x00006007, RS1),
+    I32("vl.e64",     "vector",  0x0000707f, 0x00007007, RS1),
+    I32("vs.e8",      "vector",  0x0000707f, 0x00000027, RS1),
+    I32("vs.e16",     "vector",  0x0000707f, 0x00005027, RS1),
+    I32("vs.e32",     "vector",  0x0000707f, 0x00006027, RS1),
+    I32("vs.e64",     "vector",  0x0000707f, 0x00007027, RS1),
+    I32("vsetvl",     "vector",  0x0000707f, 0x00007057, RD),
+    I32("v.opivv",    "vector",  0x0000707f, 0x00000057, 0),
+    I32("v.opfvv",    "vector",  0x0000707f, 0x00001057, 0),
+    I32("v.opmvv",    "vector",  0x0000707f, 0x00002057, 0),
+    I32("v.opivi",    "vector",  0x0000707f, 0x00003057, 0),
+    I32("v.opivx",    "vector",  0x0000707f, 0x00004057, RS1),
+    I32("v.opfvf",    "vector",  0x0000707f, 0x00005057, 0),
+    I32("v.opmvx",    "vector",  0x0000707f, 0x00006057, RS1),
+    /* C, RV64 */
+    C16("c.addi4spn", "alu",     0xe003, 0x0000, CRDP),
+    C16("c.fld",      "fp-ldst", 0xe003, 0x2000, CRS1P),
+    C16("c.lw",       "load",    0xe003, 0x4000, CRDP | CRS1P),
+    C16("c.ld",       "load",    0xe003, 0x6000, CRDP | CRS1P),
+    C16("c.fsd",      "fp-ldst", 0xe003, 0xa000, CRS1P),
+    C16("c.sw",       "store",   0xe003, 0xc000, CRS1P | CRS2P),
+    C16("c.sd",       "store",   0xe003, 0xe000, CRS1P | CRS2P),
+    C16("c.nop",      "alu",     0xffff, 0x0001, 0),
+    C16("c.addi",     "alu",     0xe003, 0x0001, CRD | CRS1),
+    C16("c.addiw",    "alu",     0xe003, 0x2001, CRD | CRS1),
+    C16("c.li",       "alu",     0xe003, 0x4001, CRD),
+    C16("c.addi16sp", "alu",     0xef83, 0x6101, 0),
+    C16("c.lui",      "alu",     0xe003, 0x6001, CRD),
+    C16("c.srli",     "alu",     0xec03, 0x8001, CRDP1 | CRS1P),
+    C16("c.srai",     "alu",     0xec03, 0x8401, CRDP1 | CRS1P),
+    C16("c.andi",     "alu",     0xec03, 0x8801, CRDP1 | CRS1P),
+    C16("c.sub",      "alu",     0xfc63, 0x8c01, CRDP1 | CRS1P | CRS2P),
+    C16("c.xor",      "alu",     0xfc63, 0x8c21, CRDP1 | CRS1P | CRS2P),
+    C16("c.or",       "alu",     0xfc63, 0x8c41, CRDP1 | CRS1P | CRS2P),
+    C16("c.and",      "alu",     0xfc63, 0x8c61, CRDP1 | CRS1P | CRS2P),
+    C16("c.subw",     "alu",     0xfc63, 0x9c01, CRDP1 | CRS1P | CRS2P),
+    C16("c.addw",     "alu",     0xfc63, 0x9c21, CRDP1 | CRS1P | CRS2P),
+    C16("c.j",        "jump",    0xe003, 0xa001, 0),
+    C16("c.beqz",     "branch",  0xe003, 0xc001, CRS1P),
+    C16("c.bnez",     "branch",  0xe003, 0xe001, CRS1P),
+    C16("c.slli",     "alu",     0xe003, 0x0002, CRD | CRS1),
+    C16("c.fldsp",    "fp-ldst", 0xe003, 0x2002, 0),
+    C16("c.lwsp",     "load",    0xe003, 0x4002, CRD),
+    C16("c.ldsp",     "load",    0xe003, 0x6002, CRD),
+    C16("c.jr",       "jump",    0xf07f, 0x8002, CRS1),
+    C16("c.mv",       "alu",     0xf003, 0x8002, CRD | CRS2),
+    C16("c.ebreak",   "system",  0xffff, 0x9002, 0),
+    C16("c.jalr",     "jump",    0xf07f, 0x9002, CRS1),
+    C16("c.add",      "alu",     0xf003, 0x9002, CRD | CRS1 | CRS2),
+    C16("c.fsdsp",    "fp-ldst", 0xe003, 0xa002, 0),
+    C16("c.swsp",     "store",   0xe003, 0xc002, CRS2),
+    C16("c.sdsp",     "store",   0xe003, 0xe002, CRS2),
+    /* anything else, must be last */
+    I32("unknown",    "unknown", 0x00000000, 0x00000000, 0),
+};
+
+#define N_INSNS     ARRAY_SIZE(rv_insns)
+#define N_MODES     4           /* U, S, (H), M - the priv encoding */
+#define N_CSRS      4096
+#define N_REGS      32
+
+static const char *const mode_names[N_MODES] = { "U", "S", "H", "M" };
+
+typedef struct {
+    uint64_t insns[N_INSNS][N_MODES];
+    uint64_t csrs[N_CSRS][N_MODES];
+    uint64_t rd[N_REGS];
+    uint64_t rs1[N_REGS];
+    uint64_t rs2[N_REGS];
+} Coverage;
+
+/*
+ * Layout of the map file, the counters are summed over the vCPUs.
+ * <seq> is odd while the counters are being updated: a reader copies
+ * them out and retries if <seq> was odd or changed meanwhile.
+ */
+#define ISACOV_MAGIC    "QISACOV"
+#define ISACOV_VERSION  1
+
+typedef struct {
+    char name[16];
+    char class[16];
+} IsaCovName;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_insns;
+    uint32_t n_modes;
+    uint32_t n_csrs;
+    uint64_t seq;
+    uint64_t names_off;     /* IsaCovName[n_insns] */
+    uint64_t counts_off;    /* Coverage, with n_insns/n_modes/n_csrs */
+} IsaCovMap;
+
+typedef struct {
+    IsaCovMap hdr;
+    IsaCovName names[N_INSNS];
+    Coverage counts;
+} IsaCovFile;
+
+static bool count_regs = true;
+static bool verbose;
+static char *map_file;
+static unsigned int interval_ms = 1000;
+
+static struct qemu_plugin_scoreboard *coverage;
+static int max_vcpu_index;
+static struct qemu_plugin_register *priv_reg;
+
+static IsaCovFile *map;
+static GThread *updater;
+static GMutex update_lock;
+static GCond update_cond;
+static bool stopping;
+
+static const RVInsn *decode(const struct qemu_plugin_insn *insn,
+                            uint32_t *opcode)
+{
+    size_t size = qemu_plugin_insn_size(insn);
+    const RVInsn *rv;
+
+    *opcode = 0;
+    memcpy(opcode, qemu_plugin_insn_data(insn), MIN(size, sizeof(*opcode)));
+    if (size == 2) {
+        *opcode &= 0xffff;
+    }
+    for (rv = rv_insns; rv < &rv_insns[N_INSNS - 1]; rv++) {
+        if (rv->size == size && (*opcode & rv->mask) == rv->match) {
+            break;
+        }
+    }
+    return rv;
+}
+
+/*
+ * The mode the TB is translated for. It is not a TCG global, so it can
+ * be read outside of a callback.
+ */
+static unsigned int current_mode(void)
+{
+    g_autoptr(GByteArray) buf = NULL;
+
+    if (!priv_reg) {
+        return 0;
+    }
+    buf = g_byte_array_new();
+    if (qemu_plugin_read_register(priv_reg, buf) <= 0) {
+        return 0;
+    }
+    /* little-endian, the low byte is enough */
+    return buf->data[0] & (N_MODES - 1);
+}
+
+static void count_reg(struct qemu_plugin_insn *insn, size_t offset,
+                      unsigned int reg)
+{
+    qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+        insn, QEMU_PLUGIN_INLINE_ADD_U64,
+        (qemu_plugin_u64) { coverage, offset + reg * sizeof(uint64_t) }, 1);
+}
+
+static void count_operands(struct qemu_plugin_insn *insn, uint16_t ops,
+                           uint32_t op)
+{
+    if (ops & RD) {
+        count_reg(insn, offsetof(Coverage, rd), (op >> 7) & 0x1f);
+    }
+    if (ops & RS1) {
+        count_reg(insn, offsetof(Coverage, rs1), (op >> 15) & 0x1f);
+    }
+    if (ops & RS2) {
+        count_reg(insn, offsetof(Coverage, rs2), (op >> 20) & 0x1f);
+    }
+    if (ops & CRD) {
+        count_reg(insn, offsetof(Coverage, rd), (op >> 7) & 0x1f);
+    }
+    if (ops & CRS1) {
+        count_reg(insn, offsetof(Coverage, rs1), (op >> 7) & 0x1f);
+    }
+    if (ops & CRS2) {
+        count_reg(insn, offsetof(Coverage, rs2), (op >> 2) & 0x1f);
+    }
+    if (ops & CRDP) {
+        count_reg(insn, offsetof(Coverage, rd), 8 + ((op >> 2) & 7));
+    }
+    if (ops & CRDP1) {
+        count_reg(insn, offsetof(Coverage, rd), 8 + ((op >> 7) & 7));
+    }
+    if (ops & CRS1P) {
+        count_reg(insn, offsetof(Coverage, rs1), 8 + ((op >> 7) & 7));
+    }
+    if (ops & CRS2P) {
+        count_reg(insn, offsetof(Coverage, rs2), 8 + ((op >> 2) & 7));
+    }
+}
+
+static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
+{
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    unsigned int mode = current_mode();
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        uint32_t opcode;
+        const RVInsn *rv = decode(insn, &opcode);
+        size_t idx = rv - rv_insns;
+
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64,
+            qemu_plugin_scoreboard_u64_in_struct(coverage, Coverage,
+                                                 insns[idx][mode]), 1);
+        if (!strcmp(rv->class, "csr")) {
+            qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+                insn, QEMU_PLUGIN_INLINE_ADD_U64,
+                qemu_plugin_scoreboard_u64_in_struct(
+                    coverage, Coverage, csrs[opcode >> 20][mode]), 1);
+        }
+        if (count_regs) {
+            count_operands(insn, rv->ops, opcode);
+        }
+    }
+}
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int cpu_index)
+{
+    int old;
+
+    if (!priv_reg) {
+        g_autoptr(GArray) regs = qemu_plugin_get_registers();
+        size_t i;
+
+        for (i = 0; i < regs->len; i++) {
+            qemu_plugin_reg_descriptor *rd =
+                &g_array_index(regs, qemu_plugin_reg_descriptor, i);
+
+            if (!strcmp(rd->name, "priv")) {
+                priv_reg = rd->handle;
+            }
+        }
+    }
+    do {
+        old = g_atomic_int_get(&max_vcpu_index);
+    } while (old < (int) cpu_index &&
+             !g_atomic_int_compare_and_exchange(&max_vcpu_index, old,
+                                                cpu_index));
+}
+
+/* Sums the vCPU counters into TOTAL. */
+static void sum_coverage(Coverage *total)
+{
+    uint64_t *dst = (uint64_t *)total;
+    size_t n = sizeof(Coverage) / sizeof(uint64_t);
+    int i;
+    size_t j;
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i <= g_atomic_int_get(&max_vcpu_index); i++) {
+        const uint64_t *src = qemu_plugin_scoreboard_find(coverage, i);
+
+        for (j = 0; j < n; j++) {
+            dst[j] += src[j];
+        }
+    }
+}
+
+static void update_map(void)
+{
+    static Coverage total;
+
+    sum_coverage(&total);
+    __atomic_store_n(&map->hdr.seq, map->hdr.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&map->counts, &total, sizeof(total));
+    __atomic_store_n(&map->hdr.seq, map->hdr.seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * In system mode the scoreboard is sized for all vCPUs up front and never
+ * moves, so it can be read from this thread while the vCPUs count.
+ */
+static gpointer updater_thread(gpointer opaque)
+{
+    g_mutex_lock(&update_lock);
+    while (!stopping) {
+        gint64 end = g_get_monotonic_time() +
+                     interval_ms * G_TIME_SPAN_MILLISECOND;
+
+        if (!g_cond_wait_until(&update_cond, &update_lock, end)) {
+            update_map();
+        }
+    }
+    g_mutex_unlock(&update_lock);
+    return NULL;
+}
+
+static int map_init(void)
+{
+    int fd = open(map_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    size_t i;
+
+    if (fd < 0 || ftruncate(fd, sizeof(IsaCovFile)) < 0) {
+        fprintf(stderr, "isacov: unable to create %s\n", map_file);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    map = mmap(NULL, sizeof(IsaCovFile), PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "isacov: unable to map %s\n", map_file);
+        map = NULL;
+        return -1;
+    }
+
+    memcpy(map->hdr.magic, ISACOV_MAGIC, sizeof(ISACOV_MAGIC));
+    map->hdr.version = ISACOV_VERSION;
+    map->hdr.n_insns = N_INSNS;
+    map->hdr.n_modes = N_MODES;
+    map->hdr.n_csrs = N_CSRS;
+    map->hdr.names_off = offsetof(IsaCovFile, names);
+    map->hdr.counts_off = offsetof(IsaCovFile, counts);
+    for (i = 0; i < N_INSNS; i++) {
+        g_strlcpy(map->names[i].name, rv_insns[i].name,
+                  sizeof(map->names[i].name));
+        g_strlcpy(map->names[i].class, rv_insns[i].class,
+                  sizeof(map->names[i].class));
+    }
+    return 0;
+}
+
+static void report_regs(GString *report, const char *name,
+                        const uint64_t *regs)
+{
+    int i;
+
+    g_string_append_printf(report, "%s:", name);
+    for (i = 0; i < N_REGS; i++) {
+        g_string_append_printf(report, " x%d=%" PRIu64, i, regs[i]);
+    }
+    g_string_append(report, "\n");
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void *p)
+{
+    g_autoptr(GString) report = g_string_new("");
+    g_autofree Coverage *total = g_new(Coverage, 1);
+    size_t i, covered = 0;
+    int m;
+
+    if (updater) {
+        g_mutex_lock(&update_lock);
+        stopping = true;
+        g_cond_signal(&update_cond);
+        g_mutex_unlock(&update_lock);
+        g_thread_join(updater);
+    }
+    if (map) {
+        update_map();
+        munmap(map, sizeof(IsaCovFile));
+    }
+
+    sum_coverage(total);
+    g_string_append(report, "insn, class, U, S, H, M\n");
+    for (i = 0; i < N_INSNS; i++) {
+        uint64_t *c = total->insns[i];
+
+        if (c[0] || c[1] || c[2] || c[3]) {
+            covered += i < N_INSNS - 1;
+            g_string_append_printf(report, "%s, %s", rv_insns[i].name,
+                                   rv_insns[i].class);
+            for (m = 0; m < N_MODES; m++) {
+                g_string_append_printf(report, ", %" PRIu64, c[m]);
+            }
+            g_string_append(report, "\n");
+        }
+    }
+    g_string_append_printf(report, "covered %zu of %zu instructions\n",
+                           covered, N_INSNS - 1);
+
+    if (verbose) {
+        g_string_append(report, "not covered:");
+        for (i = 0; i < N_INSNS - 1; i++) {
+            uint64_t *c = total->insns[i];
+
+            if (!(c[0] || c[1] || c[2] || c[3])) {
+                g_string_append_printf(report, " %s", rv_insns[i].name);
+            }
+        }
+        g_string_append(report, "\n");
+    }
+
+    g_string_append(report, "csr, U, S, H, M\n");
+    for (i = 0; i < N_CSRS; i++) {
+        uint64_t *c = total->csrs[i];
+
+        if (c[0] || c[1] || c[2] || c[3]) {
+            g_string_append_printf(report, "0x%03zx", i);
+            for (m = 0; m < N_MODES; m++) {
+                g_string_append_printf(report, ", %" PRIu64, c[m]);
+            }
+            g_string_append(report, "\n");
+        }
+    }
+
+    if (count_regs) {
+        report_regs(report, "rd", total->rd);
+        report_regs(report, "rs1", total->rs1);
+        report_regs(report, "rs2", total->rs2);
+    }
+
+    qemu_plugin_outs(report->str);
+    qemu_plugin_scoreboard_free(coverage);
+}
+
+QEMU_PLUGIN_EXPORT
+int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
+                        int argc, char **argv)
+{
+    int i;
+
+    if (strncmp(info->target_name, "riscv", 5) != 0) {
+        fprintf(stderr, "isacov: only RISC-V is supported\n");
+        return -1;
+    }
+
+    for (i = 0; i < argc; i++) {
+        char *opt = argv[i];
+        g_auto(GStrv) tokens = g_strsplit(opt, "=", 2);
+
+        if (g_strcmp0(tokens[0], "regs") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &count_regs)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
+        } else if (g_strcmp0(tokens[0], "verbose") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &verbose)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
+        } else if (g_strcmp0(tokens[0], "mapfile") == 0) {
+            g_free(map_file);
+            map_file = g_strdup(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "interval") == 0) {
+            interval_ms = g_ascii_strtoull(tokens[1], NULL, 10);
+            if (!interval_ms) {
+                fprintf(stderr, "isacov: invalid interval: %s\n", opt);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "option parsing failed: %s\n", opt);
+            return -1;
+        }
+    }
+
+    coverage = qemu_plugin_scoreboard_new(sizeof(Coverage));
+    if (map_file) {
+        if (map_init() < 0) {
+            return -1;
+        }
+        if (info->system_emulation) {
+            updater = g_thread_new("isacov", updater_thread, NULL);
+        }
+    }
+
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+    return 0;
+}
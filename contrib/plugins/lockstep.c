@@ -16,6 +16,14 @@
  * block to end early and a new partial block to start. This means
  * serial only test cases are a better bet. -d nochain may also help.
  *
+ * The instances talk over a Unix socket (sockpath=) - a write/read pair
+ * per block - or over a shared-memory ring (shm=): each instance queues
+ * its states in its half and compares them with the other half when they
+ * arrive, so the instances only wait for each other when one of them gets
+ * a whole window (window=, in blocks) ahead. With regs=on a digest of the
+ * registers is compared too, catching divergences that do not change the
+ * control flow.
+ *
  * This code is not thread safe!
  *
  * Copyright (c) 2020 Linaro Ltd
@@ -28,7 +36,11 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 
 #include <qemu-plugin.h>
@@ -54,17 +66,49 @@ typedef struct {
     unsigned long block_count;
 } ExecInfo;
 
-/* The execution state we compare */
+/* The execution state we compare, the same on both ends */
 typedef struct {
     uint64_t pc;
-    unsigned long insn_count;
+    uint64_t insn_count;
+    uint64_t block_count;
+    /* of the registers at the start of the block, 0 without regs=on */
+    uint64_t digest;
 } ExecState;
 
 typedef struct {
-    GSList *log_pos;
+    uint64_t block_count;
     int distance;
 } DivergeState;
 
+/*
+ * Shared-memory transport: one ring of ExecStates per instance. The
+ * owner advances <head>, the other instance advances <tail> once it has
+ * compared the states. Both are only ever written by one side.
+ */
+#define SHM_MAGIC           0x4c4f434b53544550ULL /* "LOCKSTEP" */
+#define SHM_WAIT_TIMEOUT    (30 * G_TIME_SPAN_SECOND)
+
+typedef struct {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t attached;
+    uint32_t done;
+} ShmRing;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t size;
+    ShmRing ring[2];
+    ExecState states[];     /* ring[0] states, then ring[1] states */
+} ShmArea;
+
+static ShmArea *shm;
+static size_t shm_len;
+static int shm_self;
+static uint64_t shm_window = 4096;
+/* producer head, compared states and the last published compare count */
+static uint64_t shm_head, shm_cmp, shm_published;
+
 /* list of translated block info */
 static GSList *blocks;
 
@@ -75,6 +119,13 @@ static int socket_fd;
 static char *path_to_unlink;
 
 static bool verbose;
+static bool compare_regs;
+/* gave up comparing, waiting for the uninstall */
+static bool stopped;
+
+/* the registers summed up in ExecState.digest */
+static GPtrArray *reg_handles;
+static GByteArray *reg_buf;
 
 static void plugin_cleanup(qemu_plugin_id_t id)
 {
@@ -83,15 +134,37 @@ static void plugin_cleanup(qemu_plugin_id_t id)
     g_slist_free_full(log, &g_free);
     g_slist_free(divergence_log);
 
-    close(socket_fd);
-    if (path_to_unlink) {
-        unlink(path_to_unlink);
+    if (shm) {
+        /* let the other end finish on its own */
+        __atomic_store_n(&shm->ring[shm_self].done, 1, __ATOMIC_RELEASE);
+        munmap(shm, shm_len);
+        shm = NULL;
+        if (path_to_unlink) {
+            shm_unlink(path_to_unlink);
+        }
+    } else {
+        close(socket_fd);
+        if (path_to_unlink) {
+            unlink(path_to_unlink);
+        }
     }
 }
 
+static void shm_drain(void);
+
 static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
-    g_autoptr(GString) out = g_string_new("No divergence :-)\n");
+    g_autoptr(GString) out = NULL;
+
+    /* compare what is still in flight */
+    if (shm && !stopped) {
+        shm_drain();
+    }
+    if (stopped) {
+        return;
+    }
+
+    out = g_string_new(divergence_log ? "" : "No divergence :-)\n");
     g_string_append_printf(out, "Executed %ld/%d blocks\n",
                            bb_count, g_slist_length(log));
     g_string_append_printf(out, "Executed ~%ld instructions\n", insn_count);
@@ -102,7 +175,7 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
 
 static void report_divergance(ExecState *us, ExecState *them)
 {
-    DivergeState divrec = { log, 0 };
+    DivergeState divrec = { us->block_count, 0 };
     g_autoptr(GString) out = g_string_new("");
     bool diverged = false;
 
@@ -112,14 +185,8 @@ static void report_divergance(ExecState *us, ExecState *them)
      */
     if (divergence_log) {
         DivergeState *last = (DivergeState *) divergence_log->data;
-        GSList *entry;
 
-        for (entry = log; g_slist_next(entry); entry = g_slist_next(entry)) {
-            if (entry == last->log_pos) {
-                break;
-            }
-            divrec.distance++;
-        }
+        divrec.distance = us->block_count - last->block_count;
 
         /*
          * If the last two records are so close it is likely we will
@@ -136,9 +203,10 @@ static void report_divergance(ExecState *us, ExecState *them)
     if (verbose || divrec.distance == 1 || diverged) {
         g_string_printf(out,
                         "@ 0x%016" PRIx64 " vs 0x%016" PRIx64
-                        " (%d/%d since last)\n",
+                        " (%d/%d since last)%s\n",
                         us->pc, them->pc, g_slist_length(divergence_log),
-                        divrec.distance);
+                        divrec.distance,
+                        us->pc == them->pc ? " registers differ" : "");
         qemu_plugin_outs(out->str);
     }
 
@@ -148,10 +216,18 @@ static void report_divergance(ExecState *us, ExecState *them)
 
         g_string_printf(out,
                         "Δ insn_count @ 0x%016" PRIx64
-                        " (%ld) vs 0x%016" PRIx64 " (%ld)\n",
+                        " (%" PRIu64 ") vs 0x%016" PRIx64 " (%" PRIu64 ")\n",
                         us->pc, us->insn_count, them->pc, them->insn_count);
 
-        for (entry = log, i = 0;
+        /* with shm= the log may be ahead of the compared state */
+        for (entry = log; entry; entry = g_slist_next(entry)) {
+            ExecInfo *prev = (ExecInfo *) entry->data;
+
+            if (prev->block_count <= us->block_count) {
+                break;
+            }
+        }
+        for (i = 0;
              g_slist_next(entry) && i < 5;
              entry = g_slist_next(entry), i++) {
             ExecInfo *prev = (ExecInfo *) entry->data;
@@ -163,51 +239,211 @@ static void report_divergance(ExecState *us, ExecState *them)
         }
         qemu_plugin_outs(out->str);
         qemu_plugin_outs("too much divergence... giving up.");
+        stopped = true;
         qemu_plugin_uninstall(our_id, plugin_cleanup);
     }
 }
 
-static void vcpu_tb_exec(unsigned int cpu_index, void *udata)
+static void compare_states(ExecState *us, ExecState *them)
 {
-    BlockInfo *bi = (BlockInfo *) udata;
-    ExecState us, them;
-    ssize_t bytes;
-    ExecInfo *exec;
+    if (us->pc != them->pc || us->digest != them->digest) {
+        report_divergance(us, them);
+    }
+}
 
-    us.pc = bi->pc;
-    us.insn_count = insn_count;
+static void stop_shm(const char *why)
+{
+    qemu_plugin_outs(why);
+    stopped = true;
+    qemu_plugin_uninstall(our_id, plugin_cleanup);
+}
+
+/* Compares the states both ends have queued, returns false once stopped. */
+static bool shm_compare(void)
+{
+    ExecState *ours = &shm->states[shm_self * shm->size];
+    ExecState *theirs = &shm->states[!shm_self * shm->size];
+    uint64_t their_head;
+
+    their_head = __atomic_load_n(&shm->ring[!shm_self].head, __ATOMIC_ACQUIRE);
+    while (shm_cmp < shm_head && shm_cmp < their_head && !stopped) {
+        uint64_t i = shm_cmp & (shm->size - 1);
+
+        compare_states(&ours[i], &theirs[i]);
+        shm_cmp++;
+    }
+    return !stopped;
+}
+
+/* Lets the other end reuse the slots of the compared states. */
+static void shm_publish(void)
+{
+    __atomic_store_n(&shm->ring[!shm_self].tail, shm_cmp, __ATOMIC_RELEASE);
+    shm_published = shm_cmp;
+}
+
+/*
+ * Waits until the other end moves *WHAT on from SEEN. Returns why it
+ * did not if it is gone or stalled.
+ */
+static const char *shm_wait(uint64_t *what, uint64_t seen, gint64 *deadline)
+{
+    ShmRing *peer = &shm->ring[!shm_self];
+    int spins;
+
+    shm_publish();
+    if (!*deadline) {
+        *deadline = g_get_monotonic_time() + SHM_WAIT_TIMEOUT;
+    }
+    for (spins = 0; __atomic_load_n(what, __ATOMIC_ACQUIRE) == seen;
+         spins++) {
+        if (spins < 1000) {
+            continue;
+        }
+        if (__atomic_load_n(&peer->done, __ATOMIC_ACQUIRE)) {
+            return "other end finished first, stopped comparing\n";
+        }
+        /* the first instance waits for the second one to start */
+        if (__atomic_load_n(&peer->attached, __ATOMIC_ACQUIRE) &&
+            g_get_monotonic_time() > *deadline) {
+            return "other end stalled, stopped comparing\n";
+        }
+        g_thread_yield();
+    }
+    return NULL;
+}
+
+static void shm_exchange(ExecState *us)
+{
+    ShmRing *mine = &shm->ring[shm_self];
+    gint64 deadline = 0;
+    const char *why;
+    uint64_t tail;
+
+    /*
+     * A slot is reused once both ends compared its state, i.e. this end
+     * is at most a window ahead of the other one.
+     */
+    for (;;) {
+        if (!shm_compare()) {
+            return;
+        }
+        tail = __atomic_load_n(&mine->tail, __ATOMIC_ACQUIRE);
+        if (shm_head - tail < shm->size && shm_head - shm_cmp < shm->size) {
+            break;
+        }
+        if (shm_head - tail >= shm->size) {
+            why = shm_wait(&mine->tail, tail, &deadline);
+        } else {
+            why = shm_wait(&shm->ring[!shm_self].head, shm_cmp, &deadline);
+        }
+        if (why) {
+            stop_shm(why);
+            return;
+        }
+    }
+
+    shm->states[shm_self * shm->size + (shm_head & (shm->size - 1))] = *us;
+    __atomic_store_n(&mine->head, ++shm_head, __ATOMIC_RELEASE);
+
+    if (shm_compare() && shm_cmp - shm_published >= shm->size / 4) {
+        shm_publish();
+    }
+}
+
+/* Compares the states left at exit. */
+static void shm_drain(void)
+{
+    gint64 deadline = 0;
+    const char *why;
+
+    __atomic_store_n(&shm->ring[shm_self].done, 1, __ATOMIC_RELEASE);
+    while (shm_compare() && shm_cmp < shm_head) {
+        /* all of theirs are compared, wait for more */
+        why = shm_wait(&shm->ring[!shm_self].head, shm_cmp, &deadline);
+        if (why) {
+            qemu_plugin_outs(why);
+            break;
+        }
+    }
+    shm_publish();
+}
+
+static bool socket_exchange(ExecState *us, ExecState *them)
+{
+    ssize_t bytes;
 
     /*
      * Write our current position to the other end. If we fail the
      * other end has probably died and we should shut down gracefully.
      */
-    bytes = write(socket_fd, &us, sizeof(ExecState));
+    bytes = write(socket_fd, us, sizeof(ExecState));
     if (bytes < sizeof(ExecState)) {
         qemu_plugin_outs(bytes < 0 ?
                          "problem writing to socket" :
                          "wrote less than expected to socket");
         qemu_plugin_uninstall(our_id, plugin_cleanup);
-        return;
+        return false;
     }
 
     /*
      * Now read where our peer has reached. Again a failure probably
      * indicates the other end died and we should close down cleanly.
      */
-    bytes = read(socket_fd, &them, sizeof(ExecState));
+    bytes = read(socket_fd, them, sizeof(ExecState));
     if (bytes < sizeof(ExecState)) {
         qemu_plugin_outs(bytes < 0 ?
                          "problem reading from socket" :
                          "read less than expected");
         qemu_plugin_uninstall(our_id, plugin_cleanup);
+        return false;
+    }
+    return true;
+}
+
+/* FNV-1a over the register values */
+static uint64_t regs_digest(void)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    guint i;
+
+    g_byte_array_set_size(reg_buf, 0);
+    qemu_plugin_read_registers(
+        (struct qemu_plugin_register *const *)reg_handles->pdata,
+        reg_handles->len, reg_buf);
+    for (i = 0; i < reg_buf->len; i++) {
+        hash = (hash ^ reg_buf->data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void vcpu_tb_exec(unsigned int cpu_index, void *udata)
+{
+    BlockInfo *bi = (BlockInfo *) udata;
+    ExecState us = { 0 }, them;
+    ExecInfo *exec;
+
+    if (stopped) {
         return;
     }
 
-    /*
-     * Compare and report if we have diverged.
-     */
-    if (us.pc != them.pc) {
-        report_divergance(&us, &them);
+    us.pc = bi->pc;
+    us.insn_count = insn_count;
+    us.block_count = bb_count;
+    if (compare_regs) {
+        us.digest = regs_digest();
+    }
+
+    if (shm) {
+        /* compared later, when the other end gets there */
+        shm_exchange(&us);
+    } else if (socket_exchange(&us, &them)) {
+        /*
+         * Compare and report if we have diverged.
+         */
+        compare_states(&us, &them);
+    } else {
+        return;
     }
 
     /*
@@ -232,9 +468,38 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
     /* save a reference so we can free later */
     blocks = g_slist_prepend(blocks, bi);
     qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec,
+                                         compare_regs ?
+                                         QEMU_PLUGIN_CB_R_REGS :
                                          QEMU_PLUGIN_CB_NO_REGS, (void *)bi);
 }
 
+/* The registers of the first (core) feature, except for the lagging PC. */
+static void vcpu_init(qemu_plugin_id_t id, unsigned int cpu_index)
+{
+    g_autoptr(GArray) regs = NULL;
+    const char *feature = NULL;
+    guint i;
+
+    if (reg_handles) {
+        return;
+    }
+    regs = qemu_plugin_get_registers();
+    reg_handles = g_ptr_array_new();
+    reg_buf = g_byte_array_new();
+    for (i = 0; i < regs->len; i++) {
+        qemu_plugin_reg_descriptor *rd =
+            &g_array_index(regs, qemu_plugin_reg_descriptor, i);
+
+        if (i == 0) {
+            feature = rd->feature;
+        }
+        if (g_strcmp0(rd->feature, feature) == 0 &&
+            g_strcmp0(rd->name, "pc") != 0) {
+            g_ptr_array_add(reg_handles, rd->handle);
+        }
+    }
+}
+
 
 /*
  * Instead of encoding master/slave status into what is essentially
@@ -327,6 +592,80 @@ static bool setup_unix_socket(const char *path)
     }
 }
 
+/*
+ * Same approach as with the socket: whoever creates the shared memory
+ * object is the first instance and sizes the rings, the second one
+ * attaches to it and removes the name.
+ */
+static bool setup_shm(const char *name)
+{
+    size_t hdr_len = sizeof(ShmArea);
+    struct stat st;
+    ShmArea *hdr;
+    int fd;
+
+    shm_len = hdr_len + 2 * shm_window * sizeof(ExecState);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        if (ftruncate(fd, shm_len) < 0) {
+            perror("size shared memory");
+            close(fd);
+            shm_unlink(name);
+            return false;
+        }
+        shm = mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shm == MAP_FAILED) {
+            perror("map shared memory");
+            shm = NULL;
+            shm_unlink(name);
+            return false;
+        }
+        /* remember to clean-up if nobody attaches */
+        path_to_unlink = g_strdup(name);
+        shm_self = 0;
+        shm->size = shm_window;
+        shm->ring[0].attached = 1;
+        __atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+        qemu_plugin_outs("setup_shm::ready\n");
+        return true;
+    }
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("open shared memory");
+        return false;
+    }
+    /* the first instance may still be setting it up */
+    while (fstat(fd, &st) == 0 && st.st_size < hdr_len) {
+        g_usleep(1000);
+    }
+    hdr = mmap(NULL, hdr_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("map shared memory");
+        close(fd);
+        return false;
+    }
+    while (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        g_usleep(1000);
+    }
+    shm_len = hdr_len + 2 * hdr->size * sizeof(ExecState);
+    munmap(hdr, hdr_len);
+
+    shm = mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("map shared memory");
+        shm = NULL;
+        return false;
+    }
+    shm_unlink(name);
+    shm_self = 1;
+    __atomic_store_n(&shm->ring[1].attached, 1, __ATOMIC_RELEASE);
+    qemu_plugin_outs("connect_shm::ready\n");
+    return true;
+}
+
 
 QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
                                            const qemu_info_t *info,
@@ -334,6 +673,7 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
 {
     int i;
     g_autofree char *sock_path = NULL;
+    g_autofree char *shm_name = NULL;
 
     for (i = 0; i < argc; i++) {
         char *p = argv[i];
@@ -344,26 +684,49 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
                 fprintf(stderr, "boolean argument parsing failed: %s\n", p);
                 return -1;
             }
+        } else if (g_strcmp0(tokens[0], "regs") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &compare_regs)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", p);
+                return -1;
+            }
         } else if (g_strcmp0(tokens[0], "sockpath") == 0) {
-            sock_path = tokens[1];
+            sock_path = g_strdup(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "shm") == 0) {
+            shm_name = g_strdup(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "window") == 0) {
+            shm_window = g_ascii_strtoull(tokens[1], NULL, 10);
+            if (shm_window < 4 || shm_window > (1 << 24)) {
+                fprintf(stderr, "window out of range: %s\n", p);
+                return -1;
+            }
+            /* rounded down to a power of 2, the ring indexes are masked */
+            while (shm_window & (shm_window - 1)) {
+                shm_window &= shm_window - 1;
+            }
         } else {
             fprintf(stderr, "option parsing failed: %s\n", p);
             return -1;
         }
     }
 
-    if (sock_path == NULL) {
+    if (shm_name) {
+        if (!setup_shm(shm_name)) {
+            fprintf(stderr, "Failed to setup shared memory.\n");
+            return -1;
+        }
+    } else if (sock_path == NULL) {
         fprintf(stderr, "Need a socket path to talk to other instance.\n");
         return -1;
-    }
-
-    if (!setup_unix_socket(sock_path)) {
+    } else if (!setup_unix_socket(sock_path)) {
         fprintf(stderr, "Failed to setup socket for communications.\n");
         return -1;
     }
 
     our_id = id;
 
+    if (compare_regs) {
+        qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    }
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
     return 0;
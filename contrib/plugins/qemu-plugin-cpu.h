@@ -1,3 +0,0 @@
-#include "osdep.h"
-#include "hw/core/cpu.h"
-#include "cpu.h" // RISC-V target, from targrt/riscv
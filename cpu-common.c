@@ -25,6 +25,7 @@
 #include "qemu/lockable.h"
 
 #include "qemu/log.h"
+#include "qemu/logim.h"
 
 #include "trace/trace-root.h"
 
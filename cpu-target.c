@@ -246,6 +246,7 @@ void cpu_exec_initfn(CPUState *cpu)
     cpu->cosim_mode = false;
     cpu->cosim_data = NULL;
     cpu->cosim_singlestep = 0;
+    cpu->cosim_budget = 0;
 
 #ifndef CONFIG_USER_ONLY
     cpu->thread_id = qemu_get_thread_id();
@@ -39,6 +39,8 @@
 #endif
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY gdb
+#include "qemu/logim.h"
 
 #include "sysemu/hw_accel.h"
 #include "sysemu/runstate.h"
@@ -422,7 +424,7 @@ static const char *get_feature_xml(const char *p, const char **newp,
     return NULL;
 }
 
-static int gdb_read_register(CPUState *cpu, GByteArray *buf, int reg)
+int gdb_read_register(CPUState *cpu, GByteArray *buf, int reg)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
     CPUArchState *env = cpu_env(cpu);
@@ -460,6 +462,103 @@ static int gdb_write_register(CPUState *cpu, uint8_t *mem_buf, int reg)
     return 0;
 }
 
+/*
+ * The XML description of a register feature: dynamically generated
+ * by the target or one of the encoded gdb-xml/ files.
+ */
+static const char *gdb_find_feature_xml(CPUState *cpu, const char *xmlname)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+
+    if (cc->gdb_get_dynamic_xml) {
+        const char *xml = cc->gdb_get_dynamic_xml(cpu, xmlname);
+        if (xml) {
+            return xml;
+        }
+    }
+    for (int i = 0; gdb_static_features[i].xmlname; i++) {
+        if (strcmp(gdb_static_features[i].xmlname, xmlname) == 0) {
+            return gdb_static_features[i].xml;
+        }
+    }
+    return NULL;
+}
+
+/* The value of ATTR="..." within TAG or NULL. */
+static char *gdb_xml_attr(const char *tag, const char *attr)
+{
+    g_autofree char *key = g_strdup_printf(" %s=\"", attr);
+    const char *p = strstr(tag, key), *end;
+
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(key);
+    end = strchr(p, '"');
+    return end ? g_strndup(p, end - p) : NULL;
+}
+
+/*
+ * Appends the <reg> elements of the feature XML. Registers are numbered
+ * from BASE_REG in document order unless they carry a regnum attribute;
+ * only the BASE_REG .. BASE_REG + NUM_REGS - 1 range is accessible.
+ */
+static void gdb_append_feature_regs(GArray *regs, const char *xml,
+                                    int base_reg, int num_regs)
+{
+    const char *p = strstr(xml, "<feature");
+    g_autofree char *feature = p ? gdb_xml_attr(p, "name") : NULL;
+    int next = base_reg;
+
+    p = xml;
+    while ((p = strstr(p, "<reg ")) != NULL) {
+        const char *end = strchr(p, '>');
+        g_autofree char *tag = g_strndup(p, end ? end - p : strlen(p));
+        g_autofree char *name = gdb_xml_attr(tag, "name");
+        g_autofree char *bitsize = gdb_xml_attr(tag, "bitsize");
+        g_autofree char *regnum = gdb_xml_attr(tag, "regnum");
+        GDBRegDesc desc;
+
+        desc.gdb_reg = regnum ? atoi(regnum) : next;
+        next = desc.gdb_reg + 1;
+        p += strlen(tag);
+
+        if (name == NULL || desc.gdb_reg < base_reg ||
+            desc.gdb_reg >= base_reg + num_regs) {
+            continue;
+        }
+        desc.name = g_intern_string(name);
+        desc.feature_name = feature ? g_intern_string(feature) : NULL;
+        desc.size = bitsize ? atoi(bitsize) / 8 : 0;
+        g_array_append_val(regs, desc);
+    }
+}
+
+GArray *gdb_get_register_list(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    GArray *regs = g_array_new(false, false, sizeof(GDBRegDesc));
+    const char *xml;
+
+    if (cc->gdb_core_xml_file) {
+        xml = gdb_find_feature_xml(cpu, cc->gdb_core_xml_file);
+        if (xml) {
+            gdb_append_feature_regs(regs, xml, 0, cc->gdb_num_core_regs);
+        }
+    }
+
+    for (guint i = 0; cpu->gdb_regs && i < cpu->gdb_regs->len; i++) {
+        GDBRegisterState *r = &g_array_index(cpu->gdb_regs,
+                                             GDBRegisterState, i);
+
+        xml = gdb_find_feature_xml(cpu, r->xml);
+        if (xml) {
+            gdb_append_feature_regs(regs, xml, r->base_reg, r->num_regs);
+        }
+    }
+    return regs;
+}
+
 void gdb_register_coprocessor(CPUState *cpu,
                               gdb_get_reg_cb get_reg, gdb_set_reg_cb set_reg,
                               int num_regs, const char *xml, int g_pos)
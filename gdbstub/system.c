@@ -31,6 +31,8 @@
 #include "internals.h"
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY gdb
+#include "qemu/logim.h"
 
 /* System emulation specific state */
 typedef struct {
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu/accel.h"
 #include "qemu/log.h"
+#include "qemu/logim.h"
 
 #include "sysemu/replay.h"
 #include "hw/boards.h"
@@ -0,0 +1,145 @@
+/*
+ * COSIM: shared-memory ring of RVFI retirement records
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef COSIM_RING_H
+#define COSIM_RING_H
+
+#include <stdint.h>
+#include "cosim-rvfi.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+//
+// Single-producer/single-consumer ring living in a memfd segment
+// (see QEMU_ring_open()). QEMU CPU thread is the producer, the
+// testbench (DPI side, same or another process) is the consumer.
+//
+// Segment layout: cosim_ring_t header followed by <nrec> st_rvfi_t
+// records at <rec_offset>. <head> and <tail> are free running counters,
+// record i lives in slot (i & (nrec - 1)).
+//
+// The producer fills a slot and publishes it with a release store of
+// <head>, the consumer reads the slot after an acquire load of <head>
+// and frees it with a release store of <tail>. Nothing is locked on
+// the per-instruction path. QEMU never runs more than <nrec>
+// instructions ahead of the consumer - it stops when the ring is full.
+//
+// <head_seq>/<tail_seq> are futex words for the optional sleep:
+// a side which is going to sleep sets its *_wait flag, the other side
+// bumps the sequence and wakes it up.
+//
+#define COSIM_RING_MAGIC      0x474e4952u     /* "RING" */
+#define COSIM_RING_VERSION    1
+#define COSIM_RING_CACHELINE  64
+
+typedef struct {
+   /* constant after QEMU_ring_open() */
+   uint32_t                 magic;
+   uint32_t                 version;
+   uint32_t                 nrec;
+   uint32_t                 rec_size;
+   uint64_t                 rec_offset;
+   uint8_t                  pad0[COSIM_RING_CACHELINE - 24];
+
+   /* written by QEMU */
+   uint64_t                 head;
+   uint32_t                 head_seq;
+   uint32_t                 prod_wait;
+   uint32_t                 done;        /* QEMU_ring_run() budget is used up */
+   uint8_t                  pad1[COSIM_RING_CACHELINE - 20];
+
+   /* written by the testbench */
+   uint64_t                 tail;
+   uint32_t                 tail_seq;
+   uint32_t                 cons_wait;
+   uint8_t                  pad2[COSIM_RING_CACHELINE - 16];
+} cosim_ring_t;
+
+static inline st_rvfi_t *cosim_ring_records(cosim_ring_t *ring)
+{
+    return (st_rvfi_t *)((char *)ring + ring->rec_offset);
+}
+
+static inline void cosim_ring_futex_wake(uint32_t *word)
+{
+#ifdef __linux__
+    syscall(__NR_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+//
+// Consumer side. The functions below are self-contained so that
+// the testbench can use them without any QEMU header.
+//
+
+/*
+ * Returns the oldest published record or NULL if the ring is empty.
+ * The record stays valid until cosim_ring_consume().
+ */
+static inline st_rvfi_t *cosim_ring_peek(cosim_ring_t *ring)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return NULL;
+    }
+    return &cosim_ring_records(ring)[tail & (ring->nrec - 1)];
+}
+
+/*
+ * Frees the oldest record and wakes QEMU up if it waits for space.
+ */
+static inline void cosim_ring_consume(cosim_ring_t *ring)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->prod_wait, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&ring->tail_seq, 1, __ATOMIC_RELEASE);
+        cosim_ring_futex_wake(&ring->tail_seq);
+    }
+}
+
+/*
+ * Blocks until a record is published or the run is done.
+ * Returns the record or NULL when the ring is empty and QEMU is done.
+ */
+static inline st_rvfi_t *cosim_ring_wait(cosim_ring_t *ring)
+{
+    st_rvfi_t *rec;
+
+    while ((rec = cosim_ring_peek(ring)) == NULL) {
+        uint32_t seq;
+
+        if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE)) {
+            /* records published before <done> are visible now */
+            return cosim_ring_peek(ring);
+        }
+
+        __atomic_store_n(&ring->cons_wait, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&ring->head_seq, __ATOMIC_ACQUIRE);
+        if (cosim_ring_peek(ring) == NULL &&
+            !__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE)) {
+#ifdef __linux__
+            syscall(__NR_futex, &ring->head_seq, FUTEX_WAIT, seq,
+                    NULL, NULL, 0);
+#else
+            (void)seq;
+#endif
+        }
+        __atomic_store_n(&ring->cons_wait, 0, __ATOMIC_RELAXED);
+    }
+    return rec;
+}
+
+#endif /* COSIM_RING_H */
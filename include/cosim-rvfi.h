@@ -0,0 +1,63 @@
+/*
+ * COSIM: RVFI retirement record
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef COSIM_RVFI_H
+#define COSIM_RVFI_H
+
+#include <stdint.h>
+
+//
+// st_rvfi_t must match the System Verilog CPU state description.
+// One record is produced per retired instruction (see QEMU_step_batch()).
+//
+typedef struct {
+   uint64_t                 nret_id;
+   uint64_t                 cycle_cnt;
+   uint64_t                 order;
+   uint64_t                 insn;
+   uint8_t                  trap;
+   uint64_t                 cause;
+   uint8_t                  halt;
+   uint8_t                  intr;
+   uint32_t                 mode;
+   uint32_t                 ixl;
+   uint32_t                 dbg;
+   uint32_t                 dbg_mode;
+   uint64_t                 nmip;
+
+   uint64_t                 insn_interrupt;
+   uint64_t                 insn_interrupt_id;
+   uint64_t                 insn_bus_fault;
+   uint64_t                 insn_nmi_store_fault;
+   uint64_t                 insn_nmi_load_fault;
+
+   uint64_t                 pc_rdata;
+   uint64_t                 pc_wdata;
+
+   uint64_t                 rs1_addr;
+   uint64_t                 rs1_rdata;
+
+   uint64_t                 rs2_addr;
+   uint64_t                 rs2_rdata;
+
+   uint64_t                 rs3_addr;
+   uint64_t                 rs3_rdata;
+
+   uint64_t                 rd1_addr;
+   uint64_t                 rd1_wdata;
+
+   uint64_t                 rd2_addr;
+   uint64_t                 rd2_wdata;
+
+   uint64_t                 mem_addr;
+   uint64_t                 mem_rdata;
+   uint64_t                 mem_rmask;
+   uint64_t                 mem_wdata;
+   uint64_t                 mem_wmask;
+
+} st_rvfi_t;
+
+#endif /* COSIM_RVFI_H */
@@ -0,0 +1,46 @@
+/*
+ * COSIM: run-ahead checkpoint and rollback
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef EXEC_COSIM_CHECKPOINT_H
+#define EXEC_COSIM_CHECKPOINT_H
+
+#include "exec/cpu-common.h"
+
+/* true while guest RAM writes are logged for rollback */
+extern bool cosim_undo_active;
+
+/*
+ * Saves the page containing RAM_ADDR into the undo log before its first
+ * write since the checkpoint. Called from the TLB notdirty path and by
+ * any code which writes guest RAM behind the TLB's back.
+ */
+void cosim_undo_log_page(ram_addr_t ram_addr);
+
+static inline void cosim_undo_log(ram_addr_t ram_addr)
+{
+    if (unlikely(cosim_undo_active)) {
+        cosim_undo_log_page(ram_addr);
+    }
+}
+
+/*
+ * Takes a checkpoint of CPU at the current instruction boundary:
+ * architectural state via TCGCPUOps.cosim_save_state, guest RAM by
+ * an undo log of the pages written from now on.
+ * The BQL must be held and the vCPU must be stopped.
+ */
+bool cosim_checkpoint_take(CPUState *cpu);
+
+/*
+ * Rolls CPU and guest RAM back to the last checkpoint, which stays
+ * valid. Device state is not rolled back.
+ * The BQL must be held and the vCPU must be stopped.
+ */
+bool cosim_checkpoint_restore(CPUState *cpu);
+
+void cosim_checkpoint_drop(void);
+
+#endif /* EXEC_COSIM_CHECKPOINT_H */
@@ -33,6 +33,39 @@ void gdb_register_coprocessor(CPUState *cpu,
                               gdb_get_reg_cb get_reg, gdb_set_reg_cb set_reg,
                               int num_regs, const char *xml, int g_pos);
 
+/**
+ * typedef GDBRegDesc - a register described by the gdb-xml features
+ * @gdb_reg: register number in gdb numbering
+ * @size: size in bytes (0 if the description has no bitsize)
+ * @name: register name (interned string)
+ * @feature_name: name of the feature the register belongs to (interned)
+ */
+typedef struct {
+    int gdb_reg;
+    int size;
+    const char *name;
+    const char *feature_name;
+} GDBRegDesc;
+
+/**
+ * gdb_get_register_list() - the registers of a CPU
+ * @cpu - the CPU
+ *
+ * Returns a GArray of GDBRegDesc for the core and coprocessor registers
+ * of @cpu, the caller frees it with g_array_free().
+ */
+GArray *gdb_get_register_list(CPUState *cpu);
+
+/**
+ * gdb_read_register() - read a register
+ * @cpu - the CPU
+ * @buf - the register value is appended in target byte order
+ * @reg - register number in gdb numbering
+ *
+ * Returns the size of the register, 0 if there is no such register.
+ */
+int gdb_read_register(CPUState *cpu, GByteArray *buf, int reg);
+
 /**
  * gdbserver_start: start the gdb server
  * @port_or_device: connection spec for gdb
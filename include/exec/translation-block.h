@@ -78,6 +78,8 @@ struct TranslationBlock {
 #define CF_PARALLEL      0x00080000 /* Generate code for a parallel context */
 #define CF_NOIRQ         0x00100000 /* Generate an uninterruptible TB */
 #define CF_PCREL         0x00200000 /* Opcodes in TB are PC-relative */
+#define CF_COSIM_COUNT   0x00400000 /* COSIM: count insns in icount_decr */
+#define CF_COSIM_RVFI    0x00800000 /* COSIM: capture the RVFI record */
 #define CF_CLUSTER_MASK  0xff000000 /* Top 8 bits are cluster ID */
 #define CF_CLUSTER_SHIFT 24
 
@@ -89,6 +91,19 @@ struct TranslationBlock {
     uint16_t size;
     uint16_t icount;
 
+    /*
+     * Tiered translation: a first-tier TB is translated without the TCG
+     * optimizer and counts down here each time it is entered.  Once below
+     * zero it exits to the main loop, which retranslates it fully
+     * optimised.  TB_TIER_FULL for the fully optimised TBs.  The count
+     * is not updated atomically and is only a hint.
+     * tier_taken counts the taken conditional branches at its end, which
+     * tell the retranslation whether to continue past them.
+     */
+    int32_t tier_count;
+    uint32_t tier_taken;
+#define TB_TIER_FULL     INT32_MAX
+
     struct tb_tc tc;
 
     /*
@@ -74,6 +74,10 @@ typedef enum DisasJumpType {
  * @singlestep_enabled: "Hardware" single stepping enabled.
  * @saved_can_do_io: Known value of cpu->neg.can_do_io, or -1 for unknown.
  * @plugin_enabled: TCG plugin enabled in this TB.
+ * @trace_start: Address of the guest basic block being translated, once
+ *               translation continued past a conditional branch.
+ * @trace_exits: Conditional branches translation may still continue past.
+ * @trace_head: Label at the first instruction, for the branches closing a loop.
  *
  * Architecture-agnostic disassembly context.
  */
@@ -88,6 +92,9 @@ typedef struct DisasContextBase {
     int8_t saved_can_do_io;
     bool plugin_enabled;
     void *host_addr[2];
+    vaddr trace_start;
+    int trace_exits;
+    struct TCGLabel *trace_head;
 } DisasContextBase;
 
 /**
@@ -169,6 +176,56 @@ bool translator_use_goto_tb(DisasContextBase *db, vaddr dest);
  */
 bool translator_io_start(DisasContextBase *db);
 
+/**
+ * translator_trace_branch
+ * @db: Disassembly context
+ * @next: pc of the instruction following the current conditional branch
+ *
+ * Return true if the fall-through of the branch was hot in the first-tier
+ * translation, and translation should continue at @next.  The taken path
+ * must then leave the TB without goto_tb, which stays available for the
+ * end of the TB: through tcg_gen_lookup_and_goto_ptr() or an exception.
+ * It should be emitted out of line, after the end of the TB, so that
+ * the trace goes on in the fall-through of the branch and is one
+ * extended basic block for the optimizer and the register allocator.
+ * At most TRANSLATOR_TRACE_MAX_EXITS branches are continued past.
+ */
+bool translator_trace_branch(DisasContextBase *db, vaddr next);
+
+#define TRANSLATOR_TRACE_MAX_EXITS 4
+
+/**
+ * translator_trace_loop
+ * @db: Disassembly context
+ * @next: pc of the instruction following the current conditional branch
+ * @dest: pc the branch jumps to when taken
+ *
+ * Return true if @dest is the start of the TB and the branch was mostly
+ * taken in the first-tier translation.  The taken path then closes a
+ * loop within the TB with translator_goto_trace_head(), which keeps the
+ * TB covering one range of guest code.
+ */
+bool translator_trace_loop(DisasContextBase *db, vaddr next, vaddr dest);
+
+/**
+ * translator_goto_trace_head
+ * @db: Disassembly context
+ *
+ * Branch back to the first instruction of the TB, or leave it as
+ * requested by an interrupt or exit request.  The front end must first
+ * update the pc to the start of the TB, as for a goto_tb.
+ */
+void translator_goto_trace_head(DisasContextBase *db);
+
+/**
+ * translator_branch_taken
+ * @db: Disassembly context
+ *
+ * Emit, for first-tier TBs, the profiling of the taken path of the
+ * conditional branch that ends the TB.  See translator_trace_branch().
+ */
+void translator_branch_taken(DisasContextBase *db);
+
 /*
  * Translator Load Functions
  *
@@ -480,6 +480,8 @@ struct CPUState {
     bool cosim_mode;
     void *cosim_data;
     int   cosim_singlestep;
+    /* step instructions beyond icount_decr.u16.low (see cpu_cosim_set_budget) */
+    uint64_t cosim_budget;
     ////////////////////////////
 
     /* Should CPU start in powered-off state? */
@@ -585,6 +587,25 @@ struct CPUState {
 QEMU_BUILD_BUG_ON(offsetof(CPUState, neg) !=
                   sizeof(CPUState) - sizeof(CPUNegativeOffsetState));
 
+/*
+ * COSIM: the step budget is the number of instructions left in the current
+ * step. Up to 0xffff of them are loaded into icount_decr.u16.low which the
+ * CF_COSIM_COUNT TBs count down (as with icount), the rest is kept in
+ * cosim_budget. EXCP_COSIM is raised when the budget is used up.
+ */
+static inline void cpu_cosim_set_budget(CPUState *cpu, uint64_t n)
+{
+    uint64_t low = n < 0xffff ? n : 0xffff;
+
+    cpu->neg.icount_decr.u16.low = low;
+    cpu->cosim_budget = n - low;
+}
+
+static inline uint64_t cpu_cosim_budget_left(CPUState *cpu)
+{
+    return cpu->neg.icount_decr.u16.low + cpu->cosim_budget;
+}
+
 static inline CPUArchState *cpu_env(CPUState *cpu)
 {
     /* We validate that CPUArchState follows CPUState in cpu-all.h. */
@@ -11,6 +11,7 @@
 #define TCG_CPU_OPS_H
 
 #include "hw/core/cpu.h"
+#include "cosim-rvfi.h"
 
 struct TCGCPUOps {
     /**
@@ -48,6 +49,34 @@ struct TCGCPUOps {
     void (*cpu_exec_exit)(CPUState *cpu);
     /** @debug_excp_handler: Callback for handling debug exceptions */
     void (*debug_excp_handler)(CPUState *cpu);
+    /**
+     * @cosim_insn_start: Prepare the RVFI record of the next instruction
+     *
+     * Called in COSIM mode before the next instruction is executed
+     * when the retirement records are collected.
+     */
+    void (*cosim_insn_start)(CPUState *cpu);
+    /**
+     * @cosim_retire: Fill the RVFI record of the retired instruction
+     *
+     * Called in COSIM mode after an instruction has been executed
+     * (or has trapped) when the retirement records are collected.
+     * @rec is zeroed; trap/cause/order are filled by the caller.
+     */
+    void (*cosim_retire)(CPUState *cpu, st_rvfi_t *rec);
+    /**
+     * @cosim_save_state: Copy the architectural state for a checkpoint
+     *
+     * Returns a g_malloc'ed blob which @cosim_load_state accepts.
+     * Guest memory is not included, it is covered by the undo log.
+     */
+    void *(*cosim_save_state)(CPUState *cpu);
+    /**
+     * @cosim_load_state: Roll the architectural state back to a checkpoint
+     *
+     * Called with the BQL held while the vCPU is stopped.
+     */
+    void (*cosim_load_state)(CPUState *cpu, const void *state);
 
 #ifdef NEED_CPU_H
 #if defined(CONFIG_USER_ONLY) && defined(TARGET_I386)
@@ -0,0 +1,133 @@
+/*
+ * libqemu: QEMU as a library for co-simulation testbenches
+ *
+ * Built as libqemu-<target>.so/.a (a riscv64-lib-softmmu build).
+ * The testbench links the library in (Verilator/VCS DPI binary) instead of
+ * dlopen()ing qemu-system-riscv64.so and looking up its entry points.
+ * All calls go through the libqemu_t handle returned by libqemu_create().
+ *
+ * QEMU keeps its machine, accelerator and main loop in process globals,
+ * so there is one instance per process: libqemu_create() fails while an
+ * instance exists or after one was destroyed.
+ *
+ * Threading: libqemu_step()/libqemu_run() and the accessors are called
+ * from one testbench thread per hart, the accessors only while the hart
+ * is not being stepped. The retire callback runs on the stepping thread.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef LIBQEMU_H
+#define LIBQEMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cosim-rvfi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The major version changes on incompatible changes of this header,
+ * the minor one when something is added.
+ */
+#define LIBQEMU_VERSION_MAJOR   1
+#define LIBQEMU_VERSION_MINOR   0
+#define LIBQEMU_VERSION         ((LIBQEMU_VERSION_MAJOR << 16) | LIBQEMU_VERSION_MINOR)
+
+typedef struct libqemu libqemu_t;
+
+typedef enum {
+    /* CPU thread(s) stepped via the main loop, MTTCG with several harts */
+    LIBQEMU_MODE_LOCKSTEP = 1,
+    /* harts run inline on the stepping thread, single threaded TCG */
+    LIBQEMU_MODE_DIRECT   = 2,
+} libqemu_mode_t;
+
+/*
+ * Zero-initialized fields take the defaults.
+ */
+typedef struct {
+    uint32_t            version;    /* LIBQEMU_VERSION */
+    libqemu_mode_t      mode;       /* default LOCKSTEP */
+    const char*         machine;    /* default "virt" */
+    const char*         cpu;        /* default - the machine's one */
+    uint64_t            ram_mb;     /* default - the machine's size */
+    int                 harts;      /* default 1 */
+    const char*         bios;       /* default "none", see libqemu_load_elf() */
+    const char* const*  extra_args; /* NULL terminated QEMU options or NULL */
+} libqemu_config_t;
+
+/*
+ * Called for every instruction retired (or trapped) by libqemu_step().
+ */
+typedef void (*libqemu_retire_cb_t)(void *opaque, int hart, const st_rvfi_t *rec);
+
+/* GDB core register numbers: x0..x31 are 0..31 */
+#define LIBQEMU_REG_PC  32
+
+/* LIBQEMU_VERSION of the library */
+uint32_t libqemu_version(void);
+
+/*
+ * Starts QEMU and returns when the harts can be stepped.
+ * Returns NULL if the major version of CFG does not match, an instance
+ * already exists or QEMU's main loop ends before the harts are up.
+ * Note that QEMU exit()s on a bad command line (machine, cpu, extra_args).
+ */
+libqemu_t *libqemu_create(const libqemu_config_t *cfg);
+
+/* Shuts QEMU down and frees the handle. */
+void libqemu_destroy(libqemu_t *q);
+
+/*
+ * Loads an ELF image into guest memory and points every hart at its entry.
+ * Call before the first step. The entry is returned via ENTRY (may be NULL).
+ * Returns 0 on success, -1 on failure.
+ */
+int libqemu_load_elf(libqemu_t *q, const char *path, uint64_t *entry);
+
+int libqemu_num_harts(libqemu_t *q);
+
+/*
+ * Executes up to N instructions of HART, calling the retire callback
+ * (if any) for each of them. Returns the number of instructions executed,
+ * 0 when QEMU is gone.
+ */
+uint64_t libqemu_step(libqemu_t *q, int hart, uint64_t n);
+
+/*
+ * Same as libqemu_step() without the retire callback - the fast path
+ * for free runs.
+ */
+uint64_t libqemu_run(libqemu_t *q, int hart, uint64_t n);
+
+/*
+ * Executes up to MAX instructions of HART and fills one RVFI record per
+ * instruction into BUF. Returns 0 on success, -1 when QEMU is gone.
+ */
+int libqemu_step_batch(libqemu_t *q, int hart, st_rvfi_t *buf, size_t max,
+                       size_t *n_retired);
+
+void libqemu_set_retire_cb(libqemu_t *q, libqemu_retire_cb_t cb, void *opaque);
+
+/*
+ * Register accessors, REG is a GDB core register number.
+ * Return 0 on success, -1 on a bad hart/register.
+ */
+int libqemu_get_reg(libqemu_t *q, int hart, int reg, uint64_t *val);
+int libqemu_set_reg(libqemu_t *q, int hart, int reg, uint64_t val);
+
+/*
+ * Guest physical memory accessors. Writes invalidate the translated code.
+ * Return 0 on success, -1 if the range is not backed.
+ */
+int libqemu_read_mem(libqemu_t *q, uint64_t addr, void *buf, size_t len);
+int libqemu_write_mem(libqemu_t *q, uint64_t addr, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBQEMU_H */
@@ -15,6 +15,74 @@ extern int (*qemu_main)(void);
 ///////////////////////////////////////////////////////////////
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "cosim-rvfi.h"
+
+/*
+ * Values of the global cosim_mode:
+ *   LOCKSTEP - QEMU_step() kicks the CPU thread via eventfd/main loop
+ *              and waits on COSIM condvar (argv ends with "-cosim").
+ *   DIRECT   - no CPU thread is created; QEMU_step() runs the vCPU loop
+ *              on the caller's thread (argv ends with "-cosim-direct").
+ */
+#define COSIM_MODE_NONE      0
+#define COSIM_MODE_LOCKSTEP  1
+#define COSIM_MODE_DIRECT    2
+
+#define COSIM_MAX_HARTS      64
+
+struct COSIM_data_;
+
+/*
+ * Per-hart COSIM context, linked to its vCPU via cpu->cosim_data.
+ * Every hart has its own step channel (QEMU_step_hart()) and its own
+ * retire channel (RVFI batch buffer or ring), so that harts running on
+ * their own MTTCG threads never share per-instruction state.
+ */
+typedef struct COSIM_hart_
+{
+    struct COSIM_data_* glue;
+    int                 hart_id;
+    void*               vcpu;
+
+    /////////////////////////////////////////////////
+    unsigned long long  state_pc;
+
+    /*
+     * LOCKSTEP step channel: QEMU_step_hart() posts the budget to
+     * step_req, kicks the main loop and sleeps on step_cond until the
+     * CPU thread clears step_busy. step_n/step_retired - the budget
+     * of the current step and the number of instructions it executed.
+     */
+    uint64_t            step_req;
+    uint64_t            step_n;
+    uint64_t            step_retired;
+    volatile int        step_busy;
+    pthread_mutex_t     step_mutex;
+    pthread_cond_t      step_cond;
+
+    /*
+     * RVFI batch (QEMU_step_batch()): the caller's buffer of <rvfi_max> records,
+     * CPU thread appends one record per retired instruction.
+     * rvfi_order - running instruction counter (st_rvfi_t.order).
+     */
+    st_rvfi_t*          rvfi_buf;
+    size_t              rvfi_max;
+    size_t              rvfi_n;
+    uint64_t            rvfi_order;
+
+    /*
+     * RVFI ring (QEMU_ring_open()/QEMU_ring_run()): CPU thread publishes
+     * one record per instruction into the shared-memory ring instead of
+     * rvfi_buf. ring_active is set for the duration of a run.
+     */
+    struct CosimRing*   ring;
+    volatile int        ring_active;
+
+} COSIM_hart_t;
+
+typedef uint64_t (*cosim_step_fn_t)(COSIM_hart_t *hart, uint64_t n);
 
 typedef struct COSIM_data_
 {
@@ -23,18 +91,56 @@ typedef struct COSIM_data_
     int               wfd;
     pthread_mutex_t*  cosim_mutex;
     pthread_cond_t*   cosim_cond;
+
     /*
-     * It is temporary hack which works with one CPU only.
-     * It is not clear how to make CPU accssible from COSIM-triggered event handler.
-     * The diresct access of CPU_FOREACH causes linking error. 
+     * Harts indexed by cpu_index, attached when their vCPUs are started.
      */
-    void*               vcpu;
+    COSIM_hart_t*       hart[COSIM_MAX_HARTS];
+    int                 nharts;
 
-    /////////////////////////////////////////////////
-    unsigned long long  state_pc;
+    /*
+     * DIRECT mode: set by the accelerator when the vCPU is linked,
+     * QEMU_step() calls it instead of the eventfd round trip.
+     */
+    cosim_step_fn_t     step;
+
+    /*
+     * Set when qemu_main_loop() returned - no more steps are possible.
+     */
+    volatile int        qemu_done;
+
+    /*
+     * Set (under cosim_mutex) when all boot harts are attached and
+     * COSIM thread is let go - a predicate for the cosim_cond wait.
+     */
+    volatile int        ready;
+
+    /*
+     * Run-ahead (QEMU_checkpoint()/QEMU_rollback()): rvfi_order of the
+     * first instruction after the last checkpoint (hart 0 only).
+     */
+    uint64_t            ckpt_order;
 
 } COSIM_data_t;
 
+/*
+ * COSIM entry points of QEMU.so (system/main.c), also used by the
+ * library API (system/libqemu.c).
+ */
+void COSIM_pass_sync(pthread_mutex_t *mutex, pthread_cond_t *cond);
+int QEMU_cosim_main(int mode, int argc, char **argv);
+int QEMU_num_harts(void);
+uint64_t QEMU_step_hart(int hart_id, uint64_t n);
+uint64_t QEMU_step(uint64_t n);
+int QEMU_step_batch_hart(int hart_id, st_rvfi_t *buf, size_t max, size_t *n_retired);
+int QEMU_step_batch(st_rvfi_t *buf, size_t max, size_t *n_retired);
+void *QEMU_ring_open_hart(int hart_id, uint32_t nrec, int *fd, size_t *size);
+void *QEMU_ring_open(uint32_t nrec, int *fd, size_t *size);
+int QEMU_ring_run_hart(int hart_id, uint64_t n);
+int QEMU_ring_run(uint64_t n);
+int QEMU_checkpoint(uint64_t *order);
+int QEMU_rollback(uint64_t order);
+
 ///////////////////////////////////////////////////////////////
 
 #endif /* QEMU_MAIN_H */
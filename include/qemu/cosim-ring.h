@@ -0,0 +1,72 @@
+/*
+ * COSIM: producer side of the RVFI ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_COSIM_RING_H
+#define QEMU_COSIM_RING_H
+
+#include "qemu/atomic.h"
+#include "cosim-ring.h"
+
+/*
+ * QEMU-private state of the ring. <head> and <tail_cache> are
+ * producer-local copies, the shared <tail> is reloaded only when
+ * the ring looks full.
+ */
+typedef struct CosimRing {
+    cosim_ring_t *shm;
+    st_rvfi_t *recs;
+    uint64_t head;
+    uint64_t tail_cache;
+    uint32_t mask;
+    size_t size;
+    int fd;
+} CosimRing;
+
+/* how long the CPU thread sleeps on a full ring before it looks around */
+#define COSIM_RING_WAIT_NS  10000000
+
+CosimRing *cosim_ring_new(uint32_t nrec, Error **errp);
+void cosim_ring_free(CosimRing *ring);
+
+/* Prepares the ring for a new run - clears <done>. */
+void cosim_ring_start(CosimRing *ring);
+
+/* Marks the run as done and wakes the consumer up. */
+void cosim_ring_finish(CosimRing *ring);
+
+/*
+ * Sleeps until the consumer frees a slot or TIMEOUT_NS expires.
+ * Returns true if there is a free slot.
+ */
+bool cosim_ring_wait_space(CosimRing *ring, int64_t timeout_ns);
+
+void cosim_ring_wake_consumer(CosimRing *ring);
+
+static inline bool cosim_ring_full(CosimRing *ring)
+{
+    if (ring->head - ring->tail_cache <= ring->mask) {
+        return false;
+    }
+    ring->tail_cache = qatomic_load_acquire(&ring->shm->tail);
+    return ring->head - ring->tail_cache > ring->mask;
+}
+
+/* The slot to fill, valid only if !cosim_ring_full(). */
+static inline st_rvfi_t *cosim_ring_slot(CosimRing *ring)
+{
+    return &ring->recs[ring->head & ring->mask];
+}
+
+static inline void cosim_ring_publish(CosimRing *ring)
+{
+    qatomic_store_release(&ring->shm->head, ++ring->head);
+    smp_mb();
+    if (unlikely(qatomic_read(&ring->shm->cons_wait))) {
+        cosim_ring_wake_consumer(ring);
+    }
+}
+
+#endif /* QEMU_COSIM_RING_H */
@@ -31,6 +31,5 @@ static inline bool qemu_loglevel_mask(int mask)
 
 /* main logging function */
 void G_GNUC_PRINTF(1, 2) qemu_log(const char *fmt, ...);
-void G_GNUC_PRINTF(3, 4) qemu_simple_log (const char* F, const char* FN, const  char *fmt, ...);
 
 #endif
@@ -0,0 +1,54 @@
+/*
+ * LOGIM: COSIM debug tracing on top of the trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_LOGIM_H
+#define QEMU_LOGIM_H
+
+#include "trace/trace-root.h"
+
+/*
+ * Every LOGIM category is a trace event of its own (logim_<category>
+ * in trace-events). A file picks its category by defining LOGIM_CATEGORY
+ * before including this header, "system" is the default:
+ *
+ *   tcg     accel/, the TCG execution loop
+ *   loop    util/, the main loop and polling
+ *   gdb     gdbstub/
+ *   system  system/, hw/, target/
+ *
+ * The message is formatted only when the event is enabled at run time
+ * (-trace logim_* or -d prefix:). With the nop backend, or with the
+ * "disable" property of the category's event, the check is a compile-time
+ * false and the whole statement, arguments included, is compiled out.
+ *
+ * With the simple backend the records are binary and go to the backend's
+ * lock-free buffer; the message is formatted into a per-thread buffer.
+ */
+#ifndef LOGIM_CATEGORY
+#define LOGIM_CATEGORY system
+#endif
+
+#define logim_enabled_tcg()    trace_event_get_state_backends(TRACE_LOGIM_TCG)
+#define logim_enabled_loop()   trace_event_get_state_backends(TRACE_LOGIM_LOOP)
+#define logim_enabled_gdb()    trace_event_get_state_backends(TRACE_LOGIM_GDB)
+#define logim_enabled_system() trace_event_get_state_backends(TRACE_LOGIM_SYSTEM)
+
+/* Formats into a per-thread buffer, valid until the next call. */
+const char * G_GNUC_PRINTF(1, 2) qemu_logim_format(const char *fmt, ...);
+
+#define LOGIM_CAT_(cat, fmt, ...)                                       \
+    do {                                                                \
+        if (logim_enabled_##cat()) {                                    \
+            trace_logim_##cat(__FILE__, __func__,                       \
+                              qemu_logim_format(fmt, ## __VA_ARGS__));  \
+        }                                                               \
+    } while (0)
+
+#define LOGIM_CAT(cat, ...)  LOGIM_CAT_(cat, __VA_ARGS__)
+
+#define LOGIM(...)           LOGIM_CAT(LOGIM_CATEGORY, __VA_ARGS__)
+
+#endif /* QEMU_LOGIM_H */
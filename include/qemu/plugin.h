@@ -76,6 +76,8 @@ enum plugin_dyn_cb_subtype {
     PLUGIN_CB_REGULAR,
     PLUGIN_CB_INLINE,
     PLUGIN_N_CB_SUBTYPES,
+    /* conditional callbacks are kept with the regular ones */
+    PLUGIN_CB_COND = PLUGIN_N_CB_SUBTYPES,
 };
 
 /*
@@ -89,15 +91,48 @@ struct qemu_plugin_dyn_cb {
     enum plugin_dyn_cb_subtype type;
     /* @rw applies to mem callbacks only (both regular and inline) */
     enum qemu_plugin_mem_rw rw;
+    /* @regs applies to regular and conditional callbacks only */
+    enum qemu_plugin_cb_flags regs;
     /* fields specific to each dyn_cb type go here */
     union {
         struct {
             enum qemu_plugin_op op;
             uint64_t imm;
+            /* per-vCPU op if @entry.score is set, else on @userp */
+            qemu_plugin_u64 entry;
         } inline_insn;
+        struct {
+            enum qemu_plugin_cond cond;
+            qemu_plugin_u64 entry;
+            uint64_t imm;
+            /*
+             * sampled callback: @entry counts the executions and the
+             * callback fires (and resets it) when it reaches @imm
+             */
+            bool sample;
+        } cond;
     };
 };
 
+/*
+ * The elements are found through @data at run-time, so that the array
+ * can move when it grows (all the scoreboards have the same number of
+ * elements, see plugin_grow_scoreboards()).
+ */
+struct qemu_plugin_scoreboard {
+    void *data;
+    size_t element_size;
+    QLIST_ENTRY(qemu_plugin_scoreboard) entry;
+};
+
+static inline uint64_t *qemu_plugin_u64_ptr(qemu_plugin_u64 entry,
+                                            unsigned int vcpu_index)
+{
+    return (uint64_t *)((char *)entry.score->data +
+                        vcpu_index * entry.score->element_size +
+                        entry.offset);
+}
+
 /* Internal context for instrumenting an instruction */
 struct qemu_plugin_insn {
     GByteArray *data;
@@ -11,6 +11,7 @@
 #ifndef QEMU_QEMU_PLUGIN_H
 #define QEMU_QEMU_PLUGIN_H
 
+#include <glib.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -51,7 +52,7 @@ typedef uint64_t qemu_plugin_id_t;
 
 extern QEMU_PLUGIN_EXPORT int qemu_plugin_version;
 
-#define QEMU_PLUGIN_VERSION 1
+#define QEMU_PLUGIN_VERSION 3
 
 /**
  * struct qemu_info_t - system information for plugins
@@ -218,8 +219,8 @@ struct qemu_plugin_insn;
  * @QEMU_PLUGIN_CB_R_REGS: callback reads the CPU's regs
  * @QEMU_PLUGIN_CB_RW_REGS: callback reads and writes the CPU's regs
  *
- * Note: currently unused, plugins cannot read or change system
- * register state.
+ * Register reads need R_REGS (or RW_REGS): the TCG registers are
+ * synced to the vCPU state before such a callback.
  */
 enum qemu_plugin_cb_flags {
     QEMU_PLUGIN_CB_NO_REGS,
@@ -274,14 +275,61 @@ void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
  * enum qemu_plugin_op - describes an inline op
  *
  * @QEMU_PLUGIN_INLINE_ADD_U64: add an immediate value uint64_t
- *
- * Note: currently only a single inline op is supported.
+ * @QEMU_PLUGIN_INLINE_STORE_U64: store an immediate value uint64_t
+ * @QEMU_PLUGIN_INLINE_STORE_PC: store the address of the instruction
+ *   (of the first instruction for a TB), the immediate is ignored
  */
 
 enum qemu_plugin_op {
     QEMU_PLUGIN_INLINE_ADD_U64,
+    QEMU_PLUGIN_INLINE_STORE_U64,
+    QEMU_PLUGIN_INLINE_STORE_PC,
 };
 
+/**
+ * enum qemu_plugin_cond - condition of a conditional callback
+ *
+ * The (unsigned) value of a scoreboard entry is compared against
+ * an immediate, e.g. QEMU_PLUGIN_COND_GE calls when entry >= imm.
+ * QEMU_PLUGIN_COND_NEVER and QEMU_PLUGIN_COND_ALWAYS ignore both.
+ */
+enum qemu_plugin_cond {
+    QEMU_PLUGIN_COND_NEVER,
+    QEMU_PLUGIN_COND_ALWAYS,
+    QEMU_PLUGIN_COND_EQ,
+    QEMU_PLUGIN_COND_NE,
+    QEMU_PLUGIN_COND_LT,
+    QEMU_PLUGIN_COND_LE,
+    QEMU_PLUGIN_COND_GT,
+    QEMU_PLUGIN_COND_GE,
+};
+
+/**
+ * struct qemu_plugin_scoreboard - per-vCPU storage of a plugin
+ *
+ * A scoreboard is an array with one element per vCPU, allocated by
+ * QEMU. Inline ops on a scoreboard only touch the element of the vCPU
+ * executing them, so they give exact results without any locking
+ * under MTTCG. The elements move when QEMU has to grow the array for
+ * a new vCPU, don't keep pointers returned by
+ * qemu_plugin_scoreboard_find() across translations.
+ */
+struct qemu_plugin_scoreboard;
+
+/**
+ * typedef qemu_plugin_u64 - uint64_t member of the scoreboard elements
+ *
+ * @score: the scoreboard
+ * @offset: offset of the uint64_t in the element
+ *
+ * Build it with qemu_plugin_scoreboard_u64() or
+ * qemu_plugin_scoreboard_u64_in_struct().
+ */
+typedef struct {
+    struct qemu_plugin_scoreboard *score;
+    size_t offset;
+} qemu_plugin_u64;
+
 /**
  * qemu_plugin_register_vcpu_tb_exec_inline() - execution inline op
  * @tb: the opaque qemu_plugin_tb handle for the translation
@@ -294,12 +342,74 @@ enum qemu_plugin_op {
  * memory.
  *
  * Note: ops are not atomic so in multi-threaded/multi-smp situations
- * you will get inexact results.
+ * you will get inexact results, use the _per_vcpu variant on a
+ * scoreboard for exact ones.
  */
 void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
                                               enum qemu_plugin_op op,
                                               void *ptr, uint64_t imm);
 
+/**
+ * qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu() - per-vCPU inline op
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @op: the type of qemu_plugin_op (e.g. ADD_U64)
+ * @entry: the scoreboard entry the op applies to
+ * @imm: the op data (e.g. 1)
+ *
+ * Same as qemu_plugin_register_vcpu_tb_exec_inline() on the element
+ * of @entry that belongs to the vCPU executing the translated unit.
+ */
+void qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+    struct qemu_plugin_tb *tb,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm);
+
+/**
+ * qemu_plugin_register_vcpu_tb_exec_cond_cb() - conditional execution cb
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @cb: callback function
+ * @flags: does the plugin read or write the CPU's registers?
+ * @cond: condition on @entry and @imm
+ * @entry: the scoreboard entry of the executing vCPU to test
+ * @imm: the value @entry is compared with
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * The @cb function is called every time the translated unit executes
+ * and @cond holds. The test is done in the generated code, so a
+ * callback that fires every N executions (an inline ADD_U64 on @entry
+ * plus a callback that resets it) costs a compare when it doesn't.
+ */
+void qemu_plugin_register_vcpu_tb_exec_cond_cb(struct qemu_plugin_tb *tb,
+                                               qemu_plugin_vcpu_udata_cb_t cb,
+                                               enum qemu_plugin_cb_flags flags,
+                                               enum qemu_plugin_cond cond,
+                                               qemu_plugin_u64 entry,
+                                               uint64_t imm,
+                                               void *userdata);
+
+/**
+ * qemu_plugin_register_vcpu_tb_exec_sampled_cb() - sampled execution cb
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @cb: callback function
+ * @flags: does the plugin read or write the CPU's registers?
+ * @counter: scoreboard entry counting the executions of the vCPU
+ * @period: the sampling period
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * Every execution of the translated unit increments @counter, the @cb
+ * function is called when it reaches @period, and @counter is reset.
+ * The counting is inline code, so only the sampled executions leave
+ * the translated code. Share @counter between several registrations
+ * to sample 1 in @period of all of them.
+ */
+void qemu_plugin_register_vcpu_tb_exec_sampled_cb(struct qemu_plugin_tb *tb,
+                                                  qemu_plugin_vcpu_udata_cb_t cb,
+                                                  enum qemu_plugin_cb_flags flags,
+                                                  qemu_plugin_u64 counter,
+                                                  uint64_t period,
+                                                  void *userdata);
+
 /**
  * qemu_plugin_register_vcpu_insn_exec_cb() - register insn execution cb
  * @insn: the opaque qemu_plugin_insn handle for an instruction
@@ -328,6 +438,62 @@ void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
                                                 enum qemu_plugin_op op,
                                                 void *ptr, uint64_t imm);
 
+/**
+ * qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu() - per-vCPU inline op
+ * @insn: the opaque qemu_plugin_insn handle for an instruction
+ * @op: the type of qemu_plugin_op (e.g. ADD_U64)
+ * @entry: the scoreboard entry the op applies to
+ * @imm: the op data (e.g. 1)
+ *
+ * Same as qemu_plugin_register_vcpu_insn_exec_inline() on the element
+ * of @entry that belongs to the vCPU executing the instruction.
+ */
+void qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm);
+
+/**
+ * qemu_plugin_register_vcpu_insn_exec_cond_cb() - conditional insn cb
+ * @insn: the opaque qemu_plugin_insn handle for an instruction
+ * @cb: callback function
+ * @flags: does the plugin read or write the CPU's registers?
+ * @cond: condition on @entry and @imm
+ * @entry: the scoreboard entry of the executing vCPU to test
+ * @imm: the value @entry is compared with
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * The @cb function is called every time the instruction is executed
+ * and @cond holds.
+ */
+void qemu_plugin_register_vcpu_insn_exec_cond_cb(struct qemu_plugin_insn *insn,
+                                                 qemu_plugin_vcpu_udata_cb_t cb,
+                                                 enum qemu_plugin_cb_flags flags,
+                                                 enum qemu_plugin_cond cond,
+                                                 qemu_plugin_u64 entry,
+                                                 uint64_t imm,
+                                                 void *userdata);
+
+/**
+ * qemu_plugin_register_vcpu_insn_exec_sampled_cb() - sampled insn cb
+ * @insn: the opaque qemu_plugin_insn handle for an instruction
+ * @cb: callback function
+ * @flags: does the plugin read or write the CPU's registers?
+ * @counter: scoreboard entry counting the executions of the vCPU
+ * @period: the sampling period
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * See qemu_plugin_register_vcpu_tb_exec_sampled_cb().
+ */
+void qemu_plugin_register_vcpu_insn_exec_sampled_cb(
+    struct qemu_plugin_insn *insn,
+    qemu_plugin_vcpu_udata_cb_t cb,
+    enum qemu_plugin_cb_flags flags,
+    qemu_plugin_u64 counter,
+    uint64_t period,
+    void *userdata);
+
 /**
  * qemu_plugin_register_vcpu_insn_after_exec_cb() - register after insn execution cb
  * @insn: the opaque qemu_plugin_insn handle for an instruction
@@ -533,6 +699,52 @@ void qemu_plugin_register_vcpu_mem_cb(struct qemu_plugin_insn *insn,
                                       enum qemu_plugin_mem_rw rw,
                                       void *userdata);
 
+/**
+ * qemu_plugin_register_vcpu_mem_cond_cb() - conditional memory callback
+ * @insn: handle for instruction to instrument
+ * @cb: callback of type qemu_plugin_vcpu_mem_cb_t
+ * @flags: (currently unused) callback flags
+ * @rw: monitor reads, writes or both
+ * @cond: condition on @entry and @imm
+ * @entry: the scoreboard entry of the executing vCPU to test
+ * @imm: the value @entry is compared with
+ * @userdata: opaque pointer for userdata
+ *
+ * Same as qemu_plugin_register_vcpu_mem_cb(), the @cb function is only
+ * called when @cond holds.
+ */
+void qemu_plugin_register_vcpu_mem_cond_cb(struct qemu_plugin_insn *insn,
+                                           qemu_plugin_vcpu_mem_cb_t cb,
+                                           enum qemu_plugin_cb_flags flags,
+                                           enum qemu_plugin_mem_rw rw,
+                                           enum qemu_plugin_cond cond,
+                                           qemu_plugin_u64 entry,
+                                           uint64_t imm,
+                                           void *userdata);
+
+/**
+ * qemu_plugin_register_vcpu_mem_sampled_cb() - sampled memory callback
+ * @insn: handle for instruction to instrument
+ * @cb: callback of type qemu_plugin_vcpu_mem_cb_t
+ * @flags: (currently unused) callback flags
+ * @rw: monitor reads, writes or both
+ * @counter: scoreboard entry counting the accesses of the vCPU
+ * @period: the sampling period
+ * @userdata: opaque pointer for userdata
+ *
+ * Same as qemu_plugin_register_vcpu_mem_cb() for 1 in @period accesses,
+ * see qemu_plugin_register_vcpu_tb_exec_sampled_cb(). Registering it
+ * for every instruction with a shared @counter samples the memory
+ * accesses of the vCPU at near native speed, e.g. for cache models.
+ */
+void qemu_plugin_register_vcpu_mem_sampled_cb(struct qemu_plugin_insn *insn,
+                                              qemu_plugin_vcpu_mem_cb_t cb,
+                                              enum qemu_plugin_cb_flags flags,
+                                              enum qemu_plugin_mem_rw rw,
+                                              qemu_plugin_u64 counter,
+                                              uint64_t period,
+                                              void *userdata);
+
 /**
  * qemu_plugin_register_vcpu_mem_inline() - register an inline op to any memory access
  * @insn: handle for instruction to instrument
@@ -550,6 +762,24 @@ void qemu_plugin_register_vcpu_mem_inline(struct qemu_plugin_insn *insn,
                                           enum qemu_plugin_op op, void *ptr,
                                           uint64_t imm);
 
+/**
+ * qemu_plugin_register_vcpu_mem_inline_per_vcpu() - per-vCPU memory inline op
+ * @insn: handle for instruction to instrument
+ * @rw: apply to reads, writes or both
+ * @op: the op, of type qemu_plugin_op
+ * @entry: the scoreboard entry the op applies to
+ * @imm: immediate data for @op
+ *
+ * Same as qemu_plugin_register_vcpu_mem_inline() on the element of
+ * @entry that belongs to the vCPU doing the access.
+ */
+void qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_mem_rw rw,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm);
+
 
 
 typedef void
@@ -625,6 +855,75 @@ int qemu_plugin_n_vcpus(void);
 /* returns -1 in user-mode */
 int qemu_plugin_n_max_vcpus(void);
 
+/**
+ * qemu_plugin_scoreboard_new() - allocate a scoreboard
+ * @element_size: size of the per-vCPU element
+ *
+ * The elements are zeroed, including the ones of vCPUs created later.
+ * Returns the new scoreboard, free it with qemu_plugin_scoreboard_free().
+ */
+struct qemu_plugin_scoreboard *qemu_plugin_scoreboard_new(size_t element_size);
+
+/**
+ * qemu_plugin_scoreboard_free() - free a scoreboard
+ * @score: scoreboard to free
+ *
+ * The scoreboard must not be used by translated code anymore, i.e.
+ * call it from the atexit callback or after a qemu_plugin_reset().
+ */
+void qemu_plugin_scoreboard_free(struct qemu_plugin_scoreboard *score);
+
+/**
+ * qemu_plugin_scoreboard_find() - element of a vCPU
+ * @score: scoreboard
+ * @vcpu_index: the vCPU
+ *
+ * Returns a pointer to the element of @vcpu_index.
+ */
+void *qemu_plugin_scoreboard_find(struct qemu_plugin_scoreboard *score,
+                                  unsigned int vcpu_index);
+
+/* the element of @score is a uint64_t */
+#define qemu_plugin_scoreboard_u64(score) \
+    ((qemu_plugin_u64) {score, 0})
+
+/* the element of @score is a struct @type with a uint64_t @member */
+#define qemu_plugin_scoreboard_u64_in_struct(score, type, member) \
+    ((qemu_plugin_u64) {score, offsetof(type, member)})
+
+/**
+ * qemu_plugin_u64_add() - add to the entry of a vCPU
+ * @entry: the entry
+ * @vcpu_index: the vCPU
+ * @added: value to add
+ */
+void qemu_plugin_u64_add(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t added);
+
+/**
+ * qemu_plugin_u64_get() - value of the entry of a vCPU
+ * @entry: the entry
+ * @vcpu_index: the vCPU
+ */
+uint64_t qemu_plugin_u64_get(qemu_plugin_u64 entry, unsigned int vcpu_index);
+
+/**
+ * qemu_plugin_u64_set() - set the entry of a vCPU
+ * @entry: the entry
+ * @vcpu_index: the vCPU
+ * @val: new value
+ */
+void qemu_plugin_u64_set(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t val);
+
+/**
+ * qemu_plugin_u64_sum() - sum of the entry over all the vCPUs
+ * @entry: the entry
+ *
+ * Only exact when the vCPUs don't run, e.g. from the atexit callback.
+ */
+uint64_t qemu_plugin_u64_sum(qemu_plugin_u64 entry);
+
 /**
  * qemu_plugin_outs() - output string via QEMU's logging system
  * @string: a string
@@ -678,12 +977,68 @@ uint64_t qemu_plugin_end_code(void);
  */
 uint64_t qemu_plugin_entry_code(void);
 
-/*
- * Get CPUState from inside the plugin
+/**
+ * struct qemu_plugin_register - Opaque handle for register access
+ */
+struct qemu_plugin_register;
+
+/**
+ * typedef qemu_plugin_reg_descriptor - register descriptions
  *
- * CPUArchState can b ederived from CPUState:
- * CPUArchState *cpu = (CPUArchState *)((CPUState *)qemu_plugin_get_cpu(cpu_index) + 1)
- */  
-void *qemu_plugin_get_cpu(int cpu_index);
+ * @handle: opaque handle for retrieving value with qemu_plugin_read_register
+ * @name: register name
+ * @feature: optional feature descriptor, can be NULL
+ * @size: register size in bytes, 0 if unknown
+ */
+typedef struct {
+    struct qemu_plugin_register *handle;
+    const char *name;
+    const char *feature;
+    int size;
+} qemu_plugin_reg_descriptor;
+
+/**
+ * qemu_plugin_get_registers() - return register list for current vCPU
+ *
+ * Returns a GArray of qemu_plugin_reg_descriptor built from the gdb-xml
+ * register descriptions of the target. The handles stay valid for the
+ * life of the vCPU, so the list is usually enumerated once from the
+ * vcpu_init callback. The caller frees the array (but not the names)
+ * with g_array_free().
+ */
+GArray *qemu_plugin_get_registers(void);
+
+/**
+ * qemu_plugin_read_register() - read register for current vCPU
+ *
+ * @handle: a @qemu_plugin_reg_handle handle
+ * @buf: A GByteArray for the data owned by the plugin
+ *
+ * This function is only available in a context where the plugin has
+ * registered a callback with QEMU_PLUGIN_CB_R_REGS (or RW_REGS) - only
+ * then the TCG registers are synced to the vCPU state. The value is
+ * appended to @buf in target byte order. Note that the PC is only
+ * updated at the end of a TB, use qemu_plugin_insn_vaddr() within it.
+ *
+ * Returns the size of the read register, -1 or 0 on failure.
+ */
+int qemu_plugin_read_register(struct qemu_plugin_register *handle,
+                              GByteArray *buf);
+
+/**
+ * qemu_plugin_read_registers() - read several registers for current vCPU
+ *
+ * @handles: array of @n handles
+ * @n: number of registers
+ * @buf: A GByteArray for the data owned by the plugin
+ *
+ * Appends the values one after another - the same as @n calls of
+ * qemu_plugin_read_register() in one call, for per-instruction state
+ * capture.
+ *
+ * Returns the total size of the read registers or -1 on failure.
+ */
+int qemu_plugin_read_registers(struct qemu_plugin_register *const *handles,
+                               size_t n, GByteArray *buf);
 
 #endif /* QEMU_QEMU_PLUGIN_H */
@@ -32,6 +32,7 @@ void cpu_handle_guest_debug(CPUState *cpu);
 
 //////////////// COSIM ////////////////////
 void cpu_handle_cosim_lockstep(CPUState *cpu);
+void cosim_hart_attach(CPUState *cpu);
 //////////////////////////////////////////
 
 /* end interface for cpus accelerator threads */
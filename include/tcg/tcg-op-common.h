@@ -285,6 +285,23 @@ void tcg_gen_goto_tb(unsigned idx);
  */
 void tcg_gen_lookup_and_goto_ptr(void);
 
+/**
+ * tcg_gen_lookup_ret_and_goto_ptr() - tcg_gen_lookup_and_goto_ptr() for
+ * a return
+ *
+ * The TB is looked up in the return address stack first, see
+ * tcg_gen_push_return().
+ */
+void tcg_gen_lookup_ret_and_goto_ptr(void);
+
+/**
+ * tcg_gen_push_return() - push a return address
+ * @addr: Guest address a later return is predicted to go to
+ *
+ * Emitted by the calls, pairs with tcg_gen_lookup_ret_and_goto_ptr().
+ */
+void tcg_gen_push_return(TCGv_i64 addr);
+
 static inline void tcg_gen_plugin_cb_start(unsigned from, unsigned type,
                                            unsigned wr)
 {
@@ -30,6 +30,7 @@
  */
 
 void tcg_temp_free_internal(TCGTemp *);
+void tcg_temp_ebb_to_tb(TCGTemp *);
 
 static inline void tcg_temp_free_i32(TCGv_i32 arg)
 {
@@ -501,6 +501,7 @@ struct TCGContext {
     TCGTemp *frame_temp;
 
     TranslationBlock *gen_tb;     /* tb for which code is being generated */
+    const TranslationBlock *gen_hot_tb; /* first-tier tb being replaced */
     tcg_insn_unit *code_buf;      /* pointer for start of tb */
     tcg_insn_unit *code_ptr;      /* pointer for running end of tb */
 
@@ -554,6 +555,8 @@ struct TCGContext {
 
     QTAILQ_HEAD(, TCGOp) ops, free_ops;
     QSIMPLEQ_HEAD(, TCGLabel) labels;
+    /* if set, tcg_emit_op() inserts before this op instead of appending */
+    TCGOp *emit_before_op;
 
     /* Tells which temporary holds a given register.
        It does not take into account fixed registers */
@@ -758,6 +761,13 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_reset_all(void);
 
+void tcg_region_request_address(void *addr);
+size_t tcg_region_count(void);
+void *tcg_region_base(size_t i);
+size_t tcg_region_space(size_t i);
+size_t tcg_region_used(size_t i);
+void tcg_region_reserve(size_t i, size_t len);
+
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
 
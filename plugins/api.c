@@ -41,6 +41,7 @@
 #include "exec/exec-all.h"
 #include "exec/ram_addr.h"
 #include "disas/disas.h"
+#include "exec/gdbstub.h"
 #include "plugin.h"
 #ifndef CONFIG_USER_ONLY
 #include "qemu/plugin-memory.h"
@@ -52,19 +53,6 @@
 #endif
 #endif
 
-/*
- * Get CPUState from inside the plugin
- *
- * CPUArchState can b ederived from CPUState:
- * CPUArchState *cpu = (CPUArchState *)((CPUState *)qemu_plugin_get_cpu(cpu_index) + 1)
- */  
-
-void *qemu_plugin_get_cpu (int cpu_index)
-{
-    return (void *)qemu_get_cpu(cpu_index);
-}
-
-
 /* Uninstall and Reset handlers */
 
 void qemu_plugin_uninstall(qemu_plugin_id_t id, qemu_plugin_simple_cb_t cb)
@@ -107,15 +95,68 @@ void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
     }
 }
 
+/* STORE_PC is a STORE_U64 of the address known at translation time */
+static enum qemu_plugin_op inline_op(enum qemu_plugin_op op, uint64_t *imm,
+                                     uint64_t vaddr)
+{
+    if (op == QEMU_PLUGIN_INLINE_STORE_PC) {
+        *imm = vaddr;
+        return QEMU_PLUGIN_INLINE_STORE_U64;
+    }
+    return op;
+}
+
 void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
                                               enum qemu_plugin_op op,
                                               void *ptr, uint64_t imm)
 {
     if (!tb->mem_only) {
+        op = inline_op(op, &imm, tb->vaddr);
         plugin_register_inline_op(&tb->cbs[PLUGIN_CB_INLINE], 0, op, ptr, imm);
     }
 }
 
+void qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+    struct qemu_plugin_tb *tb,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm)
+{
+    if (!tb->mem_only) {
+        op = inline_op(op, &imm, tb->vaddr);
+        plugin_register_inline_op_per_vcpu(&tb->cbs[PLUGIN_CB_INLINE], 0,
+                                           op, entry, imm);
+    }
+}
+
+void qemu_plugin_register_vcpu_tb_exec_cond_cb(struct qemu_plugin_tb *tb,
+                                               qemu_plugin_vcpu_udata_cb_t cb,
+                                               enum qemu_plugin_cb_flags flags,
+                                               enum qemu_plugin_cond cond,
+                                               qemu_plugin_u64 entry,
+                                               uint64_t imm,
+                                               void *udata)
+{
+    if (!tb->mem_only) {
+        plugin_register_dyn_cond_cb(&tb->cbs[PLUGIN_CB_REGULAR], cb, flags, 0,
+                                    cond, entry, imm, false, udata);
+    }
+}
+
+void qemu_plugin_register_vcpu_tb_exec_sampled_cb(struct qemu_plugin_tb *tb,
+                                                  qemu_plugin_vcpu_udata_cb_t cb,
+                                                  enum qemu_plugin_cb_flags flags,
+                                                  qemu_plugin_u64 counter,
+                                                  uint64_t period,
+                                                  void *udata)
+{
+    if (!tb->mem_only) {
+        plugin_register_dyn_cond_cb(&tb->cbs[PLUGIN_CB_REGULAR], cb, flags, 0,
+                                    QEMU_PLUGIN_COND_GE, counter, period, true,
+                                    udata);
+    }
+}
+
 void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
                                             qemu_plugin_vcpu_udata_cb_t cb,
                                             enum qemu_plugin_cb_flags flags,
@@ -132,11 +173,55 @@ void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
                                                 void *ptr, uint64_t imm)
 {
     if (!insn->mem_only) {
+        op = inline_op(op, &imm, insn->vaddr);
         plugin_register_inline_op(&insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_INLINE],
                                   0, op, ptr, imm);
     }
 }
 
+void qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm)
+{
+    if (!insn->mem_only) {
+        op = inline_op(op, &imm, insn->vaddr);
+        plugin_register_inline_op_per_vcpu(
+            &insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_INLINE], 0, op, entry, imm);
+    }
+}
+
+void qemu_plugin_register_vcpu_insn_exec_cond_cb(struct qemu_plugin_insn *insn,
+                                                 qemu_plugin_vcpu_udata_cb_t cb,
+                                                 enum qemu_plugin_cb_flags flags,
+                                                 enum qemu_plugin_cond cond,
+                                                 qemu_plugin_u64 entry,
+                                                 uint64_t imm,
+                                                 void *udata)
+{
+    if (!insn->mem_only) {
+        plugin_register_dyn_cond_cb(
+            &insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_REGULAR],
+            cb, flags, 0, cond, entry, imm, false, udata);
+    }
+}
+
+void qemu_plugin_register_vcpu_insn_exec_sampled_cb(
+    struct qemu_plugin_insn *insn,
+    qemu_plugin_vcpu_udata_cb_t cb,
+    enum qemu_plugin_cb_flags flags,
+    qemu_plugin_u64 counter,
+    uint64_t period,
+    void *udata)
+{
+    if (!insn->mem_only) {
+        plugin_register_dyn_cond_cb(
+            &insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_REGULAR],
+            cb, flags, 0, QEMU_PLUGIN_COND_GE, counter, period, true, udata);
+    }
+}
+
 void qemu_plugin_register_vcpu_insn_after_exec_cb(struct qemu_plugin_insn *insn,
                                                   qemu_plugin_vcpu_udata_cb_t cb,
                                                   enum qemu_plugin_cb_flags flags,
@@ -163,15 +248,54 @@ void qemu_plugin_register_vcpu_mem_cb(struct qemu_plugin_insn *insn,
                                     cb, flags, rw, udata);
 }
 
+void qemu_plugin_register_vcpu_mem_cond_cb(struct qemu_plugin_insn *insn,
+                                           qemu_plugin_vcpu_mem_cb_t cb,
+                                           enum qemu_plugin_cb_flags flags,
+                                           enum qemu_plugin_mem_rw rw,
+                                           enum qemu_plugin_cond cond,
+                                           qemu_plugin_u64 entry,
+                                           uint64_t imm,
+                                           void *udata)
+{
+    plugin_register_dyn_cond_cb(&insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_REGULAR],
+                                cb, flags, rw, cond, entry, imm, false, udata);
+}
+
+void qemu_plugin_register_vcpu_mem_sampled_cb(struct qemu_plugin_insn *insn,
+                                              qemu_plugin_vcpu_mem_cb_t cb,
+                                              enum qemu_plugin_cb_flags flags,
+                                              enum qemu_plugin_mem_rw rw,
+                                              qemu_plugin_u64 counter,
+                                              uint64_t period,
+                                              void *udata)
+{
+    plugin_register_dyn_cond_cb(&insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_REGULAR],
+                                cb, flags, rw, QEMU_PLUGIN_COND_GE, counter,
+                                period, true, udata);
+}
+
 void qemu_plugin_register_vcpu_mem_inline(struct qemu_plugin_insn *insn,
                                           enum qemu_plugin_mem_rw rw,
                                           enum qemu_plugin_op op, void *ptr,
                                           uint64_t imm)
 {
+    op = inline_op(op, &imm, insn->vaddr);
     plugin_register_inline_op(&insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_INLINE],
                               rw, op, ptr, imm);
 }
 
+void qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_mem_rw rw,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm)
+{
+    op = inline_op(op, &imm, insn->vaddr);
+    plugin_register_inline_op_per_vcpu(
+        &insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_INLINE], rw, op, entry, imm);
+}
+
 void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
                                            qemu_plugin_vcpu_tb_trans_cb_t cb)
 {
@@ -396,6 +520,57 @@ int qemu_plugin_n_max_vcpus(void)
 #endif
 }
 
+/*
+ * Scoreboards
+ */
+
+struct qemu_plugin_scoreboard *qemu_plugin_scoreboard_new(size_t element_size)
+{
+    /* user-mode learns about the vCPUs as they come, the array grows */
+    return plugin_scoreboard_new(element_size,
+                                 MAX(qemu_plugin_n_max_vcpus(), 1));
+}
+
+void qemu_plugin_scoreboard_free(struct qemu_plugin_scoreboard *score)
+{
+    plugin_scoreboard_free(score);
+}
+
+void *qemu_plugin_scoreboard_find(struct qemu_plugin_scoreboard *score,
+                                  unsigned int vcpu_index)
+{
+    g_assert(vcpu_index < plugin_scoreboard_size());
+    return (char *)score->data + vcpu_index * score->element_size;
+}
+
+void qemu_plugin_u64_add(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t added)
+{
+    *qemu_plugin_u64_ptr(entry, vcpu_index) += added;
+}
+
+uint64_t qemu_plugin_u64_get(qemu_plugin_u64 entry, unsigned int vcpu_index)
+{
+    return *qemu_plugin_u64_ptr(entry, vcpu_index);
+}
+
+void qemu_plugin_u64_set(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t val)
+{
+    *qemu_plugin_u64_ptr(entry, vcpu_index) = val;
+}
+
+uint64_t qemu_plugin_u64_sum(qemu_plugin_u64 entry)
+{
+    uint64_t total = 0;
+    size_t i, n = plugin_scoreboard_size();
+
+    for (i = 0; i < n; i++) {
+        total += *qemu_plugin_u64_ptr(entry, i);
+    }
+    return total;
+}
+
 /*
  * Plugin output
  */
@@ -451,3 +626,60 @@ uint64_t qemu_plugin_entry_code(void)
 #endif
     return entry;
 }
+
+/*
+ * Register API
+ *
+ * The registers are those described by the gdb-xml features of the
+ * vCPU (gdb_get_register_list()), a handle is the gdb register number + 1
+ * so that it is never NULL. Valid only from a vCPU callback.
+ */
+
+GArray *qemu_plugin_get_registers(void)
+{
+    g_autoptr(GArray) regs = NULL;
+    GArray *descs;
+
+    g_assert(current_cpu);
+
+    regs = gdb_get_register_list(current_cpu);
+    descs = g_array_sized_new(false, false,
+                              sizeof(qemu_plugin_reg_descriptor), regs->len);
+    for (guint i = 0; i < regs->len; i++) {
+        GDBRegDesc *r = &g_array_index(regs, GDBRegDesc, i);
+        qemu_plugin_reg_descriptor desc = {
+            .handle = GINT_TO_POINTER(r->gdb_reg + 1),
+            .name = r->name,
+            .feature = r->feature_name,
+            .size = r->size,
+        };
+        g_array_append_val(descs, desc);
+    }
+    return descs;
+}
+
+int qemu_plugin_read_register(struct qemu_plugin_register *reg,
+                              GByteArray *buf)
+{
+    g_assert(current_cpu);
+
+    return gdb_read_register(current_cpu, buf, GPOINTER_TO_INT(reg) - 1);
+}
+
+int qemu_plugin_read_registers(struct qemu_plugin_register *const *regs,
+                               size_t n, GByteArray *buf)
+{
+    int len = 0;
+
+    g_assert(current_cpu);
+
+    for (size_t i = 0; i < n; i++) {
+        int size = gdb_read_register(current_cpu, buf,
+                                     GPOINTER_TO_INT(regs[i]) - 1);
+        if (size <= 0) {
+            return -1;
+        }
+        len += size;
+    }
+    return len;
+}
@@ -210,10 +210,103 @@ plugin_register_cb_udata(qemu_plugin_id_t id, enum qemu_plugin_event ev,
     do_plugin_register_cb(id, ev, func, udata);
 }
 
+static void plugin_scoreboard_resize__locked(struct qemu_plugin_scoreboard *score,
+                                             size_t old_size, size_t new_size)
+{
+    score->data = g_realloc(score->data, new_size * score->element_size);
+    memset((char *)score->data + old_size * score->element_size, 0,
+           (new_size - old_size) * score->element_size);
+}
+
+/*
+ * Makes room for vCPU @cpu_index in all the scoreboards. In system mode
+ * they are sized for max_cpus upfront, so this only moves the arrays
+ * for the threads of a user-mode guest. The generated code reads
+ * the scoreboard's data pointer, no vCPU may run while it changes.
+ */
+static void plugin_grow_scoreboards(int cpu_index)
+{
+    struct qemu_plugin_scoreboard *score;
+    size_t new_size;
+    bool exclusive;
+
+    qemu_rec_mutex_lock(&plugin.lock);
+    if (cpu_index < plugin.scoreboard_size) {
+        qemu_rec_mutex_unlock(&plugin.lock);
+        return;
+    }
+    new_size = MAX(plugin.scoreboard_size * 2, cpu_index + 1);
+    if (QLIST_EMPTY(&plugin.scoreboards)) {
+        plugin.scoreboard_size = new_size;
+        qemu_rec_mutex_unlock(&plugin.lock);
+        return;
+    }
+    qemu_rec_mutex_unlock(&plugin.lock);
+
+    /* plugin.lock is not held while waiting, running vCPUs may need it */
+    exclusive = current_cpu != NULL;
+    if (exclusive) {
+        start_exclusive();
+    }
+    qemu_rec_mutex_lock(&plugin.lock);
+    if (cpu_index >= plugin.scoreboard_size) {
+        new_size = MAX(plugin.scoreboard_size * 2, cpu_index + 1);
+        QLIST_FOREACH(score, &plugin.scoreboards, entry) {
+            plugin_scoreboard_resize__locked(score, plugin.scoreboard_size,
+                                             new_size);
+        }
+        plugin.scoreboard_size = new_size;
+    }
+    qemu_rec_mutex_unlock(&plugin.lock);
+    if (exclusive) {
+        end_exclusive();
+    }
+}
+
+struct qemu_plugin_scoreboard *plugin_scoreboard_new(size_t element_size,
+                                                     size_t min_size)
+{
+    struct qemu_plugin_scoreboard *score;
+
+    score = g_new0(struct qemu_plugin_scoreboard, 1);
+    score->element_size = element_size;
+
+    qemu_rec_mutex_lock(&plugin.lock);
+    /*
+     * @min_size (max_cpus) is constant, so it only matters for the first
+     * scoreboard, the others get the size it left behind.
+     */
+    if (QLIST_EMPTY(&plugin.scoreboards)) {
+        plugin.scoreboard_size = MAX(MAX(plugin.scoreboard_size, min_size), 1);
+    }
+    score->data = g_malloc0(plugin.scoreboard_size * element_size);
+    QLIST_INSERT_HEAD(&plugin.scoreboards, score, entry);
+    qemu_rec_mutex_unlock(&plugin.lock);
+
+    return score;
+}
+
+size_t plugin_scoreboard_size(void)
+{
+    return qatomic_read(&plugin.scoreboard_size);
+}
+
+void plugin_scoreboard_free(struct qemu_plugin_scoreboard *score)
+{
+    qemu_rec_mutex_lock(&plugin.lock);
+    QLIST_REMOVE(score, entry);
+    qemu_rec_mutex_unlock(&plugin.lock);
+
+    g_free(score->data);
+    g_free(score);
+}
+
 void qemu_plugin_vcpu_init_hook(CPUState *cpu)
 {
     bool success;
 
+    plugin_grow_scoreboards(cpu->cpu_index);
+
     qemu_rec_mutex_lock(&plugin.lock);
     plugin_cpu_update__locked(&cpu->cpu_index, NULL, NULL);
     success = g_hash_table_insert(plugin.cpu_ht, &cpu->cpu_index,
@@ -292,6 +385,24 @@ void plugin_register_inline_op(GArray **arr,
     dyn_cb->rw = rw;
     dyn_cb->inline_insn.op = op;
     dyn_cb->inline_insn.imm = imm;
+    dyn_cb->inline_insn.entry = (qemu_plugin_u64) { NULL, 0 };
+}
+
+void plugin_register_inline_op_per_vcpu(GArray **arr,
+                                        enum qemu_plugin_mem_rw rw,
+                                        enum qemu_plugin_op op,
+                                        qemu_plugin_u64 entry,
+                                        uint64_t imm)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb;
+
+    dyn_cb = plugin_get_dyn_cb(arr);
+    dyn_cb->userp = NULL;
+    dyn_cb->type = PLUGIN_CB_INLINE;
+    dyn_cb->rw = rw;
+    dyn_cb->inline_insn.op = op;
+    dyn_cb->inline_insn.imm = imm;
+    dyn_cb->inline_insn.entry = entry;
 }
 
 void plugin_register_dyn_cb__udata(GArray **arr,
@@ -302,11 +413,83 @@ void plugin_register_dyn_cb__udata(GArray **arr,
     struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
 
     dyn_cb->userp = udata;
-    /* Note flags are discarded as unused. */
+    dyn_cb->regs = flags;
     dyn_cb->f.vcpu_udata = cb;
     dyn_cb->type = PLUGIN_CB_REGULAR;
 }
 
+void plugin_register_dyn_cond_cb(GArray **arr, void *cb,
+                                 enum qemu_plugin_cb_flags flags,
+                                 enum qemu_plugin_mem_rw rw,
+                                 enum qemu_plugin_cond cond,
+                                 qemu_plugin_u64 entry, uint64_t imm,
+                                 bool sample, void *udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb;
+
+    if (sample) {
+        /* every execution is a sample */
+        if (imm <= 1) {
+            cond = QEMU_PLUGIN_COND_ALWAYS;
+        } else {
+            cond = QEMU_PLUGIN_COND_GE;
+        }
+    }
+    if (cond == QEMU_PLUGIN_COND_NEVER) {
+        return;
+    }
+
+    dyn_cb = plugin_get_dyn_cb(arr);
+    dyn_cb->userp = udata;
+    dyn_cb->regs = flags;
+    dyn_cb->rw = rw;
+    dyn_cb->f.generic = cb;
+    if (cond == QEMU_PLUGIN_COND_ALWAYS) {
+        dyn_cb->type = PLUGIN_CB_REGULAR;
+        return;
+    }
+    dyn_cb->type = PLUGIN_CB_COND;
+    dyn_cb->cond.cond = cond;
+    dyn_cb->cond.entry = entry;
+    dyn_cb->cond.imm = imm;
+    dyn_cb->cond.sample = sample;
+}
+
+/*
+ * The run-time version of the check gen_cond_begin() generates, for
+ * the memory callbacks of instructions that access memory from helpers.
+ */
+static bool plugin_cond_hit(struct qemu_plugin_dyn_cb *cb, int cpu_index)
+{
+    uint64_t *entry = qemu_plugin_u64_ptr(cb->cond.entry, cpu_index);
+    uint64_t imm = cb->cond.imm;
+
+    if (cb->cond.sample) {
+        if (++*entry < imm) {
+            return false;
+        }
+        *entry = 0;
+        return true;
+    }
+
+    switch (cb->cond.cond) {
+    case QEMU_PLUGIN_COND_EQ:
+        return *entry == imm;
+    case QEMU_PLUGIN_COND_NE:
+        return *entry != imm;
+    case QEMU_PLUGIN_COND_LT:
+        return *entry < imm;
+    case QEMU_PLUGIN_COND_LE:
+        return *entry <= imm;
+    case QEMU_PLUGIN_COND_GT:
+        return *entry > imm;
+    case QEMU_PLUGIN_COND_GE:
+        return *entry >= imm;
+    default:
+        g_assert_not_reached();
+    }
+}
+
 void plugin_register_vcpu_mem_cb(GArray **arr,
                                  void *cb,
                                  enum qemu_plugin_cb_flags flags,
@@ -317,7 +500,7 @@ void plugin_register_vcpu_mem_cb(GArray **arr,
 
     dyn_cb = plugin_get_dyn_cb(arr);
     dyn_cb->userp = udata;
-    /* Note flags are discarded as unused. */
+    dyn_cb->regs = flags;
     dyn_cb->type = PLUGIN_CB_REGULAR;
     dyn_cb->rw = rw;
     dyn_cb->f.generic = cb;
@@ -432,14 +615,21 @@ void qemu_plugin_flush_cb(void)
     plugin_cb__simple(QEMU_PLUGIN_EV_FLUSH);
 }
 
-void exec_inline_op(struct qemu_plugin_dyn_cb *cb)
+void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index)
 {
     uint64_t *val = cb->userp;
 
+    if (cb->inline_insn.entry.score) {
+        val = qemu_plugin_u64_ptr(cb->inline_insn.entry, cpu_index);
+    }
+
     switch (cb->inline_insn.op) {
     case QEMU_PLUGIN_INLINE_ADD_U64:
         *val += cb->inline_insn.imm;
         break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        *val = cb->inline_insn.imm;
+        break;
     default:
         g_assert_not_reached();
     }
@@ -467,7 +657,13 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                            vaddr, cb->userp);
             break;
         case PLUGIN_CB_INLINE:
-            exec_inline_op(cb);
+            exec_inline_op(cb, cpu->cpu_index);
+            break;
+        case PLUGIN_CB_COND:
+            if (plugin_cond_hit(cb, cpu->cpu_index)) {
+                cb->f.vcpu_mem(cpu->cpu_index, make_plugin_meminfo(oi, rw),
+                               vaddr, cb->userp);
+            }
             break;
         default:
             g_assert_not_reached();
@@ -185,6 +185,8 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tb-cache=file (keep the TCG translated code in file)\n"
+    "                tier-threshold=n (optimise TCG translation blocks run n times, default 0)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -227,6 +229,23 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tb-cache=file``
+        Saves the TCG translated code to file at exit and reuses it in the
+        next runs, for repeated boots of the same images. The saved code
+        is only used by the same QEMU binary, on the same host, with the
+        same machine and CPU options, and when the binary and the code
+        buffer are loaded at the same addresses: run QEMU with address
+        space randomization disabled (``setarch -R``). It is ignored
+        otherwise, and ignored (not saved) when plugins are in use.
+
+    ``tier-threshold=n``
+        Translates code quickly at first, without the TCG optimizer, and
+        retranslates a translation block with full optimisation once it
+        has run n times, continuing it past the conditional branches that
+        were rarely taken. This shortens boots that run much code only
+        once, at a small cost for counting. The default, 0, optimises every
+        translation block from the start.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
@@ -36,7 +36,10 @@
 #include "qemu/thread.h"
 
 #include "qemu/log.h"
+#include "qemu/logim.h"
 #include "qemu-main.h"
+#include "qemu/cosim-ring.h"
+#include "qemu/error-report.h"
 
 #include "qemu/main-loop.h"
 #include "qemu/plugin.h"
@@ -302,30 +305,99 @@ bool cpu_can_run(CPUState *cpu)
 }
 
 //////////////////  COSIM /////////////////////////////
+extern int           cosim_mode;
+extern COSIM_data_t  *COSIM_glue_data;
+
+/*
+ * COSIM thread waits on the COSIM_pass_sync() condvar until the harts
+ * are linked and can be stepped.
+ */
+static void cosim_thread_go (void)
+{
+    pthread_mutex_lock (COSIM_glue_data->cosim_mutex);
+    COSIM_glue_data->ready = 1;
+    pthread_cond_broadcast (COSIM_glue_data->cosim_cond);
+    pthread_mutex_unlock (COSIM_glue_data->cosim_mutex);
+    LOGIM("COSIM thread released, harts linked");
+}
+
+/*
+ * Links the vCPU with its own COSIM hart context (hart id = cpu_index).
+ * Called by the accelerator before the vCPU starts; COSIM thread is
+ * let go once all boot harts are linked.
+ */
+void cosim_hart_attach(CPUState *cpu)
+{
+    COSIM_hart_t *hart;
+
+    cpu->cosim_mode = cosim_mode;
+    cpu->cosim_data = NULL;
+    if (!cosim_mode) {
+        return;
+    }
+
+    if (cpu->cpu_index >= COSIM_MAX_HARTS) {
+        error_report("COSIM: hart %d is out of range (max %d)",
+                     cpu->cpu_index, COSIM_MAX_HARTS);
+        exit(1);
+    }
+
+    hart = g_new0(COSIM_hart_t, 1);
+    hart->glue = COSIM_glue_data;
+    hart->hart_id = cpu->cpu_index;
+    hart->vcpu = cpu;
+    pthread_mutex_init (&hart->step_mutex, NULL);
+    pthread_cond_init (&hart->step_cond, NULL);
+
+    cpu->cosim_data = (void*)hart;
+    COSIM_glue_data->hart[hart->hart_id] = hart;
+
+    if (++COSIM_glue_data->nharts == current_machine->smp.cpus) {
+        cosim_thread_go ();
+    }
+}
+
 /*
- * CPU thread wakes up COSIM thread;
- * TBD: In case of NCPU > 1 this mechanzism to be reconsidered.
- *      ?? QEMU_step() - per CPU or for all cpus. 
+ * CPU thread wakes up the COSIM thread stepping this hart.
  */
 static void vm_cosim_notify (CPUState *cpu)
 {
-    COSIM_data_t* pgd = (COSIM_data_t*)cpu->cosim_data; 
-    
-    // printf ("%s() ++++>  LOCK (mutex = %p ) \n", __FUNCTION__, pgd->cosim_mutex); 
-    pthread_mutex_lock (pgd->cosim_mutex);
-    // printf ("%s() <++++  LOCK (mutex = %p ) \n", __FUNCTION__, pgd->cosim_mutex); 
-    // printf ("%s() ++++>  COND_BROADCAST (cond = %p ) \n", __FUNCTION__, pgd->cosim_cond); 
-    pthread_cond_broadcast (pgd->cosim_cond);
-    pthread_mutex_unlock (pgd->cosim_mutex);
+    COSIM_hart_t* hart = (COSIM_hart_t*)cpu->cosim_data; 
+
+    hart->step_retired = hart->step_n - cpu_cosim_budget_left(cpu);
+    cpu_cosim_set_budget(cpu, 0);
+
+    pthread_mutex_lock (&hart->step_mutex);
+    hart->step_busy = 0;
+    pthread_cond_broadcast (&hart->step_cond);
+    pthread_mutex_unlock (&hart->step_mutex);
 }
 
 /*
  * Similar to cpu_handle_guest_debug() this function
  * processes new EXCP_COSIM and notifies
- * COSIM that an instruction is executed.
+ * COSIM that the step of this hart is over.
+ *
+ * With the RVFI ring EXCP_COSIM is raised when the ring is full as well.
+ * Then the CPU thread sleeps (without BQL) until the consumer frees
+ * a slot and keeps running - the run is over only when the budget is.
  */ 
 void cpu_handle_cosim_lockstep(CPUState *cpu)
 {
+    COSIM_hart_t* hart = (COSIM_hart_t*)cpu->cosim_data; 
+
+    if (hart->ring_active) {
+        if (cpu_cosim_budget_left(cpu) != 0) {
+            qemu_mutex_unlock_iothread();
+            cosim_ring_wait_space(hart->ring, COSIM_RING_WAIT_NS);
+            qemu_mutex_lock_iothread();
+            cpu_cosim_set_budget(cpu, cpu_cosim_budget_left(cpu));
+            return;
+        }
+        hart->ring_active = 0;
+        cosim_ring_finish(hart->ring);
+    }
+
     cpu->stopped = true;
 
 #if 0
@@ -0,0 +1,328 @@
+/*
+ * libqemu: QEMU as a library for co-simulation testbenches
+ *
+ * The API of include/libqemu.h on top of the COSIM entry points of
+ * system/main.c. libqemu_create() builds the QEMU command line from
+ * libqemu_config_t and runs QEMU_cosim_main() on its own thread,
+ * the COSIM mode is passed explicitly (no "-cosim" argv marker).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-main.h"
+#include "libqemu.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "hw/core/cpu.h"
+#include "hw/loader.h"
+#include "exec/address-spaces.h"
+#include "sysemu/runstate.h"
+#include "elf.h"
+
+#ifdef TARGET_RISCV
+#define LIBQEMU_ELF_MACHINE  EM_RISCV
+#else
+#error "libqemu: no ELF machine for this target"
+#endif
+
+/* records per QEMU_step_batch_hart() call when the retire callback is set */
+#define LIBQEMU_BATCH  256
+
+extern COSIM_data_t *COSIM_glue_data;
+
+struct libqemu {
+    libqemu_mode_t      mode;
+    char**              argv;
+    int                 argc;
+    QemuThread          thread;
+
+    /* passed to QEMU via COSIM_pass_sync() */
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    bool                exited;     /* QEMU_cosim_main() returned */
+
+    libqemu_retire_cb_t retire_cb;
+    void*               retire_opaque;
+    st_rvfi_t*          rvfi[COSIM_MAX_HARTS];
+};
+
+/* QEMU can be started only once per process */
+static bool libqemu_used;
+
+uint32_t libqemu_version(void)
+{
+    return LIBQEMU_VERSION;
+}
+
+static void *libqemu_thread(void *opaque)
+{
+    libqemu_t *q = opaque;
+
+    QEMU_cosim_main(q->mode, q->argc, q->argv);
+
+    pthread_mutex_lock(&q->mutex);
+    q->exited = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+static char **libqemu_build_argv(const libqemu_config_t *cfg, int *argc)
+{
+    GPtrArray *args = g_ptr_array_new();
+    const char *const *extra;
+
+    g_ptr_array_add(args, g_strdup("libqemu"));
+    g_ptr_array_add(args, g_strdup("-nographic"));
+    g_ptr_array_add(args, g_strdup("-accel"));
+    /* DIRECT mode: the TCG context belongs to the stepping thread */
+    g_ptr_array_add(args, g_strdup(cfg->mode == LIBQEMU_MODE_DIRECT ||
+                                   cfg->harts <= 1 ?
+                                   "tcg,thread=single" : "tcg,thread=multi"));
+    g_ptr_array_add(args, g_strdup("-machine"));
+    g_ptr_array_add(args, g_strdup(cfg->machine ? cfg->machine : "virt"));
+    if (cfg->cpu) {
+        g_ptr_array_add(args, g_strdup("-cpu"));
+        g_ptr_array_add(args, g_strdup(cfg->cpu));
+    }
+    if (cfg->ram_mb) {
+        g_ptr_array_add(args, g_strdup("-m"));
+        g_ptr_array_add(args, g_strdup_printf("%" PRIu64 "M", cfg->ram_mb));
+    }
+    if (cfg->harts > 1) {
+        g_ptr_array_add(args, g_strdup("-smp"));
+        g_ptr_array_add(args, g_strdup_printf("%d", cfg->harts));
+    }
+    g_ptr_array_add(args, g_strdup("-bios"));
+    g_ptr_array_add(args, g_strdup(cfg->bios ? cfg->bios : "none"));
+    for (extra = cfg->extra_args; extra && *extra; extra++) {
+        g_ptr_array_add(args, g_strdup(*extra));
+    }
+
+    *argc = args->len;
+    g_ptr_array_add(args, NULL);
+    return (char **)g_ptr_array_free(args, false);
+}
+
+libqemu_t *libqemu_create(const libqemu_config_t *cfg)
+{
+    libqemu_t *q;
+    bool ready;
+    int i;
+
+    if (cfg == NULL || (cfg->version >> 16) != LIBQEMU_VERSION_MAJOR ||
+        cfg->harts > COSIM_MAX_HARTS || libqemu_used) {
+        return NULL;
+    }
+    libqemu_used = true;
+
+    q = g_new0(libqemu_t, 1);
+    q->mode = cfg->mode == LIBQEMU_MODE_DIRECT ? LIBQEMU_MODE_DIRECT :
+                                                 LIBQEMU_MODE_LOCKSTEP;
+    q->argv = libqemu_build_argv(cfg, &q->argc);
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    COSIM_pass_sync(&q->mutex, &q->cond);
+
+    /* held before QEMU starts so that cosim_thread_go() is not missed */
+    pthread_mutex_lock(&q->mutex);
+    qemu_thread_create(&q->thread, "libqemu", libqemu_thread, q,
+                       QEMU_THREAD_JOINABLE);
+    while (!q->exited && !(COSIM_glue_data && COSIM_glue_data->ready)) {
+        pthread_cond_wait(&q->cond, &q->mutex);
+    }
+    ready = !q->exited;
+    pthread_mutex_unlock(&q->mutex);
+
+    if (!ready) {
+        error_report("libqemu: QEMU exited during the initialization");
+        qemu_thread_join(&q->thread);
+        g_strfreev(q->argv);
+        g_free(q);
+        return NULL;
+    }
+
+    for (i = 0; i < QEMU_num_harts(); i++) {
+        q->rvfi[i] = g_new(st_rvfi_t, LIBQEMU_BATCH);
+    }
+    return q;
+}
+
+void libqemu_destroy(libqemu_t *q)
+{
+    int i;
+
+    if (q == NULL) {
+        return;
+    }
+
+    if (!COSIM_glue_data->qemu_done) {
+        qemu_mutex_lock_iothread();
+        qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_QMP_QUIT);
+        qemu_mutex_unlock_iothread();
+    }
+    qemu_thread_join(&q->thread);
+
+    for (i = 0; i < COSIM_MAX_HARTS; i++) {
+        g_free(q->rvfi[i]);
+    }
+    g_strfreev(q->argv);
+    g_free(q);
+}
+
+int libqemu_load_elf(libqemu_t *q, const char *path, uint64_t *entry)
+{
+    uint64_t pc;
+    ssize_t size;
+    CPUState *cpu;
+
+    qemu_mutex_lock_iothread();
+    size = load_elf_ram_sym(path, NULL, NULL, NULL, &pc, NULL, NULL, NULL,
+                            target_words_bigendian(), LIBQEMU_ELF_MACHINE,
+                            1, 0, &address_space_memory, false, NULL);
+    if (size >= 0) {
+        CPU_FOREACH(cpu) {
+            cpu_set_pc(cpu, pc);
+        }
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (size < 0) {
+        error_report("libqemu: unable to load %s: %s", path,
+                     load_elf_strerror(size));
+        return -1;
+    }
+    if (entry) {
+        *entry = pc;
+    }
+    return 0;
+}
+
+int libqemu_num_harts(libqemu_t *q)
+{
+    return QEMU_num_harts();
+}
+
+uint64_t libqemu_step(libqemu_t *q, int hart, uint64_t n)
+{
+    uint64_t done = 0;
+
+    if (q->retire_cb == NULL) {
+        return QEMU_step_hart(hart, n);
+    }
+    if (hart < 0 || hart >= COSIM_MAX_HARTS || q->rvfi[hart] == NULL) {
+        return 0;
+    }
+
+    while (done < n) {
+        size_t i, n_retired = 0;
+
+        if (QEMU_step_batch_hart(hart, q->rvfi[hart],
+                                 MIN(n - done, LIBQEMU_BATCH),
+                                 &n_retired) != 0 || n_retired == 0) {
+            break;
+        }
+        for (i = 0; i < n_retired; i++) {
+            q->retire_cb(q->retire_opaque, hart, &q->rvfi[hart][i]);
+        }
+        done += n_retired;
+    }
+    return done;
+}
+
+uint64_t libqemu_run(libqemu_t *q, int hart, uint64_t n)
+{
+    return QEMU_step_hart(hart, n);
+}
+
+int libqemu_step_batch(libqemu_t *q, int hart, st_rvfi_t *buf, size_t max,
+                       size_t *n_retired)
+{
+    return QEMU_step_batch_hart(hart, buf, max, n_retired);
+}
+
+void libqemu_set_retire_cb(libqemu_t *q, libqemu_retire_cb_t cb, void *opaque)
+{
+    q->retire_opaque = opaque;
+    q->retire_cb = cb;
+}
+
+/*
+ * The registers are accessed through the gdbstub hooks of the CPU,
+ * so REG is a GDB core register number.
+ */
+int libqemu_get_reg(libqemu_t *q, int hart, int reg, uint64_t *val)
+{
+    g_autoptr(GByteArray) buf = g_byte_array_new();
+    CPUState *cpu = qemu_get_cpu(hart);
+    int len;
+
+    if (cpu == NULL || reg < 0 || reg >= cpu->cc->gdb_num_core_regs) {
+        return -1;
+    }
+
+    qemu_mutex_lock_iothread();
+    len = cpu->cc->gdb_read_register(cpu, buf, reg);
+    qemu_mutex_unlock_iothread();
+
+    if (len <= 0 || len > sizeof(uint64_t)) {
+        return -1;
+    }
+    *val = target_words_bigendian() ? ldn_be_p(buf->data, len) :
+                                      ldn_le_p(buf->data, len);
+    return 0;
+}
+
+int libqemu_set_reg(libqemu_t *q, int hart, int reg, uint64_t val)
+{
+    g_autoptr(GByteArray) buf = g_byte_array_new();
+    CPUState *cpu = qemu_get_cpu(hart);
+    uint8_t data[sizeof(uint64_t)];
+    int len;
+
+    if (cpu == NULL || reg < 0 || reg >= cpu->cc->gdb_num_core_regs) {
+        return -1;
+    }
+
+    qemu_mutex_lock_iothread();
+    /* the width of the register */
+    len = cpu->cc->gdb_read_register(cpu, buf, reg);
+    if (len > 0 && len <= sizeof(data)) {
+        if (target_words_bigendian()) {
+            stn_be_p(data, len, val);
+        } else {
+            stn_le_p(data, len, val);
+        }
+        len = cpu->cc->gdb_write_register(cpu, data, reg);
+    }
+    qemu_mutex_unlock_iothread();
+
+    return len > 0 ? 0 : -1;
+}
+
+int libqemu_read_mem(libqemu_t *q, uint64_t addr, void *buf, size_t len)
+{
+    MemTxResult res;
+
+    qemu_mutex_lock_iothread();
+    res = address_space_read(&address_space_memory, addr,
+                             MEMTXATTRS_UNSPECIFIED, buf, len);
+    qemu_mutex_unlock_iothread();
+
+    return res == MEMTX_OK ? 0 : -1;
+}
+
+int libqemu_write_mem(libqemu_t *q, uint64_t addr, const void *buf, size_t len)
+{
+    MemTxResult res;
+
+    qemu_mutex_lock_iothread();
+    res = address_space_write(&address_space_memory, addr,
+                              MEMTXATTRS_UNSPECIFIED, buf, len);
+    qemu_mutex_unlock_iothread();
+
+    return res == MEMTX_OK ? 0 : -1;
+}
@@ -27,6 +27,13 @@
 #include "sysemu/sysemu.h"
 
 #include "qemu/log.h"
+#include "qemu/logim.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qemu/cosim-ring.h"
+#include "hw/core/cpu.h"
+#include "exec/cosim-checkpoint.h"
 
 #ifdef CONFIG_SDL
 #include <SDL.h>
@@ -41,10 +48,9 @@
 
 extern int cosim_ep (void);
 void qemu_cosim_API (void* opaque_data);
-void COSIM_pass_sync (pthread_mutex_t *mutex_sync_init, pthread_cond_t * cond_sync_init);
-void* QEMU_step(void);
 
 static bool qemu_COSIM_init_glue(void);
+static void qemu_COSIM_release_harts(void);
 
 /*
  * The below global variables are used by COSIM  
@@ -78,6 +84,17 @@ LOGIM("--> qemu_main_loop() status = %d", status);
     status = qemu_main_loop();
     if (cosim_mode) {
         fprintf (stderr, "QEMU:%s() <---- qemu_main_loop() status = %d, COSIM_MODE = %d\n", __FUNCTION__, status, cosim_mode);
+        COSIM_glue_data->qemu_done = 1;
+        qemu_COSIM_release_harts();
+    }
+
+    /*
+     * In DIRECT mode the vCPU loop runs on COSIM thread which takes
+     * the global lock in QEMU_step(). Release it so that the pending
+     * (or any further) step notices qemu_done and returns.
+     */
+    if (cosim_mode == COSIM_MODE_DIRECT) {
+        qemu_mutex_unlock_iothread();
     }
 
     if (cosim_mode == 0) {
@@ -91,19 +108,16 @@ int (*qemu_main)(void) = qemu_default_main;
 
 ///////////////////////////////////////////////////////////////
 
-int main(int argc, char **argv)
+/*
+ * Runs QEMU in COSIM MODE (or as a plain emulator with COSIM_MODE_NONE).
+ * ARGV is a regular QEMU command line without the "-cosim" marker.
+ * The COSIM mode is passed explicitly by the library API (system/libqemu.c),
+ * QEMU.so main() takes it from the trailing argument.
+ */
+int QEMU_cosim_main(int mode, int argc, char **argv)
 {
-    int i;
+    cosim_mode = mode;
 
-    for (i = 0; i < argc; i++) {
-        printf ("QEMU:%s() ---- argv [%d] = %s\n ", __FUNCTION__, i, argv[i]);
-    }
-
-    bool iam_qemu_so = (strcmp (argv[argc - 1], "-cosim") == 0);
-
-    ///////////////////////////////////////////////////////////
-
-    cosim_mode = iam_qemu_so;
     if (cosim_mode) {
         if (!qemu_COSIM_init_glue()) {
 	    fprintf (stderr, "QEMU-cosim: Unable to initialize COSIM interface\n");
@@ -111,11 +125,6 @@ int main(int argc, char **argv)
         }
     }
 
-    ///////////////////////////////////////////////////////////
-
-    if (iam_qemu_so) {
-        argc--;
-    }
     qemu_init (argc, argv);
 
 LOGIM ("<---- qemu_init()");
@@ -127,6 +136,33 @@ LOGIM ("<---- qemu_init()");
     return rc;
 }
 
+/*
+ * The library (libqemu-<target>) is linked into the testbench binary
+ * which has its own main().
+ */
+#ifndef CONFIG_COSIM_LIB
+int main(int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        printf ("QEMU:%s() ---- argv [%d] = %s\n ", __FUNCTION__, i, argv[i]);
+    }
+
+    bool iam_qemu_so = (strcmp (argv[argc - 1], "-cosim") == 0);
+    bool iam_direct  = (strcmp (argv[argc - 1], "-cosim-direct") == 0);
+
+    ///////////////////////////////////////////////////////////
+
+    if (iam_qemu_so || iam_direct) {
+        argc--;
+    }
+    return QEMU_cosim_main(iam_direct ? COSIM_MODE_DIRECT :
+                           iam_qemu_so ? COSIM_MODE_LOCKSTEP : COSIM_MODE_NONE,
+                           argc, argv);
+}
+#endif
+
 ///////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////
 
@@ -167,6 +203,7 @@ qemu_COSIM_init_glue (void)
         fprintf (stderr, "MALLOC: unable to allocate COSIM glue data\n");
         exit (0);
     }
+    memset (pgd, 0, sizeof(COSIM_data_t));
     pgd->rfd = pgd->wfd = -1;
 
     COSIM_glue_data = pgd;
@@ -192,31 +229,321 @@ void COSIM_pass_sync (pthread_mutex_t *mutex, pthread_cond_t *cond)
 
 //////////////////////////////////////////////////////////////
 /*
- * QEMU new entry point for COSIM which kicks off QEMU main thread
- * to execute one guest intsruction.
- * It sends the signalling 8 bytes via file descriptor opened by EVENTFD.
- * In fact it is an extension of the common QEMU sync mehanizm (event loop).
- */ 
-void* QEMU_step(void)
+ * QEMU is gone: wake up COSIM threads sleeping in QEMU_step_hart()
+ * and ring consumers waiting for a run which will never end.
+ */
+static void qemu_COSIM_release_harts (void)
 {
-  int fd = COSIM_glue_data->wfd;
-  unsigned long long msg = 0x12345678;
+  int i;
+
+  for (i = 0; i < COSIM_MAX_HARTS; i++) {
+      COSIM_hart_t *hart = COSIM_glue_data->hart[i];
+
+      if (hart == NULL) {
+          continue;
+      }
+      pthread_mutex_lock (&hart->step_mutex);
+      hart->step_busy = 0;
+      pthread_cond_broadcast (&hart->step_cond);
+      pthread_mutex_unlock (&hart->step_mutex);
+
+      if (hart->ring != NULL) {
+          hart->ring_active = 0;
+          cosim_ring_finish(hart->ring);
+      }
+  }
+}
 
-  // printf ("%s(): ====> LOCK () sync_mutex = %p\n", __FUNCTION__, sync_mutex);
-  pthread_mutex_lock (sync_mutex);
-  // printf ("%s(): <==== LOCK () sync_mutex = %p\n", __FUNCTION__, sync_mutex);
+static COSIM_hart_t *qemu_COSIM_hart (int hart_id)
+{
+  if (hart_id < 0 || hart_id >= COSIM_MAX_HARTS) {
+      return NULL;
+  }
+  return COSIM_glue_data->hart[hart_id];
+}
 
-  int rc = write (fd, (char*)&msg, 8);
-  // printf ("%s() ====  STEP --> write (FD = %d) , rc = %d  \n", __FUNCTION__, fd, rc);
+/*
+ * LOCKSTEP mode: posts the budget of HART and kicks the main loop
+ * (qemu_fd_sync_dispatch() resumes the harts with posted budgets).
+ */
+static bool qemu_COSIM_kick_hart (COSIM_hart_t *hart, uint64_t n)
+{
+  unsigned long long msg = 1;
+
+  hart->step_n = n;
+  hart->step_retired = 0;
+  qatomic_set_mb(&hart->step_req, n);
+  return write (COSIM_glue_data->wfd, (char*)&msg, 8) == 8;
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * The number of harts which can be stepped (hart id = 0 .. N-1).
+ */
+int QEMU_num_harts(void)
+{
+  return COSIM_glue_data->nharts;
+}
 
-LOGIM("<======== write (fd = %d) rc = %d  ==> COND_WAIT()", fd, rc);
-  pthread_cond_wait (sync_cond, sync_mutex);
+//////////////////////////////////////////////////////////////
+/*
+ * QEMU new entry point for COSIM which executes N guest instructions
+ * of hart HART_ID and returns the number of instructions actually executed.
+ *
+ * LOCKSTEP mode: the budget is posted to the hart and the signalling 8 bytes
+ * are sent via file descriptor opened by EVENTFD; then it waits until the CPU
+ * thread notifies back via the hart's condvar. In fact it is an extension of
+ * the common QEMU sync mehanizm (event loop). With MTTCG every hart has its
+ * own CPU thread, so harts stepped from different COSIM threads run in parallel.
+ *
+ * DIRECT mode: the instructions are executed inline on the caller's thread,
+ * no eventfd/main loop/condvar round trips.
+ */ 
+uint64_t QEMU_step_hart(int hart_id, uint64_t n)
+{
+  COSIM_hart_t *hart = qemu_COSIM_hart (hart_id);
+  uint64_t retired;
+
+  if (hart == NULL || hart->ring_active || n == 0) {
+      return 0;
+  }
+
+  if (COSIM_glue_data->step != NULL) {
+      return COSIM_glue_data->step(hart, n);
+  }
+
+  pthread_mutex_lock (&hart->step_mutex);
+  if (COSIM_glue_data->qemu_done) {
+      pthread_mutex_unlock (&hart->step_mutex);
+      return 0;
+  }
+
+  hart->step_busy = 1;
+  if (!qemu_COSIM_kick_hart (hart, n)) {
+      hart->step_busy = 0;
+  }
+
+LOGIM("<======== kick (hart = %d, n = %lu)  ==> COND_WAIT()", hart_id, n);
+  while (hart->step_busy) {
+      pthread_cond_wait (&hart->step_cond, &hart->step_mutex);
+  }
 LOGIM("<======== COND_WAIT()");
 
-  // printf ("%s(): <==== COND_WAIT () sync_cond = %p\n", __FUNCTION__, sync_cond);
-printf ("%s(): PC = 0x%llx\n", __FUNCTION__, COSIM_glue_data->state_pc);
+  retired = hart->step_retired;
+  pthread_mutex_unlock (&hart->step_mutex);
+
+  return retired;
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * Single hart entry point - steps hart 0.
+ */
+uint64_t QEMU_step(uint64_t n)
+{
+  return QEMU_step_hart(0, n);
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * QEMU entry point for COSIM which executes up to MAX guest instructions
+ * of hart HART_ID and fills one RVFI record per retired (or trapped)
+ * instruction. The number of records is returned via N_RETIRED.
+ * It amortizes COSIM-QEMU synchronization over the whole batch
+ * (a single round trip in LOCKSTEP mode, a single call in DIRECT mode).
+ *
+ * Returns 0 on success, -1 if there is no such hart or QEMU is gone.
+ */
+int QEMU_step_batch_hart(int hart_id, st_rvfi_t *buf, size_t max, size_t *n_retired)
+{
+  COSIM_hart_t *hart = qemu_COSIM_hart (hart_id);
 
-  pthread_mutex_unlock (sync_mutex);
-   
-  return NULL;
+  *n_retired = 0;
+  if (hart == NULL || COSIM_glue_data->qemu_done) {
+      return -1;
+  }
+
+  hart->rvfi_buf = buf;
+  hart->rvfi_max = max;
+  hart->rvfi_n   = 0;
+
+  QEMU_step_hart(hart_id, max);
+
+  *n_retired     = hart->rvfi_n;
+  hart->rvfi_buf = NULL;
+  hart->rvfi_max = 0;
+
+  return (*n_retired == 0 && COSIM_glue_data->qemu_done) ? -1 : 0;
+}
+
+int QEMU_step_batch(st_rvfi_t *buf, size_t max, size_t *n_retired)
+{
+  return QEMU_step_batch_hart(0, buf, max, n_retired);
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * Creates the RVFI ring of hart HART_ID with NREC (power of 2) records
+ * in a memfd segment. The testbench either uses the returned mapping
+ * directly or maps FD/SIZE in another process. See cosim-ring.h for the
+ * protocol. The ring is created once, subsequent calls return the same one.
+ *
+ * Returns NULL on failure.
+ */
+void *QEMU_ring_open_hart(int hart_id, uint32_t nrec, int *fd, size_t *size)
+{
+  COSIM_hart_t *hart = qemu_COSIM_hart (hart_id);
+  Error *local_err = NULL;
+
+  if (hart == NULL) {
+      return NULL;
+  }
+
+  if (hart->ring == NULL) {
+      hart->ring = cosim_ring_new(nrec, &local_err);
+      if (hart->ring == NULL) {
+          error_report_err(local_err);
+          return NULL;
+      }
+  }
+
+  *fd   = hart->ring->fd;
+  *size = hart->ring->size;
+  return hart->ring->shm;
+}
+
+void *QEMU_ring_open(uint32_t nrec, int *fd, size_t *size)
+{
+  return QEMU_ring_open_hart(0, nrec, fd, size);
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * Lets hart HART_ID run N guest instructions ahead, one RVFI record per
+ * instruction is published into its ring. QEMU never gets more than
+ * the ring size ahead of the consumer. The end of the run is signalled
+ * by cosim_ring_t.done; QEMU_step_hart() is refused until then.
+ *
+ * LOCKSTEP mode: returns immediately, the CPU thread is the producer.
+ * DIRECT mode: runs on the caller's thread and returns when the run is
+ * done, the consumer has to live on another thread (or process).
+ *
+ * Returns 0 on success, -1 if there is no ring, a run is in progress
+ * or QEMU is gone.
+ */
+int QEMU_ring_run_hart(int hart_id, uint64_t n)
+{
+  COSIM_hart_t *hart = qemu_COSIM_hart (hart_id);
+
+  if (hart == NULL || hart->ring == NULL || hart->ring_active ||
+      COSIM_glue_data->qemu_done || n == 0) {
+      return -1;
+  }
+
+  cosim_ring_start(hart->ring);
+  qatomic_set_mb(&hart->ring_active, 1);
+
+  if (COSIM_glue_data->step != NULL) {
+      COSIM_glue_data->step(hart, n);
+      hart->ring_active = 0;
+      cosim_ring_finish(hart->ring);
+      return 0;
+  }
+
+  if (!qemu_COSIM_kick_hart (hart, n)) {
+      hart->ring_active = 0;
+      return -1;
+  }
+  return 0;
+}
+
+int QEMU_ring_run(uint64_t n)
+{
+  return QEMU_ring_run_hart(0, n);
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * Run-ahead COSIM: takes a checkpoint at the current instruction
+ * boundary. The RVFI order of the next instruction is returned via ORDER.
+ * QEMU may then run ahead (QEMU_step_batch()/QEMU_ring_run()) while
+ * the RTL catches up. Single hart only.
+ *
+ * Returns 0 on success, -1 during a ring run, if QEMU is gone,
+ * there is more than one hart or the target cannot save its state.
+ */
+int QEMU_checkpoint(uint64_t *order)
+{
+  COSIM_data_t *pgd = COSIM_glue_data;
+  COSIM_hart_t *hart = pgd->hart[0];
+  bool ok;
+
+  if (pgd->nharts != 1 || hart->ring_active || pgd->qemu_done) {
+      return -1;
+  }
+
+  qemu_mutex_lock_iothread();
+  ok = cosim_checkpoint_take((CPUState *)hart->vcpu);
+  if (ok) {
+      pgd->ckpt_order = hart->rvfi_order;
+  }
+  qemu_mutex_unlock_iothread();
+
+  *order = pgd->ckpt_order;
+  return ok ? 0 : -1;
+}
+
+//////////////////////////////////////////////////////////////
+/*
+ * Run-ahead COSIM: on a mismatch with the RTL (or an RTL-injected
+ * interrupt/bus fault) rolls QEMU back to the last checkpoint and replays
+ * up to (not including) the instruction with RVFI order ORDER.
+ * The checkpoint stays valid, the records of the replay are discarded.
+ * Device state (UART, timers) is not rolled back.
+ *
+ * Returns 0 on success, -1 if there is no checkpoint, ORDER precedes it,
+ * during a ring run or if QEMU is gone.
+ */
+int QEMU_rollback(uint64_t order)
+{
+  COSIM_data_t *pgd = COSIM_glue_data;
+  COSIM_hart_t *hart = pgd->hart[0];
+  size_t n, n_retired = 0;
+  st_rvfi_t *scratch;
+  bool ok;
+  int rc;
+
+  if (pgd->nharts != 1 || hart->ring_active || pgd->qemu_done ||
+      order < pgd->ckpt_order) {
+      return -1;
+  }
+
+  qemu_mutex_lock_iothread();
+  ok = cosim_checkpoint_restore((CPUState *)hart->vcpu);
+  if (ok) {
+      hart->rvfi_order = pgd->ckpt_order;
+  }
+  qemu_mutex_unlock_iothread();
+
+  if (!ok) {
+      return -1;
+  }
+
+  n = order - pgd->ckpt_order;
+  if (n == 0) {
+      return 0;
+  }
+
+  /*
+   * Replay by records, not by step budget: a trapped instruction is
+   * a record of its own, so the batch ends exactly before ORDER.
+   */
+  scratch = (st_rvfi_t *)malloc (n * sizeof(st_rvfi_t));
+  if (scratch == NULL) {
+      return -1;
+  }
+  rc = QEMU_step_batch(scratch, n, &n_retired);
+  free (scratch);
+
+  return (rc == 0 && n_retired == n) ? 0 : -1;
 }
@@ -15,6 +15,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "qemu/logim.h"
 #include "qapi/error.h"
 #include "exec/memory.h"
 #include "qapi/visitor.h"
@@ -45,6 +45,7 @@
 #include "qemu/qemu-print.h"
 
 #include "qemu/log.h"
+#include "qemu/logim.h"
 
 #include "qemu/memalign.h"
 #include "exec/memory.h"
@@ -44,6 +44,7 @@
 #include "qemu/error-report.h"
 #include "qemu/job.h"
 #include "qemu/log.h"
+#include "qemu/logim.h"
 #include "qemu/module.h"
 #include "qemu/plugin.h"
 #include "qemu/sockets.h"
@@ -75,6 +75,7 @@
 #include "chardev/char.h"
 #include "qemu/bitmap.h"
 #include "qemu/log.h"
+#include "qemu/logim.h"
 #include "sysemu/blockdev.h"
 #include "hw/block/block.h"
 #include "hw/i386/x86.h"
@@ -2777,6 +2778,8 @@ static gboolean qemu_fd_sync_check (GSource *src)
  *  b) sets  RUN_STATE_RUNNING and cpu->cosim_singlestep
  *  c) invokes cpu_resume (cpu) which in turn sends a signal (COND_BROADCAST)
  *     which wakes up CPU thread
+ * Only the harts with a pending QEMU_step_hart()/QEMU_ring_run_hart()
+ * request are resumed, each with its own budget.
  */
 static gboolean qemu_fd_sync_dispatch (GSource *src, GSourceFunc cb, gpointer udata)
 {
@@ -2796,8 +2799,15 @@ static gboolean qemu_fd_sync_dispatch (GSource *src, GSourceFunc cb, gpointer ud
 LOGIM("<== READ (fd = %d) rc = %d ==> cpu_reaume() ", ssrc->fd.fd, rc);
 
     CPU_FOREACH(cpu) {
+      COSIM_hart_t *hart = (COSIM_hart_t *)cpu->cosim_data;
+      uint64_t budget = hart ? qatomic_xchg(&hart->step_req, 0) : 0;
+
+      if (budget == 0) {
+          continue;
+      }
       // printf ("%s() +++++ CPU = %p --> CPU_RESUME, cpu->cosim_singlestep = %d\n", __FUNCTION__, cpu, cpu->cosim_singlestep);
       cpu->cosim_singlestep = 1;
+      cpu_cosim_set_budget(cpu, budget);
       cpu_resume(cpu);
     }
     return TRUE;
@@ -3829,7 +3839,12 @@ printf ("QEMU:%s() ----- cosim_mode = %d\n", __FUNCTION__, cosim_mode);
 #if 1
         autostart = 0;
 #endif
-        qemu_cosim_set_sync (COSIM_glue_data);
+        /*
+         * In DIRECT mode QEMU_step() does not go through the event loop.
+         */
+        if (cosim_mode != COSIM_MODE_DIRECT) {
+            qemu_cosim_set_sync (COSIM_glue_data);
+        }
     }
 #endif
 
@@ -21,6 +21,7 @@
 #include "qemu/qemu-print.h"
 #include "qemu/ctype.h"
 #include "qemu/log.h"
+#include "qemu/logim.h"
 #include "cpu.h"
 #include "cpu_vendorid.h"
 #include "internals.h"
@@ -882,6 +883,8 @@ static void riscv_cpu_reset_hold(Object *obj)
     }
     /* mmte is supposed to have pm.current hardwired to 1 */
     env->mmte |= (EXT_STATUS_INITIAL | MMTE_M_PM_CURRENT);
+    riscv_pwc_flush(env, RISCV_PWC_ALL);
+    env->tlb_bank = 0;
 #endif
     env->xl = riscv_cpu_mxl(env);
     riscv_cpu_update_mask(env);
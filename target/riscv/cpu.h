@@ -28,6 +28,7 @@
 #include "qom/object.h"
 #include "qemu/int128.h"
 #include "cpu_bits.h"
+#include "cosim-rvfi.h"
 #include "cpu_cfg.h"
 #include "qapi/qapi-types-common.h"
 #include "cpu-qom.h"
@@ -95,6 +96,8 @@ typedef enum {
 #define MMU_USER_IDX 3
 
 #define MAX_RISCV_PMPS (16)
+/* satp values whose U and S mode TLB entries are kept, see internals.h */
+#define RISCV_TLB_BANKS 4
 
 #if !defined(CONFIG_USER_ONLY)
 #include "pmp.h"
@@ -102,6 +105,8 @@ typedef enum {
 #endif
 
 #define RV_VLEN_MAX 1024
+/* Largest register group of the vector ops the translator expands inline */
+#define RV_GVEC_INLINE_MAX 64
 #define RV_MAX_MHPMEVENTS 32
 #define RV_MAX_MHPMCOUNTERS 32
 
@@ -126,74 +131,30 @@ typedef struct PMUCTRState {
     target_ulong irq_overflow_left;
 } PMUCTRState;
 
-// **********
-//
-// Structures for co-simulation:
-//    st_rvfi must match the System Verilog CPU state description
-//    cosim_args_t contains insn itself and packed register numbers in insn
-//
-// **********
-typedef struct {
-   uint64_t                 nret_id;
-   uint64_t                 cycle_cnt;
-   uint64_t                 order;
-   uint64_t                 insn;
-   uint8_t                  trap;
-   uint64_t                 cause;
-   uint8_t                  halt;
-   uint8_t                  intr;
-   uint32_t                 mode;
-   uint32_t                 ixl;
-   uint32_t                 dbg;
-   uint32_t                 dbg_mode;
-   uint64_t                 nmip;
-
-   uint64_t                 insn_interrupt;
-   uint64_t                 insn_interrupt_id;
-   uint64_t                 insn_bus_fault;
-   uint64_t                 insn_nmi_store_fault;
-   uint64_t                 insn_nmi_load_fault;
-
-   uint64_t                 pc_rdata;
-   uint64_t                 pc_wdata;
-
-   uint64_t                 rs1_addr;
-   uint64_t                 rs1_rdata;
-
-   uint64_t                 rs2_addr;
-   uint64_t                 rs2_rdata;
-
-   uint64_t                 rs3_addr;
-   uint64_t                 rs3_rdata;
-
-   uint64_t                 rd1_addr;
-   uint64_t                 rd1_wdata;
-
-   uint64_t                 rd2_addr;
-   uint64_t                 rd2_wdata;
-
-   uint64_t                 mem_addr;
-   uint64_t                 mem_rdata;
-   uint64_t                 mem_rmask;
-   uint64_t                 mem_wdata;
-   uint64_t                 mem_wmask;
-
-} st_rvfi_t;
-
-typedef struct cosim_args_s {
-    uint32_t insn;
-    union {
-        struct {
-            uint8_t  rs1 : 8;
-            uint8_t  rs2 : 8;
-            uint8_t  rs3 : 8;
-            uint8_t  rd  : 8;
-        } insn_regs;
-        uint32_t insn_p_regs;
-    }; 
-} cosim_args_t;
-//
-// ********* end of co-simulation types
+#if !defined(CONFIG_USER_ONLY)
+/*
+ * Paging-structure cache: the non-leaf PTEs of recent page table walks,
+ * tagged with the virtual address bits that index down to them.
+ */
+#define RISCV_PWC_SIZE 64
+
+typedef enum {
+    RISCV_PWC_S   = 1 << 0, /* single stage walks */
+    RISCV_PWC_VS  = 1 << 1, /* first stage of two */
+    RISCV_PWC_G   = 1 << 2, /* second stage */
+    RISCV_PWC_ALL = RISCV_PWC_S | RISCV_PWC_VS | RISCV_PWC_G,
+} RISCVPWCStage;
+
+typedef struct RISCVPWCEntry {
+    target_ulong atp;   /* satp, vsatp or hgatp of the walk */
+    target_ulong hgatp; /* of the second stage of RISCV_PWC_VS walks */
+    target_ulong tag;
+    hwaddr base;        /* of the next level table */
+    hwaddr pte_base;    /* where its PTEs are loaded, after the G-stage */
+    uint8_t level;      /* of the cached PTE */
+    uint8_t stage;      /* RISCVPWCStage, 0 if invalid */
+} RISCVPWCEntry;
+#endif
 
 struct CPUArchState {
     target_ulong gpr[32];
@@ -201,6 +162,9 @@ struct CPUArchState {
 
     /* vector coprocessor state. */
     uint64_t vreg[32 * RV_VLEN_MAX / 64] QEMU_ALIGNED(16);
+    /* result and element select of the inline masked vector operations */
+    uint64_t vgvec_res[RV_GVEC_INLINE_MAX / 8] QEMU_ALIGNED(16);
+    uint64_t vgvec_sel[RV_GVEC_INLINE_MAX / 8] QEMU_ALIGNED(16);
     target_ulong vxrm;
     target_ulong vxsat;
     target_ulong vl;
@@ -275,6 +239,12 @@ struct CPUArchState {
     target_ulong stval;
     target_ulong medeleg;
 
+    /* TLB banks: the satp of their entries, and when they were last used */
+    target_ulong tlb_bank_satp[RISCV_TLB_BANKS];
+    uint32_t tlb_bank_stamp[RISCV_TLB_BANKS];
+    uint32_t tlb_bank_clock;
+    uint8_t tlb_bank;
+
     target_ulong stvec;
     target_ulong sepc;
     target_ulong scause;
@@ -441,6 +411,10 @@ struct CPUArchState {
     hwaddr kernel_addr;
     hwaddr fdt_addr;
 
+#ifndef CONFIG_USER_ONLY
+    RISCVPWCEntry pwc[RISCV_PWC_SIZE];
+#endif
+
 #ifdef CONFIG_KVM
     /* kvm timer */
     bool kvm_timer_dirty;
@@ -450,13 +424,13 @@ struct CPUArchState {
     uint64_t kvm_timer_frequency;
 #endif /* CONFIG_KVM */
 
-    /* cosim_state - state for co-simulation verification;
-        NULL - if no co-sim;
-        otherwise a poiner to the state provided by the co-sim tool
-      cosim_args - insns registers numbers and insn itself 
+    /*
+     * COSIM: RVFI slot of the current instruction. With CF_COSIM_RVFI
+     * the translated code stores the insn word, pc_rdata, the source
+     * registers, rd writeback and the memory access here; st_rvfi_t
+     * (cosim-rvfi.h) must match the System Verilog CPU state description.
      */
-    cosim_args_t cosim_args;
-    st_rvfi_t   *cosim_state;
+    st_rvfi_t cosim_rvfi;
 };
 
 /*
@@ -537,6 +511,8 @@ void riscv_cpu_do_transaction_failed(CPUState *cs, hwaddr physaddr,
 hwaddr riscv_cpu_get_phys_page_debug(CPUState *cpu, vaddr addr);
 bool riscv_cpu_exec_interrupt(CPUState *cs, int interrupt_request);
 void riscv_cpu_swap_hypervisor_regs(CPURISCVState *env);
+void riscv_pwc_flush(CPURISCVState *env, unsigned stages);
+void riscv_cpu_set_tlb_bank(CPURISCVState *env, target_ulong satp);
 int riscv_cpu_claim_interrupts(RISCVCPU *cpu, uint64_t interrupts);
 uint64_t riscv_cpu_update_mip(CPURISCVState *env, uint64_t mask,
                               uint64_t value);
@@ -564,28 +540,28 @@ void riscv_cpu_set_fflags(CPURISCVState *env, target_ulong);
 
 #include "exec/cpu-all.h"
 
-FIELD(TB_FLAGS, MEM_IDX, 0, 3)
-FIELD(TB_FLAGS, FS, 3, 2)
+FIELD(TB_FLAGS, MEM_IDX, 0, 4)
+FIELD(TB_FLAGS, FS, 4, 2)
 /* Vector flags */
-FIELD(TB_FLAGS, VS, 5, 2)
-FIELD(TB_FLAGS, LMUL, 7, 3)
-FIELD(TB_FLAGS, SEW, 10, 3)
-FIELD(TB_FLAGS, VL_EQ_VLMAX, 13, 1)
-FIELD(TB_FLAGS, VILL, 14, 1)
-FIELD(TB_FLAGS, VSTART_EQ_ZERO, 15, 1)
+FIELD(TB_FLAGS, VS, 6, 2)
+FIELD(TB_FLAGS, LMUL, 8, 3)
+FIELD(TB_FLAGS, SEW, 11, 3)
+FIELD(TB_FLAGS, VL_EQ_VLMAX, 14, 1)
+FIELD(TB_FLAGS, VILL, 15, 1)
+FIELD(TB_FLAGS, VSTART_EQ_ZERO, 16, 1)
 /* The combination of MXL/SXL/UXL that applies to the current cpu mode. */
-FIELD(TB_FLAGS, XL, 16, 2)
+FIELD(TB_FLAGS, XL, 17, 2)
 /* If PointerMasking should be applied */
-FIELD(TB_FLAGS, PM_MASK_ENABLED, 18, 1)
-FIELD(TB_FLAGS, PM_BASE_ENABLED, 19, 1)
-FIELD(TB_FLAGS, VTA, 20, 1)
-FIELD(TB_FLAGS, VMA, 21, 1)
+FIELD(TB_FLAGS, PM_MASK_ENABLED, 19, 1)
+FIELD(TB_FLAGS, PM_BASE_ENABLED, 20, 1)
+FIELD(TB_FLAGS, VTA, 21, 1)
+FIELD(TB_FLAGS, VMA, 22, 1)
 /* Native debug itrigger */
-FIELD(TB_FLAGS, ITRIGGER, 22, 1)
+FIELD(TB_FLAGS, ITRIGGER, 23, 1)
 /* Virtual mode enabled */
-FIELD(TB_FLAGS, VIRT_ENABLED, 23, 1)
-FIELD(TB_FLAGS, PRIV, 24, 2)
-FIELD(TB_FLAGS, AXL, 26, 2)
+FIELD(TB_FLAGS, VIRT_ENABLED, 24, 1)
+FIELD(TB_FLAGS, PRIV, 25, 2)
+FIELD(TB_FLAGS, AXL, 27, 2)
 
 #ifdef TARGET_RISCV32
 #define riscv_cpu_mxl(env)  ((void)(env), MXL_RV32)
@@ -24,6 +24,7 @@
 #include "internals.h"
 #include "pmu.h"
 #include "exec/exec-all.h"
+#include "exec/cosim-checkpoint.h"
 #include "instmap.h"
 #include "tcg/tcg-op.h"
 #include "trace.h"
@@ -58,7 +59,13 @@ int riscv_cpu_mmu_index(CPURISCVState *env, bool ifetch)
         }
     }
 
-    return mode | (virt ? MMU_2STAGE_BIT : 0);
+    if (virt) {
+        return mode | MMU_2STAGE_BIT;
+    }
+    if (mode != PRV_M) {
+        return MMUIdx_BANK(env->tlb_bank) + mode;
+    }
+    return mode;
 #endif
 }
 
@@ -726,6 +733,58 @@ static int get_physical_address_pmp(CPURISCVState *env, int *prot, hwaddr addr,
     return TRANSLATE_SUCCESS;
 }
 
+/*
+ * Switch the U and S modes to the TLB bank of SATP, written with V=0.
+ * The entries of each bank were filled under its tlb_bank_satp, the ones
+ * of the current bank under env->satp: when SATP has no bank, the least
+ * recently used one is flushed and reused.  Everything else that changes
+ * the translation of a bank, sfence.vma included, flushes the whole TLB.
+ */
+void riscv_cpu_set_tlb_bank(CPURISCVState *env, target_ulong satp)
+{
+    int i, bank = 0;
+
+    env->tlb_bank_satp[env->tlb_bank] = env->satp;
+    env->tlb_bank_stamp[env->tlb_bank] = ++env->tlb_bank_clock;
+
+    for (i = 0; i < RISCV_TLB_BANKS; i++) {
+        if (i != env->tlb_bank && env->tlb_bank_satp[i] == satp) {
+            env->tlb_bank = i;
+            return;
+        }
+        if (env->tlb_bank_stamp[i] < env->tlb_bank_stamp[bank]) {
+            bank = i;
+        }
+    }
+
+    /* U, S and S+SUM */
+    tlb_flush_by_mmuidx(env_cpu(env), 7 << MMUIdx_BANK(bank));
+    env->tlb_bank_satp[bank] = satp;
+    env->tlb_bank = bank;
+}
+
+static RISCVPWCEntry *riscv_pwc_entry(CPURISCVState *env, target_ulong tag,
+                                      int level)
+{
+    return &env->pwc[((tag ^ (tag >> 6)) + level * 17) % RISCV_PWC_SIZE];
+}
+
+/*
+ * Forget the cached non-leaf PTEs of the STAGES walks.  Done by the fences
+ * that order page table updates, and when the PMP checks of the PTE loads
+ * that the cache skips may change.
+ */
+void riscv_pwc_flush(CPURISCVState *env, unsigned stages)
+{
+    int i;
+
+    for (i = 0; i < RISCV_PWC_SIZE; i++) {
+        if (env->pwc[i].stage & stages) {
+            env->pwc[i].stage = 0;
+        }
+    }
+}
+
 /*
  * get_physical_address - get the physical address for this virtual address
  *
@@ -787,38 +846,24 @@ static int get_physical_address(CPURISCVState *env, hwaddr *physical,
 
     *ret_prot = 0;
 
-    hwaddr base;
+    hwaddr base, root;
+    target_ulong atp;
     int levels, ptidxbits, ptesize, vm, widened;
 
     if (first_stage == true) {
-        if (use_background) {
-            if (riscv_cpu_mxl(env) == MXL_RV32) {
-                base = (hwaddr)get_field(env->vsatp, SATP32_PPN) << PGSHIFT;
-                vm = get_field(env->vsatp, SATP32_MODE);
-            } else {
-                base = (hwaddr)get_field(env->vsatp, SATP64_PPN) << PGSHIFT;
-                vm = get_field(env->vsatp, SATP64_MODE);
-            }
-        } else {
-            if (riscv_cpu_mxl(env) == MXL_RV32) {
-                base = (hwaddr)get_field(env->satp, SATP32_PPN) << PGSHIFT;
-                vm = get_field(env->satp, SATP32_MODE);
-            } else {
-                base = (hwaddr)get_field(env->satp, SATP64_PPN) << PGSHIFT;
-                vm = get_field(env->satp, SATP64_MODE);
-            }
-        }
+        atp = use_background ? env->vsatp : env->satp;
         widened = 0;
     } else {
-        if (riscv_cpu_mxl(env) == MXL_RV32) {
-            base = (hwaddr)get_field(env->hgatp, SATP32_PPN) << PGSHIFT;
-            vm = get_field(env->hgatp, SATP32_MODE);
-        } else {
-            base = (hwaddr)get_field(env->hgatp, SATP64_PPN) << PGSHIFT;
-            vm = get_field(env->hgatp, SATP64_MODE);
-        }
+        atp = env->hgatp;
         widened = 2;
     }
+    if (riscv_cpu_mxl(env) == MXL_RV32) {
+        root = (hwaddr)get_field(atp, SATP32_PPN) << PGSHIFT;
+        vm = get_field(atp, SATP32_MODE);
+    } else {
+        root = (hwaddr)get_field(atp, SATP64_PPN) << PGSHIFT;
+        vm = get_field(atp, SATP64_MODE);
+    }
 
     switch (vm) {
     case VM_1_10_SV32:
@@ -867,15 +912,42 @@ static int get_physical_address(CPURISCVState *env, hwaddr *physical,
         adue = adue && (env->henvcfg & HENVCFG_ADUE);
     }
 
-    int ptshift = (levels - 1) * ptidxbits;
+    RISCVPWCStage stage = !first_stage ? RISCV_PWC_G :
+                          two_stage ? RISCV_PWC_VS : RISCV_PWC_S;
+    target_ulong hgatp = stage == RISCV_PWC_VS ? env->hgatp : 0;
+    int ptshift;
     target_ulong pte;
-    hwaddr pte_addr;
-    int i;
+    hwaddr pte_addr, pte_base;
+    RISCVPWCEntry *pwc;
+    bool pwc_hit;
+    int i, start;
 
 #if !TCG_OVERSIZED_GUEST
 restart:
 #endif
-    for (i = 0; i < levels; i++, ptshift -= ptidxbits) {
+    /* Resume the walk below the deepest cached non-leaf PTE */
+    base = pte_base = root;
+    ptshift = (levels - 1) * ptidxbits;
+    start = 0;
+    pwc_hit = false;
+    for (i = levels - 2; i >= 0; i--) {
+        int shift = PGSHIFT + (levels - 1 - i) * ptidxbits;
+
+        pwc = riscv_pwc_entry(env, addr >> shift, i);
+        if (pwc->stage == stage && pwc->level == i &&
+            pwc->tag == addr >> shift &&
+            pwc->atp == atp && pwc->hgatp == hgatp) {
+            base = pwc->base;
+            pte_base = pwc->pte_base;
+            ptshift = shift - PGSHIFT - ptidxbits;
+            start = i + 1;
+            pwc_hit = true;
+            break;
+        }
+    }
+
+    for (i = start; i < levels; i++, ptshift -= ptidxbits) {
+        bool cached = i == start && pwc_hit;
         target_ulong idx;
         if (i == 0) {
             idx = (addr >> (PGSHIFT + ptshift)) &
@@ -887,12 +959,11 @@ restart:
 
         /* check that physical address of PTE is legal */
 
-        if (two_stage && first_stage) {
+        if (two_stage && first_stage && !cached) {
             int vbase_prot;
-            hwaddr vbase;
 
             /* Do the second stage translation on the base PTE address. */
-            int vbase_ret = get_physical_address(env, &vbase, &vbase_prot,
+            int vbase_ret = get_physical_address(env, &pte_base, &vbase_prot,
                                                  base, NULL, MMU_DATA_LOAD,
                                                  MMUIdx_U, false, true,
                                                  is_debug);
@@ -903,10 +974,23 @@ restart:
                 }
                 return TRANSLATE_G_STAGE_FAIL;
             }
-
-            pte_addr = vbase + idx * ptesize;
-        } else {
-            pte_addr = base + idx * ptesize;
+        } else if (!cached) {
+            pte_base = base;
+        }
+        pte_addr = pte_base + idx * ptesize;
+
+        /* The PTE above is a pointer to this table, cache it */
+        if (i > start && !is_debug) {
+            int shift = PGSHIFT + ptshift + ptidxbits;
+
+            pwc = riscv_pwc_entry(env, addr >> shift, i - 1);
+            pwc->atp = atp;
+            pwc->hgatp = hgatp;
+            pwc->tag = addr >> shift;
+            pwc->base = base;
+            pwc->pte_base = pte_base;
+            pwc->level = i - 1;
+            pwc->stage = stage;
         }
 
         int pmp_prot;
@@ -1043,6 +1127,9 @@ restart:
                                      false, MEMTXATTRS_UNSPECIFIED);
         if (memory_region_is_ram(mr)) {
             target_ulong *pte_pa = qemu_map_ram_ptr(mr->ram_block, addr1);
+
+            /* COSIM: A/D updates bypass the TLB dirty tracking */
+            cosim_undo_log(memory_region_get_ram_addr(mr) + addr1);
 #if TCG_OVERSIZED_GUEST
             /*
              * MTTCG is not enabled on oversized TCG guests so
@@ -2748,10 +2748,15 @@ static RISCVException write_satp(CPURISCVState *env, int csrno,
         /*
          * The ISA defines SATP.MODE=Bare as "no translation", but we still
          * pass these through QEMU's TLB emulation as it improves
-         * performance.  Flushing the TLB on SATP writes with paging
-         * enabled avoids leaking those invalid cached mappings.
+         * performance.  Switching the TLB bank (or flushing the TLB, for
+         * the VS-stage satp) on SATP writes with paging enabled avoids
+         * leaking those invalid cached mappings.
          */
-        tlb_flush(env_cpu(env));
+        if (env->virt_enabled) {
+            tlb_flush(env_cpu(env));
+        } else {
+            riscv_cpu_set_tlb_bank(env, val);
+        }
         env->satp = val;
     }
     return RISCV_EXCP_NONE;
@@ -913,6 +913,41 @@ void riscv_trigger_realize(CPURISCVState *env)
     }
 }
 
+/*
+ * The QEMU breakpoints and watchpoints of the triggers, for a restore of
+ * tdata1/2/3 behind the CSR write path (COSIM rollback): remove them
+ * before, insert them for the new values after.
+ */
+void riscv_trigger_remove_all(CPURISCVState *env)
+{
+    int i;
+
+    for (i = 0; i < RV_MAX_TRIGGERS; i++) {
+        type2_breakpoint_remove(env, i);
+    }
+}
+
+void riscv_trigger_insert_all(CPURISCVState *env)
+{
+    int i;
+
+    for (i = 0; i < RV_MAX_TRIGGERS; i++) {
+        env->cpu_breakpoint[i] = NULL;
+        env->cpu_watchpoint[i] = NULL;
+
+        switch (get_trigger_type(env, i)) {
+        case TRIGGER_TYPE_AD_MATCH:
+            type2_breakpoint_insert(env, i);
+            break;
+        case TRIGGER_TYPE_AD_MATCH6:
+            type6_breakpoint_insert(env, i);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
 void riscv_trigger_reset_hold(CPURISCVState *env)
 {
     target_ulong tdata1 = build_tdata1(env, TRIGGER_TYPE_AD_MATCH, 0, 0);
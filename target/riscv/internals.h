@@ -30,16 +30,32 @@
  *  - U+2STAGE          0b100
  *  - S+2STAGE          0b101
  *  - S+SUM+2STAGE      0b110
+ *
+ * U, S and S+SUM translate with satp when V=0.  They have one copy per TLB
+ * bank, so that the entries of RISCV_TLB_BANKS satp values are kept across
+ * satp writes: bank N > 0 has them at MMUIdx_BANK(N) + U, S or S+SUM.
  */
 #define MMUIdx_U            0
 #define MMUIdx_S            1
 #define MMUIdx_S_SUM        2
 #define MMUIdx_M            3
 #define MMU_2STAGE_BIT      (1 << 2)
+#define MMUIdx_BANK(n)      ((n) ? 4 + 3 * (n) : 0)
+
+QEMU_BUILD_BUG_ON(MMUIdx_BANK(RISCV_TLB_BANKS) > NB_MMU_MODES);
+
+/* The mode of the MMU index in bank 0 */
+static inline int mmuidx_unbanked(int mmu_idx)
+{
+    if (mmu_idx >= MMUIdx_BANK(1)) {
+        return (mmu_idx - MMUIdx_BANK(1)) % 3;
+    }
+    return mmu_idx;
+}
 
 static inline int mmuidx_priv(int mmu_idx)
 {
-    int ret = mmu_idx & 3;
+    int ret = mmuidx_unbanked(mmu_idx) & 3;
     if (ret == MMUIdx_S_SUM) {
         ret = PRV_S;
     }
@@ -48,12 +64,12 @@ static inline int mmuidx_priv(int mmu_idx)
 
 static inline bool mmuidx_sum(int mmu_idx)
 {
-    return (mmu_idx & 3) == MMUIdx_S_SUM;
+    return (mmuidx_unbanked(mmu_idx) & 3) == MMUIdx_S_SUM;
 }
 
 static inline bool mmuidx_2stage(int mmu_idx)
 {
-    return mmu_idx & MMU_2STAGE_BIT;
+    return mmuidx_unbanked(mmu_idx) & MMU_2STAGE_BIT;
 }
 
 /* share data between vector helpers and decode code */
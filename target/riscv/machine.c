@@ -265,6 +265,7 @@ static int riscv_cpu_post_load(void *opaque, int version_id)
 
     env->xl = cpu_recompute_xl(env);
     riscv_cpu_update_mask(env);
+    riscv_pwc_flush(env, RISCV_PWC_ALL);
     return 0;
 }
 
@@ -391,13 +391,28 @@ void helper_tlb_flush(CPURISCVState *env)
                (env->priv == PRV_U || get_field(env->hstatus, HSTATUS_VTVM))) {
         riscv_raise_exception(env, RISCV_EXCP_VIRT_INSTRUCTION_FAULT, GETPC());
     } else {
+        riscv_pwc_flush(env, env->virt_enabled ? RISCV_PWC_VS : RISCV_PWC_S);
         tlb_flush(cs);
     }
 }
 
+static void do_pwc_flush_all(CPUState *cs, run_on_cpu_data data)
+{
+    riscv_pwc_flush(cpu_env(cs), RISCV_PWC_ALL);
+}
+
 void helper_tlb_flush_all(CPURISCVState *env)
 {
     CPUState *cs = env_cpu(env);
+    CPUState *other;
+
+    CPU_FOREACH(other) {
+        if (other == cs) {
+            riscv_pwc_flush(env, RISCV_PWC_ALL);
+        } else {
+            async_run_on_cpu(other, do_pwc_flush_all, RUN_ON_CPU_NULL);
+        }
+    }
     tlb_flush_all_cpus_synced(cs);
 }
 
@@ -411,6 +426,7 @@ void helper_hyp_tlb_flush(CPURISCVState *env)
 
     if (env->priv == PRV_M ||
         (env->priv == PRV_S && !env->virt_enabled)) {
+        riscv_pwc_flush(env, RISCV_PWC_VS);
         tlb_flush(cs);
         return;
     }
@@ -425,6 +441,8 @@ void helper_hyp_gvma_tlb_flush(CPURISCVState *env)
         riscv_raise_exception(env, RISCV_EXCP_ILLEGAL_INST, GETPC());
     }
 
+    /* the VS-stage entries hold G-stage translations as well */
+    riscv_pwc_flush(env, RISCV_PWC_G);
     helper_hyp_tlb_flush(env);
 }
 
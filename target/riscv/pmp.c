@@ -29,6 +29,7 @@
 static bool pmp_write_cfg(CPURISCVState *env, uint32_t addr_index,
                           uint8_t val);
 static uint8_t pmp_read_cfg(CPURISCVState *env, uint32_t addr_index);
+static void pmp_update_index(CPURISCVState *env);
 
 /*
  * Accessor method to extract address matching type 'a field' from cfg reg
@@ -210,6 +211,7 @@ void pmp_update_rule_nums(CPURISCVState *env)
             env->pmp_state.num_rules++;
         }
     }
+    pmp_update_index(env);
 }
 
 static int pmp_is_in_range(CPURISCVState *env, int pmp_index,
@@ -227,6 +229,91 @@ static int pmp_is_in_range(CPURISCVState *env, int pmp_index,
     return result;
 }
 
+static int pmp_addr_cmp(const void *a, const void *b)
+{
+    target_ulong x = *(const target_ulong *)a;
+    target_ulong y = *(const target_ulong *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Rebuild the index of the rules, after a change of their address or cfg.
+ * Within the ranges between the bounds of the active rules, every address
+ * is matched by the same rules, so the first one of the start address is
+ * the one of the range.  Neighbours with the same rule are merged.
+ */
+static void pmp_update_index(CPURISCVState *env)
+{
+    pmp_table_t *t = &env->pmp_state;
+    target_ulong bound[PMP_INDEX_MAX];
+    uint32_t n = 0, len = 0;
+    uint32_t i, k;
+
+    bound[n++] = 0;
+    for (i = 0; i < MAX_RISCV_PMPS; i++) {
+        if (pmp_get_a_field(t->pmp[i].cfg_reg) == PMP_AMATCH_OFF) {
+            continue;
+        }
+        bound[n++] = t->addr[i].sa;
+        if (t->addr[i].ea != (target_ulong)-1) {
+            bound[n++] = t->addr[i].ea + 1;
+        }
+    }
+    qsort(bound, n, sizeof(bound[0]), pmp_addr_cmp);
+
+    for (k = 0; k < n; k++) {
+        int rule = -1;
+
+        if (k && bound[k] == bound[k - 1]) {
+            continue;
+        }
+        for (i = 0; i < MAX_RISCV_PMPS; i++) {
+            if (pmp_get_a_field(t->pmp[i].cfg_reg) != PMP_AMATCH_OFF &&
+                pmp_is_in_range(env, i, bound[k])) {
+                rule = i;
+                break;
+            }
+        }
+        if (len && t->index_rule[len - 1] == rule) {
+            continue;
+        }
+        t->index_sa[len] = bound[k];
+        t->index_rule[len] = rule;
+        len++;
+    }
+    t->index_len = len;
+
+    /* the PTE loads that the walk cache skips were checked with the old */
+    riscv_pwc_flush(env, RISCV_PWC_ALL);
+}
+
+/*
+ * Return the first rule matching ADDR, or -1 if none, and the last address
+ * of its range of the index in *EA.
+ */
+static int pmp_index_lookup(CPURISCVState *env, target_ulong addr,
+                            target_ulong *ea)
+{
+    pmp_table_t *t = &env->pmp_state;
+    uint32_t lo = 0, hi = t->index_len;
+
+    /* the last range starting at or below addr */
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (t->index_sa[mid] <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (ea) {
+        *ea = lo + 1 < t->index_len ? t->index_sa[lo + 1] - 1 : -1;
+    }
+    return t->index_rule[lo];
+}
+
 /*
  * Check if the address has required RWX privs when no PMP entry is matched.
  */
@@ -296,8 +383,7 @@ bool pmp_hart_has_privs(CPURISCVState *env, target_ulong addr,
 {
     int i = 0;
     int pmp_size = 0;
-    target_ulong s = 0;
-    target_ulong e = 0;
+    uint8_t epmp_operation;
 
     /* Short cut if no rules */
     if (0 == pmp_get_num_rules(env)) {
@@ -320,130 +406,117 @@ bool pmp_hart_has_privs(CPURISCVState *env, target_ulong addr,
 
     /*
      * 1.10 draft priv spec states there is an implicit order
-     * from low to high
+     * from low to high, the index holds the first rule matching an address.
+     * An access is inside a rule if both its ends match it first.
      */
-    for (i = 0; i < MAX_RISCV_PMPS; i++) {
-        s = pmp_is_in_range(env, i, addr);
-        e = pmp_is_in_range(env, i, addr + pmp_size - 1);
-
-        /* partially inside */
-        if ((s + e) == 1) {
-            qemu_log_mask(LOG_GUEST_ERROR,
-                          "pmp violation - access is partially inside\n");
-            *allowed_privs = 0;
-            return false;
-        }
+    i = pmp_index_lookup(env, addr, NULL);
+    if (i != pmp_index_lookup(env, addr + pmp_size - 1, NULL)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "pmp violation - access is partially inside\n");
+        *allowed_privs = 0;
+        return false;
+    }
+    if (i < 0) {
+        /* No rule matched */
+        return pmp_hart_has_privs_default(env, privs, allowed_privs, mode);
+    }
 
-        /* fully inside */
-        const uint8_t a_field =
-            pmp_get_a_field(env->pmp_state.pmp[i].cfg_reg);
+    /*
+     * Convert the PMP permissions to match the truth table in the
+     * ePMP spec.
+     */
+    epmp_operation =
+        ((env->pmp_state.pmp[i].cfg_reg & PMP_LOCK) >> 4) |
+        ((env->pmp_state.pmp[i].cfg_reg & PMP_READ) << 2) |
+        (env->pmp_state.pmp[i].cfg_reg & PMP_WRITE) |
+        ((env->pmp_state.pmp[i].cfg_reg & PMP_EXEC) >> 2);
 
+    if (!MSECCFG_MML_ISSET(env)) {
         /*
-         * Convert the PMP permissions to match the truth table in the
-         * ePMP spec.
+         * If mseccfg.MML Bit is not set, do pmp priv check
+         * This will always apply to regular PMP.
          */
-        const uint8_t epmp_operation =
-            ((env->pmp_state.pmp[i].cfg_reg & PMP_LOCK) >> 4) |
-            ((env->pmp_state.pmp[i].cfg_reg & PMP_READ) << 2) |
-            (env->pmp_state.pmp[i].cfg_reg & PMP_WRITE) |
-            ((env->pmp_state.pmp[i].cfg_reg & PMP_EXEC) >> 2);
-
-        if (((s + e) == 2) && (PMP_AMATCH_OFF != a_field)) {
-            /*
-             * If the PMP entry is not off and the address is in range,
-             * do the priv check
-             */
-            if (!MSECCFG_MML_ISSET(env)) {
-                /*
-                 * If mseccfg.MML Bit is not set, do pmp priv check
-                 * This will always apply to regular PMP.
-                 */
+        *allowed_privs = PMP_READ | PMP_WRITE | PMP_EXEC;
+        if ((mode != PRV_M) || pmp_is_locked(env, i)) {
+            *allowed_privs &= env->pmp_state.pmp[i].cfg_reg;
+        }
+    } else {
+        /*
+         * If mseccfg.MML Bit set, do the enhanced pmp priv check
+         */
+        if (mode == PRV_M) {
+            switch (epmp_operation) {
+            case 0:
+            case 1:
+            case 4:
+            case 5:
+            case 6:
+            case 7:
+            case 8:
+                *allowed_privs = 0;
+                break;
+            case 2:
+            case 3:
+            case 14:
+                *allowed_privs = PMP_READ | PMP_WRITE;
+                break;
+            case 9:
+            case 10:
+                *allowed_privs = PMP_EXEC;
+                break;
+            case 11:
+            case 13:
+                *allowed_privs = PMP_READ | PMP_EXEC;
+                break;
+            case 12:
+            case 15:
+                *allowed_privs = PMP_READ;
+                break;
+            default:
+                g_assert_not_reached();
+            }
+        } else {
+            switch (epmp_operation) {
+            case 0:
+            case 8:
+            case 9:
+            case 12:
+            case 13:
+            case 14:
+                *allowed_privs = 0;
+                break;
+            case 1:
+            case 10:
+            case 11:
+                *allowed_privs = PMP_EXEC;
+                break;
+            case 2:
+            case 4:
+            case 15:
+                *allowed_privs = PMP_READ;
+                break;
+            case 3:
+            case 6:
+                *allowed_privs = PMP_READ | PMP_WRITE;
+                break;
+            case 5:
+                *allowed_privs = PMP_READ | PMP_EXEC;
+                break;
+            case 7:
                 *allowed_privs = PMP_READ | PMP_WRITE | PMP_EXEC;
-                if ((mode != PRV_M) || pmp_is_locked(env, i)) {
-                    *allowed_privs &= env->pmp_state.pmp[i].cfg_reg;
-                }
-            } else {
-                /*
-                 * If mseccfg.MML Bit set, do the enhanced pmp priv check
-                 */
-                if (mode == PRV_M) {
-                    switch (epmp_operation) {
-                    case 0:
-                    case 1:
-                    case 4:
-                    case 5:
-                    case 6:
-                    case 7:
-                    case 8:
-                        *allowed_privs = 0;
-                        break;
-                    case 2:
-                    case 3:
-                    case 14:
-                        *allowed_privs = PMP_READ | PMP_WRITE;
-                        break;
-                    case 9:
-                    case 10:
-                        *allowed_privs = PMP_EXEC;
-                        break;
-                    case 11:
-                    case 13:
-                        *allowed_privs = PMP_READ | PMP_EXEC;
-                        break;
-                    case 12:
-                    case 15:
-                        *allowed_privs = PMP_READ;
-                        break;
-                    default:
-                        g_assert_not_reached();
-                    }
-                } else {
-                    switch (epmp_operation) {
-                    case 0:
-                    case 8:
-                    case 9:
-                    case 12:
-                    case 13:
-                    case 14:
-                        *allowed_privs = 0;
-                        break;
-                    case 1:
-                    case 10:
-                    case 11:
-                        *allowed_privs = PMP_EXEC;
-                        break;
-                    case 2:
-                    case 4:
-                    case 15:
-                        *allowed_privs = PMP_READ;
-                        break;
-                    case 3:
-                    case 6:
-                        *allowed_privs = PMP_READ | PMP_WRITE;
-                        break;
-                    case 5:
-                        *allowed_privs = PMP_READ | PMP_EXEC;
-                        break;
-                    case 7:
-                        *allowed_privs = PMP_READ | PMP_WRITE | PMP_EXEC;
-                        break;
-                    default:
-                        g_assert_not_reached();
-                    }
-                }
+                break;
+            default:
+                g_assert_not_reached();
             }
-
-            /*
-             * If matching address range was found, the protection bits
-             * defined with PMP must be used. We shouldn't fallback on
-             * finding default privileges.
-             */
-            return (privs & *allowed_privs) == privs;
         }
     }
 
-    /* No rule matched */
-    return pmp_hart_has_privs_default(env, privs, allowed_privs, mode);
+    /*
+     * If matching address range was found, the protection bits
+     * defined with PMP must be used. We shouldn't fallback on
+     * finding default privileges.
+     */
+    return (privs & *allowed_privs) == privs;
 }
 
 /*
@@ -524,6 +597,7 @@ void pmpaddr_csr_write(CPURISCVState *env, uint32_t addr_index,
                 if (is_next_cfg_tor) {
                     pmp_update_rule_addr(env, addr_index + 1);
                 }
+                pmp_update_index(env);
                 tlb_flush(env_cpu(env));
             }
         } else {
@@ -578,6 +652,7 @@ void mseccfg_csr_write(CPURISCVState *env, target_ulong val)
         /* Sticky bits */
         val |= (env->mseccfg & (MSECCFG_MMWP | MSECCFG_MML));
         if ((val ^ env->mseccfg) & (MSECCFG_MMWP | MSECCFG_MML)) {
+            riscv_pwc_flush(env, RISCV_PWC_ALL);
             tlb_flush(env_cpu(env));
         }
     } else {
@@ -606,16 +681,15 @@ target_ulong mseccfg_csr_read(CPURISCVState *env)
  * A write access to 0x80000000 will match PMP1. However we cannot cache the
  * translation result in the TLB since this will make the write access to
  * 0x80000008 bypass the check of PMP0.
- * To avoid this we return a size of 1 (which means no caching) if the PMP
- * region only covers partial of the TLB page.
+ * To avoid this we return a size of 1 (which means no caching) unless the
+ * whole TLB page is in one range of the rule index, i.e. it is matched first
+ * by the same rule, or by none.
  */
 target_ulong pmp_get_tlb_size(CPURISCVState *env, target_ulong addr)
 {
-    target_ulong pmp_sa;
-    target_ulong pmp_ea;
     target_ulong tlb_sa = addr & ~(TARGET_PAGE_SIZE - 1);
     target_ulong tlb_ea = tlb_sa + TARGET_PAGE_SIZE - 1;
-    int i;
+    target_ulong ea;
 
     /*
      * If PMP is not supported or there are no PMP rules, the TLB page will not
@@ -626,38 +700,8 @@ target_ulong pmp_get_tlb_size(CPURISCVState *env, target_ulong addr)
         return TARGET_PAGE_SIZE;
     }
 
-    for (i = 0; i < MAX_RISCV_PMPS; i++) {
-        if (pmp_get_a_field(env->pmp_state.pmp[i].cfg_reg) == PMP_AMATCH_OFF) {
-            continue;
-        }
-
-        pmp_sa = env->pmp_state.addr[i].sa;
-        pmp_ea = env->pmp_state.addr[i].ea;
-
-        /*
-         * Only the first PMP entry that covers (whole or partial of) the TLB
-         * page really matters:
-         * If it covers the whole TLB page, set the size to TARGET_PAGE_SIZE,
-         * since the following PMP entries have lower priority and will not
-         * affect the permissions of the page.
-         * If it only covers partial of the TLB page, set the size to 1 since
-         * the allowed permissions of the region may be different from other
-         * region of the page.
-         */
-        if (pmp_sa <= tlb_sa && pmp_ea >= tlb_ea) {
-            return TARGET_PAGE_SIZE;
-        } else if ((pmp_sa >= tlb_sa && pmp_sa <= tlb_ea) ||
-                   (pmp_ea >= tlb_sa && pmp_ea <= tlb_ea)) {
-            return 1;
-        }
-    }
-
-    /*
-     * If no PMP entry matches the TLB page, the TLB page will also not be
-     * split into regions with different permissions by PMP so we set the size
-     * to TARGET_PAGE_SIZE.
-     */
-    return TARGET_PAGE_SIZE;
+    pmp_index_lookup(env, tlb_sa, &ea);
+    return ea >= tlb_ea ? TARGET_PAGE_SIZE : 1;
 }
 
 /*
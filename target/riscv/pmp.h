@@ -56,10 +56,21 @@ typedef struct {
     target_ulong ea;
 } pmp_addr_t;
 
+/*
+ * The address space split in ranges matched by the same rule, the first
+ * one in priority order, or by none (-1).  Ranges are sorted by their start
+ * address, the first one starts at 0 and each one ends where the next one
+ * starts.
+ */
+#define PMP_INDEX_MAX (2 * MAX_RISCV_PMPS + 1)
+
 typedef struct {
     pmp_entry_t pmp[MAX_RISCV_PMPS];
     pmp_addr_t  addr[MAX_RISCV_PMPS];
     uint32_t num_rules;
+    target_ulong index_sa[PMP_INDEX_MAX];
+    int8_t index_rule[PMP_INDEX_MAX];
+    uint32_t index_len;
 } pmp_table_t;
 
 void pmpcfg_csr_write(CPURISCVState *env, uint32_t reg_index,
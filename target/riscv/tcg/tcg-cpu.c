@@ -82,10 +82,107 @@ static void riscv_restore_state_to_opc(CPUState *cs,
     env->bins = data[1];
 }
 
+/*
+ * COSIM: RVFI retirement record support. The translated code captures
+ * the instruction's fields in env->cosim_rvfi (CF_COSIM_RVFI), a field
+ * is valid only if its address/mask is set. The slot is reset here as
+ * well, so that an instruction which traps before its first op (fetch
+ * fault) does not report the previous instruction's fields.
+ */
+static void riscv_cosim_insn_start(CPUState *cs)
+{
+    CPURISCVState *env = cpu_env(cs);
+    st_rvfi_t *slot = &env->cosim_rvfi;
+
+    slot->pc_rdata  = env->pc;
+    slot->insn      = 0;
+    slot->rs1_addr  = 0;
+    slot->rs2_addr  = 0;
+    slot->rs3_addr  = 0;
+    slot->rd1_addr  = 0;
+    slot->mem_rmask = 0;
+    slot->mem_wmask = 0;
+}
+
+static void riscv_cosim_retire(CPUState *cs, st_rvfi_t *rec)
+{
+    CPURISCVState *env = cpu_env(cs);
+    const st_rvfi_t *slot = &env->cosim_rvfi;
+
+    rec->insn      = slot->insn;
+    rec->mode      = env->priv;
+    rec->ixl       = env->xl;
+    rec->pc_rdata  = slot->pc_rdata;
+    rec->pc_wdata  = env->pc;
+
+    if (slot->rs1_addr) {
+        rec->rs1_addr  = slot->rs1_addr;
+        rec->rs1_rdata = slot->rs1_rdata;
+    }
+    if (slot->rs2_addr) {
+        rec->rs2_addr  = slot->rs2_addr;
+        rec->rs2_rdata = slot->rs2_rdata;
+    }
+    if (slot->rs3_addr) {
+        rec->rs3_addr  = slot->rs3_addr;
+        rec->rs3_rdata = slot->rs3_rdata;
+    }
+    if (slot->rd1_addr) {
+        rec->rd1_addr  = slot->rd1_addr;
+        rec->rd1_wdata = slot->rd1_wdata;
+    }
+    if (slot->mem_rmask | slot->mem_wmask) {
+        rec->mem_addr  = slot->mem_addr;
+    }
+    if (slot->mem_rmask) {
+        rec->mem_rmask = slot->mem_rmask;
+        rec->mem_rdata = slot->mem_rdata;
+    }
+    if (slot->mem_wmask) {
+        rec->mem_wmask = slot->mem_wmask;
+        rec->mem_wdata = slot->mem_wdata;
+    }
+}
+
+#ifndef CONFIG_USER_ONLY
+/*
+ * COSIM checkpoint: everything up to the fields preserved across reset
+ * (timers, boot addresses) is the architectural state.  The QEMU
+ * breakpoints and watchpoints of the triggers are not: the guest can
+ * replace them before the rollback, they are rebuilt from tdata.  The
+ * itrigger timers are created once at realize, their pointers do not
+ * change.
+ */
+static void *riscv_cosim_save_state(CPUState *cs)
+{
+    CPURISCVState *state = g_memdup2(cpu_env(cs),
+                                     offsetof(CPURISCVState, stimer));
+
+    memset(state->cpu_breakpoint, 0, sizeof(state->cpu_breakpoint));
+    memset(state->cpu_watchpoint, 0, sizeof(state->cpu_watchpoint));
+    return state;
+}
+
+static void riscv_cosim_load_state(CPUState *cs, const void *state)
+{
+    CPURISCVState *env = cpu_env(cs);
+
+    riscv_trigger_remove_all(env);
+    memcpy(env, state, offsetof(CPURISCVState, stimer));
+    riscv_trigger_insert_all(env);
+    /* resync CPU_INTERRUPT_HARD with the restored mip */
+    riscv_cpu_update_mip(env, 0, 0);
+    /* the page tables are back to the checkpoint contents */
+    riscv_pwc_flush(env, RISCV_PWC_ALL);
+}
+#endif
+
 static const struct TCGCPUOps riscv_tcg_ops = {
     .initialize = riscv_translate_init,
     .synchronize_from_tb = riscv_cpu_synchronize_from_tb,
     .restore_state_to_opc = riscv_restore_state_to_opc,
+    .cosim_insn_start = riscv_cosim_insn_start,
+    .cosim_retire = riscv_cosim_retire,
 
 #ifndef CONFIG_USER_ONLY
     .tlb_fill = riscv_cpu_tlb_fill,
@@ -96,6 +193,8 @@ static const struct TCGCPUOps riscv_tcg_ops = {
     .debug_excp_handler = riscv_cpu_debug_excp_handler,
     .debug_check_breakpoint = riscv_cpu_debug_check_breakpoint,
     .debug_check_watchpoint = riscv_cpu_debug_check_watchpoint,
+    .cosim_save_state = riscv_cosim_save_state,
+    .cosim_load_state = riscv_cosim_load_state,
 #endif /* !CONFIG_USER_ONLY */
 };
 
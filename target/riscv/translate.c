@@ -58,14 +58,6 @@ typedef enum {
     EXT_ZERO,
 } DisasExtend;
 
-typedef struct cosim_ops_s {
-    uint32_t insn;
-    uint8_t  rs1;
-    uint8_t  rs2;
-    uint8_t  rs3;
-    uint8_t  rd;
-} cosim_ops_t;
-
 typedef struct DisasContext {
     DisasContextBase base;
     target_ulong cur_insn_len;
@@ -124,8 +116,18 @@ typedef struct DisasContext {
     bool frm_valid;
     /* TCG of the current insn_start */
     TCGOp *insn_start;
-    /* Insn and Regiters for co-simulation */
-    cosim_ops_t cosim_ops;
+    /* COSIM: capture the RVFI record (CF_COSIM_RVFI) */
+    bool cosim_rvfi;
+    /* COSIM: rs1/rs2/rs3 slots of the RVFI record already captured */
+    uint8_t cosim_rs_used;
+    /* Side exits of the trace, emitted out of line by riscv_tr_tb_stop() */
+    struct {
+        TCGLabel *label;
+        target_ulong pc;
+        target_ulong pc_save;
+        target_long diff;
+    } trace_exit[TRANSLATOR_TRACE_MAX_EXITS];
+    int trace_nexits;
 } DisasContext;
 
 static inline bool has_ext(DisasContext *ctx, uint32_t ext)
@@ -280,6 +282,37 @@ static void lookup_and_goto_ptr(DisasContext *ctx)
     tcg_gen_lookup_and_goto_ptr();
 }
 
+/* ra and t0 are the link registers of the calling convention hints */
+static bool is_link_reg(int reg)
+{
+    return reg == 1 || reg == 5;
+}
+
+/* A return: look up the target in the return address stack first */
+static void lookup_ret_and_goto_ptr(DisasContext *ctx)
+{
+#ifndef CONFIG_USER_ONLY
+    if (ctx->itrigger) {
+        gen_helper_itrigger_match(tcg_env);
+    }
+#endif
+    tcg_gen_lookup_ret_and_goto_ptr();
+}
+
+/* A call: SUCC_PC is where the matching return goes */
+static void gen_push_return(DisasContext *ctx, TCGv succ_pc)
+{
+    TCGv_i64 addr;
+
+    /* Without goto_ptr the returns never look at the stack */
+    if (tb_cflags(ctx->base.tb) & CF_NO_GOTO_PTR) {
+        return;
+    }
+    addr = tcg_temp_new_i64();
+    tcg_gen_extu_tl_i64(addr, succ_pc);
+    tcg_gen_push_return(addr);
+}
+
 static void exit_tb(DisasContext *ctx)
 {
 #ifndef CONFIG_USER_ONLY
@@ -324,6 +357,152 @@ static void gen_goto_tb(DisasContext *ctx, int n, target_long diff)
     }
 }
 
+/*
+ * COSIM: RVFI record capture.
+ *
+ * With CF_COSIM_RVFI every instruction stores the fields of its RVFI
+ * record into env->cosim_rvfi: the insn word and pc_rdata up front,
+ * the source registers when they are read, the rd writeback when it
+ * is written and the memory access next to the load/store. Only the
+ * fields the instruction uses cost anything.
+ */
+#define COSIM_RVFI(field)  offsetof(CPURISCVState, cosim_rvfi.field)
+
+static void gen_cosim_st_tl(TCGv v, size_t ofs)
+{
+#ifdef TARGET_RISCV64
+    tcg_gen_st_tl(v, tcg_env, ofs);
+#else
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_extu_tl_i64(t, v);
+    tcg_gen_st_i64(t, tcg_env, ofs);
+#endif
+}
+
+static void gen_cosim_st_const(uint64_t v, size_t ofs)
+{
+    tcg_gen_st_i64(tcg_constant_i64(v), tcg_env, ofs);
+}
+
+static void gen_cosim_insn(DisasContext *ctx)
+{
+    TCGv pc;
+
+    if (!ctx->cosim_rvfi) {
+        return;
+    }
+
+    pc = tcg_temp_new();
+    gen_pc_plus_diff(pc, ctx, 0);
+    gen_cosim_st_tl(pc, COSIM_RVFI(pc_rdata));
+    gen_cosim_st_const(ctx->opcode, COSIM_RVFI(insn));
+
+    /* the rest is valid only if the instruction sets it */
+    gen_cosim_st_const(0, COSIM_RVFI(rs1_addr));
+    gen_cosim_st_const(0, COSIM_RVFI(rs2_addr));
+    gen_cosim_st_const(0, COSIM_RVFI(rs3_addr));
+    gen_cosim_st_const(0, COSIM_RVFI(rd1_addr));
+    gen_cosim_st_const(0, COSIM_RVFI(mem_rmask));
+    gen_cosim_st_const(0, COSIM_RVFI(mem_wmask));
+    ctx->cosim_rs_used = 0;
+}
+
+/*
+ * A source register is read: the slot is picked by the rs1/rs2/rs3
+ * fields of a 32-bit encoding (the read order differs between insns),
+ * otherwise the next free one.
+ */
+static void gen_cosim_rs(DisasContext *ctx, int reg_num)
+{
+    static const size_t addr_ofs[3] = {
+        COSIM_RVFI(rs1_addr), COSIM_RVFI(rs2_addr), COSIM_RVFI(rs3_addr),
+    };
+    static const size_t data_ofs[3] = {
+        COSIM_RVFI(rs1_rdata), COSIM_RVFI(rs2_rdata), COSIM_RVFI(rs3_rdata),
+    };
+    static const int field_pos[3] = { 15, 20, 27 };
+    int slot = -1;
+    int i;
+
+    if (!ctx->cosim_rvfi) {
+        return;
+    }
+
+    if (ctx->cur_insn_len == 4) {
+        for (i = 0; i < 3; i++) {
+            if (!(ctx->cosim_rs_used & (1 << i)) &&
+                extract32(ctx->opcode, field_pos[i], 5) == reg_num) {
+                slot = i;
+                break;
+            }
+        }
+    }
+    for (i = 0; slot < 0 && i < 3; i++) {
+        if (!(ctx->cosim_rs_used & (1 << i))) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return;
+    }
+
+    ctx->cosim_rs_used |= 1 << slot;
+    gen_cosim_st_const(reg_num, addr_ofs[slot]);
+    gen_cosim_st_tl(cpu_gpr[reg_num], data_ofs[slot]);
+}
+
+static void gen_cosim_rd(DisasContext *ctx, int reg_num)
+{
+    if (ctx->cosim_rvfi) {
+        gen_cosim_st_const(reg_num, COSIM_RVFI(rd1_addr));
+        gen_cosim_st_tl(cpu_gpr[reg_num], COSIM_RVFI(rd1_wdata));
+    }
+}
+
+static void gen_cosim_mem(DisasContext *ctx, TCGv addr, TCGv_i64 data,
+                          MemOp memop, bool is_store)
+{
+    uint64_t mask;
+
+    if (!ctx->cosim_rvfi || (memop & MO_SIZE) > MO_64) {
+        return;
+    }
+
+    mask = MAKE_64BIT_MASK(0, 8 << (memop & MO_SIZE));
+    gen_cosim_st_tl(addr, COSIM_RVFI(mem_addr));
+    if (is_store) {
+        tcg_gen_st_i64(data, tcg_env, COSIM_RVFI(mem_wdata));
+        gen_cosim_st_const(MAKE_64BIT_MASK(0, 1 << (memop & MO_SIZE)),
+                           COSIM_RVFI(mem_wmask));
+    } else {
+        TCGv_i64 t = tcg_temp_new_i64();
+
+        tcg_gen_andi_i64(t, data, mask);
+        tcg_gen_st_i64(t, tcg_env, COSIM_RVFI(mem_rdata));
+        gen_cosim_st_const(MAKE_64BIT_MASK(0, 1 << (memop & MO_SIZE)),
+                           COSIM_RVFI(mem_rmask));
+    }
+}
+
+static void gen_cosim_mem_tl(DisasContext *ctx, TCGv addr, TCGv data,
+                             MemOp memop, bool is_store)
+{
+    TCGv_i64 t;
+
+    if (!ctx->cosim_rvfi) {
+        return;
+    }
+
+#ifdef TARGET_RISCV64
+    t = data;
+#else
+    t = tcg_temp_new_i64();
+    tcg_gen_extu_tl_i64(t, data);
+#endif
+    gen_cosim_mem(ctx, addr, t, memop, is_store);
+}
+
 /*
  * Wrappers for getting reg values.
  *
@@ -340,6 +519,8 @@ static TCGv get_gpr(DisasContext *ctx, int reg_num, DisasExtend ext)
         return ctx->zero;
     }
 
+    gen_cosim_rs(ctx, reg_num);
+
     switch (get_ol(ctx)) {
     case MXL_RV32:
         switch (ext) {
@@ -409,6 +590,7 @@ static void gen_set_gpr(DisasContext *ctx, int reg_num, TCGv t)
         if (get_xl_max(ctx) == MXL_RV128) {
             tcg_gen_sari_tl(cpu_gprh[reg_num], cpu_gpr[reg_num], 63);
         }
+        gen_cosim_rd(ctx, reg_num);
     }
 }
 
@@ -430,6 +612,7 @@ static void gen_set_gpri(DisasContext *ctx, int reg_num, target_long imm)
         if (get_xl_max(ctx) == MXL_RV128) {
             tcg_gen_movi_tl(cpu_gprh[reg_num], -(imm < 0));
         }
+        gen_cosim_rd(ctx, reg_num);
     }
 }
 
@@ -439,6 +622,7 @@ static void gen_set_gpr128(DisasContext *ctx, int reg_num, TCGv rl, TCGv rh)
     if (reg_num != 0) {
         tcg_gen_mov_tl(cpu_gpr[reg_num], rl);
         tcg_gen_mov_tl(cpu_gprh[reg_num], rh);
+        gen_cosim_rd(ctx, reg_num);
     }
 }
 
@@ -584,6 +768,9 @@ static void gen_jal(DisasContext *ctx, int rd, target_ulong imm)
 
     gen_pc_plus_diff(succ_pc, ctx, ctx->cur_insn_len);
     gen_set_gpr(ctx, rd, succ_pc);
+    if (is_link_reg(rd)) {
+        gen_push_return(ctx, succ_pc);
+    }
 
     gen_goto_tb(ctx, 0, imm); /* must use this for safety */
     ctx->base.is_jmp = DISAS_NORETURN;
@@ -1151,6 +1338,7 @@ static void decode_opc(CPURISCVState *env, DisasContext *ctx, uint16_t opcode)
     /* Check for compressed insn */
     if (ctx->cur_insn_len == 2) {
         ctx->opcode = opcode;
+        gen_cosim_insn(ctx);
         /*
          * The Zca extension is added as way to refer to instructions in the C
          * extension that do not include the floating-point loads and stores
@@ -1165,6 +1353,7 @@ static void decode_opc(CPURISCVState *env, DisasContext *ctx, uint16_t opcode)
                              translator_lduw(env, &ctx->base,
                                              ctx->base.pc_next + 2));
         ctx->opcode = opcode32;
+        gen_cosim_insn(ctx);
 
         for (size_t i = 0; i < ARRAY_SIZE(decoders); ++i) {
             if (decoders[i].guard_func(ctx->cfg_ptr) &&
@@ -1210,7 +1399,9 @@ static void riscv_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cs)
     ctx->pm_base_enabled = FIELD_EX32(tb_flags, TB_FLAGS, PM_BASE_ENABLED);
     ctx->itrigger = FIELD_EX32(tb_flags, TB_FLAGS, ITRIGGER);
     ctx->zero = tcg_constant_tl(0);
+    ctx->cosim_rvfi = tb_cflags(ctx->base.tb) & CF_COSIM_RVFI;
     ctx->virt_inst_excp = false;
+    ctx->trace_nexits = 0;
 }
 
 static void riscv_tr_tb_start(DisasContextBase *db, CPUState *cpu)
@@ -1238,11 +1429,6 @@ static void riscv_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
 
     ctx->ol = ctx->xl;
 
-    ctx->cosim_ops.rs1 = 0;
-    ctx->cosim_ops.rs2 = 0;
-    ctx->cosim_ops.rs3 = 0;
-    ctx->cosim_ops.rd  = 0;
-
     decode_opc(env, ctx, opcode16);
     ctx->base.pc_next += ctx->cur_insn_len;
     
@@ -1265,6 +1451,25 @@ static void riscv_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     }
 }
 
+/*
+ * The taken paths of the branches the trace continued past, see
+ * gen_branch(): set pc as the branch would have, and leave the TB.
+ */
+static void gen_trace_exits(DisasContext *ctx)
+{
+    target_ulong pc_next = ctx->base.pc_next;
+    int i;
+
+    for (i = 0; i < ctx->trace_nexits; i++) {
+        gen_set_label(ctx->trace_exit[i].label);
+        ctx->base.pc_next = ctx->trace_exit[i].pc;
+        ctx->pc_save = ctx->trace_exit[i].pc_save;
+        gen_update_pc(ctx, ctx->trace_exit[i].diff);
+        lookup_and_goto_ptr(ctx);
+    }
+    ctx->base.pc_next = pc_next;
+}
+
 static void riscv_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *ctx = container_of(dcbase, DisasContext, base);
@@ -1278,6 +1483,7 @@ static void riscv_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
     default:
         g_assert_not_reached();
     }
+    gen_trace_exits(ctx);
 }
 
 static void riscv_tr_disas_log(const DisasContextBase *dcbase,
@@ -180,6 +180,136 @@ static void vext_set_tail_elems_1s(target_ulong vl, void *vd,
     }
 }
 
+/*
+ * Host address of the LEN bytes at ADDR, all in one page, when they are
+ * plain RAM that the unit-stride accesses can copy directly.  NULL for
+ * I/O, watchpoints, clean pages holding translated code, pages without a
+ * valid mapping or split by PMP, and when pointer masking or plugin
+ * memory callbacks apply: those go element by element, which also raises
+ * the exceptions.
+ */
+static void *vext_host_addr(CPURISCVState *env, target_ulong addr,
+                            target_ulong len, MMUAccessType access_type,
+                            uintptr_t ra)
+{
+#if HOST_BIG_ENDIAN
+    /* H() reorders the elements of the registers */
+    return NULL;
+#else
+    int mmu_idx = cpu_mmu_index(env, false);
+#ifndef CONFIG_USER_ONLY
+    CPUTLBEntryFull *full;
+    void *host;
+    int flags;
+#endif
+
+    if (env->cur_pmmask || env->cur_pmbase ||
+        cpu_plugin_mem_cbs_enabled(env_cpu(env))) {
+        return NULL;
+    }
+#ifdef CONFIG_USER_ONLY
+    if (!page_check_range(addr, len, access_type == MMU_DATA_STORE ?
+                          PAGE_WRITE : PAGE_READ)) {
+        return NULL;
+    }
+#else
+    /*
+     * The refill checks the whole range against PMP.  A TLB entry smaller
+     * than a page only stands for the range its refill checked, and it is
+     * valid for a single access: the other elements need their own checks.
+     */
+    flags = probe_access_full(env, addr, len, access_type, mmu_idx, true,
+                              &host, &full, ra);
+    if (flags & TLB_INVALID_MASK || full->lg_page_size < TARGET_PAGE_BITS) {
+        return NULL;
+    }
+#endif
+    /* and no I/O, watchpoint or translated code in the page */
+    return tlb_vaddr_to_host(env, addr, access_type, mmu_idx);
+#endif
+}
+
+static void vext_copy_elem(void *dst, const void *src, uint32_t esz)
+{
+    switch (esz) {
+    case 1:
+        *(uint8_t *)dst = *(const uint8_t *)src;
+        break;
+    case 2:
+        stw_he_p(dst, lduw_he_p(src));
+        break;
+    case 4:
+        stl_he_p(dst, ldl_he_p(src));
+        break;
+    default:
+        stq_he_p(dst, ldq_he_p(src));
+        break;
+    }
+}
+
+/*
+ * Unit-stride access of the segments [env->vstart, evl) of NF fields:
+ * those in a page of RAM are copied from or to the host memory, with one
+ * TLB lookup for the page, the others go through LDST_ELEM.
+ */
+static void
+vext_ldst_us_pages(void *vd, void *v0, target_ulong base,
+                   CPURISCVState *env, uint32_t desc, uint32_t vm,
+                   vext_ldst_elem_fn *ldst_elem, uint32_t log2_esz,
+                   uint32_t evl, MMUAccessType access_type, uintptr_t ra)
+{
+    uint32_t nf = vext_nf(desc);
+    uint32_t max_elems = vext_max_elems(desc, log2_esz);
+    uint32_t esz = 1 << log2_esz;
+    uint32_t segsz = nf << log2_esz;
+    uint32_t vma = vext_vma(desc);
+    uint32_t i, k, n;
+
+    for (i = env->vstart; i < evl; i = env->vstart) {
+        target_ulong addr = base + i * segsz;
+        uint8_t *host;
+
+        /* the segments that end in the page of addr, at least one */
+        n = MIN(evl - i, -(addr | TARGET_PAGE_MASK) / segsz);
+        host = n ? vext_host_addr(env, addr, n * segsz, access_type, ra)
+                 : NULL;
+        n = MAX(n, 1);
+
+        if (host && nf == 1 && vm) {
+            if (access_type == MMU_DATA_LOAD) {
+                memcpy((uint8_t *)vd + i * esz, host, n * esz);
+            } else {
+                memcpy(host, (uint8_t *)vd + i * esz, n * esz);
+            }
+            env->vstart += n;
+            continue;
+        }
+
+        for (; n; n--, i++, env->vstart++) {
+            for (k = 0; k < nf; k++) {
+                uint32_t idx = i + k * max_elems;
+
+                if (!vm && !vext_elem_mask(v0, i)) {
+                    /* set masked-off elements to 1s */
+                    vext_set_elems_1s(vd, vma, idx * esz, (idx + 1) * esz);
+                } else if (!host) {
+                    addr = base + i * segsz + (k << log2_esz);
+                    ldst_elem(env, adjust_addr(env, addr), idx, vd, ra);
+                } else if (access_type == MMU_DATA_LOAD) {
+                    vext_copy_elem((uint8_t *)vd + idx * esz,
+                                   host + (k << log2_esz), esz);
+                } else {
+                    vext_copy_elem(host + (k << log2_esz),
+                                   (uint8_t *)vd + idx * esz, esz);
+                }
+            }
+            if (host) {
+                host += segsz;
+            }
+        }
+    }
+}
+
 /*
  * stride: access vector element from strided memory
  */
@@ -188,7 +318,8 @@ vext_ldst_stride(void *vd, void *v0, target_ulong base,
                  target_ulong stride, CPURISCVState *env,
                  uint32_t desc, uint32_t vm,
                  vext_ldst_elem_fn *ldst_elem,
-                 uint32_t log2_esz, uintptr_t ra)
+                 uint32_t log2_esz, MMUAccessType access_type,
+                 uintptr_t ra)
 {
     uint32_t i, k;
     uint32_t nf = vext_nf(desc);
@@ -196,6 +327,15 @@ vext_ldst_stride(void *vd, void *v0, target_ulong base,
     uint32_t esz = 1 << log2_esz;
     uint32_t vma = vext_vma(desc);
 
+    /* masked unit-stride */
+    if (stride == nf << log2_esz) {
+        vext_ldst_us_pages(vd, v0, base, env, desc, vm, ldst_elem, log2_esz,
+                           env->vl, access_type, ra);
+        env->vstart = 0;
+        vext_set_tail_elems_1s(env->vl, vd, desc, nf, esz, max_elems);
+        return;
+    }
+
     for (i = env->vstart; i < env->vl; i++, env->vstart++) {
         k = 0;
         while (k < nf) {
@@ -223,7 +363,7 @@ void HELPER(NAME)(void *vd, void * v0, target_ulong base,               \
 {                                                                       \
     uint32_t vm = vext_vm(desc);                                        \
     vext_ldst_stride(vd, v0, base, stride, env, desc, vm, LOAD_FN,      \
-                     ctzl(sizeof(ETYPE)), GETPC());                     \
+                     ctzl(sizeof(ETYPE)), MMU_DATA_LOAD, GETPC());      \
 }
 
 GEN_VEXT_LD_STRIDE(vlse8_v,  int8_t,  lde_b)
@@ -238,7 +378,7 @@ void HELPER(NAME)(void *vd, void *v0, target_ulong base,                \
 {                                                                       \
     uint32_t vm = vext_vm(desc);                                        \
     vext_ldst_stride(vd, v0, base, stride, env, desc, vm, STORE_FN,     \
-                     ctzl(sizeof(ETYPE)), GETPC());                     \
+                     ctzl(sizeof(ETYPE)), MMU_DATA_STORE, GETPC());     \
 }
 
 GEN_VEXT_ST_STRIDE(vsse8_v,  int8_t,  ste_b)
@@ -254,22 +394,14 @@ GEN_VEXT_ST_STRIDE(vsse64_v, int64_t, ste_d)
 static void
 vext_ldst_us(void *vd, target_ulong base, CPURISCVState *env, uint32_t desc,
              vext_ldst_elem_fn *ldst_elem, uint32_t log2_esz, uint32_t evl,
-             uintptr_t ra)
+             MMUAccessType access_type, uintptr_t ra)
 {
-    uint32_t i, k;
     uint32_t nf = vext_nf(desc);
     uint32_t max_elems = vext_max_elems(desc, log2_esz);
     uint32_t esz = 1 << log2_esz;
 
-    /* load bytes from guest memory */
-    for (i = env->vstart; i < evl; i++, env->vstart++) {
-        k = 0;
-        while (k < nf) {
-            target_ulong addr = base + ((i * nf + k) << log2_esz);
-            ldst_elem(env, adjust_addr(env, addr), i + k * max_elems, vd, ra);
-            k++;
-        }
-    }
+    vext_ldst_us_pages(vd, NULL, base, env, desc, 1, ldst_elem, log2_esz,
+                       evl, access_type, ra);
     env->vstart = 0;
 
     vext_set_tail_elems_1s(evl, vd, desc, nf, esz, max_elems);
@@ -286,14 +418,14 @@ void HELPER(NAME##_mask)(void *vd, void *v0, target_ulong base,         \
 {                                                                       \
     uint32_t stride = vext_nf(desc) << ctzl(sizeof(ETYPE));             \
     vext_ldst_stride(vd, v0, base, stride, env, desc, false, LOAD_FN,   \
-                     ctzl(sizeof(ETYPE)), GETPC());                     \
+                     ctzl(sizeof(ETYPE)), MMU_DATA_LOAD, GETPC());      \
 }                                                                       \
                                                                         \
 void HELPER(NAME)(void *vd, void *v0, target_ulong base,                \
                   CPURISCVState *env, uint32_t desc)                    \
 {                                                                       \
     vext_ldst_us(vd, base, env, desc, LOAD_FN,                          \
-                 ctzl(sizeof(ETYPE)), env->vl, GETPC());                \
+                 ctzl(sizeof(ETYPE)), env->vl, MMU_DATA_LOAD, GETPC()); \
 }
 
 GEN_VEXT_LD_US(vle8_v,  int8_t,  lde_b)
@@ -307,14 +439,14 @@ void HELPER(NAME##_mask)(void *vd, void *v0, target_ulong base,          \
 {                                                                        \
     uint32_t stride = vext_nf(desc) << ctzl(sizeof(ETYPE));              \
     vext_ldst_stride(vd, v0, base, stride, env, desc, false, STORE_FN,   \
-                     ctzl(sizeof(ETYPE)), GETPC());                      \
+                     ctzl(sizeof(ETYPE)), MMU_DATA_STORE, GETPC());      \
 }                                                                        \
                                                                          \
 void HELPER(NAME)(void *vd, void *v0, target_ulong base,                 \
                   CPURISCVState *env, uint32_t desc)                     \
 {                                                                        \
     vext_ldst_us(vd, base, env, desc, STORE_FN,                          \
-                 ctzl(sizeof(ETYPE)), env->vl, GETPC());                 \
+                 ctzl(sizeof(ETYPE)), env->vl, MMU_DATA_STORE, GETPC()); \
 }
 
 GEN_VEXT_ST_US(vse8_v,  int8_t,  ste_b)
@@ -331,7 +463,7 @@ void HELPER(vlm_v)(void *vd, void *v0, target_ulong base,
     /* evl = ceil(vl/8) */
     uint8_t evl = (env->vl + 7) >> 3;
     vext_ldst_us(vd, base, env, desc, lde_b,
-                 0, evl, GETPC());
+                 0, evl, MMU_DATA_LOAD, GETPC());
 }
 
 void HELPER(vsm_v)(void *vd, void *v0, target_ulong base,
@@ -340,7 +472,7 @@ void HELPER(vsm_v)(void *vd, void *v0, target_ulong base,
     /* evl = ceil(vl/8) */
     uint8_t evl = (env->vl + 7) >> 3;
     vext_ldst_us(vd, base, env, desc, ste_b,
-                 0, evl, GETPC());
+                 0, evl, MMU_DATA_STORE, GETPC());
 }
 
 /*
@@ -554,31 +686,34 @@ GEN_VEXT_LDFF(vle64ff_v, int64_t, lde_d)
  */
 static void
 vext_ldst_whole(void *vd, target_ulong base, CPURISCVState *env, uint32_t desc,
-                vext_ldst_elem_fn *ldst_elem, uint32_t log2_esz, uintptr_t ra)
+                vext_ldst_elem_fn *ldst_elem, uint32_t log2_esz,
+                MMUAccessType access_type, uintptr_t ra)
 {
-    uint32_t i, k, off, pos;
+    uint32_t i, n;
     uint32_t nf = vext_nf(desc);
     uint32_t vlenb = riscv_cpu_cfg(env)->vlen >> 3;
-    uint32_t max_elems = vlenb >> log2_esz;
-
-    k = env->vstart / max_elems;
-    off = env->vstart % max_elems;
-
-    if (off) {
-        /* load/store rest of elements of current segment pointed by vstart */
-        for (pos = off; pos < max_elems; pos++, env->vstart++) {
-            target_ulong addr = base + ((pos + k * max_elems) << log2_esz);
-            ldst_elem(env, adjust_addr(env, addr), pos + k * max_elems, vd,
-                      ra);
+    uint32_t evl = nf * (vlenb >> log2_esz);
+
+    /* the NF registers are contiguous in memory as in the register file */
+    for (i = env->vstart; i < evl; i = env->vstart) {
+        target_ulong addr = base + (i << log2_esz);
+        void *host;
+
+        n = MIN(evl - i, -(addr | TARGET_PAGE_MASK) >> log2_esz);
+        host = n ? vext_host_addr(env, addr, n << log2_esz, access_type, ra)
+                 : NULL;
+        if (host) {
+            if (access_type == MMU_DATA_LOAD) {
+                memcpy((uint8_t *)vd + (i << log2_esz), host, n << log2_esz);
+            } else {
+                memcpy(host, (uint8_t *)vd + (i << log2_esz), n << log2_esz);
+            }
+            env->vstart += n;
+            continue;
         }
-        k++;
-    }
-
-    /* load/store elements for rest of segments */
-    for (; k < nf; k++) {
-        for (i = 0; i < max_elems; i++, env->vstart++) {
-            target_ulong addr = base + ((i + k * max_elems) << log2_esz);
-            ldst_elem(env, adjust_addr(env, addr), i + k * max_elems, vd, ra);
+        for (n = MAX(n, 1); n; n--, i++, env->vstart++) {
+            addr = base + (i << log2_esz);
+            ldst_elem(env, adjust_addr(env, addr), i, vd, ra);
         }
     }
 
@@ -590,7 +725,8 @@ void HELPER(NAME)(void *vd, target_ulong base,       \
                   CPURISCVState *env, uint32_t desc) \
 {                                                    \
     vext_ldst_whole(vd, base, env, desc, LOAD_FN,    \
-                    ctzl(sizeof(ETYPE)), GETPC());   \
+                    ctzl(sizeof(ETYPE)),             \
+                    MMU_DATA_LOAD, GETPC());         \
 }
 
 GEN_VEXT_LD_WHOLE(vl1re8_v,  int8_t,  lde_b)
@@ -615,7 +751,8 @@ void HELPER(NAME)(void *vd, target_ulong base,       \
                   CPURISCVState *env, uint32_t desc) \
 {                                                    \
     vext_ldst_whole(vd, base, env, desc, STORE_FN,   \
-                    ctzl(sizeof(ETYPE)), GETPC());   \
+                    ctzl(sizeof(ETYPE)),             \
+                    MMU_DATA_STORE, GETPC());        \
 }
 
 GEN_VEXT_ST_WHOLE(vs1r_v, int8_t, ste_b)
@@ -69,6 +69,10 @@ struct tcg_region_state {
     size_t stride; /* .size + guard size */
     size_t total_size; /* size of entire buffer, >= n * stride */
 
+    /* fields set before init by the TB cache, see tcg_region_reserve() */
+    void *hint;
+    size_t *reserved; /* bytes kept at the start of each region */
+
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
@@ -340,6 +344,11 @@ static void tcg_region_bounds(size_t curr_region, void **pstart, void **pend)
     if (curr_region == region.n - 1) {
         end = region.start_aligned + region.total_size;
     }
+    if (region.reserved) {
+        start = MAX(start, region.start_aligned +
+                    curr_region * region.stride + region.reserved[curr_region]);
+        start = MIN(start, end);
+    }
 
     *pstart = start;
     *pend = end;
@@ -412,6 +421,8 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    g_free(region.reserved);
+    region.reserved = NULL;
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -554,9 +565,16 @@ static int alloc_code_gen_buffer(size_t size, int splitwx, Error **errp)
 static int alloc_code_gen_buffer_anon(size_t size, int prot,
                                       int flags, Error **errp)
 {
-    void *buf;
+    void *buf = MAP_FAILED;
 
-    buf = mmap(NULL, size, prot, flags, -1, 0);
+#ifdef MAP_FIXED_NOREPLACE
+    if (region.hint) {
+        buf = mmap(region.hint, size, prot, flags | MAP_FIXED_NOREPLACE, -1, 0);
+    }
+#endif
+    if (buf == MAP_FAILED) {
+        buf = mmap(region.hint, size, prot, flags, -1, 0);
+    }
     if (buf == MAP_FAILED) {
         error_setg_errno(errp, errno,
                          "allocate %zu bytes for jit buffer", size);
@@ -877,6 +895,95 @@ void tcg_region_prologue_set(TCGContext *s)
                      region.after_prologue);
 }
 
+/*
+ * Support for the persistent TB cache, which saves the used part of
+ * every region at exit and maps it back at the same address at startup.
+ */
+
+/* Ask for the code buffer to be allocated at ADDR, call before tcg_init() */
+void tcg_region_request_address(void *addr)
+{
+    region.hint = addr;
+}
+
+size_t tcg_region_count(void)
+{
+    return region.n;
+}
+
+/* Returns the page aligned start of region I, the prologue included */
+void *tcg_region_base(size_t i)
+{
+    return region.start_aligned + i * region.stride;
+}
+
+/* Returns the space of region I, from tcg_region_base() */
+size_t tcg_region_space(size_t i)
+{
+    void *start, *end;
+
+    tcg_region_bounds(i, &start, &end);
+    return end - tcg_region_base(i);
+}
+
+/*
+ * Returns the number of bytes from tcg_region_base() that hold code.
+ * Only valid while no TCG thread translates.
+ */
+size_t tcg_region_used(size_t i)
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    size_t used = region.reserved ? region.reserved[i] : 0;
+    void *base = tcg_region_base(i);
+    unsigned int j;
+
+    if (i == 0) {
+        used = MAX(used, region.after_prologue - base);
+    }
+    qemu_mutex_lock(&region.lock);
+    if (i < region.current) {
+        /* full, unless it is the current region of a context */
+        size_t full = tcg_region_space(i);
+
+        for (j = 0; j <= n_ctxs; j++) {
+            const TCGContext *s;
+
+            if (j < n_ctxs) {
+                s = qatomic_read(&tcg_ctxs[j]);
+            } else if (n_ctxs == 0) {
+                /* no thread registered, region 0 is the initial one's */
+                s = &tcg_init_ctx;
+            } else {
+                break;
+            }
+            if (s->code_gen_buffer >= base &&
+                s->code_gen_buffer <= base + full) {
+                full = s->code_gen_ptr - base;
+                break;
+            }
+        }
+        used = MAX(used, full);
+    }
+    qemu_mutex_unlock(&region.lock);
+    return used;
+}
+
+/*
+ * Keeps the first LEN bytes of region I from being allocated, until
+ * the next tcg_region_reset_all(). Called before the TCG threads start.
+ */
+void tcg_region_reserve(size_t i, size_t len)
+{
+    if (!region.reserved) {
+        region.reserved = g_new0(size_t, region.n);
+    }
+    region.reserved[i] = len;
+    if (i == 0) {
+        /* recompute the bounds of the region of the initial context */
+        tcg_region_assign(&tcg_init_ctx, 0);
+    }
+}
+
 /*
  * Returns the size (in bytes) of all translated code (i.e. from all regions)
  * currently in the cache.
@@ -90,7 +90,8 @@ static void add_last_as_label_use(TCGLabel *l)
 {
     TCGLabelUse *u = tcg_malloc(sizeof(TCGLabelUse));
 
-    u->op = tcg_last_op();
+    u->op = tcg_ctx->emit_before_op ?
+            QTAILQ_PREV(tcg_ctx->emit_before_op, link) : tcg_last_op();
     QSIMPLEQ_INSERT_TAIL(&l->branches, u, next);
 }
 
@@ -2962,7 +2963,7 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
-void tcg_gen_lookup_and_goto_ptr(void)
+static void gen_lookup_and_goto_ptr(bool ret)
 {
     TCGv_ptr ptr;
 
@@ -2973,7 +2974,26 @@ void tcg_gen_lookup_and_goto_ptr(void)
 
     plugin_gen_disable_mem_helpers();
     ptr = tcg_temp_ebb_new_ptr();
-    gen_helper_lookup_tb_ptr(ptr, tcg_env);
+    if (ret) {
+        gen_helper_lookup_tb_ptr_ret(ptr, tcg_env);
+    } else {
+        gen_helper_lookup_tb_ptr(ptr, tcg_env);
+    }
     tcg_gen_op1i(INDEX_op_goto_ptr, tcgv_ptr_arg(ptr));
     tcg_temp_free_ptr(ptr);
 }
+
+void tcg_gen_lookup_and_goto_ptr(void)
+{
+    gen_lookup_and_goto_ptr(false);
+}
+
+void tcg_gen_lookup_ret_and_goto_ptr(void)
+{
+    gen_lookup_and_goto_ptr(true);
+}
+
+void tcg_gen_push_return(TCGv_i64 addr)
+{
+    gen_helper_tb_ras_push(tcg_env, addr);
+}
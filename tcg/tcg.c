@@ -1510,6 +1510,7 @@ void tcg_func_start(TCGContext *s)
 
     QTAILQ_INIT(&s->ops);
     QTAILQ_INIT(&s->free_ops);
+    s->emit_before_op = NULL;
     QSIMPLEQ_INIT(&s->labels);
 
     tcg_debug_assert(s->addr_type == TCG_TYPE_I32 ||
@@ -1746,6 +1747,36 @@ void tcg_temp_free_internal(TCGTemp *ts)
     }
 }
 
+/*
+ * Turn an EBB temp into a TB temp, so that its value survives the labels
+ * inserted into its extended basic block after translation (conditional
+ * plugin callbacks).  It is no longer reused by tcg_temp_new_internal().
+ */
+void tcg_temp_ebb_to_tb(TCGTemp *ts)
+{
+    TCGContext *s = tcg_ctx;
+    TCGTemp *base = ts - ts->temp_subindex;
+    int i, n = 1;
+
+    if (ts->kind != TEMP_EBB) {
+        return;
+    }
+
+    switch (base->base_type) {
+    case TCG_TYPE_I64:
+    case TCG_TYPE_I128:
+        n = tcg_type_size(base->base_type) * 8 / TCG_TARGET_REG_BITS;
+        break;
+    default:
+        break;
+    }
+
+    clear_bit(temp_idx(base), s->free_temps[base->base_type].l);
+    for (i = 0; i < n; i++) {
+        base[i].kind = TEMP_TB;
+    }
+}
+
 TCGTemp *tcg_constant_internal(TCGType type, int64_t val)
 {
     TCGContext *s = tcg_ctx;
@@ -2145,6 +2176,19 @@ bool tcg_op_supported(TCGOpcode op)
 
 static TCGOp *tcg_op_alloc(TCGOpcode opc, unsigned nargs);
 
+/*
+ * New ops go to the end of the op list, or before @emit_before_op
+ * when the plugin code injects ops in the middle of a TB.
+ */
+static void tcg_insert_op(TCGContext *s, TCGOp *op)
+{
+    if (s->emit_before_op) {
+        QTAILQ_INSERT_BEFORE(s->emit_before_op, op, link);
+    } else {
+        QTAILQ_INSERT_TAIL(&s->ops, op, link);
+    }
+}
+
 static void tcg_gen_callN(TCGHelperInfo *info, TCGTemp *ret, TCGTemp **args)
 {
     TCGv_i64 extend_free[MAX_CALL_IARGS];
@@ -2227,7 +2271,7 @@ static void tcg_gen_callN(TCGHelperInfo *info, TCGTemp *ret, TCGTemp **args)
     op->args[pi++] = (uintptr_t)info;
     tcg_debug_assert(pi == total_args);
 
-    QTAILQ_INSERT_TAIL(&tcg_ctx->ops, op, link);
+    tcg_insert_op(tcg_ctx, op);
 
     tcg_debug_assert(n_extend < ARRAY_SIZE(extend_free));
     for (i = 0; i < n_extend; ++i) {
@@ -3106,7 +3150,7 @@ static TCGOp *tcg_op_alloc(TCGOpcode opc, unsigned nargs)
 TCGOp *tcg_emit_op(TCGOpcode opc, unsigned nargs)
 {
     TCGOp *op = tcg_op_alloc(opc, nargs);
-    QTAILQ_INSERT_TAIL(&tcg_ctx->ops, op, link);
+    tcg_insert_op(tcg_ctx, op);
     return op;
 }
 
@@ -5965,7 +6009,10 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb, uint64_t pc_start)
     }
 #endif
 
-    tcg_optimize(s);
+    /* First-tier TBs are translated quickly and retranslated when hot */
+    if (tb->tier_count == TB_TIER_FULL) {
+        tcg_optimize(s);
+    }
 
     reachable_code_pass(s);
     liveness_pass_0(s);
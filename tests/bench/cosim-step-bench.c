@@ -0,0 +1,427 @@
+/*
+ * COSIM stepping throughput benchmark
+ *
+ * Loads qemu-system-riscv64.so the way contrib/cosim-proto/cosim.c does,
+ * runs a fixed workload (tests/tcg/riscv64/cosim-bench.S) and measures
+ * each stepping mode:
+ *
+ *   step   QEMU_step(1) - one instruction per call
+ *   batch  QEMU_step_batch() - up to -batch RVFI records per call
+ *   run    QEMU_step(-chunk) - free run, no records
+ *   ring   QEMU_ring_run(-chunk) - free run streaming RVFI records
+ *
+ * Reported: instructions/sec, p50/p99 latency of a stepping call and
+ * context switches (voluntary + involuntary, all threads) per instruction.
+ * QEMU can be initialized only once per process, so every mode runs in
+ * a child process which sends its result back via a pipe.
+ *
+ * Usage:
+ *   cosim-step-bench [-direct] [-v] [-mode step|batch|run|ring|all]
+ *                    [-n INSNS] [-warmup INSNS] [-batch N] [-chunk N]
+ *                    <QEMU.so path> <workload>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "cosim-rvfi.h"
+#include "cosim-ring.h"
+
+typedef int (*qemu_main_t)(int, char **);
+typedef void (*qemu_pass_sync_t)(pthread_mutex_t *, pthread_cond_t *);
+typedef uint64_t (*qemu_step_t)(uint64_t);
+typedef int (*qemu_batch_t)(st_rvfi_t *, size_t, size_t *);
+typedef void *(*qemu_ring_open_t)(uint32_t, int *, size_t *);
+typedef int (*qemu_ring_run_t)(uint64_t);
+
+enum {
+    MODE_STEP,
+    MODE_BATCH,
+    MODE_RUN,
+    MODE_RING,
+    MODE_MAX,
+};
+
+static const char *mode_names[MODE_MAX] = {
+    [MODE_STEP] = "step",
+    [MODE_BATCH] = "batch",
+    [MODE_RUN] = "run",
+    [MODE_RING] = "ring",
+};
+
+typedef struct BenchResult {
+    int ok;
+    uint64_t insns;
+    uint64_t calls;
+    uint64_t elapsed_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t csw;
+} BenchResult;
+
+static bool direct;
+static bool verbose;
+static uint64_t n_insns = 1000000;
+static uint64_t n_warmup = 100000;
+static size_t batch_n = 256;
+static uint64_t chunk_n = 100000;
+static uint32_t ring_n = 4096;
+static const char *so_path;
+static const char *workload;
+
+static pthread_mutex_t qemu_cosim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qemu_cosim_cond = PTHREAD_COND_INITIALIZER;
+static volatile int qemu_running = 1;
+
+static qemu_main_t qemu_main_ep;
+static qemu_step_t qemu_step_ep;
+static qemu_batch_t qemu_batch_ep;
+static qemu_ring_open_t qemu_ring_open_ep;
+static qemu_ring_run_t qemu_ring_run_ep;
+
+static char *qemu_argv[16];
+static int qemu_argc;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t csw_count(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void *qemu_thread_ep(void *arg)
+{
+    qemu_main_ep(qemu_argc, qemu_argv);
+
+    pthread_mutex_lock(&qemu_cosim_mutex);
+    qemu_running = 0;
+    pthread_cond_broadcast(&qemu_cosim_cond);
+    pthread_mutex_unlock(&qemu_cosim_mutex);
+    return NULL;
+}
+
+/*
+ * Loads QEMU.so, starts QEMU on its own thread and waits until
+ * the CPU is ready to be stepped.
+ */
+static bool qemu_start(void)
+{
+    char path[4096];
+    qemu_pass_sync_t pass_sync;
+    pthread_t thr;
+    void *h;
+
+    snprintf(path, sizeof(path), "%s/qemu-system-riscv64.so", so_path);
+    h = dlopen(path, RTLD_LAZY | RTLD_GLOBAL);
+    if (h == NULL) {
+        fprintf(stderr, "Unable to load %s: %s\n", path, dlerror());
+        return false;
+    }
+
+    qemu_main_ep = (qemu_main_t)dlsym(h, "main");
+    pass_sync = (qemu_pass_sync_t)dlsym(h, "COSIM_pass_sync");
+    qemu_step_ep = (qemu_step_t)dlsym(h, "QEMU_step");
+    qemu_batch_ep = (qemu_batch_t)dlsym(h, "QEMU_step_batch");
+    qemu_ring_open_ep = (qemu_ring_open_t)dlsym(h, "QEMU_ring_open");
+    qemu_ring_run_ep = (qemu_ring_run_t)dlsym(h, "QEMU_ring_run");
+    if (qemu_main_ep == NULL || pass_sync == NULL || qemu_step_ep == NULL ||
+        qemu_batch_ep == NULL || qemu_ring_open_ep == NULL ||
+        qemu_ring_run_ep == NULL) {
+        fprintf(stderr, "%s is not a COSIM build\n", path);
+        return false;
+    }
+    pass_sync(&qemu_cosim_mutex, &qemu_cosim_cond);
+
+    qemu_argv[qemu_argc++] = (char *)"qemu.so";
+    qemu_argv[qemu_argc++] = (char *)"-nographic";
+    qemu_argv[qemu_argc++] = (char *)"-accel";
+    qemu_argv[qemu_argc++] = (char *)"tcg,thread=single";
+    qemu_argv[qemu_argc++] = (char *)"-machine";
+    qemu_argv[qemu_argc++] = (char *)"virt";
+    qemu_argv[qemu_argc++] = (char *)"-bios";
+    qemu_argv[qemu_argc++] = (char *)workload;
+    qemu_argv[qemu_argc++] = (char *)(direct ? "-cosim-direct" : "-cosim");
+
+    /* held before QEMU starts so that its "ready" broadcast is not lost */
+    pthread_mutex_lock(&qemu_cosim_mutex);
+    pthread_create(&thr, NULL, qemu_thread_ep, NULL);
+    pthread_cond_wait(&qemu_cosim_cond, &qemu_cosim_mutex);
+    pthread_mutex_unlock(&qemu_cosim_mutex);
+
+    return qemu_running;
+}
+
+static cosim_ring_t *ring;
+static volatile int ring_consumer_on;
+
+static uint64_t ring_drain(void)
+{
+    uint64_t n = 0;
+
+    while (cosim_ring_wait(ring) != NULL) {
+        cosim_ring_consume(ring);
+        n++;
+    }
+    return n;
+}
+
+/* DIRECT mode: QEMU_ring_run() produces on the stepping thread */
+static void *ring_consumer_ep(void *arg)
+{
+    while (ring_consumer_on) {
+        if (ring_drain() == 0) {
+            usleep(10);
+        }
+    }
+    return NULL;
+}
+
+/* One stepping call of MODE, returns the number of retired instructions. */
+static uint64_t bench_call(int mode, st_rvfi_t *buf)
+{
+    size_t n = 0;
+
+    switch (mode) {
+    case MODE_STEP:
+        return qemu_step_ep(1);
+    case MODE_BATCH:
+        if (qemu_batch_ep(buf, batch_n, &n) != 0) {
+            return 0;
+        }
+        return n;
+    case MODE_RUN:
+        return qemu_step_ep(chunk_n);
+    case MODE_RING:
+        if (qemu_ring_run_ep(chunk_n) != 0) {
+            return 0;
+        }
+        /* LOCKSTEP: QEMU runs on the CPU thread while this thread consumes */
+        return direct ? chunk_n : ring_drain();
+    }
+    return 0;
+}
+
+static void bench_mode(int mode, BenchResult *res)
+{
+    uint64_t max_calls, *lat, t0, csw0, done = 0;
+    st_rvfi_t *buf = NULL;
+    pthread_t thr_ring;
+
+    memset(res, 0, sizeof(*res));
+    if (!qemu_start()) {
+        return;
+    }
+
+    if (mode == MODE_BATCH) {
+        buf = calloc(batch_n, sizeof(st_rvfi_t));
+    }
+    if (mode == MODE_RING) {
+        int fd;
+        size_t size;
+
+        ring = qemu_ring_open_ep(ring_n, &fd, &size);
+        if (ring == NULL) {
+            fprintf(stderr, "Unable to open RVFI ring of %u records\n", ring_n);
+            return;
+        }
+        if (direct) {
+            ring_consumer_on = 1;
+            pthread_create(&thr_ring, NULL, ring_consumer_ep, NULL);
+        }
+    }
+
+    /* translate the workload and settle the caches */
+    while (done < n_warmup && qemu_running) {
+        uint64_t n = bench_call(mode, buf);
+
+        if (n == 0) {
+            return;
+        }
+        done += n;
+    }
+
+    max_calls = mode == MODE_STEP ? n_insns :
+                mode == MODE_BATCH ? n_insns / batch_n + 1 :
+                n_insns / chunk_n + 1;
+    lat = calloc(max_calls, sizeof(uint64_t));
+
+    csw0 = csw_count();
+    t0 = now_ns();
+    while (res->insns < n_insns && res->calls < max_calls && qemu_running) {
+        uint64_t t = now_ns();
+        uint64_t n = bench_call(mode, buf);
+
+        lat[res->calls++] = now_ns() - t;
+        if (n == 0) {
+            break;
+        }
+        res->insns += n;
+    }
+    res->elapsed_ns = now_ns() - t0;
+    res->csw = csw_count() - csw0;
+
+    if (mode == MODE_RING && direct) {
+        ring_consumer_on = 0;
+        pthread_join(thr_ring, NULL);
+    }
+
+    if (res->calls != 0) {
+        qsort(lat, res->calls, sizeof(uint64_t), cmp_u64);
+        res->p50_ns = lat[res->calls / 2];
+        res->p99_ns = lat[res->calls * 99 / 100];
+        res->ok = 1;
+    }
+    free(lat);
+    free(buf);
+}
+
+/*
+ * Runs MODE in a child process. QEMU output goes to /dev/null unless -v,
+ * the child exits without shutting QEMU down.
+ */
+static bool bench_fork(int mode, BenchResult *res)
+{
+    int pfd[2], status;
+    pid_t pid;
+
+    memset(res, 0, sizeof(*res));
+    fflush(stdout);
+    if (pipe(pfd) != 0) {
+        perror("pipe");
+        return false;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        BenchResult r;
+
+        close(pfd[0]);
+        if (!verbose) {
+            int fd = open("/dev/null", O_WRONLY);
+
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        bench_mode(mode, &r);
+        if (write(pfd[1], &r, sizeof(r)) != sizeof(r)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(pfd[1]);
+    if (read(pfd[0], res, sizeof(*res)) != sizeof(*res)) {
+        res->ok = 0;
+    }
+    close(pfd[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return res->ok;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: cosim-step-bench [-direct] [-v] "
+            "[-mode step|batch|run|ring|all]\n"
+            "                        [-n INSNS] [-warmup INSNS] [-batch N] "
+            "[-chunk N]\n"
+            "                        <QEMU.so path> <workload>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int first = 0, last = MODE_MAX - 1;
+    int i, m;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-direct")) {
+            direct = true;
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else if (i + 1 >= argc) {
+            usage();
+        } else if (!strcmp(argv[i], "-mode")) {
+            i++;
+            if (strcmp(argv[i], "all") != 0) {
+                for (m = 0; m < MODE_MAX; m++) {
+                    if (!strcmp(argv[i], mode_names[m])) {
+                        break;
+                    }
+                }
+                if (m == MODE_MAX) {
+                    usage();
+                }
+                first = last = m;
+            }
+        } else if (!strcmp(argv[i], "-n")) {
+            n_insns = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-warmup")) {
+            n_warmup = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-batch")) {
+            batch_n = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-chunk")) {
+            chunk_n = strtoull(argv[++i], NULL, 0);
+        } else {
+            usage();
+        }
+    }
+    if (argc - i != 2 || n_insns == 0 || batch_n == 0 || chunk_n == 0) {
+        usage();
+    }
+    so_path = argv[i];
+    workload = argv[i + 1];
+
+    printf("%-6s %-8s %12s %14s %10s %10s %10s\n", "mode",
+           "sync", "insns", "insns/sec", "p50(ns)", "p99(ns)", "csw/insn");
+    for (m = first; m <= last; m++) {
+        BenchResult r;
+
+        if (!bench_fork(m, &r)) {
+            printf("%-6s %-8s failed\n", mode_names[m],
+                   direct ? "direct" : "lockstep");
+            continue;
+        }
+        printf("%-6s %-8s %12" PRIu64 " %14.0f %10" PRIu64 " %10" PRIu64
+               " %10.6f\n", mode_names[m], direct ? "direct" : "lockstep",
+               r.insns, r.insns * 1e9 / r.elapsed_ns, r.p50_ns, r.p99_ns,
+               (double)r.csw / r.insns);
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * COSIM: shared-memory ring of RVFI retirement records
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/timer.h"
+#include "qemu/cosim-ring.h"
+
+#ifdef CONFIG_LINUX
+#include "qemu/futex.h"
+#endif
+
+CosimRing *cosim_ring_new(uint32_t nrec, Error **errp)
+{
+    CosimRing *ring;
+    cosim_ring_t *shm;
+    size_t size;
+    int fd = -1;
+
+    if (nrec < 2 || !is_power_of_2(nrec)) {
+        error_setg(errp, "COSIM ring size %u is not a power of 2", nrec);
+        return NULL;
+    }
+
+    size = QEMU_ALIGN_UP(sizeof(cosim_ring_t) + (size_t)nrec * sizeof(st_rvfi_t),
+                         qemu_real_host_page_size());
+    shm = qemu_memfd_alloc("cosim-ring", size,
+                           F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                           &fd, errp);
+    if (shm == NULL) {
+        return NULL;
+    }
+
+    memset(shm, 0, sizeof(*shm));
+    shm->magic = COSIM_RING_MAGIC;
+    shm->version = COSIM_RING_VERSION;
+    shm->nrec = nrec;
+    shm->rec_size = sizeof(st_rvfi_t);
+    shm->rec_offset = sizeof(cosim_ring_t);
+
+    ring = g_new0(CosimRing, 1);
+    ring->shm = shm;
+    ring->recs = cosim_ring_records(shm);
+    ring->mask = nrec - 1;
+    ring->size = size;
+    ring->fd = fd;
+    return ring;
+}
+
+void cosim_ring_free(CosimRing *ring)
+{
+    if (ring) {
+        qemu_memfd_free(ring->shm, ring->size, ring->fd);
+        g_free(ring);
+    }
+}
+
+void cosim_ring_start(CosimRing *ring)
+{
+    qatomic_store_release(&ring->shm->done, 0);
+}
+
+void cosim_ring_finish(CosimRing *ring)
+{
+    qatomic_store_release(&ring->shm->done, 1);
+    smp_mb();
+    cosim_ring_wake_consumer(ring);
+}
+
+void cosim_ring_wake_consumer(CosimRing *ring)
+{
+    qatomic_inc(&ring->shm->head_seq);
+#ifdef CONFIG_LINUX
+    qemu_futex_wake(&ring->shm->head_seq, 1);
+#endif
+}
+
+bool cosim_ring_wait_space(CosimRing *ring, int64_t timeout_ns)
+{
+    cosim_ring_t *shm = ring->shm;
+    uint32_t seq;
+
+    if (!cosim_ring_full(ring)) {
+        return true;
+    }
+
+    qatomic_set(&shm->prod_wait, 1);
+    smp_mb();
+    seq = qatomic_read(&shm->tail_seq);
+    if (cosim_ring_full(ring)) {
+#ifdef CONFIG_LINUX
+        struct timespec ts = {
+            .tv_sec = timeout_ns / NANOSECONDS_PER_SECOND,
+            .tv_nsec = timeout_ns % NANOSECONDS_PER_SECOND,
+        };
+        /* EINTR/EAGAIN/ETIMEDOUT - the caller rechecks anyway */
+        qemu_futex(&shm->tail_seq, FUTEX_WAIT, (int)seq, &ts, NULL, 0);
+#else
+        (void)seq;
+        g_usleep(timeout_ns / SCALE_US);
+#endif
+    }
+    qatomic_set(&shm->prod_wait, 0);
+
+    return !cosim_ring_full(ring);
+}
@@ -47,41 +47,18 @@ int qemu_loglevel;
 static bool log_per_thread;
 static GArray *debug_regions;
 
-#if 1 ////////////// The IM simple log (for debugging only) //////////////////
+/* LOGIM message buffer, see qemu/logim.h */
+static __thread char logim_buf[256];
 
-static char *im_log_prefix = NULL;
-static FILE *im_log_fp     = NULL;
-
-static void qemu_simple_log_enable (void)
-{
-    if (im_log_prefix != NULL) {
-
-        char *im_log_fname = (char*)malloc (strlen(im_log_prefix) + 64);
-        sprintf (im_log_fname, "%s.%d.IMLOG", im_log_prefix, getpid ());
-
-        im_log_fp = fopen (im_log_fname, "w");
-        if (im_log_fp) {
-	    fprintf (stderr, "Unable to create LOGF = <%s>, FP = %p, errno = %d\n", im_log_fname, im_log_fp, errno);
-        } 
-    }
-} 
-
-void qemu_simple_log (const char *F, const char *FN, const  char *fmt, ...)
+const char *qemu_logim_format(const char *fmt, ...)
 {
-    if (im_log_fp == NULL) {
-        return;
-    } 
     va_list ap;
-    fprintf(im_log_fp, "= (%ld) %s : %s() :",  pthread_self(), F, FN);
-    va_start (ap, fmt);
-    vfprintf (im_log_fp, fmt, ap);
-    
-    va_end(ap); 
-    fprintf (im_log_fp,"\n");
-    fflush (im_log_fp);
-}
 
-#endif  /////////////////////////////////////////////////////////
+    va_start(ap, fmt);
+    vsnprintf(logim_buf, sizeof(logim_buf), fmt, ap);
+    va_end(ap);
+    return logim_buf;
+}
 
 /* Returns true if qemu_log() will really write somewhere. */
 bool qemu_log_enabled(void)
@@ -544,7 +521,6 @@ int qemu_str_to_log_mask(const char *str)
     int mask = 0;
     char **parts = g_strsplit(str, ",", 0);
     char **tmp;
-    char *pp = NULL;
 
     for (tmp = parts; tmp && *tmp; tmp++) {
         if (g_str_equal(*tmp, "all")) {
@@ -555,12 +531,12 @@ int qemu_str_to_log_mask(const char *str)
         } else if (g_str_has_prefix(*tmp, "trace:") && (*tmp)[6] != '\0') {
             trace_enable_events((*tmp) + 6);
             mask |= LOG_TRACE;
-        } else if (g_str_has_prefix(*tmp, "prefix:")) {
-            pp = *tmp + 7;
-            im_log_prefix = strdup (pp);
-	    qemu_simple_log_enable ();
-	    mask |= LOG_IM_SIMPLE;
 #endif
+        } else if (g_str_has_prefix(*tmp, "prefix:")) {
+            /* COSIM debug tracing: LOGIM categories and cosim_* events */
+            trace_enable_events("logim_*");
+            trace_enable_events("cosim_*");
+            mask |= LOG_TRACE;
         } else {
             for (item = qemu_log_items; item->mask != 0; item++) {
                 if (g_str_equal(*tmp, item->name)) {
@@ -34,6 +34,8 @@
 #include "qemu/error-report.h"
 #include "qemu/queue.h"
 #include "qemu/log.h"
+#define LOGIM_CATEGORY loop
+#include "qemu/logim.h"
 #include "qom/object.h"
 
 #include "qemu-main.h"
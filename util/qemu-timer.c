@@ -43,6 +43,8 @@
 #endif
 
 #include "qemu/log.h"
+#define LOGIM_CATEGORY loop
+#include "qemu/logim.h"
 #include <sys/time.h>
 
 /***********************************************************/